@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+#
+# This file is part of OBus.
+#
+# OBus is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# OBus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Starts a daemon and a subscriber to everything, then checks that once
+# the subscriber goes away its subscription is gone from the daemon's
+# index, and a message published after that has nobody watching it.
+#
+# Usage: catchall-test.sh [base port]
+# OBUS_DAEMON and OBUS_CLI point at the binaries to use.
+
+OBUS_DAEMON=${OBUS_DAEMON:-../daemon/obus_daemon}
+OBUS_CLI=${OBUS_CLI:-../cli/obus-cli}
+BASE_PORT=${1:-24480}
+TIMEOUT=10
+
+if [ ! -x "$OBUS_DAEMON" ] || [ ! -x "$OBUS_CLI" ]; then
+	echo "obus_daemon or obus-cli not built, skipping" >&2
+	#Skipped, to automake
+	exit 77
+fi
+
+DIR=$(mktemp -d)
+PIDS=()
+
+cleanup(){
+	if [ ${#PIDS[@]} -gt 0 ]; then
+		kill "${PIDS[@]}" 2>/dev/null
+		wait "${PIDS[@]}" 2>/dev/null
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+: > "$DIR/cli.conf"
+: > "$DIR/obusd.conf"
+
+cli(){
+	"$OBUS_CLI" -c "$DIR/cli.conf" -H 127.0.0.1 -p "$BASE_PORT" "$@"
+}
+
+publish(){
+	echo "$2" | cli -s -t "$1" || fail "publishing $1"
+}
+
+#The prefixes subscribed to, as the stats endpoint lists them
+subscriptions(){
+	cli -S | sed -e 's/.*"subscriptions"//'
+}
+
+"$OBUS_DAEMON" -c "$DIR/obusd.conf" -H 127.0.0.1 -p "$BASE_PORT" 2> "$DIR/obusd.log" &
+PIDS+=($!)
+
+cli -l -t "" > "$DIR/listen" 2> "$DIR/listen.log" &
+LISTENER=$!
+PIDS+=($LISTENER)
+
+deadline=$((SECONDS + TIMEOUT))
+until grep -q "probe" "$DIR/listen" 2>/dev/null; do
+	[ $SECONDS -lt $deadline ] || fail "the subscriber to everything never got a probe"
+	publish catchall probe
+	sleep 0.1
+done
+
+subscriptions | grep -q '"":' || fail "the subscription to everything isn't indexed"
+
+kill "$LISTENER"
+wait "$LISTENER" 2>/dev/null
+
+deadline=$((SECONDS + TIMEOUT))
+while subscriptions | grep -q '"":'; do
+	[ $SECONDS -lt $deadline ] || fail "the subscription to everything outlived its subscriber"
+	sleep 0.1
+done
+
+publish catchall after
+cli -S | grep -o '"catchall:": {[^}]*' | grep -q '"subscribers": 0' || fail "catchall: is still watched"
+
+echo "PASS"
@@ -0,0 +1,182 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+#
+# This file is part of OBus.
+#
+# OBus is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# OBus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Starts three daemons, A, B and C, federated with each other on
+# localhost, and checks that:
+#
+#  - a message reaches a subscriber on another daemon exactly once, so
+#    nothing loops between the daemons
+#  - a daemon is only sent the topics its own subscribers want
+#
+# A and B subscribe to fedtest, C only to other. Messages of fedtest are
+# published on A, and of other on B.
+#
+# Usage: federation-test.sh [base port]
+# OBUS_DAEMON and OBUS_CLI point at the binaries to use.
+
+OBUS_DAEMON=${OBUS_DAEMON:-../daemon/obus_daemon}
+OBUS_CLI=${OBUS_CLI:-../cli/obus-cli}
+BASE_PORT=${1:-24450}
+COUNT=20
+TIMEOUT=10
+
+if [ ! -x "$OBUS_DAEMON" ] || [ ! -x "$OBUS_CLI" ]; then
+	echo "obus_daemon or obus-cli not built, skipping" >&2
+	#Skipped, to automake
+	exit 77
+fi
+
+DIR=$(mktemp -d)
+PIDS=()
+
+cleanup(){
+	if [ ${#PIDS[@]} -gt 0 ]; then
+		kill "${PIDS[@]}" 2>/dev/null
+		wait "${PIDS[@]}" 2>/dev/null
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+#Daemon n listens on BASE_PORT + 10n, and its peers on that + 4
+port(){
+	echo $((BASE_PORT + 10 * $1))
+}
+
+: > "$DIR/cli.conf"
+
+cli(){
+	local n=$1
+	shift
+	"$OBUS_CLI" -c "$DIR/cli.conf" -H 127.0.0.1 -p "$(port "$n")" "$@"
+}
+
+start_daemon(){
+	local n=$1
+	local conf="$DIR/obusd$n.conf"
+
+	{
+		printf 'a:peers\n'
+		local peer
+		for peer in 0 1 2; do
+			if [ "$peer" != "$n" ]; then
+				printf 's:tcp://127.0.0.1:%d\n' $(($(port "$peer") + 4))
+			fi
+		done
+		printf '\n'
+	} > "$conf"
+
+	"$OBUS_DAEMON" -c "$conf" -H 127.0.0.1 -p "$(port "$n")" 2> "$DIR/obusd$n.log" &
+	PIDS+=($!)
+}
+
+start_listener(){
+	local n=$1
+	local type=$2
+
+	cli "$n" -l -t "$type" > "$DIR/listen$n" 2> "$DIR/listen$n.log" &
+	PIDS+=($!)
+}
+
+#Lines of file matching pattern
+count(){
+	grep -c "$2" "$1" 2>/dev/null
+}
+
+#Waits until file has at least want lines matching pattern, sending a
+#probe with the command after it each time round if one is given
+wait_for(){
+	local file=$1
+	local pattern=$2
+	local want=$3
+	shift 3
+
+	local deadline=$((SECONDS + TIMEOUT))
+	while [ "$(count "$file" "$pattern")" -lt "$want" ]; do
+		if [ $SECONDS -ge $deadline ]; then
+			return 1
+		fi
+		if [ $# -gt 0 ]; then
+			"$@"
+		fi
+		sleep 0.1
+	done
+	return 0
+}
+
+publish(){
+	local n=$1
+	local type=$2
+	local body=$3
+
+	echo "$body" | cli "$n" -s -t "$type" || fail "publishing $type on daemon $n"
+}
+
+#Topics daemon n has counted messages for, leaving out its subscriptions
+topics(){
+	cli "$1" -S | sed -e 's/"subscriptions".*//'
+}
+
+for n in 0 1 2; do
+	start_daemon "$n"
+done
+
+start_listener 0 fedtest
+start_listener 1 fedtest
+start_listener 2 other
+
+#Subscriptions reach the peers in their own time, so keep probing until
+#every listener has heard from the daemon it waits on
+wait_for "$DIR/listen0" "^probe" 1 publish 0 fedtest probe || fail "no probe on daemon 0"
+wait_for "$DIR/listen1" "^probe" 1 publish 0 fedtest probe || fail "fedtest never forwarded from daemon 0 to 1"
+wait_for "$DIR/listen2" "^probe" 1 publish 1 other probe || fail "other never forwarded from daemon 1 to 2"
+
+for i in $(seq 1 $COUNT); do
+	publish 0 fedtest "msg-$i"
+	publish 1 other "msg-$i"
+done
+
+wait_for "$DIR/listen0" "^msg-" $COUNT || fail "daemon 0 got $(count "$DIR/listen0" "^msg-") of $COUNT fedtest messages"
+wait_for "$DIR/listen1" "^msg-" $COUNT || fail "daemon 1 got $(count "$DIR/listen1" "^msg-") of $COUNT fedtest messages"
+wait_for "$DIR/listen2" "^msg-" $COUNT || fail "daemon 2 got $(count "$DIR/listen2" "^msg-") of $COUNT other messages"
+
+#Copies going round in a loop would show up a little later
+sleep 1
+
+for n in 0 1 2; do
+	got=$(count "$DIR/listen$n" "^msg-")
+	if [ "$got" -ne $COUNT ]; then
+		fail "daemon $n got $got messages instead of $COUNT, they are looping"
+	fi
+done
+
+if topics 2 | grep -q '"fedtest:'; then
+	fail "fedtest was forwarded to daemon 2, which doesn't subscribe to it"
+fi
+if topics 0 | grep -q '"other:'; then
+	fail "other was forwarded to daemon 0, which doesn't subscribe to it"
+fi
+
+echo "PASS"
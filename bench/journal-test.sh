@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+#
+# This file is part of OBus.
+#
+# OBus is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# OBus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Starts a daemon with a journal and checks that:
+#
+#  - a message is only answered once it can be replayed
+#  - a replay from a sequence number gets that message and those after it
+#  - sequence numbers carry on from the journal after a restart
+#  - a topic too long to journal is refused rather than answered as
+#    published
+#
+# Usage: journal-test.sh [base port]
+# OBUS_DAEMON and OBUS_CLI point at the binaries to use.
+
+OBUS_DAEMON=${OBUS_DAEMON:-../daemon/obus_daemon}
+OBUS_CLI=${OBUS_CLI:-../cli/obus-cli}
+BASE_PORT=${1:-24500}
+
+if [ ! -x "$OBUS_DAEMON" ] || [ ! -x "$OBUS_CLI" ]; then
+	echo "obus_daemon or obus-cli not built, skipping" >&2
+	#Skipped, to automake
+	exit 77
+fi
+
+DIR=$(mktemp -d)
+PIDS=()
+
+cleanup(){
+	if [ ${#PIDS[@]} -gt 0 ]; then
+		kill "${PIDS[@]}" 2>/dev/null
+		wait "${PIDS[@]}" 2>/dev/null
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+: > "$DIR/cli.conf"
+printf 's:journal_dir\n%s\n\n' "$DIR/journal" > "$DIR/obusd.conf"
+
+cli(){
+	"$OBUS_CLI" -c "$DIR/cli.conf" -H 127.0.0.1 -p "$BASE_PORT" "$@"
+}
+
+start_daemon(){
+	"$OBUS_DAEMON" -c "$DIR/obusd.conf" -H 127.0.0.1 -p "$BASE_PORT" 2>> "$DIR/obusd.log" &
+	DAEMON=$!
+	PIDS+=($DAEMON)
+}
+
+#Publishes body as type and prints the daemon's answer, "publish:ok <seq>"
+publish(){
+	echo "$2" | cli -V -s -t "$1" 2>&1 | grep -o 'publish:[a-z]* [0-9]*'
+}
+
+expect(){
+	local got
+	got=$(publish "$1" "$2")
+	[ "$got" = "$3" ] || fail "$1 $2 was answered '$got' instead of '$3'"
+}
+
+start_daemon
+
+for i in 1 2 3; do
+	expect jt "msg-$i" "publish:ok $i"
+	#Only synced messages are replayed, so an answered one must be there
+	cli -R "$i" -t jt | grep -q "^msg-$i\$" || fail "msg-$i was answered before it could be replayed"
+done
+
+got=$(cli -R 2 -t jt | tr '\n' ' ')
+[ "$got" = "msg-2 msg-3 " ] || fail "a replay from 2 got '$got'"
+
+kill "$DAEMON"
+wait "$DAEMON" 2>/dev/null
+start_daemon
+
+expect jt "msg-4" "publish:ok 4"
+got=$(cli -R 1 -t jt | tr '\n' ' ')
+[ "$got" = "msg-1 msg-2 msg-3 msg-4 " ] || fail "a replay after a restart got '$got'"
+
+long=$(printf 'x%.0s' $(seq 1 200))
+if echo "too long" | cli -s -t "$long" 2> "$DIR/long.log"; then
+	fail "a topic too long to journal was answered as published"
+fi
+grep -q "topic too long" "$DIR/long.log" || fail "a topic too long to journal wasn't refused: $(cat "$DIR/long.log")"
+
+echo "PASS"
@@ -0,0 +1,674 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "libobus.h"
+#include "obusd.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <zmq.h>
+
+//Every message starts with the time it was sent, so it can't be smaller
+#define OBUSB_MIN_MESSAGE_LEN sizeof(uint64_t)
+//How long subscribers wait for stragglers once the publishers are done
+#define OBUSB_IDLE_TIMEOUT_MS 2000
+//How long the daemon and subscribers get to answer a probe before giving up
+#define OBUSB_READY_TIMEOUT_MS 10000
+//How often a probe is sent again while waiting on it
+#define OBUSB_PROBE_INTERVAL_MS 10
+
+//Sent until every subscriber has one, so they are known to be subscribed.
+//Subscribed to last, as subscriptions take effect in the order they are made
+#define OBUSB_PROBE_TOPIC "obus-bench-probe"
+//Each publisher sends itself one of these once done, see obusb_publisherMain
+#define OBUSB_DONE_TOPIC "obus-bench-done"
+
+char* obusb_daemonPath = NULL;
+char* obusb_daemonConfig = NULL;
+unsigned char obusb_startDaemon = 1;
+char* obusb_host = NULL;
+int obusb_port = 24452;
+int obusb_daemonThreads = 1;
+int obusb_publishers = 1;
+int obusb_subscribers = 1;
+int obusb_messageLen = 100;
+int obusb_messages = 100000;
+int obusb_topicCount = 1;
+char* obusb_transport = NULL;
+char* obusb_rpcEndpoint = NULL;
+char* obusb_pubEndpoint = NULL;
+//Shared with a daemon run in this process, for inproc
+void* obusb_zmqCtx = NULL;
+
+char** obusb_topics = NULL;
+
+atomic_int obusb_subscribersReady;
+atomic_int obusb_started;
+atomic_int obusb_publishersDone;
+atomic_ullong obusb_publishFailures;
+
+typedef struct obusb_Subscriber{
+	pthread_t thread;
+	unsigned char ready;
+	unsigned long long received;
+	unsigned long long bytes;
+	uint64_t* latencies;
+	unsigned long long latencyCap;
+	uint64_t lastAt;
+} obusb_Subscriber;
+
+typedef struct obusb_Publisher{
+	pthread_t thread;
+	int id;
+	unsigned char drained;
+} obusb_Publisher;
+
+static uint64_t obusb_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static obus_Client* obusb_connect(){
+	if(obusb_rpcEndpoint){
+		return obus_clientNewShared(obusb_zmqCtx, obusb_rpcEndpoint, obusb_pubEndpoint, 1);
+	}
+	return obus_clientNew(obusb_host, obusb_port, 1);
+}
+
+//Publishes a message with nothing in it, until it is taken
+static unsigned char obusb_publishProbe(obus_Client* client, const char* topic){
+	unsigned char r;
+	while((r = obus_publish(client, topic, "", 0)) == OBUS_PUBLISH_AGAIN){
+		usleep(50);
+	}
+	return r;
+}
+
+static void obusb_onProbe(obus_Client* client, const char* topic, size_t topicLen, uint64_t seq, const char* data, size_t len, void* ud){
+	obusb_Subscriber* sub = ud;
+	sub->ready = 1;
+}
+
+/*
+ * Counts a message of the run. Anything before the publishers start is
+ * drained unseen, such as the last messages the daemon cached for a
+ * topic in an earlier run.
+ */
+static void obusb_onMessage(obus_Client* client, const char* topic, size_t topicLen, uint64_t seq, const char* data, size_t len, void* ud){
+	obusb_Subscriber* sub = ud;
+	if(!atomic_load(&obusb_started) || obus_messageIsCached(client)){
+		return;
+	}
+	
+	uint64_t now = obusb_now();
+
+	if(len >= OBUSB_MIN_MESSAGE_LEN && sub->received < sub->latencyCap){
+		uint64_t sentAt;
+		memcpy(&sentAt, data, sizeof(sentAt));
+		sub->latencies[sub->received] = now - sentAt;
+	}
+	
+	sub->received++;
+	sub->bytes += len;
+	sub->lastAt = now;
+}
+
+static void* obusb_subscriberMain(void* vdSub){
+	obusb_Subscriber* sub = vdSub;
+	
+	obus_Client* client = obusb_connect();
+	if(!client){
+		fputs("Failed to connect to message bus.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	int i;
+	for(i = 0; i < obusb_topicCount; i++){
+		obus_subscribe(client, obusb_topics[i], obusb_onMessage, sub);
+	}
+	obus_subscribe(client, OBUSB_PROBE_TOPIC, obusb_onProbe, sub);
+
+	//Ready once a probe gets through, and so every subscription before it
+	while(!sub->ready){
+		if(obus_poll(client, OBUSB_PROBE_INTERVAL_MS) < 0){
+			fputs("Failed to receive message.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	obus_unsubscribe(client, OBUSB_PROBE_TOPIC);
+	atomic_fetch_add(&obusb_subscribersReady, 1);
+
+	uint64_t idleSince = 0;
+	
+	while(sub->received < sub->latencyCap){
+		int r = obus_poll(client, 100);
+		if(r < 0){
+			fputs("Failed to receive message.\n", stderr);
+			break;
+		}
+
+		if(atomic_load(&obusb_publishersDone) == obusb_publishers && r == 0){
+			uint64_t now = obusb_now();
+			if(idleSince == 0){
+				idleSince = now;
+			}else if(now - idleSince > OBUSB_IDLE_TIMEOUT_MS * 1000000ull){
+				break;
+			}
+		}else{
+			idleSince = 0;
+		}
+	}
+
+	obus_clientFree(client);
+	return NULL;
+}
+
+static void obusb_onDone(obus_Client* client, const char* topic, size_t topicLen, uint64_t seq, const char* data, size_t len, void* ud){
+	obusb_Publisher* pub = ud;
+	pub->drained = 1;
+}
+
+/*
+ * Publishes obusb_messages messages, then drains its connection: a message
+ * it sends itself coming back means the daemon has everything sent before
+ * it, so nothing is left to linger when the client is freed.
+ */
+static void* obusb_publisherMain(void* vdPub){
+	obusb_Publisher* pub = vdPub;
+	
+	obus_Client* client = obusb_connect();
+	if(!client){
+		fputs("Failed to connect to message bus.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	char* body = malloc(obusb_messageLen);
+	if(!body){
+		exit(EXIT_FAILURE);
+	}
+	memset(body, 'x', obusb_messageLen);
+
+	int i;
+	for(i = 0; i < obusb_messages; i++){
+		const char* topic = obusb_topics[(i + pub->id) % obusb_topicCount];
+		
+		uint64_t now = obusb_now();
+		memcpy(body, &now, sizeof(now));
+
+		unsigned char r;
+		while((r = obus_publish(client, topic, body, obusb_messageLen)) == OBUS_PUBLISH_AGAIN){
+			usleep(50);
+		}
+		if(r != 0){
+			atomic_fetch_add(&obusb_publishFailures, 1);
+		}
+	}
+
+	free(body);
+
+	char doneTopic[64];
+	snprintf(doneTopic, sizeof(doneTopic), OBUSB_DONE_TOPIC "%i", pub->id);
+	obus_subscribe(client, doneTopic, obusb_onDone, pub);
+
+	uint64_t deadline = obusb_now() + OBUSB_READY_TIMEOUT_MS * 1000000ull;
+	while(!pub->drained){
+		if(obusb_now() > deadline){
+			fputs("A publisher's messages never all reached the daemon.\n", stderr);
+			break;
+		}
+		if(obusb_publishProbe(client, doneTopic) != 0 || obus_poll(client, OBUSB_PROBE_INTERVAL_MS) < 0){
+			fputs("Failed to send message.\n", stderr);
+			break;
+		}
+	}
+	
+	obus_clientFree(client);
+	atomic_fetch_add(&obusb_publishersDone, 1);
+	
+	return NULL;
+}
+
+//The daemon's command line, kept for as long as a daemon in this process runs
+static char obusb_daemonPort[16];
+static char obusb_daemonThreadCount[16];
+static char* obusb_daemonArgs[16];
+static int obusb_daemonArgCount = 0;
+
+static void obusb_buildDaemonArgs(){
+	snprintf(obusb_daemonPort, sizeof(obusb_daemonPort), "%i", obusb_port);
+	snprintf(obusb_daemonThreadCount, sizeof(obusb_daemonThreadCount), "%i", obusb_daemonThreads);
+
+	char** args = obusb_daemonArgs;
+	int argCount = 0;
+	args[argCount++] = obusb_daemonPath;
+	args[argCount++] = "-H";
+	args[argCount++] = obusb_host;
+	args[argCount++] = "-p";
+	args[argCount++] = obusb_daemonPort;
+	args[argCount++] = "-T";
+	args[argCount++] = obusb_daemonThreadCount;
+	if(obusb_rpcEndpoint){
+		args[argCount++] = "-b";
+		args[argCount++] = obusb_rpcEndpoint;
+		args[argCount++] = "-B";
+		args[argCount++] = obusb_pubEndpoint;
+	}
+	if(obusb_daemonConfig){
+		args[argCount++] = "-c";
+		args[argCount++] = obusb_daemonConfig;
+	}
+	args[argCount] = NULL;
+	
+	obusb_daemonArgCount = argCount;
+}
+
+static pid_t obusb_spawnDaemon(){
+	obusb_buildDaemonArgs();
+
+	pid_t pid = fork();
+	if(pid == 0){
+		execv(obusb_daemonPath, obusb_daemonArgs);
+		fprintf(stderr, "Failed to run %s\n", obusb_daemonPath);
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void* obusb_daemonMain(void* unused){
+	//The daemon parses its command line with getopt, as this did
+	optind = 1;
+	obusd_main(obusb_daemonArgCount, obusb_daemonArgs, obusb_zmqCtx);
+	
+	fputs("The daemon stopped.\n", stderr);
+	exit(EXIT_FAILURE);
+	return NULL;
+}
+
+//Runs the daemon on a thread of this process, sharing obusb_zmqCtx for inproc
+static unsigned char obusb_runDaemon(){
+	obusb_buildDaemonArgs();
+
+	obusb_zmqCtx = zmq_ctx_new();
+	if(!obusb_zmqCtx){
+		return 1;
+	}
+	zmq_ctx_set(obusb_zmqCtx, ZMQ_IO_THREADS, obusb_daemonThreads);
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, obusb_daemonMain, NULL) != 0){
+		return 1;
+	}
+	pthread_detach(thread);
+	
+	return 0;
+}
+
+/*
+ * Publishes probes until every subscriber has one, so the daemon is up
+ * and every subscription has taken effect. Fails if the daemon this
+ * started, when there is one, exits first.
+ */
+static unsigned char obusb_waitReady(pid_t daemon){
+	obus_Client* client = obusb_connect();
+	if(!client){
+		fputs("Failed to connect to message bus.\n", stderr);
+		return 1;
+	}
+
+	unsigned char ret = 0;
+	uint64_t deadline = obusb_now() + OBUSB_READY_TIMEOUT_MS * 1000000ull;
+	
+	while(atomic_load(&obusb_subscribersReady) < obusb_subscribers){
+		if(daemon > 0 && waitpid(daemon, NULL, WNOHANG) == daemon){
+			fputs("The daemon exited.\n", stderr);
+			ret = 1;
+			break;
+		}
+		if(obusb_now() > deadline){
+			fputs("The daemon or subscribers never became ready.\n", stderr);
+			ret = 1;
+			break;
+		}
+		if(obusb_publishProbe(client, OBUSB_PROBE_TOPIC) != 0){
+			fputs("Failed to send message.\n", stderr);
+			ret = 1;
+			break;
+		}
+		usleep(OBUSB_PROBE_INTERVAL_MS * 1000);
+	}
+
+	obus_clientFree(client);
+	return ret;
+}
+
+static int obusb_compareLatency(const void* a, const void* b){
+	uint64_t latencyA = *(const uint64_t*)a;
+	uint64_t latencyB = *(const uint64_t*)b;
+	return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+static double obusb_percentile(uint64_t* sorted, unsigned long long count, double p){
+	if(count == 0){
+		return 0;
+	}
+	unsigned long long idx = (unsigned long long)(p * (count - 1));
+	return sorted[idx] / 1000.0;
+}
+
+int main(int argc, char* argv[]){
+	obusb_daemonPath = strdup("obus_daemon");
+	obusb_host = strdup("127.0.0.1");
+	obusb_transport = strdup("tcp");
+	
+    static struct option long_opts[] = {
+		{"version", no_argument, 0, 'v'},
+		{"help", no_argument, 0, 'h'},
+		{"daemon", required_argument, 0, 'd'},
+		{"daemon-config", required_argument, 0, 'c'},
+		{"no-daemon", no_argument, 0, 'N'},
+		{"host", required_argument, 0, 'H'},
+		{"port", required_argument, 0, 'p'},
+		{"threads", required_argument, 0, 'T'},
+		{"publishers", required_argument, 0, 'P'},
+		{"subscribers", required_argument, 0, 'S'},
+		{"size", required_argument, 0, 's'},
+		{"messages", required_argument, 0, 'n'},
+		{"topics", required_argument, 0, 't'},
+		{"transport", required_argument, 0, 'x'},
+        {0, 0, 0, 0}
+    };
+
+    int opt_idx = 0;
+
+    while(1){
+        int c = getopt_long(argc, argv, "vhd:c:NH:p:T:P:S:s:n:t:x:", long_opts, &opt_idx);
+
+        if(c == -1){
+            break;
+        }
+
+        switch(c){
+            case 'v': {
+				puts(PACKAGE_NAME "-bench " PACKAGE_VERSION);
+				puts("");
+                puts("Copyright (C) 2017 John M. Harris, Jr.");
+				puts("");
+                puts("This is free software. It is licensed for use, modification and");
+                puts("redistribution under the terms of the GNU General Public License,");
+                puts("version 3 or later <https://gnu.org/licenses/gpl.html>");
+                puts("");
+                puts("Please send bug reports to: <" PACKAGE_BUGREPORT ">");
+                exit(EXIT_SUCCESS);
+                break;
+            }
+            case 'h': {
+                puts(PACKAGE_NAME "-bench - Message bus benchmark");
+                printf("Usage: %s [options]\n", argv[0]);
+				puts("Daemon:");
+				puts("   -d, --daemon                Path to the obus_daemon to start (Default: from PATH)");
+				puts("   -c, --daemon-config         Configuration file for the daemon");
+				puts("   -N, --no-daemon             Use a daemon that is already running");
+				puts("   -H, --host                  Sets the host/address to use (Default: 127.0.0.1)");
+				puts("   -p, --port                  Sets the port to use (Default: 24452)");
+				puts("   -T, --threads               Number of daemon worker threads");
+				puts("   -x, --transport             tcp, ipc to use Unix sockets, or inproc to run the");
+				puts("                               daemon in this process (Default: tcp)");
+				puts("");
+				puts("Load:");
+				puts("   -P, --publishers            Number of publishing threads");
+				puts("   -S, --subscribers           Number of subscribing threads");
+				puts("   -s, --size                  Message size in bytes (at least 8)");
+				puts("   -n, --messages              Messages sent by each publisher");
+				puts("   -t, --topics                Number of topics to spread messages across");
+				puts("");
+                puts("   -v, --version               Prints version information and exits");
+                puts("   -h, --help                  Prints this help text and exits");
+                puts("");
+                puts("Every subscriber subscribes to every topic. Latency is measured from the");
+                puts("time each message was sent, embedded in it, to when it was received.");
+                puts("");
+                puts("Please send bug reports to: <" PACKAGE_BUGREPORT ">");
+                exit(EXIT_SUCCESS);
+                break;
+            }
+			case 'd': {
+				free(obusb_daemonPath);
+				obusb_daemonPath = strdup(optarg);
+				break;
+			}
+			case 'c': {
+				free(obusb_daemonConfig);
+				obusb_daemonConfig = strdup(optarg);
+				break;
+			}
+			case 'N': {
+				obusb_startDaemon = 0;
+				break;
+			}
+			case 'H': {
+                free(obusb_host);
+				obusb_host = strdup(optarg);
+                break;
+            }
+			case 'p': {
+				obusb_port = atoi(optarg);
+                break;
+            }
+			case 'T': {
+				obusb_daemonThreads = atoi(optarg);
+                break;
+            }
+			case 'P': {
+				obusb_publishers = atoi(optarg);
+                break;
+            }
+			case 'S': {
+				obusb_subscribers = atoi(optarg);
+                break;
+            }
+			case 's': {
+				obusb_messageLen = atoi(optarg);
+                break;
+            }
+			case 'n': {
+				obusb_messages = atoi(optarg);
+                break;
+            }
+			case 't': {
+				obusb_topicCount = atoi(optarg);
+                break;
+            }
+			case 'x': {
+				free(obusb_transport);
+				obusb_transport = strdup(optarg);
+                break;
+            }
+            default: {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+	if(obusb_publishers < 1 || obusb_subscribers < 1 || obusb_messages < 1 || obusb_topicCount < 1){
+		fputs("Publishers, subscribers, messages and topics must all be at least 1.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if(obusb_messageLen < OBUSB_MIN_MESSAGE_LEN){
+		obusb_messageLen = OBUSB_MIN_MESSAGE_LEN;
+	}
+
+	if(strcmp(obusb_transport, "ipc") == 0){
+		//Named by port, so a daemon started with -N can be bound to them too
+		char endpoint[64];
+		snprintf(endpoint, sizeof(endpoint), "ipc:///tmp/obus-bench-%i-rpc", obusb_port);
+		obusb_rpcEndpoint = strdup(endpoint);
+		snprintf(endpoint, sizeof(endpoint), "ipc:///tmp/obus-bench-%i-pub", obusb_port);
+		obusb_pubEndpoint = strdup(endpoint);
+	}else if(strcmp(obusb_transport, "inproc") == 0){
+		//Only reachable from this process, so the daemon has to run in it
+		if(!obusb_startDaemon){
+			fputs("inproc needs the daemon started by obus-bench.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		obusb_rpcEndpoint = strdup("inproc://obus-bench-rpc");
+		obusb_pubEndpoint = strdup("inproc://obus-bench-pub");
+	}else if(strcmp(obusb_transport, "tcp") != 0){
+		fprintf(stderr, "Unknown transport: %s\n", obusb_transport);
+		return EXIT_FAILURE;
+	}
+
+	obusb_topics = malloc(sizeof(char*) * obusb_topicCount);
+	if(!obusb_topics){
+		return EXIT_FAILURE;
+	}
+	
+	int i;
+	for(i = 0; i < obusb_topicCount; i++){
+		char topic[32];
+		snprintf(topic, sizeof(topic), "bench%i", i);
+		obusb_topics[i] = strdup(topic);
+	}
+
+	pid_t daemon = 0;
+	if(obusb_startDaemon && strcmp(obusb_transport, "inproc") == 0){
+		if(obusb_runDaemon() != 0){
+			fputs("Failed to start the daemon.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}else if(obusb_startDaemon){
+		daemon = obusb_spawnDaemon();
+		if(daemon < 0){
+			fputs("Failed to start the daemon.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	atomic_init(&obusb_subscribersReady, 0);
+	atomic_init(&obusb_started, 0);
+	atomic_init(&obusb_publishersDone, 0);
+	atomic_init(&obusb_publishFailures, 0);
+
+	unsigned long long expected = (unsigned long long)obusb_publishers * obusb_messages;
+
+	obusb_Subscriber* subs = calloc(obusb_subscribers, sizeof(obusb_Subscriber));
+	obusb_Publisher* pubs = calloc(obusb_publishers, sizeof(obusb_Publisher));
+	if(!subs || !pubs){
+		return EXIT_FAILURE;
+	}
+	
+	for(i = 0; i < obusb_subscribers; i++){
+		subs[i].latencyCap = expected;
+		subs[i].latencies = malloc(sizeof(uint64_t) * expected);
+		if(!subs[i].latencies){
+			fputs("Not enough memory for the latency samples.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		pthread_create(&subs[i].thread, NULL, obusb_subscriberMain, &subs[i]);
+	}
+
+	if(obusb_waitReady(daemon) != 0){
+		if(daemon > 0){
+			kill(daemon, SIGTERM);
+			waitpid(daemon, NULL, 0);
+		}
+		return EXIT_FAILURE;
+	}
+
+	atomic_store(&obusb_started, 1);
+	uint64_t startAt = obusb_now();
+	
+	for(i = 0; i < obusb_publishers; i++){
+		pubs[i].id = i;
+		pthread_create(&pubs[i].thread, NULL, obusb_publisherMain, &pubs[i]);
+	}
+
+	for(i = 0; i < obusb_publishers; i++){
+		pthread_join(pubs[i].thread, NULL);
+	}
+	uint64_t sentAt = obusb_now();
+	
+	for(i = 0; i < obusb_subscribers; i++){
+		pthread_join(subs[i].thread, NULL);
+	}
+
+	if(daemon > 0){
+		kill(daemon, SIGTERM);
+		waitpid(daemon, NULL, 0);
+
+		if(obusb_rpcEndpoint){
+			unlink(obusb_rpcEndpoint + strlen("ipc://"));
+			unlink(obusb_pubEndpoint + strlen("ipc://"));
+		}
+	}
+
+	unsigned long long received = 0;
+	unsigned long long bytes = 0;
+	unsigned long long samples = 0;
+	uint64_t lastAt = startAt;
+	
+	for(i = 0; i < obusb_subscribers; i++){
+		received += subs[i].received;
+		bytes += subs[i].bytes;
+		if(subs[i].lastAt > lastAt){
+			lastAt = subs[i].lastAt;
+		}
+	}
+
+	uint64_t* latencies = malloc(sizeof(uint64_t) * (received > 0 ? received : 1));
+	if(!latencies){
+		return EXIT_FAILURE;
+	}
+	for(i = 0; i < obusb_subscribers; i++){
+		unsigned long long count = subs[i].received < subs[i].latencyCap ? subs[i].received : subs[i].latencyCap;
+		memcpy(&latencies[samples], subs[i].latencies, sizeof(uint64_t) * count);
+		samples += count;
+	}
+	qsort(latencies, samples, sizeof(uint64_t), obusb_compareLatency);
+
+	double seconds = (lastAt - startAt) / 1e9;
+	if(seconds <= 0){
+		seconds = 1e-9;
+	}
+
+	printf("%s, %i publishers, %i subscribers, %i byte messages, %i topics, %i daemon threads\n",
+		   obusb_transport, obusb_publishers, obusb_subscribers, obusb_messageLen, obusb_topicCount, obusb_daemonThreads);
+	printf("sent:       %llu in %.3f s (%llu failed)\n", expected, (sentAt - startAt) / 1e9, (unsigned long long)atomic_load(&obusb_publishFailures));
+	printf("received:   %llu of %llu (%llu lost)\n", received, expected * obusb_subscribers, expected * obusb_subscribers - received);
+	printf("throughput: %.0f msgs/s, %.2f MB/s\n", received / seconds, bytes / seconds / (1024 * 1024));
+	printf("latency:    p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		   obusb_percentile(latencies, samples, 0.5), obusb_percentile(latencies, samples, 0.99),
+		   obusb_percentile(latencies, samples, 0.999), obusb_percentile(latencies, samples, 1.0));
+
+	return received == expected * obusb_subscribers ? EXIT_SUCCESS : EXIT_FAILURE;
+}
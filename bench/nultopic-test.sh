@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+#
+# This file is part of OBus.
+#
+# OBus is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# OBus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Starts a daemon and publishes to topics that only differ after a NUL,
+# checking that each is numbered on its own, as topics are keyed by their
+# bytes and length rather than as C strings.
+#
+# Usage: nultopic-test.sh [base port]
+# OBUS_DAEMON and OBUS_CLI point at the binaries to use.
+
+OBUS_DAEMON=${OBUS_DAEMON:-../daemon/obus_daemon}
+OBUS_CLI=${OBUS_CLI:-../cli/obus-cli}
+BASE_PORT=${1:-24490}
+
+if [ ! -x "$OBUS_DAEMON" ] || [ ! -x "$OBUS_CLI" ]; then
+	echo "obus_daemon or obus-cli not built, skipping" >&2
+	#Skipped, to automake
+	exit 77
+fi
+
+DIR=$(mktemp -d)
+PIDS=()
+
+cleanup(){
+	if [ ${#PIDS[@]} -gt 0 ]; then
+		kill "${PIDS[@]}" 2>/dev/null
+		wait "${PIDS[@]}" 2>/dev/null
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+: > "$DIR/cli.conf"
+: > "$DIR/obusd.conf"
+
+cli(){
+	"$OBUS_CLI" -c "$DIR/cli.conf" -H 127.0.0.1 -p "$BASE_PORT" "$@"
+}
+
+#Publishes the whole message, topic included, and prints the daemon's
+#answer, "publish:ok <seq>"
+publish(){
+	printf '%b\n' "$1" | cli -V -s -t "" 2>&1 | grep -o 'publish:[a-z]* [0-9]*'
+}
+
+expect(){
+	local got
+	got=$(publish "$1")
+	[ "$got" = "$2" ] || fail "$1 was answered '$got' instead of '$2'"
+}
+
+"$OBUS_DAEMON" -c "$DIR/obusd.conf" -H 127.0.0.1 -p "$BASE_PORT" 2> "$DIR/obusd.log" &
+PIDS+=($!)
+
+expect 'nul\0a:{"n":1}' "publish:ok 1"
+expect 'nul\0b:{"n":1}' "publish:ok 1"
+expect 'nul\0a:{"n":2}' "publish:ok 2"
+expect 'nul:{"n":1}' "publish:ok 1"
+expect 'nul\0b:{"n":2}' "publish:ok 2"
+
+#Counting them must not have taken the daemon down
+cli -S > /dev/null || fail "the stats endpoint stopped answering"
+
+echo "PASS"
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+#
+# This file is part of OBus.
+#
+# OBus is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# OBus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Starts a daemon caching the last message of at most two topics, and
+# checks that a snapshot holds each topic's latest message only, and that
+# the topic updated longest ago makes way for a new one.
+#
+# Usage: snapshot-test.sh [base port]
+# OBUS_DAEMON and OBUS_CLI point at the binaries to use.
+
+OBUS_DAEMON=${OBUS_DAEMON:-../daemon/obus_daemon}
+OBUS_CLI=${OBUS_CLI:-../cli/obus-cli}
+BASE_PORT=${1:-24510}
+
+if [ ! -x "$OBUS_DAEMON" ] || [ ! -x "$OBUS_CLI" ]; then
+	echo "obus_daemon or obus-cli not built, skipping" >&2
+	#Skipped, to automake
+	exit 77
+fi
+
+DIR=$(mktemp -d)
+PIDS=()
+
+cleanup(){
+	if [ ${#PIDS[@]} -gt 0 ]; then
+		kill "${PIDS[@]}" 2>/dev/null
+		wait "${PIDS[@]}" 2>/dev/null
+	fi
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+: > "$DIR/cli.conf"
+printf 'i:lvc_max_topics\n2\n' > "$DIR/obusd.conf"
+
+cli(){
+	"$OBUS_CLI" -c "$DIR/cli.conf" -H 127.0.0.1 -p "$BASE_PORT" "$@"
+}
+
+publish(){
+	echo "$2" | cli -s -t "$1" || fail "publishing $1"
+}
+
+#Every cached message, in a stable order
+snapshot(){
+	cli -n | sort | tr '\n' ' '
+}
+
+"$OBUS_DAEMON" -c "$DIR/obusd.conf" -H 127.0.0.1 -p "$BASE_PORT" 2> "$DIR/obusd.log" &
+PIDS+=($!)
+
+publish lvca a1
+publish lvca a2
+publish lvcb b1
+
+got=$(snapshot)
+[ "$got" = "lvca:a2 lvcb:b1 " ] || fail "the snapshot was '$got'"
+
+publish lvcc c1
+
+got=$(snapshot)
+[ "$got" = "lvcb:b1 lvcc:c1 " ] || fail "after a third topic the snapshot was '$got'"
+
+echo "PASS"
@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "conf.h"
+#include "compress.h"
 #include "obus.h"
 
 #include <stdlib.h>
@@ -27,6 +28,11 @@
 
 #include <getopt.h>
 #include <unistd.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+
+#include <glib.h>
 
 #include <zmq.h>
 
@@ -34,7 +40,24 @@ unsigned char obus_isVerbose = 0;
 char* obus_confFile = NULL;
 int obus_port = 14452;
 char* obus_host = NULL;
+char* obus_rpcEndpoint = NULL;
+char* obus_pubEndpoint = NULL;
+char* obus_statsEndpoint = NULL;
+char* obus_queuedEndpoint = NULL;
 char* obus_msg_type = NULL;
+char* obus_filter = NULL;
+int obus_maxMessageLen = OBUS_DEFAULT_MAX_MESSAGE_LEN;
+int obus_chunkLen = OBUS_DEFAULT_CHUNK_LEN;
+//Content type sent messages are enveloped with, or -1 to send them as text
+int obus_contentType = -1;
+//Codec the daemon asked enveloped messages of obus_msg_type to be compressed with
+int obus_codec = OBUS_CODEC_NONE;
+//Whether to receive through the daemon's queued subscriber endpoint
+unsigned char obus_queued = 0;
+
+//Last sequence number seen per topic, and where to ask for missed messages
+GHashTable* obus_lastSeqs = NULL;
+void* obus_recoverSock = NULL;
 
 #define OBUS_DEBUG
 
@@ -45,9 +68,921 @@ char* obus_msg_type = NULL;
 	#define OBUS_DEFAULT_HOST "0.0.0.0"
 #endif
 
+//Type of sent messages when none is given
+#define OBUS_DEFAULT_TYPE "event:"
+
 #define OBUS_OPMODE_SEND 0
 #define OBUS_OPMODE_RECV 1
 #define OBUS_OPMODE_LISTEN 2
+#define OBUS_OPMODE_STATS 3
+#define OBUS_OPMODE_REPLAY 4
+#define OBUS_OPMODE_CALL 5
+#define OBUS_OPMODE_STREAM 6
+#define OBUS_OPMODE_SNAPSHOT 7
+
+#define OBUS_FRAMING_LINE 0
+#define OBUS_FRAMING_LEN 1
+
+//Matches the daemon's limit on messages per replay reply
+#define OBUS_REPLAY_LIMIT 1000
+//Most calls kept in flight at once by --call
+#define OBUS_CALL_WINDOW 64
+//Milliseconds to wait on the daemon to answer a request
+#define OBUS_REPLY_TIMEOUT 5000
+//Messages --stream lets queue up before a send waits on the daemon
+#define OBUS_STREAM_HWM 100000
+//Milliseconds --stream waits on exit for what is still queued to go out
+#define OBUS_STREAM_LINGER 10000
+
+//Outgoing message, sent in chunks of at most obus_chunkLen bytes as it is
+//built so that only one chunk is ever held in memory.
+typedef struct obus_OutMessage{
+	void* sock;
+	char* buf;
+	size_t len;
+	size_t cap;
+	size_t total;
+	//Compressed messages are held whole, and sent with their envelope at the end
+	unsigned char buffered;
+} obus_OutMessage;
+
+static unsigned char obus_outMessageInit(obus_OutMessage* out, void* sock){
+	out->sock = sock;
+	out->len = 0;
+	out->total = 0;
+	out->buffered = 0;
+	out->cap = obus_chunkLen > 0 ? obus_chunkLen : 1024;
+	out->buf = malloc(out->cap);
+	return out->buf == NULL;
+}
+
+static unsigned char obus_outMessageAppend(obus_OutMessage* out, const char* data, size_t len);
+
+/*
+ * Starts a message of obus_msg_type. Text messages start with the type
+ * prefix, while enveloped ones send the envelope and the type as frames
+ * of their own, ahead of the payload.
+ */
+static unsigned char obus_outMessageBegin(obus_OutMessage* out){
+	size_t typeLen = strlen(obus_msg_type);
+	
+	if(obus_contentType < 0){
+		return obus_outMessageAppend(out, obus_msg_type, typeLen);
+	}
+
+	//Whether it ends up compressed is only known once it's all there
+	if(obus_codec != OBUS_CODEC_NONE){
+		out->buffered = 1;
+		out->total = typeLen;
+		return 0;
+	}
+
+	obus_Envelope env;
+	obus_envelopeInit(&env, obus_contentType);
+	
+	if(zmq_send(out->sock, &env, sizeof(env), ZMQ_SNDMORE) < 0 ||
+	   zmq_send(out->sock, obus_msg_type, typeLen, ZMQ_SNDMORE) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	out->total = typeLen;
+	return 0;
+}
+
+/*
+ * Adds len bytes of data to a message. The daemon's max_message_len bounds
+ * each chunk, as obus_chunkLen does, so only a message sent as a single
+ * chunk is bounded as a whole.
+ */
+static unsigned char obus_outMessageAppend(obus_OutMessage* out, const char* data, size_t len){
+	out->total += len;
+	if(obus_chunkLen == 0 && out->total > obus_maxMessageLen){
+		fputs("The message is too long.\n", stderr);
+		return 1;
+	}
+	
+	while(len > 0){
+		if(out->len == out->cap){
+			if(obus_chunkLen > 0 && !out->buffered){
+				int r = zmq_send(out->sock, out->buf, out->len, ZMQ_SNDMORE);
+				if(r < 0){
+					fputs("Failed to send message.\n", stderr);
+					return 1;
+				}
+				out->len = 0;
+			}else{
+				size_t newCap = out->cap * 2;
+				char* tmpBuf = realloc(out->buf, newCap);
+				if(!tmpBuf){
+					return 1;
+				}
+				out->buf = tmpBuf;
+				out->cap = newCap;
+			}
+		}
+
+		size_t n = out->cap - out->len;
+		if(n > len){
+			n = len;
+		}
+		memcpy(&out->buf[out->len], data, n);
+		out->len += n;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+//Sends a buffered message with its envelope, compressed if that makes it smaller
+static unsigned char obus_outMessageSendBuffered(obus_OutMessage* out){
+	obus_Envelope env;
+	obus_envelopeInit(&env, obus_contentType);
+
+	void* compressed = NULL;
+	size_t compressedLen = 0;
+	if(out->len >= OBUS_COMPRESS_MIN_LEN && obus_compress(obus_codec, out->buf, out->len, &compressed, &compressedLen) == 0){
+		env.flags |= obus_codec;
+	}
+
+	unsigned char ret = 0;
+	if(zmq_send(out->sock, &env, sizeof(env), ZMQ_SNDMORE) < 0 ||
+	   zmq_send(out->sock, obus_msg_type, strlen(obus_msg_type), ZMQ_SNDMORE) < 0){
+		fputs("Failed to send message.\n", stderr);
+		ret = 1;
+	}else{
+		const void* data = compressed ? compressed : out->buf;
+		size_t len = compressed ? compressedLen : out->len;
+		
+		ret = obus_sendChunks(out->sock, data, len, obus_chunkLen > 0 ? obus_chunkLen : 0);
+		if(ret != 0){
+			fputs("Failed to send message.\n", stderr);
+		}
+	}
+
+	free(compressed);
+	
+	out->len = 0;
+	out->total = 0;
+	return ret;
+}
+
+//Sends the last chunk, leaving out ready to build the next message
+static unsigned char obus_outMessageSend(obus_OutMessage* out){
+	if(out->buffered){
+		return obus_outMessageSendBuffered(out);
+	}
+	
+	//Envelopes carry the payload as is, text is NUL terminated
+	unsigned char ret = 0;
+	if(obus_contentType < 0){
+		ret = obus_outMessageAppend(out, "\0", 1);
+	}
+	if(ret == 0){
+		int r = zmq_send(out->sock, out->buf, out->len, 0);
+		if(r < 0){
+			fputs("Failed to send message.\n", stderr);
+			ret = 1;
+		}
+	}
+
+	out->len = 0;
+	out->total = 0;
+	return ret;
+}
+
+static unsigned char obus_outMessageFinish(obus_OutMessage* out){
+	unsigned char ret = obus_outMessageSend(out);
+	
+	free(out->buf);
+	out->buf = NULL;
+	return ret;
+}
+
+/*
+ * Writes the payload of an enveloped message to stdout exactly as it is,
+ * after decompressing it if need be. The payload is what is left of the
+ * message on sock, if more is set. Returns -1 on error.
+ */
+static int obus_printEnveloped(void* sock, const obus_Envelope* env, int more){
+	int codec = env->flags & OBUS_ENVELOPE_CODEC_MASK;
+	
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	char* buf = NULL;
+	size_t len = 0;
+	int r = 0;
+	
+	while(more){
+		r = zmq_msg_recv(&msg, sock, 0);
+		if(r < 0){
+			break;
+		}
+		more = zmq_msg_more(&msg);
+
+		if(codec == OBUS_CODEC_NONE){
+			fwrite(zmq_msg_data(&msg), 1, r, stdout);
+			continue;
+		}
+
+		char* tmpBuf = realloc(buf, len + r);
+		if(!tmpBuf){
+			r = -1;
+			break;
+		}
+		buf = tmpBuf;
+		memcpy(&buf[len], zmq_msg_data(&msg), r);
+		len += r;
+	}
+
+	if(r >= 0 && codec != OBUS_CODEC_NONE){
+		void* body;
+		size_t bodyLen;
+		
+		if(!obus_codecAvailable(codec)){
+			fprintf(stderr, "Can't decompress %s messages.\n", obus_codecName(codec));
+		}else if(obus_decompress(codec, buf, len, OBUS_DEFAULT_MAX_BODY_LEN, &body, &bodyLen) != 0){
+			fputs("Failed to decompress message.\n", stderr);
+		}else{
+			fwrite(body, 1, bodyLen, stdout);
+			free(body);
+		}
+	}
+	putchar('\n');
+
+	free(buf);
+	zmq_msg_close(&msg);
+	return r < 0 ? -1 : 0;
+}
+
+//Writes one chunk of a message to stdout, skipping skip bytes of type prefix
+static void obus_printChunk(zmq_msg_t* msg, size_t skip, int last){
+	char* data = zmq_msg_data(msg);
+	size_t size = zmq_msg_size(msg);
+
+	if(size < skip){
+		skip = size;
+	}
+	data += skip;
+	size -= skip;
+
+	if(last && size > 0 && data[size - 1] == '\0'){
+		size--;
+	}
+		
+	fwrite(data, 1, size, stdout);
+	if(last){
+		putchar('\n');
+	}
+}
+
+static unsigned char obus_checkSeq(const char* topic, size_t topicLen, uint64_t seq, uint32_t count, unsigned char cached, unsigned char conflated);
+
+/*
+ * Prints the rest of a message replayed or served from the daemon's cache,
+ * whose header frame msg is: its chunks, or [topic][envelope][payload]...
+ * for an enveloped message, as the journal keeps them. A cached message,
+ * given its seq, is checked against those already seen, and skipped if
+ * it is one of them. The topic is left out as it would be live: all of it
+ * for a content filter, else the type subscribed to.
+ */
+static void obus_printStored(void* sock, zmq_msg_t* msg, long long cachedSeq){
+	int more = zmq_msg_more(msg);
+	int chunkIdx = 0;
+	size_t skip = 0;
+			
+	while(more){
+		int r = zmq_msg_recv(msg, sock, 0);
+		if(r < 0){
+			break;
+		}
+				
+		more = zmq_msg_more(msg);
+
+		if(chunkIdx == 0){
+			skip = obus_filter ? obus_topicLength(zmq_msg_data(msg), r) : strlen(obus_msg_type);
+		}
+
+		if(chunkIdx == 0 && cachedSeq >= 0 && obus_checkSeq(zmq_msg_data(msg), obus_topicLength(zmq_msg_data(msg), r), cachedSeq, 1, 1, 0)){
+			while(more && zmq_msg_recv(msg, sock, 0) >= 0){
+				more = zmq_msg_more(msg);
+			}
+			break;
+		}
+				
+		if(chunkIdx == 1 && obus_isEnvelope(zmq_msg_data(msg), r)){
+			obus_Envelope env;
+			memcpy(&env, zmq_msg_data(msg), sizeof(env));
+					
+			obus_printEnveloped(sock, &env, more);
+			break;
+		}
+				
+		obus_printChunk(msg, skip, !more);
+		skip = 0;
+		chunkIdx++;
+	}
+}
+
+/*
+ * Asks the daemon's journal for up to max messages (0 for all) of topic
+ * from seq on, and prints them. Replies come back in runs of at most
+ * OBUS_REPLAY_LIMIT messages, each ended by "$replay:end <next>", so a full
+ * run is followed by a request for the next one. Returns how many messages
+ * were printed, or -1 on error.
+ */
+static long long obus_replay(void* sock, const char* topic, unsigned long long seq, unsigned long long max){
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	long long total = 0;
+	int want = 0;
+	int count = 0;
+	
+	do{
+		want = OBUS_REPLAY_LIMIT;
+		if(max > 0 && max - total < want){
+			want = max - total;
+		}
+		
+		char req[256];
+		int reqLen = snprintf(req, sizeof(req), "$replay:%s %llu %i", topic, seq, want);
+		
+		if(zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(sock, req, reqLen, 0) < 0){
+			fputs("Failed to send message.\n", stderr);
+			total = -1;
+			break;
+		}
+
+		count = 0;
+		
+		while(1){
+			//The empty delimiter, then the reply's header
+			int r = zmq_msg_recv(&msg, sock, 0);
+			if(r >= 0){
+				r = zmq_msg_recv(&msg, sock, 0);
+			}
+			if(r < 0){
+				fputs("Failed to receive message.\n", stderr);
+				total = -1;
+				break;
+			}
+
+			char head[64];
+			size_t headLen = r < sizeof(head) - 1 ? r : sizeof(head) - 1;
+			memcpy(head, zmq_msg_data(&msg), headLen);
+			head[headLen] = '\0';
+
+			if(strncmp(head, "$replay:end ", 12) == 0){
+				seq = strtoull(&head[12], NULL, 10);
+				break;
+			}
+			if(strncmp(head, "$replay:error ", 14) == 0){
+				fprintf(stderr, "Replay failed: %s\n", &head[14]);
+				total = -1;
+				break;
+			}
+
+			obus_printStored(sock, &msg, -1);
+			count++;
+		}
+
+		if(total >= 0){
+			total += count;
+		}
+	}while(total >= 0 && count == want && (max == 0 || total < max));
+
+	fflush(stdout);
+	zmq_msg_close(&msg);
+	return total;
+}
+
+/*
+ * Prints the last message of every topic starting with type that the
+ * daemon has cached. With track, their sequence numbers are checked and
+ * noted as those of messages received, as when catching up on a
+ * subscription. Returns how many there were, or -1 on error.
+ */
+static long long obus_snapshot(void* sock, const char* type, unsigned char track){
+	char req[256];
+	int reqLen = snprintf(req, sizeof(req), OBUS_SNAPSHOT_COMMAND "%s", type);
+	
+	if(zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(sock, req, reqLen, 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return -1;
+	}
+	
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	long long count = 0;
+	
+	while(1){
+		//The empty delimiter, then the reply's header
+		int r = zmq_msg_recv(&msg, sock, 0);
+		if(r >= 0){
+			r = zmq_msg_recv(&msg, sock, 0);
+		}
+		if(r < 0){
+			fputs("Failed to receive message.\n", stderr);
+			count = -1;
+			break;
+		}
+
+		char head[64];
+		size_t headLen = r < sizeof(head) - 1 ? r : sizeof(head) - 1;
+		memcpy(head, zmq_msg_data(&msg), headLen);
+		head[headLen] = '\0';
+
+		if(strncmp(head, "$snapshot:end", 13) == 0){
+			break;
+		}
+		if(strncmp(head, "$snapshot:error ", 16) == 0){
+			//Such as the cache being off, which a subscriber needn't hear about
+			if(!track){
+				fprintf(stderr, "Snapshot failed: %s\n", &head[16]);
+			}
+			count = -1;
+			break;
+		}
+
+		obus_printStored(sock, &msg, track ? (long long)strtoull(&head[10], NULL, 10) : -1);
+		count++;
+	}
+
+	fflush(stdout);
+	zmq_msg_close(&msg);
+	return count;
+}
+
+/*
+ * Asks the daemon at endpoint which codec, if any, messages of type are
+ * to be compressed with. Its rules are checked in order, and the first
+ * whose prefix type starts with applies. Codecs this build lacks are
+ * treated as none.
+ */
+static int obus_negotiateCodec(void* zmq_ctx, const char* endpoint, const char* type){
+	int timeout = OBUS_REPLY_TIMEOUT;
+	int linger = 0;
+	
+	void* sock = zmq_socket(zmq_ctx, ZMQ_DEALER);
+	zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+	zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(linger));
+
+	const char* cmd = OBUS_COMPRESS_COMMAND;
+	if(zmq_connect(sock, endpoint) != 0 || zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(sock, cmd, strlen(cmd), 0) < 0){
+		zmq_close(sock);
+		return OBUS_CODEC_NONE;
+	}
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	int codec = OBUS_CODEC_NONE;
+	unsigned char matched = 0;
+	int frameIdx = 0;
+	
+	//The empty delimiter, then "$compress:" and a frame for each rule
+	int r = zmq_msg_recv(&msg, sock, 0);
+	while(r >= 0 && zmq_msg_more(&msg)){
+		r = zmq_msg_recv(&msg, sock, 0);
+		frameIdx++;
+		if(r < 0 || frameIdx < 2 || matched){
+			continue;
+		}
+
+		size_t prefixLen;
+		int ruleCodec;
+		if(obus_codecRuleParse(zmq_msg_data(&msg), r, &prefixLen, &ruleCodec) != 0){
+			continue;
+		}
+
+		if(strlen(type) >= prefixLen && memcmp(type, zmq_msg_data(&msg), prefixLen) == 0){
+			matched = 1;
+			codec = ruleCodec;
+			
+			if(codec == OBUS_CODEC_NONE && obus_isVerbose){
+				fprintf(stderr, "Not compressing, by the rule %.*s\n", r, (char*)zmq_msg_data(&msg));
+			}
+		}
+	}
+
+	zmq_msg_close(&msg);
+	zmq_close(sock);
+	return codec;
+}
+
+/*
+ * Notes that messages seq through seq + count - 1 of a topic arrived,
+ * reporting any skipped since the last ones seen. Those are printed from
+ * the daemon's journal first, when it keeps one. Gaps before a conflated
+ * message were left by the daemon on purpose, and aren't reported. Returns
+ * 1 if the message is a cached copy of one already seen, which should be
+ * skipped.
+ */
+static unsigned char obus_checkSeq(const char* topic, size_t topicLen, uint64_t seq, uint32_t count, unsigned char cached, unsigned char conflated){
+	if(!obus_lastSeqs){
+		obus_lastSeqs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	}
+	
+	char key[topicLen + 1];
+	memcpy(key, topic, topicLen);
+	key[topicLen] = '\0';
+
+	uint64_t* last = g_hash_table_lookup(obus_lastSeqs, key);
+	if(!last){
+		last = malloc(sizeof(uint64_t));
+		if(!last){
+			return 0;
+		}
+		g_hash_table_insert(obus_lastSeqs, g_strdup(key), last);
+	}else if(cached && seq <= *last){
+		//Already received live
+		return 1;
+	}else if(seq > *last + 1 && !conflated){
+		unsigned long long missed = seq - *last - 1;
+		fprintf(stderr, "Missed %llu message(s) of %s (%llu to %llu)\n", missed, key, (unsigned long long)*last + 1, (unsigned long long)seq - 1);
+
+		if(obus_recoverSock){
+			long long recovered = obus_replay(obus_recoverSock, key, *last + 1, missed);
+			if(recovered < 0){
+				fputs("Not recovering missed messages.\n", stderr);
+				zmq_close(obus_recoverSock);
+				obus_recoverSock = NULL;
+			}else if(recovered < missed){
+				fprintf(stderr, "Only %lld of them could be recovered.\n", recovered);
+			}
+		}
+	}
+
+	//Also picks up again after the daemon restarts without a journal
+	*last = seq + count - 1;
+	return 0;
+}
+
+/*
+ * Receives one (possibly multipart) message and writes it to stdout, with
+ * the subscribed type prefix removed. Batches published by the daemon are
+ * split back into the messages they carry, and sequence numbers are
+ * checked for gaps. Returns 1 when a message was printed, 0 when one was
+ * skipped, or -1 on error.
+ */
+static int obus_printMessage(void* sock){
+	zmq_msg_t msg;
+	zmq_msg_t next;
+	zmq_msg_init(&msg);
+	zmq_msg_init(&next);
+	
+	size_t skip = strlen(obus_msg_type);
+	int more = 0;
+	int r = zmq_msg_recv(&msg, sock, 0);
+
+	//Copies published for a content filter lead with the filter's topic
+	if(r > 0 && ((char*)zmq_msg_data(&msg))[0] == '?' && zmq_msg_more(&msg)){
+		r = zmq_msg_recv(&msg, sock, 0);
+		
+		if(!obus_filter){
+			while(r >= 0 && zmq_msg_more(&msg)){
+				r = zmq_msg_recv(&msg, sock, 0);
+			}
+			
+			zmq_msg_close(&next);
+			zmq_msg_close(&msg);
+			return r < 0 ? r : 0;
+		}
+
+		if(r >= 0){
+			skip = obus_topicLength(zmq_msg_data(&msg), zmq_msg_size(&msg));
+		}
+	}
+
+	if(r >= 0 && zmq_msg_more(&msg)){
+		r = zmq_msg_recv(&next, sock, 0);
+		
+		if(r >= 0 && obus_isBatchHeader(zmq_msg_data(&next), zmq_msg_size(&next))){
+			obus_BatchHeader* hdr = (obus_BatchHeader*)zmq_msg_data(&next);
+			obus_checkSeq(zmq_msg_data(&msg), zmq_msg_size(&msg), obus_ntohll(hdr->seq), ntohl(hdr->count), 0, 0);
+			
+			do{
+				r = zmq_msg_recv(&msg, sock, 0);
+				if(r < 0){
+					break;
+				}
+				
+				more = zmq_msg_more(&msg);
+				obus_printChunk(&msg, skip, 1);
+			}while(more);
+
+			goto done;
+		}
+
+		//The topic frame, then the envelope and the payload
+		if(r >= 0 && obus_isEnvelope(zmq_msg_data(&next), zmq_msg_size(&next))){
+			obus_Envelope* env = (obus_Envelope*)zmq_msg_data(&next);
+			if(obus_checkSeq(zmq_msg_data(&msg), zmq_msg_size(&msg), obus_ntohll(env->seq), 1, env->flags & OBUS_ENVELOPE_CACHED, env->flags & OBUS_ENVELOPE_CONFLATED)){
+				more = zmq_msg_more(&next);
+				goto skipped;
+			}
+
+			obus_printChunk(&msg, skip, 0);
+			r = obus_printEnveloped(sock, env, zmq_msg_more(&next));
+
+			goto done;
+		}
+
+		if(r >= 0 && obus_isSeqHeader(zmq_msg_data(&next), zmq_msg_size(&next))){
+			obus_SeqHeader* hdr = (obus_SeqHeader*)zmq_msg_data(&next);
+			size_t topicLen = obus_topicLength(zmq_msg_data(&msg), zmq_msg_size(&msg));
+			more = zmq_msg_more(&next);
+			
+			if(obus_checkSeq(zmq_msg_data(&msg), topicLen, obus_ntohll(hdr->seq), 1, hdr->flags & OBUS_SEQ_CACHED, hdr->flags & OBUS_SEQ_CONFLATED)){
+				goto skipped;
+			}
+
+			obus_printChunk(&msg, skip, !more);
+			skip = 0;
+			
+			if(!more){
+				goto done;
+			}
+			r = zmq_msg_recv(&msg, sock, 0);
+		}else if(r >= 0){
+			obus_printChunk(&msg, skip, 0);
+			skip = 0;
+			zmq_msg_move(&msg, &next);
+		}
+	}
+
+	while(r >= 0){
+		more = zmq_msg_more(&msg);
+		obus_printChunk(&msg, skip, !more);
+		skip = 0;
+		
+		if(!more){
+			break;
+		}
+		r = zmq_msg_recv(&msg, sock, 0);
+	}
+
+  done:
+	fflush(stdout);
+	
+	zmq_msg_close(&next);
+	zmq_msg_close(&msg);
+	return r < 0 ? r : 1;
+
+  skipped:
+	while(more){
+		r = zmq_msg_recv(&msg, sock, 0);
+		if(r < 0){
+			break;
+		}
+		more = zmq_msg_more(&msg);
+	}
+	
+	zmq_msg_close(&next);
+	zmq_msg_close(&msg);
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Calls a service once for every line on stdin, with each line as the
+ * request body, and prints the replies as they come. Up to window calls
+ * are in flight at once, each tagged with its line number.
+ */
+static unsigned char obus_call(void* sock, const char* service, int window){
+	size_t headLen = strlen("$call:") + strlen(service);
+	char* head = malloc(headLen + 1);
+	if(!head){
+		return 1;
+	}
+	snprintf(head, headLen + 1, "$call:%s", service);
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	char* line = NULL;
+	size_t len = 0;
+	
+	unsigned long long sent = 0;
+	int inFlight = 0;
+	unsigned char eof = 0;
+	unsigned char ret = 0;
+	
+	while(ret == 0){
+		while(!eof && inFlight < window){
+			ssize_t read = getline(&line, &len, stdin);
+			if(read == -1){
+				eof = 1;
+				break;
+			}
+			if(read > 0 && line[read - 1] == '\n'){
+				read--;
+			}
+
+			char tag[32];
+			int tagLen = snprintf(tag, sizeof(tag), "%llu", ++sent);
+			
+			if(zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0 || zmq_send(sock, head, headLen, ZMQ_SNDMORE) < 0 ||
+			   zmq_send(sock, tag, tagLen, ZMQ_SNDMORE) < 0 || zmq_send(sock, line, read, 0) < 0){
+				fputs("Failed to send message.\n", stderr);
+				ret = 1;
+				break;
+			}
+			inFlight++;
+		}
+
+		if(ret != 0 || inFlight == 0){
+			break;
+		}
+
+		//[""][$reply:...][tag][body]...
+		int r = zmq_msg_recv(&msg, sock, 0);
+		if(r >= 0){
+			r = zmq_msg_recv(&msg, sock, 0);
+		}
+		if(r < 0){
+			fputs("No reply from the message bus.\n", stderr);
+			ret = 1;
+			break;
+		}
+		inFlight--;
+
+		char status[128];
+		size_t statusLen = r < sizeof(status) - 1 ? r : sizeof(status) - 1;
+		memcpy(status, zmq_msg_data(&msg), statusLen);
+		status[statusLen] = '\0';
+
+		int more = zmq_msg_more(&msg);
+		if(more){
+			r = zmq_msg_recv(&msg, sock, 0);
+			more = r >= 0 && zmq_msg_more(&msg);
+			
+			if(r >= 0 && obus_isVerbose){
+				fprintf(stderr, "Reply to %.*s\n", r, (char*)zmq_msg_data(&msg));
+			}
+		}
+
+		if(strncmp(status, "$reply:error ", 13) == 0){
+			fprintf(stderr, "Call failed: %s\n", &status[13]);
+		}
+
+		while(more){
+			if(zmq_msg_recv(&msg, sock, 0) < 0){
+				break;
+			}
+			more = zmq_msg_more(&msg);
+			obus_printChunk(&msg, 0, !more);
+		}
+		fflush(stdout);
+	}
+
+	free(line);
+	free(head);
+	zmq_msg_close(&msg);
+	return ret;
+}
+
+/*
+ * Publishes every record on stdin as its own message: each line, or with
+ * OBUS_FRAMING_LEN, each record of a 4 byte length in network byte order
+ * followed by that many bytes. Messages aren't acknowledged, so they go
+ * out back to back and ZeroMQ writes as many at once as it can.
+ */
+static unsigned char obus_stream(void* sock, int framing){
+	obus_OutMessage out;
+	if(obus_outMessageInit(&out, sock) != 0){
+		return 1;
+	}
+
+	char* record = NULL;
+	size_t cap = 0;
+	unsigned long long sent = 0;
+	unsigned char ret = 0;
+
+	//The type prefix, and the NUL ending text messages, count towards the
+	//limit on a message sent as a single chunk
+	size_t overhead = strlen(obus_msg_type) + (obus_contentType < 0 ? 1 : 0);
+	
+	while(ret == 0){
+		ssize_t len;
+		
+		if(framing == OBUS_FRAMING_LEN){
+			uint32_t netLen;
+			if(fread(&netLen, sizeof(netLen), 1, stdin) != 1){
+				break;
+			}
+			
+			len = ntohl(netLen);
+			if(obus_chunkLen == 0 && len + overhead > obus_maxMessageLen){
+				fputs("The message is too long.\n", stderr);
+				ret = 1;
+				break;
+			}
+			
+			if(len > cap){
+				char* tmpRecord = realloc(record, len);
+				if(!tmpRecord){
+					ret = 1;
+					break;
+				}
+				record = tmpRecord;
+				cap = len;
+			}
+			
+			if(len > 0 && fread(record, len, 1, stdin) != 1){
+				fputs("Truncated record on stdin.\n", stderr);
+				ret = 1;
+				break;
+			}
+		}else{
+			len = getline(&record, &cap, stdin);
+			if(len == -1){
+				break;
+			}
+			if(len > 0 && record[len - 1] == '\n'){
+				len--;
+			}
+		}
+
+		if(obus_outMessageBegin(&out) != 0 ||
+		   obus_outMessageAppend(&out, record, len) != 0 ||
+		   obus_outMessageSend(&out) != 0){
+			ret = 1;
+			break;
+		}
+		sent++;
+	}
+
+	if(ferror(stdin)){
+		fputs("Error reading from stdin.\n", stderr);
+		ret = 1;
+	}
+	
+	if(obus_isVerbose){
+		fprintf(stderr, "Sent %llu messages\n", sent);
+	}
+
+	free(record);
+	free(out.buf);
+	return ret;
+}
+
+//OBUS_CONTENT_* for a content type's name, or -1 if there is none
+static int obus_contentTypeFromName(const char* name){
+	static const char* names[] = {"text", "json", "binary", "msgpack", "protobuf"};
+
+	int i;
+	for(i = 0; i < sizeof(names) / sizeof(names[0]); i++){
+		if(strcmp(name, names[i]) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Subscribes sock to messages starting with prefix, by asking the daemon
+ * to when receiving through its queued subscriber endpoint.
+ */
+static int obus_subscribeTo(void* sock, const char* prefix, size_t len){
+	if(!obus_queued){
+		return zmq_setsockopt(sock, ZMQ_SUBSCRIBE, prefix, len);
+	}
+
+	size_t cmdLen = strlen("subscribe:");
+	char* cmd = malloc(cmdLen + len);
+	if(!cmd){
+		return -1;
+	}
+	memcpy(cmd, "subscribe:", cmdLen);
+	memcpy(&cmd[cmdLen], prefix, len);
+
+	int r = zmq_send(sock, cmd, cmdLen + len, 0);
+	free(cmd);
+	return r < 0 ? r : 0;
+}
+
+/*
+ * The endpoint the daemon binds to for the configuration entry name, if
+ * it can be connected to as is. Only ipc:// endpoints can; anything else
+ * is reached through the host and port.
+ */
+static char* obus_configEndpoint(char* name){
+	char* endpoint = NULL;
+	
+	obus_ConfigEntry* ent = obus_getConfigEntry(name);
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+			if(ent->data.str.len > 0 && obus_isLocalEndpoint(ent->data.str.str)){
+				endpoint = strdup(ent->data.str.str);
+			}
+		}
+		obus_releaseConfigEntry(ent);
+	}
+	return endpoint;
+}
 
 int main(int argc, char* argv[]){
 	obus_confFile = strdup("/etc/obus.conf");
@@ -55,6 +990,11 @@ int main(int argc, char* argv[]){
 	obus_msg_type = NULL;
 	
 	unsigned char obus_opMode = 0;
+	unsigned long long obus_replayFrom = 0;
+	char* obus_service = NULL;
+	int obus_framing = OBUS_FRAMING_LINE;
+	char* obus_compileOut = NULL;
+	unsigned char hostGiven = 0;
 	
     static struct option long_opts[] = {
 		{"version", no_argument, 0, 'v'},
@@ -65,15 +1005,26 @@ int main(int argc, char* argv[]){
 		{"send", no_argument, 0, 's'},
 		{"recv", no_argument, 0, 'r'},
 		{"listen", no_argument, 0, 'l'},
+		{"stats", no_argument, 0, 'S'},
+		{"replay", required_argument, 0, 'R'},
+		{"snapshot", no_argument, 0, 'n'},
+		{"call", required_argument, 0, 'k'},
+		{"stream", no_argument, 0, 'm'},
+		{"framing", required_argument, 0, 'F'},
+		{"envelope", required_argument, 0, 'e'},
+		{"chunk", required_argument, 0, 'C'},
+		{"filter", required_argument, 0, 'f'},
+		{"queued", no_argument, 0, 'Q'},
         {"verbose", no_argument, 0, 'V'},
 		{"config", required_argument, 0, 'c'},
+		{"compile-config", required_argument, 0, 'X'},
         {0, 0, 0, 0}
     };
 
     int opt_idx = 0;
 
     while(1){
-        int c = getopt_long(argc, argv, "vhVsrlt:c:p:H:", long_opts, &opt_idx);
+        int c = getopt_long(argc, argv, "vhVsrlSmnQR:k:F:e:t:c:p:H:C:f:X:", long_opts, &opt_idx);
 
         if(c == -1){
             break;
@@ -104,10 +1055,28 @@ int main(int argc, char* argv[]){
 				puts("   -s, --send                  Send a message to the bus (Default)");
 				puts("   -r, --recv                  Receive a message from the bus");
 				puts("   -l, --listen                Listen for messages on the bus");
+				puts("   -S, --stats                 Print the daemon's per-topic counters as JSON");
+				puts("   -R, --replay                Print journaled messages of the type from this sequence number on");
+				puts("   -n, --snapshot              Print the last message of every topic of the type the daemon cached");
+				puts("   -k, --call                  Call a service with each line of stdin, printing the replies");
+				puts("   -m, --stream                Send each line of stdin as its own message");
+				puts("   -F, --framing               With --stream, line (Default) or len for records of a");
+				puts("                               4 byte big endian length followed by the message");
+				puts("   -e, --envelope              Send messages in a binary envelope, with a content type");
+				puts("                               of text, json, binary, msgpack or protobuf");
 				puts("");
 				puts("   -t, --type                  Type prefix to use");
+				puts("   -f, --filter                Only receive messages whose JSON body matches,");
+				puts("                               e.g. 'type == \"player\" && region == 3'");
+				puts("   -Q, --queued                With --recv or --listen, subscribe through the daemon's");
+				puts("                               per-subscriber queues, so falling behind follows the");
+				puts("                               daemon's sub_policies instead of dropping at random");
+				puts("   -C, --chunk                 Sends messages in chunks of this many bytes, at most");
+				puts("                               max_message_len (0 sends each as one chunk of at most that)");
 				puts("");
 				puts("   -c, --config                Uses a specified file instead of /etc/obus.conf");
+				puts("   -X, --compile-config        Compiles the configuration file into this file and exits,");
+				puts("                               for the daemon to load faster with -c");
                 puts("   -v, --version               Prints version information and exits");
 				puts("   -V, --verbose               Print verbose messages throughout operation");
                 puts("   -h, --help                  Prints this help text and exits");
@@ -134,13 +1103,70 @@ int main(int argc, char* argv[]){
 				obus_opMode = OBUS_OPMODE_LISTEN;
                 break;
             }
+			case 'S': {
+				obus_opMode = OBUS_OPMODE_STATS;
+                break;
+            }
+			case 'R': {
+				obus_opMode = OBUS_OPMODE_REPLAY;
+				obus_replayFrom = strtoull(optarg, NULL, 10);
+                break;
+            }
+			case 'n': {
+				obus_opMode = OBUS_OPMODE_SNAPSHOT;
+                break;
+            }
+			case 'k': {
+				obus_opMode = OBUS_OPMODE_CALL;
+				free(obus_service);
+				obus_service = strdup(optarg);
+                break;
+            }
+			case 'm': {
+				obus_opMode = OBUS_OPMODE_STREAM;
+                break;
+            }
+			case 'F': {
+				if(strcmp(optarg, "line") == 0){
+					obus_framing = OBUS_FRAMING_LINE;
+				}else if(strcmp(optarg, "len") == 0){
+					obus_framing = OBUS_FRAMING_LEN;
+				}else{
+					fprintf(stderr, "Unknown framing: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+                break;
+            }
+			case 'e': {
+				obus_contentType = obus_contentTypeFromName(optarg);
+				if(obus_contentType < 0){
+					fprintf(stderr, "Unknown content type: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'C': {
+				obus_chunkLen = atoi(optarg);
+				break;
+			}
+			case 'f': {
+				free(obus_filter);
+				obus_filter = strdup(optarg);
+				break;
+			}
+			case 'Q': {
+				obus_queued = 1;
+				break;
+			}
 			case 'H': {
                 free(obus_host);
 				obus_host = strdup(optarg);
+				hostGiven = 1;
                 break;
             }
 			case 'p': {
 				obus_port = atoi(optarg);
+				hostGiven = 1;
                 break;
             }
 			case 't': {
@@ -149,6 +1175,7 @@ int main(int argc, char* argv[]){
 				char* newMsg = malloc(newMsgLen + 2);
 
 				strncpy(newMsg, optarg, newMsgLen);
+				newMsg[newMsgLen] = '\0';
 				if(newMsgLen > 0){
 				    newMsg[newMsgLen] = ':';
 					newMsg[newMsgLen + 1] = '\0';
@@ -161,6 +1188,11 @@ int main(int argc, char* argv[]){
                 free(obus_confFile);
 				obus_confFile = strdup(optarg);
                 break;
+            }
+			case 'X': {
+				free(obus_compileOut);
+				obus_compileOut = strdup(optarg);
+                break;
             }
             case 'V': {
                 obus_isVerbose = !obus_isVerbose;
@@ -172,6 +1204,14 @@ int main(int argc, char* argv[]){
         }
     }
 
+	if(obus_compileOut){
+		if(obus_compileConfig(obus_confFile, obus_compileOut) != 0){
+			fprintf(stderr, "Failed to compile %s\n", obus_confFile);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
 	unsigned char runningInteractive = isatty(fileno(stdin));
 
     int r = obus_loadConfig(obus_confFile);
@@ -205,43 +1245,170 @@ int main(int argc, char* argv[]){
 			obus_releaseConfigEntry(ent);
 			ent = NULL;
 		}
+
+		//A daemon on this machine listening on ipc:// is used directly,
+		//unless a host or port is asked for
+		if(!hostGiven){
+			obus_rpcEndpoint = obus_configEndpoint("bind_rpc");
+			obus_pubEndpoint = obus_configEndpoint("bind_pub");
+			obus_statsEndpoint = obus_configEndpoint("bind_stats");
+			obus_queuedEndpoint = obus_configEndpoint("bind_queued");
+		}
+
+		ent = obus_getConfigEntry("max_message_len");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer > 0){
+					obus_maxMessageLen = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+	}
+
+	//Chunks can't be larger than what the daemon accepts
+	if(obus_chunkLen > obus_maxMessageLen){
+		obus_chunkLen = obus_maxMessageLen;
 	}
 
 	void* zmq_ctx = zmq_ctx_new();
 
 	int zmqType = ZMQ_REQ;
+	const char* endpoint = obus_rpcEndpoint;
 
-	if(obus_opMode != OBUS_OPMODE_SEND){
+	if(obus_opMode == OBUS_OPMODE_STATS){
+		obus_port += 2;
+		endpoint = obus_statsEndpoint;
+	}else if(obus_opMode == OBUS_OPMODE_REPLAY || obus_opMode == OBUS_OPMODE_SNAPSHOT || obus_opMode == OBUS_OPMODE_CALL || obus_opMode == OBUS_OPMODE_STREAM){
+		//Replays and snapshots come back as several replies, and calls and streamed
+		//messages are pipelined, none of which REQ allows
+		zmqType = ZMQ_DEALER;
+	}else if(obus_opMode != OBUS_OPMODE_SEND && obus_queued){
+		//Subscriptions are asked for with commands, and messages come as from a SUB
+		obus_port += 3;
+		zmqType = ZMQ_DEALER;
+		endpoint = obus_queuedEndpoint;
+	}else if(obus_opMode != OBUS_OPMODE_SEND){
 		obus_port++;
 		zmqType = ZMQ_SUB;
+		endpoint = obus_pubEndpoint;
 	}
 	
 	void* zmq_req = zmq_socket(zmq_ctx, zmqType);
 
-	//18 is tcp:// + : + 10 for port (lots of buffer, as max port is 5 digits) + 1 '\0'
-	int zmq_host_str_maxlen = 18 + strlen(obus_host);
-	char* zmq_host_str = malloc(zmq_host_str_maxlen);
-	snprintf(zmq_host_str, zmq_host_str_maxlen-1, "tcp://%s:%i", obus_host, obus_port);
+	if(obus_opMode == OBUS_OPMODE_STREAM){
+		//Nothing is acknowledged, so what is queued gets a while to go out
+		//before exiting, but an unreachable daemon can't hold the CLI forever
+		int hwm = OBUS_STREAM_HWM;
+		int linger = OBUS_STREAM_LINGER;
+		zmq_setsockopt(zmq_req, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+		zmq_setsockopt(zmq_req, ZMQ_LINGER, &linger, sizeof(linger));
+	}else if(zmqType != ZMQ_SUB && !obus_queued){
+		int timeout = OBUS_REPLY_TIMEOUT;
+		int linger = 0;
+		zmq_setsockopt(zmq_req, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+		zmq_setsockopt(zmq_req, ZMQ_LINGER, &linger, sizeof(linger));
+	}
+
+	char* zmq_host_str = obus_endpoint(endpoint, obus_host, obus_port);
 		
     r = zmq_connect(zmq_req, zmq_host_str);
-	free(zmq_host_str);
     if(r != 0){
 		puts("Failed to connect to message bus.\n");
 		return EXIT_FAILURE;
 	}
 
-	char buffer[OBUS_MAX_MESSAGE_LEN];
+	//Enveloped messages are compressed when the daemon's configuration asks for it
+	if(obus_contentType >= 0 && (obus_opMode == OBUS_OPMODE_SEND || obus_opMode == OBUS_OPMODE_STREAM)){
+		obus_codec = obus_negotiateCodec(zmq_ctx, zmq_host_str, obus_msg_type ? obus_msg_type : OBUS_DEFAULT_TYPE);
+	}
 
-	if(obus_opMode == OBUS_OPMODE_SEND){
-		buffer[0] = '\0';
+	//Missed messages are asked for on the request port
+	if((obus_opMode == OBUS_OPMODE_RECV || obus_opMode == OBUS_OPMODE_LISTEN) && !obus_filter){
+		int timeout = 2000;
+		int linger = 0;
+		
+		obus_recoverSock = zmq_socket(zmq_ctx, ZMQ_DEALER);
+		zmq_setsockopt(obus_recoverSock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+		zmq_setsockopt(obus_recoverSock, ZMQ_LINGER, &linger, sizeof(linger));
+		
+		free(zmq_host_str);
+		zmq_host_str = obus_endpoint(obus_rpcEndpoint, obus_host, obus_port - (obus_queued ? 3 : 1));
+		if(zmq_connect(obus_recoverSock, zmq_host_str) != 0){
+			zmq_close(obus_recoverSock);
+			obus_recoverSock = NULL;
+		}
+	}
+	free(zmq_host_str);
 
+	if(obus_opMode == OBUS_OPMODE_STATS){
+		//Only topics starting with the type prefix are reported
+		const char* prefix = obus_msg_type ? obus_msg_type : "";
+		
+		r = zmq_send(zmq_req, prefix, strlen(prefix), 0);
+		if(r < 0){
+			fputs("Failed to send message.\n", stderr);
+			return EXIT_FAILURE;
+		}
+
+		free(obus_msg_type);
+		obus_msg_type = strdup("");
+		
+		r = obus_printMessage(zmq_req);
+		if(r < 0){
+			fputs("Failed to receive message.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}else if(obus_opMode == OBUS_OPMODE_REPLAY){
+		if(obus_msg_type == NULL || obus_msg_type[0] == '\0'){
+			fputs("A type is needed to replay messages.\n", stderr);
+			return EXIT_FAILURE;
+		}
+
+		if(obus_replay(zmq_req, obus_msg_type, obus_replayFrom, 0) < 0){
+			return EXIT_FAILURE;
+		}
+	}else if(obus_opMode == OBUS_OPMODE_SNAPSHOT){
+		//Every cached topic, without a type
+		if(obus_msg_type == NULL){
+			obus_msg_type = strdup("");
+		}
+
+		if(obus_snapshot(zmq_req, obus_msg_type, 0) < 0){
+			return EXIT_FAILURE;
+		}
+	}else if(obus_opMode == OBUS_OPMODE_STREAM){
 		if(obus_msg_type == NULL){
-			obus_msg_type = strdup("event:");
+			obus_msg_type = strdup(OBUS_DEFAULT_TYPE);
+		}
+
+		if(obus_stream(zmq_req, obus_framing) != 0){
+			return EXIT_FAILURE;
+		}
+	}else if(obus_opMode == OBUS_OPMODE_CALL){
+		if(runningInteractive){
+			fputs("Please type one request per line, and press C-d (EOF) when done.\n", stderr);
+		}
+		
+		//Waiting on each reply in turn keeps typed calls interactive
+		if(obus_call(zmq_req, obus_service, runningInteractive ? 1 : OBUS_CALL_WINDOW) != 0){
+			return EXIT_FAILURE;
+		}
+	}else if(obus_opMode == OBUS_OPMODE_SEND){
+		if(obus_msg_type == NULL){
+			obus_msg_type = strdup(OBUS_DEFAULT_TYPE);
+		}
+
+		obus_OutMessage out;
+		if(obus_outMessageInit(&out, zmq_req) != 0){
+			return EXIT_FAILURE;
 		}
 		
 		size_t typeLen = strlen(obus_msg_type);
-		size_t bufSize = typeLen;
-		strncat(buffer, obus_msg_type, typeLen);
+		if(obus_outMessageBegin(&out) != 0){
+			return EXIT_FAILURE;
+		}
 		
 		if(runningInteractive){
 			fputs("Please type your message, and follow it with a blank line or press\n", stderr);
@@ -257,44 +1424,81 @@ int main(int argc, char* argv[]){
 				break;
 			}
 
-			if(bufSize > typeLen){
-				strncat(buffer, "\n", 1);
+			if(out.total > typeLen){
+				if(obus_outMessageAppend(&out, "\n", 1) != 0){
+					return EXIT_FAILURE;
+				}
 			}
 
-			bufSize += (read - 1);
-			strncat(buffer, line, read - 1);
-			
-			if(bufSize > (OBUS_MAX_MESSAGE_LEN - 1)){
-				fputs("The message is too long.\n", stderr);
+			if(obus_outMessageAppend(&out, line, read - 1) != 0){
 				return EXIT_FAILURE;
 			}
 		}
 
+		free(line);
+
 		if(ferror(stdin)){
 			fputs("Error reading from stdin.", stderr);
 		    return EXIT_FAILURE;
 		}
 		
-		r = zmq_send(zmq_req, buffer, bufSize + 1, 0);
+		if(obus_outMessageFinish(&out) != 0){
+			return EXIT_FAILURE;
+		}
+
+		//"publish:ok <seq>", "publish:dropped <seq>" or "publish:error <reason>"
+		char ack[64];
+		r = zmq_recv(zmq_req, ack, sizeof(ack) - 1, 0);
 		if(r < 0){
-			fputs("Failed to send message.\n", stderr);
+			fputs("No reply from the message bus.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		ack[r < sizeof(ack) - 1 ? r : sizeof(ack) - 1] = '\0';
+
+		if(strncmp(ack, "publish:dropped", 15) == 0){
+			fputs("The message was dropped by the message bus.\n", stderr);
 			return EXIT_FAILURE;
 		}
+		if(strncmp(ack, "publish:error ", 14) == 0){
+			fprintf(stderr, "The message bus refused the message: %s\n", &ack[14]);
+			return EXIT_FAILURE;
+		}
+		if(obus_isVerbose){
+			fprintf(stderr, "Sent (%s)\n", ack);
+		}
 	}else{
 		if(obus_msg_type == NULL){
 			obus_msg_type = malloc(1);
 			obus_msg_type[0] = '\0';
 		}
 		
-		r = zmq_setsockopt(zmq_req, ZMQ_SUBSCRIBE, obus_msg_type, strlen(obus_msg_type));
+		if(obus_filter){
+			//"?", the expression and a NUL, so no filter is a prefix of another
+			size_t filterLen = strlen(obus_filter);
+			char* filterTopic = malloc(filterLen + 2);
+			filterTopic[0] = '?';
+			memcpy(&filterTopic[1], obus_filter, filterLen + 1);
+			
+			r = obus_subscribeTo(zmq_req, filterTopic, filterLen + 2);
+			free(filterTopic);
+		}else{
+			r = obus_subscribeTo(zmq_req, obus_msg_type, strlen(obus_msg_type));
+		}
 		if(r != 0){
 			fputs("Failed to subscribe.\n", stderr);
 			return EXIT_FAILURE;
 		}
+
+		//The daemon's cache isn't pushed to new subscribers, but asked for
+		//once subscribed, so nothing published in between is missed. Queued
+		//subscribers are sent it by the daemon.
+		if(obus_opMode == OBUS_OPMODE_LISTEN && obus_recoverSock && !obus_queued){
+			obus_snapshot(obus_recoverSock, obus_msg_type, 1);
+		}
 		
 		if(obus_opMode == OBUS_OPMODE_LISTEN){
 			while(1){
-				r = zmq_recv(zmq_req, buffer, OBUS_MAX_MESSAGE_LEN, 0);
+				r = obus_printMessage(zmq_req);
 				if(r < 0){
 					if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
 						fputs("Failed to receive message.\n", stderr);
@@ -305,15 +1509,12 @@ int main(int argc, char* argv[]){
 						}
 					}
 				}
-
-				if(r > 0){
-					if(buffer[0] != '\0'){
-						puts(&buffer[strlen(obus_msg_type)]);
-					}
-				}
 			}
 		}else{
-			r = zmq_recv(zmq_req, buffer, OBUS_MAX_MESSAGE_LEN, 0);
+			do{
+				r = obus_printMessage(zmq_req);
+			}while(r == 0);
+			
 			if(r < 0){
 				if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
 					fputs("Failed to receive message.\n", stderr);
@@ -325,15 +1526,12 @@ int main(int argc, char* argv[]){
 					}
 				}
 			}
-
-			if(r > 0){
-				if(buffer[0] != '\0'){
-					puts(&buffer[strlen(obus_msg_type)]);
-				}
-			}
 		}
 	}
 
+	if(obus_recoverSock){
+		zmq_close(obus_recoverSock);
+	}
 	zmq_close(zmq_req);
 	zmq_ctx_destroy(zmq_ctx);
 	
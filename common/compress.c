@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+//Favours speed, as messages are compressed on the way out
+#define OBUS_ZSTD_LEVEL 3
+
+static const char* obus_codecNames[] = {"none", "lz4", "zstd"};
+
+//The codec called name, or -1 if there is none
+int obus_codecFromName(const char* name){
+	int i;
+	for(i = 0; i < sizeof(obus_codecNames) / sizeof(obus_codecNames[0]); i++){
+		if(strcmp(name, obus_codecNames[i]) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* obus_codecName(int codec){
+	if(codec < 0 || codec >= sizeof(obus_codecNames) / sizeof(obus_codecNames[0])){
+		return "unknown";
+	}
+	return obus_codecNames[codec];
+}
+
+/*
+ * Splits one of the daemon's a:compress_topics rules, "<prefix> <codec>",
+ * as it answers OBUS_COMPRESS_COMMAND with. The prefix may hold spaces,
+ * the codec's name can't. Codecs this build lacks come out as
+ * OBUS_CODEC_NONE, so the rule still matches. Returns 1 if rule isn't one.
+ */
+unsigned char obus_codecRuleParse(const char* rule, size_t len, size_t* prefixLen, int* codec){
+	const char* space = NULL;
+	
+	size_t i;
+	for(i = len; i > 0 && !space; i--){
+		if(rule[i - 1] == ' '){
+			space = &rule[i - 1];
+		}
+	}
+	if(!space){
+		return 1;
+	}
+
+	char name[16];
+	size_t nameLen = len - (space + 1 - rule);
+	if(nameLen >= sizeof(name)){
+		return 1;
+	}
+	memcpy(name, space + 1, nameLen);
+	name[nameLen] = '\0';
+
+	*prefixLen = space - rule;
+	*codec = obus_codecFromName(name);
+	if(*codec < 0 || !obus_codecAvailable(*codec)){
+		*codec = OBUS_CODEC_NONE;
+	}
+	return 0;
+}
+
+//Whether this build can compress and decompress with codec
+unsigned char obus_codecAvailable(int codec){
+	switch(codec){
+		case OBUS_CODEC_NONE: {
+			return 1;
+		}
+#ifdef HAVE_LZ4
+		case OBUS_CODEC_LZ4: {
+			return 1;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case OBUS_CODEC_ZSTD: {
+			return 1;
+		}
+#endif
+	}
+	return 0;
+}
+
+/*
+ * Compresses len bytes of src with codec into a new buffer, which the
+ * caller frees. Returns 1 on error, or if compressing didn't make the
+ * payload any smaller, in which case it should be sent as it is.
+ */
+unsigned char obus_compress(int codec, const void* src, size_t len, void** out, size_t* outLen){
+	if(len > UINT32_MAX){
+		return 1;
+	}
+	
+	size_t bound = 0;
+	switch(codec){
+#ifdef HAVE_LZ4
+		case OBUS_CODEC_LZ4: {
+			if(len > INT32_MAX){
+				return 1;
+			}
+			bound = LZ4_compressBound(len);
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case OBUS_CODEC_ZSTD: {
+			bound = ZSTD_compressBound(len);
+			break;
+		}
+#endif
+		default: {
+			return 1;
+		}
+	}
+
+	char* buf = malloc(sizeof(uint32_t) + bound);
+	if(!buf){
+		return 1;
+	}
+
+	uint32_t netLen = htonl(len);
+	memcpy(buf, &netLen, sizeof(netLen));
+
+	size_t compressedLen = 0;
+	switch(codec){
+#ifdef HAVE_LZ4
+		case OBUS_CODEC_LZ4: {
+			int r = LZ4_compress_default(src, buf + sizeof(uint32_t), len, bound);
+			if(r > 0){
+				compressedLen = r;
+			}
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case OBUS_CODEC_ZSTD: {
+			size_t r = ZSTD_compress(buf + sizeof(uint32_t), bound, src, len, OBUS_ZSTD_LEVEL);
+			if(!ZSTD_isError(r)){
+				compressedLen = r;
+			}
+			break;
+		}
+#endif
+	}
+
+	if(compressedLen == 0 || sizeof(uint32_t) + compressedLen >= len){
+		free(buf);
+		return 1;
+	}
+
+	*out = buf;
+	*outLen = sizeof(uint32_t) + compressedLen;
+	return 0;
+}
+
+/*
+ * Decompresses a payload compressed with codec into a new buffer, which
+ * the caller frees. Payloads that claim to be larger than maxLen are
+ * refused.
+ */
+unsigned char obus_decompress(int codec, const void* src, size_t len, size_t maxLen, void** out, size_t* outLen){
+	if(len < sizeof(uint32_t)){
+		return 1;
+	}
+
+	uint32_t netLen;
+	memcpy(&netLen, src, sizeof(netLen));
+	size_t origLen = ntohl(netLen);
+	if(origLen > maxLen){
+		return 1;
+	}
+
+	//Never 0 bytes, so malloc always returns something to free
+	char* buf = malloc(origLen + 1);
+	if(!buf){
+		return 1;
+	}
+
+	const char* data = (const char*)src + sizeof(uint32_t);
+	size_t dataLen = len - sizeof(uint32_t);
+	unsigned char failed = 1;
+	
+	switch(codec){
+#ifdef HAVE_LZ4
+		case OBUS_CODEC_LZ4: {
+			if(dataLen <= INT32_MAX && origLen <= INT32_MAX){
+				failed = LZ4_decompress_safe(data, buf, dataLen, origLen) != (int)origLen;
+			}
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case OBUS_CODEC_ZSTD: {
+			size_t r = ZSTD_decompress(buf, origLen, data, dataLen);
+			failed = ZSTD_isError(r) || r != origLen;
+			break;
+		}
+#endif
+	}
+
+	if(failed){
+		free(buf);
+		return 1;
+	}
+
+	*out = buf;
+	*outLen = origLen;
+	return 0;
+}
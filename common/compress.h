@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUS_COMPRESS_H_
+#define OBUS_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Codecs an enveloped payload may be compressed with, kept in the low
+ * bits of the envelope's flags. A compressed payload is the original
+ * length, 4 bytes in network byte order, followed by the codec's output.
+ */
+#define OBUS_CODEC_NONE 0
+#define OBUS_CODEC_LZ4 1
+#define OBUS_CODEC_ZSTD 2
+
+#define OBUS_ENVELOPE_CODEC_MASK 0x0f
+
+//Payloads smaller than this aren't worth compressing
+#define OBUS_COMPRESS_MIN_LEN 128
+//Largest payload a compressed one may claim to decompress to
+#define OBUS_DEFAULT_MAX_BODY_LEN (64 * 1024 * 1024)
+
+int obus_codecFromName(const char* name);
+const char* obus_codecName(int codec);
+unsigned char obus_codecAvailable(int codec);
+unsigned char obus_codecRuleParse(const char* rule, size_t len, size_t* prefixLen, int* codec);
+
+unsigned char obus_compress(int codec, const void* src, size_t len, void** out, size_t* outLen);
+unsigned char obus_decompress(int codec, const void* src, size_t len, size_t maxLen, void** out, size_t* outLen);
+
+#endif
@@ -23,10 +23,71 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 
-GHashTable* confTable = NULL;
+struct obus_Config{
+	atomic_int refs;
+	//A parsed configuration has a table, a compiled one is mapped
+	GHashTable* table;
+	char* map;
+	size_t mapLen;
+};
+
+/*
+ * A compiled configuration is this header, then the perfect hash's
+ * displacement for each bucket and its slots, then every entry, then the
+ * entries of arrays as offsets, then the keys and strings, NUL
+ * terminated. Entries are stored as obus_ConfigEntry with offsets in
+ * place of their pointers, and are fixed up when the file is mapped.
+ */
+typedef struct _obus_ConfigHeader{
+	char magic[4];
+	uint32_t version;
+	uint32_t entrySize;
+	uint32_t ptrSize;
+	uint32_t bucketCount;
+	uint32_t slotCount;
+	uint32_t entryCount;
+	uint32_t ptrCount;
+	uint64_t bucketsOff;
+	uint64_t slotsOff;
+	uint64_t entriesOff;
+	uint64_t ptrsOff;
+	uint64_t stringsOff;
+	uint64_t size;
+} _obus_ConfigHeader;
+
+//keyOff is 0 for an empty slot, where the header is
+typedef struct _obus_ConfigSlot{
+	uint64_t keyOff;
+	uint32_t keyLen;
+	uint32_t entry;
+} _obus_ConfigSlot;
+
+#define _OBUS_CONF_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+//Displacements tried for a bucket before giving up on compiling
+#define _OBUS_CONF_MAX_DISPLACE (1 << 20)
+
+/*
+ * The current snapshot. A reader counts itself in obus_configReaders for
+ * just long enough to load it and take a reference, so once a reload has
+ * swapped in a new one and seen no readers, nobody can still be about to
+ * take a reference to the old one, and its own reference can be dropped.
+ */
+static _Atomic(obus_Config*) obus_config = NULL;
+static atomic_int obus_configReaders = 0;
+static atomic_uint obus_configGen = 0;
+//Reloads are rare, so they are simply done one at a time
+static pthread_mutex_t obus_configLoadLock = PTHREAD_MUTEX_INITIALIZER;
 
 obus_ConfigEntry* _obus_conf_ent_new(){
     obus_ConfigEntry* ent = malloc(sizeof(obus_ConfigEntry));
@@ -36,6 +97,7 @@ obus_ConfigEntry* _obus_conf_ent_new(){
 	
 	ent->type = 0;
 	ent->refs = 0;
+	ent->owner = NULL;
 
 	return ent;
 }
@@ -47,48 +109,33 @@ static void _obus_destroy_conf(void* vdEnt){
 	
 	obus_ConfigEntry* ent = (obus_ConfigEntry*)vdEnt;
 
-	if(ent->refs < 2){
-		switch(ent->type){
-			case OBUS_CONF_ENT_TYPE_STR: {
-				free(ent->data.str.str);
-				break;
-			}
-			case OBUS_CONF_ENT_TYPE_ARRAY: {
-			    obus_ConfigEntry** arry = ent->data.array.array;
+	switch(ent->type){
+		case OBUS_CONF_ENT_TYPE_STR: {
+			free(ent->data.str.str);
+			break;
+		}
+		case OBUS_CONF_ENT_TYPE_ARRAY: {
+			obus_ConfigEntry** arry = ent->data.array.array;
 
-				int i;
-				for(i = 0; i < ent->data.array.len; i++){
-					if(arry[i]){
-						_obus_destroy_conf(arry[i]);
-					}
+			int i;
+			for(i = 0; i < ent->data.array.len; i++){
+				if(arry[i]){
+					_obus_destroy_conf(arry[i]);
 				}
 			}
+			free(arry);
 		}
-    
-		free(ent);
 	}
+    
+	free(ent);
 }
 
 #define _OBUS_CONF_PARSE_NORM 0
 #define _OBUS_CONF_PARSE_TYPE 1
 #define _OBUS_CONF_PARSE_COMMENT 2
 
-unsigned char obus_loadConfig(char* newConfig){
-	if(!newConfig){
-		return 1;
-	}
-	
-    if(!confTable){
-		confTable = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, _obus_destroy_conf);
-	}
-
-	FILE* f = fopen(newConfig, "r");
-	if(!f){
-	    g_hash_table_destroy(confTable);
-		confTable = NULL;
-		return 1;
-	}
-
+//Reads the entries of f into table, returning 2 if the file is invalid
+static unsigned char _obus_parseConfig(FILE* f, GHashTable* table){
 	char* line = NULL;
 	size_t len = 0;
 	ssize_t read;
@@ -292,7 +339,7 @@ unsigned char obus_loadConfig(char* newConfig){
 			  updateConfKey:
 				curEnt->refs = 1;
 					
-				g_hash_table_insert(confTable, strdup(curKey), curEnt);
+				g_hash_table_insert(table, strdup(curKey), curEnt);
 
 				free(curKey);
 				curKey = NULL;
@@ -307,41 +354,543 @@ unsigned char obus_loadConfig(char* newConfig){
 	if(curEnt && curKey){
 		curEnt->refs = 1;
 					
-		g_hash_table_insert(confTable, strdup(curKey), curEnt);
+		g_hash_table_insert(table, strdup(curKey), curEnt);
 
 		free(curKey);
 	}
 
+	free(line);
+	return 0;
+}
+
+static void _obus_configFree(obus_Config* conf){
+	if(conf->table){
+		g_hash_table_destroy(conf->table);
+	}
+	if(conf->map){
+		munmap(conf->map, conf->mapLen);
+	}
+	free(conf);
+}
+
+static uint32_t _obus_confHash(const char* key, size_t len, uint32_t seed){
+	uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+
+	size_t i;
+	for(i = 0; i < len; i++){
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+
+	//FNV alone leaves similar keys too close together for the displacements to separate
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	
+	return hash;
+}
+
+static obus_ConfigEntry* _obus_compiledLookup(obus_Config* conf, const char* name){
+	_obus_ConfigHeader* hdr = (_obus_ConfigHeader*)conf->map;
+	uint32_t* buckets = (uint32_t*)(conf->map + hdr->bucketsOff);
+	_obus_ConfigSlot* slots = (_obus_ConfigSlot*)(conf->map + hdr->slotsOff);
+	
+	size_t len = strlen(name);
+	uint32_t bucket = _obus_confHash(name, len, 0) % hdr->bucketCount;
+	_obus_ConfigSlot* slot = &slots[_obus_confHash(name, len, buckets[bucket]) % hdr->slotCount];
+
+	if(slot->keyOff == 0 || slot->keyLen != len || memcmp(conf->map + slot->keyOff, name, len) != 0){
+		return NULL;
+	}
+	return &((obus_ConfigEntry*)(conf->map + hdr->entriesOff))[slot->entry];
+}
+
+//Whether count elements of size bytes at off fit in a file of size bytes
+static unsigned char _obus_confFits(uint64_t off, uint64_t count, uint64_t size, uint64_t fileSize){
+	return off <= fileSize && count <= (fileSize - off) / size;
+}
+
+//Whether a NUL terminated string of len bytes is at off
+static unsigned char _obus_confHasString(obus_Config* conf, uint64_t off, uint64_t len){
+	return _obus_confFits(off, len + 1, 1, conf->mapLen) && conf->map[off + len] == '\0';
+}
+
+/*
+ * Maps the compiled configuration open as fd into conf, checking every
+ * offset in it and turning them into pointers. Nothing is allocated, and
+ * only the pages holding entries are copied. Returns 2 if it is invalid.
+ */
+static unsigned char _obus_mapConfig(int fd, obus_Config* conf){
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		return 1;
+	}
+	if(st.st_size < sizeof(_obus_ConfigHeader)){
+		return 2;
+	}
+
+	conf->mapLen = st.st_size;
+	conf->map = mmap(NULL, conf->mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(conf->map == MAP_FAILED){
+		conf->map = NULL;
+		return 1;
+	}
+
+	_obus_ConfigHeader* hdr = (_obus_ConfigHeader*)conf->map;
+	uint64_t size = conf->mapLen;
+	
+	if(memcmp(hdr->magic, OBUS_CONF_COMPILED_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != OBUS_CONF_COMPILED_VERSION){
+		return 2;
+	}
+	if(hdr->entrySize != sizeof(obus_ConfigEntry) || hdr->ptrSize != sizeof(obus_ConfigEntry*)){
+		fputs("Configuration was compiled for a different build.\n", stderr);
+		return 2;
+	}
+	if(hdr->size != size || hdr->bucketCount == 0 || hdr->slotCount == 0 ||
+	   hdr->bucketsOff % 8 != 0 || hdr->slotsOff % 8 != 0 || hdr->entriesOff % 8 != 0 || hdr->ptrsOff % 8 != 0 ||
+	   !_obus_confFits(hdr->bucketsOff, hdr->bucketCount, sizeof(uint32_t), size) ||
+	   !_obus_confFits(hdr->slotsOff, hdr->slotCount, sizeof(_obus_ConfigSlot), size) ||
+	   !_obus_confFits(hdr->entriesOff, hdr->entryCount, sizeof(obus_ConfigEntry), size) ||
+	   !_obus_confFits(hdr->ptrsOff, hdr->ptrCount, sizeof(obus_ConfigEntry*), size)){
+		return 2;
+	}
+
+	_obus_ConfigSlot* slots = (_obus_ConfigSlot*)(conf->map + hdr->slotsOff);
+	obus_ConfigEntry* entries = (obus_ConfigEntry*)(conf->map + hdr->entriesOff);
+	uintptr_t* ptrs = (uintptr_t*)(conf->map + hdr->ptrsOff);
+
+	uint32_t i;
+	for(i = 0; i < hdr->slotCount; i++){
+		if(slots[i].keyOff != 0 && (slots[i].entry >= hdr->entryCount || !_obus_confHasString(conf, slots[i].keyOff, slots[i].keyLen))){
+			return 2;
+		}
+	}
+
+	for(i = 0; i < hdr->ptrCount; i++){
+		uint64_t off = ptrs[i];
+		if(off < hdr->entriesOff || (off - hdr->entriesOff) % sizeof(obus_ConfigEntry) != 0 || (off - hdr->entriesOff) / sizeof(obus_ConfigEntry) >= hdr->entryCount){
+			return 2;
+		}
+		ptrs[i] = (uintptr_t)(conf->map + off);
+	}
+
+	for(i = 0; i < hdr->entryCount; i++){
+		obus_ConfigEntry* ent = &entries[i];
+		ent->owner = conf;
+		atomic_init(&ent->refs, 1);
+		
+		if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+			uint64_t off = (uintptr_t)ent->data.str.str;
+			if(ent->data.str.len < 0 || off < hdr->stringsOff || !_obus_confHasString(conf, off, ent->data.str.len)){
+				return 2;
+			}
+			ent->data.str.str = conf->map + off;
+		}else if(ent->type == OBUS_CONF_ENT_TYPE_ARRAY){
+			uint64_t off = (uintptr_t)ent->data.array.array;
+			if(ent->data.array.len < 0 || off < hdr->ptrsOff || (off - hdr->ptrsOff) % sizeof(obus_ConfigEntry*) != 0 ||
+			   (off - hdr->ptrsOff) / sizeof(obus_ConfigEntry*) + ent->data.array.len > hdr->ptrCount){
+				return 2;
+			}
+			ent->data.array.array = (obus_ConfigEntry**)(conf->map + off);
+		}else if(ent->type != OBUS_CONF_ENT_TYPE_INT){
+			return 2;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Loads the configuration file newConfig as a new snapshot. If it can't
+ * be read or is invalid, whatever was loaded before stays in place.
+ */
+unsigned char obus_loadConfig(char* newConfig){
+	if(!newConfig){
+		return 1;
+	}
+
+	FILE* f = fopen(newConfig, "r");
+	if(!f){
+		return 1;
+	}
+
+	obus_Config* conf = calloc(1, sizeof(obus_Config));
+	if(!conf){
+		fclose(f);
+		return 1;
+	}
+	atomic_init(&conf->refs, 1);
+
+	unsigned char r;
+	
+	char magic[4];
+	if(fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, OBUS_CONF_COMPILED_MAGIC, sizeof(magic)) == 0){
+		r = _obus_mapConfig(fileno(f), conf);
+	}else{
+		rewind(f);
+		
+		conf->table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)obus_releaseConfigEntry);
+		r = _obus_parseConfig(f, conf->table);
+	}
+	fclose(f);
+	
+	if(r != 0){
+		_obus_configFree(conf);
+		return r;
+	}
+
+	pthread_mutex_lock(&obus_configLoadLock);
+	
+	obus_Config* old = atomic_exchange(&obus_config, conf);
+	atomic_fetch_add(&obus_configGen, 1);
+	
+	while(atomic_load(&obus_configReaders) > 0){
+		sched_yield();
+	}
+	
+	pthread_mutex_unlock(&obus_configLoadLock);
+
+	if(old){
+		obus_configRelease(old);
+	}
 	return 0;
 }
 
 unsigned char obus_configLoaded(){
-	return confTable != NULL;
+	return atomic_load(&obus_config) != NULL;
+}
+
+//Counts up with every load, so users of an entry can tell when to read it again
+unsigned int obus_configGeneration(){
+	return atomic_load(&obus_configGen);
+}
+
+//The current snapshot, or NULL if none was loaded. Release it when done
+obus_Config* obus_configAcquire(){
+	atomic_fetch_add(&obus_configReaders, 1);
+	
+	obus_Config* conf = atomic_load(&obus_config);
+	if(conf){
+		atomic_fetch_add(&conf->refs, 1);
+	}
+	
+	atomic_fetch_sub(&obus_configReaders, 1);
+	return conf;
+}
+
+void obus_configRelease(obus_Config* conf){
+	if(conf && atomic_fetch_sub(&conf->refs, 1) == 1){
+		_obus_configFree(conf);
+	}
+}
+
+//An entry of conf, valid for as long as conf is held
+obus_ConfigEntry* obus_configLookup(obus_Config* conf, char* name){
+	if(!conf){
+		return NULL;
+	}
+	if(conf->map){
+		return _obus_compiledLookup(conf, name);
+	}
+	return g_hash_table_lookup(conf->table, name);
 }
 
 unsigned char obus_hasConfigEntry(char* name){
-	if(confTable){
-		return g_hash_table_contains(confTable, name);
+	obus_Config* conf = obus_configAcquire();
+	if(conf){
+		unsigned char r = obus_configLookup(conf, name) != NULL;
+		obus_configRelease(conf);
+		return r;
 	}
 	return 1;
 }
 
 obus_ConfigEntry* obus_getConfigEntry(char* name){
-	if(confTable){
-	    obus_ConfigEntry* ent = (obus_ConfigEntry*)g_hash_table_lookup(confTable, name);
-		if(ent){
-			ent->refs++;
-		}
-		return ent;
+	obus_Config* conf = obus_configAcquire();
+	
+	obus_ConfigEntry* ent = obus_configLookup(conf, name);
+	if(ent){
+		//Compiled entries are held by holding the whole configuration
+		atomic_fetch_add(ent->owner ? &ent->owner->refs : &ent->refs, 1);
 	}
-	return NULL;
+
+	obus_configRelease(conf);
+	return ent;
 }
 
 void obus_releaseConfigEntry(obus_ConfigEntry* ent){
-	if(ent){
-	    ent->refs--;
-		if(ent->refs < 1){
-			_obus_destroy_conf(ent);
+	if(!ent){
+		return;
+	}
+	
+	if(ent->owner){
+		obus_configRelease(ent->owner);
+	}else if(atomic_fetch_sub(&ent->refs, 1) == 1){
+		_obus_destroy_conf(ent);
+	}
+}
+
+//Appends the len bytes of str and a NUL to buf at *off, returning where it went
+static uint64_t _obus_putString(char* buf, uint64_t* off, const char* str, size_t len){
+	uint64_t at = *off;
+	if(str){
+		memcpy(&buf[at], str, len);
+	}
+	buf[at + len] = '\0';
+	*off += len + 1;
+	return at;
+}
+
+//Copies ent to out, with offsets in place of its pointers
+static void _obus_putEntry(char* buf, obus_ConfigEntry* out, obus_ConfigEntry* ent, uint64_t* stringOff){
+	memset(out, 0, sizeof(obus_ConfigEntry));
+	out->type = ent->type;
+
+	if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+		out->data.integer = ent->data.integer;
+	}else if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+		size_t len = ent->data.str.str ? ent->data.str.len : 0;
+		out->data.str.len = len;
+		out->data.str.str = (char*)(uintptr_t)_obus_putString(buf, stringOff, ent->data.str.str, len);
+	}
+}
+
+/*
+ * Builds a perfect hash of keys into slotCount slots, by hash and
+ * displace: keys are put in buckets by one hash, and each bucket, the
+ * fullest first, gets the seed of a second hash that sends all of its
+ * keys to free slots. slotOf gets each key's slot.
+ */
+static unsigned char _obus_buildHash(char** keys, uint32_t keyCount, uint32_t* buckets, uint32_t bucketCount, uint32_t slotCount, uint32_t* slotOf){
+	uint32_t* keyBucket = malloc(sizeof(uint32_t) * (keyCount + 1));
+	uint32_t* bucketStart = calloc(bucketCount + 1, sizeof(uint32_t));
+	uint32_t* bucketKeys = malloc(sizeof(uint32_t) * (keyCount + 1));
+	unsigned char* taken = calloc(slotCount, 1);
+	uint32_t* tried = malloc(sizeof(uint32_t) * (keyCount + 1));
+
+	unsigned char r = 1;
+	if(!keyBucket || !bucketStart || !bucketKeys || !taken || !tried){
+		goto done;
+	}
+
+	uint32_t i;
+	uint32_t maxSize = 0;
+	for(i = 0; i < keyCount; i++){
+		keyBucket[i] = _obus_confHash(keys[i], strlen(keys[i]), 0) % bucketCount;
+		bucketStart[keyBucket[i] + 1]++;
+	}
+	for(i = 0; i < bucketCount; i++){
+		if(bucketStart[i + 1] > maxSize){
+			maxSize = bucketStart[i + 1];
+		}
+		bucketStart[i + 1] += bucketStart[i];
+	}
+
+	//Counting sort of the keys into their buckets, tried counts how many are placed so far
+	memset(tried, 0, sizeof(uint32_t) * (keyCount + 1));
+	for(i = 0; i < keyCount; i++){
+		uint32_t b = keyBucket[i];
+		bucketKeys[bucketStart[b] + tried[b]++] = i;
+	}
+
+	uint32_t size;
+	for(size = maxSize; size > 0; size--){
+		uint32_t b;
+		for(b = 0; b < bucketCount; b++){
+			if(bucketStart[b + 1] - bucketStart[b] != size){
+				continue;
+			}
+
+			uint32_t* members = &bucketKeys[bucketStart[b]];
+			uint32_t seed;
+			for(seed = 1; seed < _OBUS_CONF_MAX_DISPLACE; seed++){
+				uint32_t placed = 0;
+				for(; placed < size; placed++){
+					uint32_t slot = _obus_confHash(keys[members[placed]], strlen(keys[members[placed]]), seed) % slotCount;
+					if(taken[slot]){
+						break;
+					}
+					taken[slot] = 1;
+					tried[placed] = slot;
+				}
+				if(placed == size){
+					break;
+				}
+				
+				while(placed > 0){
+					taken[tried[--placed]] = 0;
+				}
+			}
+			if(seed == _OBUS_CONF_MAX_DISPLACE){
+				goto done;
+			}
+
+			buckets[b] = seed;
+			for(i = 0; i < size; i++){
+				slotOf[members[i]] = tried[i];
+			}
+		}
+	}
+	r = 0;
+
+  done:
+	free(keyBucket);
+	free(bucketStart);
+	free(bucketKeys);
+	free(taken);
+	free(tried);
+	return r;
+}
+
+static unsigned char _obus_writeCompiled(GHashTable* table, char* out){
+	uint32_t keyCount = g_hash_table_size(table);
+	char** keys = calloc(keyCount + 1, sizeof(char*));
+	obus_ConfigEntry** ents = calloc(keyCount + 1, sizeof(obus_ConfigEntry*));
+	uint32_t* slotOf = calloc(keyCount + 1, sizeof(uint32_t));
+	char* buf = NULL;
+	char* tmpName = NULL;
+	unsigned char r = 1;
+	
+	if(!keys || !ents || !slotOf){
+		goto done;
+	}
+
+	uint64_t ptrCount = 0;
+	uint64_t stringsLen = 0;
+	
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	uint32_t i = 0;
+	
+	g_hash_table_iter_init(&iter, table);
+	while(g_hash_table_iter_next(&iter, &key, &value)){
+		keys[i] = key;
+		ents[i] = value;
+		stringsLen += strlen(key) + 1;
+		
+		if(ents[i]->type == OBUS_CONF_ENT_TYPE_STR){
+			stringsLen += ents[i]->data.str.len + 1;
+		}else if(ents[i]->type == OBUS_CONF_ENT_TYPE_ARRAY){
+			int j;
+			for(j = 0; j < ents[i]->data.array.len; j++){
+				obus_ConfigEntry* elem = ents[i]->data.array.array[j];
+				if(elem->type == OBUS_CONF_ENT_TYPE_STR){
+					stringsLen += elem->data.str.len + 1;
+				}
+			}
+			ptrCount += ents[i]->data.array.len;
+		}
+		i++;
+	}
+
+	_obus_ConfigHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBUS_CONF_COMPILED_MAGIC, sizeof(hdr.magic));
+	hdr.version = OBUS_CONF_COMPILED_VERSION;
+	hdr.entrySize = sizeof(obus_ConfigEntry);
+	hdr.ptrSize = sizeof(obus_ConfigEntry*);
+	hdr.bucketCount = keyCount / 2 + 1;
+	hdr.slotCount = keyCount + keyCount / 4 + 1;
+	hdr.entryCount = keyCount + ptrCount;
+	hdr.ptrCount = ptrCount;
+	hdr.bucketsOff = _OBUS_CONF_ALIGN(sizeof(hdr));
+	hdr.slotsOff = _OBUS_CONF_ALIGN(hdr.bucketsOff + sizeof(uint32_t) * hdr.bucketCount);
+	hdr.entriesOff = _OBUS_CONF_ALIGN(hdr.slotsOff + sizeof(_obus_ConfigSlot) * hdr.slotCount);
+	hdr.ptrsOff = _OBUS_CONF_ALIGN(hdr.entriesOff + sizeof(obus_ConfigEntry) * hdr.entryCount);
+	hdr.stringsOff = hdr.ptrsOff + sizeof(obus_ConfigEntry*) * hdr.ptrCount;
+	hdr.size = hdr.stringsOff + stringsLen;
+
+	buf = calloc(1, hdr.size);
+	if(!buf){
+		goto done;
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	
+	uint32_t* buckets = (uint32_t*)(buf + hdr.bucketsOff);
+	_obus_ConfigSlot* slots = (_obus_ConfigSlot*)(buf + hdr.slotsOff);
+	obus_ConfigEntry* entries = (obus_ConfigEntry*)(buf + hdr.entriesOff);
+	uintptr_t* ptrs = (uintptr_t*)(buf + hdr.ptrsOff);
+
+	if(_obus_buildHash(keys, keyCount, buckets, hdr.bucketCount, hdr.slotCount, slotOf) != 0){
+		fputs("Failed to build the configuration's key index.\n", stderr);
+		goto done;
+	}
+
+	//Top level entries first, in key order, then the elements of arrays
+	uint64_t stringOff = hdr.stringsOff;
+	uint32_t nextEntry = keyCount;
+	uint64_t nextPtr = 0;
+	
+	for(i = 0; i < keyCount; i++){
+		_obus_ConfigSlot* slot = &slots[slotOf[i]];
+		slot->keyLen = strlen(keys[i]);
+		slot->keyOff = _obus_putString(buf, &stringOff, keys[i], slot->keyLen);
+		slot->entry = i;
+
+		_obus_putEntry(buf, &entries[i], ents[i], &stringOff);
+		
+		if(ents[i]->type == OBUS_CONF_ENT_TYPE_ARRAY){
+			entries[i].data.array.len = ents[i]->data.array.len;
+			entries[i].data.array.array = (obus_ConfigEntry**)(uintptr_t)(hdr.ptrsOff + sizeof(obus_ConfigEntry*) * nextPtr);
+
+			int j;
+			for(j = 0; j < ents[i]->data.array.len; j++){
+				_obus_putEntry(buf, &entries[nextEntry], ents[i]->data.array.array[j], &stringOff);
+				ptrs[nextPtr++] = hdr.entriesOff + sizeof(obus_ConfigEntry) * nextEntry;
+				nextEntry++;
+			}
 		}
 	}
+
+	//Written aside and renamed over out, so a daemon reloading never sees half of it
+	tmpName = g_strdup_printf("%s.tmp", out);
+
+	FILE* f = fopen(tmpName, "wb");
+	if(!f){
+		fprintf(stderr, "Failed to open %s\n", tmpName);
+		goto done;
+	}
+	
+	size_t written = fwrite(buf, 1, hdr.size, f);
+	if(fclose(f) != 0 || written != hdr.size || rename(tmpName, out) != 0){
+		fprintf(stderr, "Failed to write %s\n", out);
+		unlink(tmpName);
+		goto done;
+	}
+	r = 0;
+
+  done:
+	g_free(tmpName);
+	free(keys);
+	free(ents);
+	free(slotOf);
+	free(buf);
+	return r;
 }
+
+/*
+ * Compiles the configuration file name into out, to be loaded with
+ * obus_loadConfig. Returns 2 if name is invalid.
+ */
+unsigned char obus_compileConfig(char* name, char* out){
+	FILE* f = fopen(name, "r");
+	if(!f){
+		return 1;
+	}
+
+	GHashTable* table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)obus_releaseConfigEntry);
+
+	unsigned char r = _obus_parseConfig(f, table);
+	fclose(f);
+
+	if(r == 0){
+		r = _obus_writeCompiled(table, out);
+	}
+
+	g_hash_table_destroy(table);
+	return r;
+}
+
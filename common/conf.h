@@ -20,6 +20,8 @@
 #ifndef OBUS_CONF_H_
 #define OBUS_CONF_H_
 
+#include <stdatomic.h>
+
 //int
 #define OBUS_CONF_ENT_TYPE_INT 1
 //char*
@@ -29,7 +31,9 @@
 
 typedef struct obus_ConfigEntry{
 	unsigned char type;
-	int refs;
+	atomic_int refs;
+	//Set for entries of a compiled configuration, which live as long as it does
+	struct obus_Config* owner;
 	union{
 		int integer;
 		char cchar;
@@ -45,8 +49,34 @@ typedef struct obus_ConfigEntry{
 	} data;
 } obus_ConfigEntry;
 
+/*
+ * The loaded configuration is an immutable snapshot. obus_loadConfig
+ * builds a new one and swaps it in, so it may be called again at any time
+ * to reload, and readers on any thread never take a lock. A reader that
+ * needs several entries from the same load holds the snapshot with
+ * obus_configAcquire; entries looked up in it stay valid until it is
+ * released. Entries from obus_getConfigEntry outlive their snapshot.
+ */
+typedef struct obus_Config obus_Config;
+
+/*
+ * A configuration file can be compiled ahead of time into one flat file,
+ * which obus_loadConfig maps into memory rather than parsing, and looks
+ * keys up in with a perfect hash. Like the journal, it is in host byte
+ * order and only meant for the machine, or at least the build, it was
+ * compiled on.
+ */
+#define OBUS_CONF_COMPILED_MAGIC "\0OBC"
+#define OBUS_CONF_COMPILED_VERSION 1
+
 unsigned char obus_loadConfig(char* name);
+unsigned char obus_compileConfig(char* name, char* out);
 unsigned char obus_configLoaded();
+unsigned int obus_configGeneration();
+
+obus_Config* obus_configAcquire();
+void obus_configRelease(obus_Config* conf);
+obus_ConfigEntry* obus_configLookup(obus_Config* conf, char* name);
 
 unsigned char obus_hasConfigEntry(char* name);
 obus_ConfigEntry* obus_getConfigEntry(char* name);
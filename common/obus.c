@@ -18,33 +18,173 @@
  */
 
 #include "obus.h"
+#include "parse.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-struct json_object* obus_parseMessage(char* str, int len){
-	struct json_tokener* tok = NULL;
+#include <arpa/inet.h>
+
+#include <zmq.h>
 
-	tok = json_tokener_new();
-	if(!tok){
+/*
+ * Parses a JSON message with the calling thread's reusable tokener. The
+ * caller owns the result. See parse.h for views that avoid building a
+ * json-c tree altogether.
+ */
+struct json_object* obus_parseMessage(char* str, int len){
+	obus_ParseCtx* ctx = obus_parseCtxGet();
+	if(!ctx){
 		return NULL;
 	}
 	
-	struct json_object* jobj = NULL;
-	enum json_tokener_error jerr;
+	return obus_parseTree(ctx, str, len);
+}
 
-	jobj = json_tokener_parse_ex(tok, str, len);
-	jerr = json_tokener_get_error(tok);
+//32-bit FNV-1a
+uint32_t obus_hash(const void* data, size_t len){
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint32_t hash = 2166136261u;
 
-	if(jerr != json_tokener_success){
-		fprintf(stderr, "JSON parse error: %s\n", json_tokener_error_desc(jerr));
-		if(jobj){
-			json_object_put(jobj);
-		}
-		json_tokener_free(tok);
-		return NULL;
+	size_t i;
+	for(i = 0; i < len; i++){
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+//Length of the "type:" prefix of a message, including the ':', or 0 if none
+size_t obus_topicLength(const char* data, size_t len){
+	const char* end = memchr(data, ':', len);
+	if(!end){
+		return 0;
+	}
+	return (end - data) + 1;
+}
+
+unsigned char obus_isBatchHeader(const void* data, size_t len){
+	if(len != sizeof(obus_BatchHeader)){
+		return 0;
+	}
+
+	const obus_BatchHeader* hdr = (const obus_BatchHeader*)data;
+	return memcmp(hdr->magic, OBUS_BATCH_MAGIC, sizeof(hdr->magic)) == 0 && hdr->version == OBUS_BATCH_VERSION;
+}
+
+unsigned char obus_isSeqHeader(const void* data, size_t len){
+	if(len != sizeof(obus_SeqHeader)){
+		return 0;
+	}
+
+	const obus_SeqHeader* hdr = (const obus_SeqHeader*)data;
+	return memcmp(hdr->magic, OBUS_SEQ_MAGIC, sizeof(hdr->magic)) == 0 && hdr->version == OBUS_SEQ_VERSION;
+}
+
+unsigned char obus_isEnvelope(const void* data, size_t len){
+	if(len != sizeof(obus_Envelope)){
+		return 0;
+	}
+
+	const obus_Envelope* env = (const obus_Envelope*)data;
+	return memcmp(env->magic, OBUS_ENVELOPE_MAGIC, sizeof(env->magic)) == 0 && env->version == OBUS_ENVELOPE_VERSION;
+}
+
+//An envelope for the sender to fill in, contentType in host byte order
+void obus_envelopeInit(obus_Envelope* env, uint16_t contentType){
+	memset(env, 0, sizeof(obus_Envelope));
+	memcpy(env->magic, OBUS_ENVELOPE_MAGIC, sizeof(env->magic));
+	env->version = OBUS_ENVELOPE_VERSION;
+	env->contentType = htons(contentType);
+}
+
+unsigned char obus_isPeerHeader(const void* data, size_t len){
+	if(len != sizeof(obus_PeerHeader)){
+		return 0;
 	}
 
-	json_tokener_free(tok);
+	const obus_PeerHeader* hdr = (const obus_PeerHeader*)data;
+	return memcmp(hdr->magic, OBUS_PEER_MAGIC, sizeof(hdr->magic)) == 0 && hdr->version == OBUS_PEER_VERSION;
+}
+
+//64-bit versions of htonl and ntohl
+uint64_t obus_htonll(uint64_t n){
+	unsigned char bytes[8];
+	
+	int i;
+	for(i = 7; i >= 0; i--){
+		bytes[i] = n & 0xff;
+		n >>= 8;
+	}
 
-	return jobj;
+	uint64_t out;
+	memcpy(&out, bytes, sizeof(out));
+	return out;
+}
+
+uint64_t obus_ntohll(uint64_t n){
+	unsigned char bytes[8];
+	memcpy(bytes, &n, sizeof(bytes));
+
+	uint64_t out = 0;
+	
+	int i;
+	for(i = 0; i < 8; i++){
+		out = (out << 8) | bytes[i];
+	}
+	return out;
+}
+
+/*
+ * The endpoint a socket at host:port is reached on, or a copy of
+ * endpoint when one is configured, such as ipc:///run/obus/rpc. The
+ * caller frees the result.
+ */
+char* obus_endpoint(const char* endpoint, const char* host, int port){
+	if(endpoint){
+		return strdup(endpoint);
+	}
+	
+	//18 is tcp:// + : + 10 for port (lots of buffer, as max port is 5 digits) + 1 '\0'
+	int maxlen = 18 + strlen(host);
+	char* out = malloc(maxlen);
+	if(out){
+		snprintf(out, maxlen - 1, "tcp://%s:%i", host, port);
+	}
+	return out;
+}
+
+/*
+ * Whether clients connect to endpoint exactly as the daemon binds it,
+ * unlike a tcp:// one on all interfaces. inproc:// endpoints are only
+ * reachable from inside the daemon's own process, so they don't count.
+ */
+unsigned char obus_isLocalEndpoint(const char* endpoint){
+	return strncmp(endpoint, "ipc://", 6) == 0;
+}
+
+/*
+ * Sends len bytes of data as the rest of a message, in chunks of at most
+ * chunkLen bytes, or all at once if it is 0. At least one frame is sent,
+ * even if empty.
+ */
+unsigned char obus_sendChunks(void* sock, const void* data, size_t len, size_t chunkLen){
+	const char* bytes = data;
+	
+	do{
+		size_t n = len;
+		if(chunkLen > 0 && n > chunkLen){
+			n = chunkLen;
+		}
+
+		if(zmq_send(sock, bytes, n, n < len ? ZMQ_SNDMORE : 0) < 0){
+			return 1;
+		}
+		bytes += n;
+		len -= n;
+	}while(len > 0);
+	
+	return 0;
 }
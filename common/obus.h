@@ -21,9 +21,143 @@
 #define OBUS_H_
 
 #include <json.h>
+#include <stdint.h>
+#include <stddef.h>
 
-#define OBUS_MAX_MESSAGE_LEN 1024
+//Default upper bound on a single message chunk, overridden by i:max_message_len
+#define OBUS_DEFAULT_MAX_MESSAGE_LEN (1024 * 1024)
+//Messages larger than this are sent as multipart chunks by default
+#define OBUS_DEFAULT_CHUNK_LEN (64 * 1024)
+
+/*
+ * A request whose first payload frame starts with this is a command to
+ * the daemon, such as "$replay:", and the daemon's answers start with it
+ * too. No text message may start with it, so commands never take a topic
+ * a publisher might want.
+ */
+#define OBUS_COMMAND_MARKER '$'
+
+//Commands clients send, answered as the daemon's lvc.h and compression.h describe
+#define OBUS_SNAPSHOT_COMMAND "$snapshot:"
+#define OBUS_COMPRESS_COMMAND "$compress:"
+
+/*
+ * Batches are published as [topic][obus_BatchHeader][message]...[message],
+ * with count (in network byte order) single-chunk messages following the
+ * header. The leading NUL keeps the magic from ever matching text payloads.
+ * The messages carry consecutive sequence numbers, starting at seq.
+ */
+#define OBUS_BATCH_MAGIC "\0OBB"
+#define OBUS_BATCH_VERSION 2
+
+typedef struct obus_BatchHeader{
+	char magic[4];
+	uint8_t version;
+	uint8_t reserved[3];
+	uint32_t count;
+	uint32_t reserved2;
+	uint64_t seq;
+} obus_BatchHeader;
+
+/*
+ * Every other message is published with this as its second frame, after
+ * the first chunk: [chunk][obus_SeqHeader][chunk]... seq counts up per
+ * topic, so a subscriber that sees it skip has missed messages.
+ */
+#define OBUS_SEQ_MAGIC "\0OBS"
+#define OBUS_SEQ_VERSION 1
+
+/*
+ * Set on a copy of a topic's last message that the daemon serves from its
+ * cache to a new subscriber. Other subscribers of the topic may get it
+ * too, and should skip it if they have already seen seq.
+ */
+#define OBUS_SEQ_CACHED 0x01
+
+/*
+ * Set on messages of a topic the daemon conflates, where only the latest
+ * message of each entity is published. The messages they replaced leave
+ * gaps in seq that aren't losses.
+ */
+#define OBUS_SEQ_CONFLATED 0x02
+
+//Set on messages a daemon got from one of its peers rather than a producer
+#define OBUS_SEQ_FORWARDED 0x04
+
+typedef struct obus_SeqHeader{
+	char magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint64_t seq;
+} obus_SeqHeader;
+
+/*
+ * Binary messages are sent as [obus_Envelope][topic][payload]..., and
+ * published as [topic][obus_Envelope][payload]... so that subscriptions
+ * still match the topic frame. The topic is the whole frame, such as
+ * "type:", and the payload is passed on untouched, NULs and all. The
+ * daemon fills in seq, and timestamp (microseconds since the epoch) if
+ * the sender left it 0. Fields are in network byte order.
+ */
+#define OBUS_ENVELOPE_MAGIC "\0OBE"
+#define OBUS_ENVELOPE_VERSION 1
+
+//Content types, so receivers know how to decode the payload
+#define OBUS_CONTENT_TEXT 0
+#define OBUS_CONTENT_JSON 1
+#define OBUS_CONTENT_BINARY 2
+#define OBUS_CONTENT_MSGPACK 3
+#define OBUS_CONTENT_PROTOBUF 4
+
+//Flag bits above the codec's, meaning the same as the OBUS_SEQ_ ones
+#define OBUS_ENVELOPE_CACHED 0x10
+#define OBUS_ENVELOPE_CONFLATED 0x20
+#define OBUS_ENVELOPE_FORWARDED 0x40
+
+typedef struct obus_Envelope{
+	char magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint16_t contentType;
+	uint8_t reserved[8];
+	uint64_t seq;
+	uint64_t timestamp;
+} obus_Envelope;
+
+/*
+ * Daemons forward messages to their peers as they published them, with
+ * this after the first frame: [chunk][obus_PeerHeader][obus_SeqHeader]...
+ * origin identifies the daemon the message was first published on, and
+ * is random for every run of it. The receiving daemon publishes the
+ * message again by sending [obus_PeerHeader][chunk]... to itself.
+ */
+#define OBUS_PEER_MAGIC "\0OBP"
+#define OBUS_PEER_VERSION 1
+
+typedef struct obus_PeerHeader{
+	char magic[4];
+	uint8_t version;
+	uint8_t reserved[3];
+	uint64_t origin;
+} obus_PeerHeader;
 
 struct json_object* obus_parseMessage(char* str, int len);
 
+uint32_t obus_hash(const void* data, size_t len);
+size_t obus_topicLength(const char* data, size_t len);
+unsigned char obus_isBatchHeader(const void* data, size_t len);
+unsigned char obus_isSeqHeader(const void* data, size_t len);
+unsigned char obus_isEnvelope(const void* data, size_t len);
+unsigned char obus_isPeerHeader(const void* data, size_t len);
+void obus_envelopeInit(obus_Envelope* env, uint16_t contentType);
+
+uint64_t obus_htonll(uint64_t n);
+uint64_t obus_ntohll(uint64_t n);
+
+char* obus_endpoint(const char* endpoint, const char* host, int port);
+unsigned char obus_isLocalEndpoint(const char* endpoint);
+
+unsigned char obus_sendChunks(void* sock, const void* data, size_t len, size_t chunkLen);
+
 #endif
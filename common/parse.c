@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "parse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static __thread obus_ParseCtx* obus_parseCtx = NULL;
+
+void* obus_arenaAlloc(obus_Arena* arena, size_t len){
+	//Keep everything aligned for doubles and pointers
+	len = (len + 7) & ~(size_t)7;
+
+	obus_ArenaChunk* chunk = arena->head;
+	if(!chunk || chunk->len - chunk->used < len){
+		size_t chunkLen = OBUS_ARENA_CHUNK_LEN;
+		if(len > chunkLen){
+			chunkLen = len;
+		}
+
+		chunk = malloc(sizeof(obus_ArenaChunk) + chunkLen);
+		if(!chunk){
+			return NULL;
+		}
+		chunk->len = chunkLen;
+		chunk->used = 0;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+
+	void* ptr = (char*)(chunk + 1) + chunk->used;
+	chunk->used += len;
+	return ptr;
+}
+
+//Frees all but one chunk, which is kept for the next message
+void obus_arenaReset(obus_Arena* arena){
+	obus_ArenaChunk* chunk = arena->head;
+	if(!chunk){
+		return;
+	}
+
+	obus_ArenaChunk* rest = chunk->next;
+	while(rest){
+		obus_ArenaChunk* next = rest->next;
+		free(rest);
+		rest = next;
+	}
+
+	chunk->next = NULL;
+	chunk->used = 0;
+}
+
+obus_ParseCtx* obus_parseCtxGet(){
+	if(obus_parseCtx){
+		return obus_parseCtx;
+	}
+	
+	obus_ParseCtx* ctx = malloc(sizeof(obus_ParseCtx));
+	if(!ctx){
+		return NULL;
+	}
+
+	ctx->tok = json_tokener_new();
+	if(!ctx->tok){
+		free(ctx);
+		return NULL;
+	}
+	ctx->arena.head = NULL;
+
+	obus_parseCtx = ctx;
+	return ctx;
+}
+
+//Releases every view parsed with ctx since the last reset
+void obus_parseCtxReset(obus_ParseCtx* ctx){
+	obus_arenaReset(&ctx->arena);
+}
+
+//Parses a json-c tree with the context's tokener. The caller owns the result.
+struct json_object* obus_parseTree(obus_ParseCtx* ctx, const char* str, int len){
+	json_tokener_reset(ctx->tok);
+	
+	struct json_object* jobj = json_tokener_parse_ex(ctx->tok, str, len);
+	enum json_tokener_error jerr = json_tokener_get_error(ctx->tok);
+
+	if(jerr != json_tokener_success){
+		fprintf(stderr, "JSON parse error: %s\n", json_tokener_error_desc(jerr));
+		if(jobj){
+			json_object_put(jobj);
+		}
+		return NULL;
+	}
+
+	return jobj;
+}
+
+typedef struct _obus_ViewParser{
+	obus_Arena* arena;
+	const char* cur;
+	const char* end;
+	int depth;
+} _obus_ViewParser;
+
+static void _obus_skipSpace(_obus_ViewParser* p){
+	while(p->cur < p->end && (*p->cur == ' ' || *p->cur == '\t' || *p->cur == '\n' || *p->cur == '\r')){
+		p->cur++;
+	}
+}
+
+//Leaves p->cur on the closing quote
+static unsigned char _obus_scanString(_obus_ViewParser* p, const char** str, size_t* len, unsigned char* escaped){
+	if(p->cur >= p->end || *p->cur != '"'){
+		return 1;
+	}
+	p->cur++;
+	
+	const char* start = p->cur;
+	*escaped = 0;
+	
+	while(p->cur < p->end && *p->cur != '"'){
+		if(*p->cur == '\\'){
+			*escaped = 1;
+			p->cur++;
+		}
+		p->cur++;
+	}
+	
+	if(p->cur >= p->end){
+		return 1;
+	}
+
+	*str = start;
+	*len = p->cur - start;
+	p->cur++;
+	
+	return 0;
+}
+
+static obus_JsonView* _obus_parseValue(_obus_ViewParser* p);
+
+static obus_JsonView* _obus_parseContainer(_obus_ViewParser* p, obus_JsonView* view, char close){
+	if(++p->depth > OBUS_JSON_MAX_DEPTH){
+		return NULL;
+	}
+	
+	p->cur++;
+	_obus_skipSpace(p);
+	
+	if(p->cur < p->end && *p->cur == close){
+		p->cur++;
+		p->depth--;
+		return view;
+	}
+
+	obus_JsonView** tail = &view->child;
+	
+	while(1){
+		const char* key = NULL;
+		size_t keyLen = 0;
+		
+		if(close == '}'){
+			unsigned char escaped;
+			if(_obus_scanString(p, &key, &keyLen, &escaped) != 0){
+				return NULL;
+			}
+			
+			_obus_skipSpace(p);
+			if(p->cur >= p->end || *p->cur != ':'){
+				return NULL;
+			}
+			p->cur++;
+		}
+
+		obus_JsonView* child = _obus_parseValue(p);
+		if(!child){
+			return NULL;
+		}
+		child->key = key;
+		child->keyLen = keyLen;
+
+		*tail = child;
+		tail = &child->next;
+
+		_obus_skipSpace(p);
+		if(p->cur >= p->end){
+			return NULL;
+		}
+
+		if(*p->cur == ','){
+			p->cur++;
+			_obus_skipSpace(p);
+		}else if(*p->cur == close){
+			p->cur++;
+			break;
+		}else{
+			return NULL;
+		}
+	}
+
+	p->depth--;
+	return view;
+}
+
+static unsigned char _obus_matchWord(_obus_ViewParser* p, const char* word){
+	size_t len = strlen(word);
+	if(p->end - p->cur < len || memcmp(p->cur, word, len) != 0){
+		return 0;
+	}
+	p->cur += len;
+	return 1;
+}
+
+static obus_JsonView* _obus_parseValue(_obus_ViewParser* p){
+	_obus_skipSpace(p);
+	if(p->cur >= p->end){
+		return NULL;
+	}
+	
+	obus_JsonView* view = obus_arenaAlloc(p->arena, sizeof(obus_JsonView));
+	if(!view){
+		return NULL;
+	}
+	memset(view, 0, sizeof(obus_JsonView));
+
+	char c = *p->cur;
+	
+	if(c == '{'){
+		view->type = OBUS_JSON_OBJECT;
+		return _obus_parseContainer(p, view, '}');
+	}else if(c == '['){
+		view->type = OBUS_JSON_ARRAY;
+		return _obus_parseContainer(p, view, ']');
+	}else if(c == '"'){
+		view->type = OBUS_JSON_STRING;
+		if(_obus_scanString(p, &view->str, &view->len, &view->escaped) != 0){
+			return NULL;
+		}
+	}else if(_obus_matchWord(p, "true")){
+		view->type = OBUS_JSON_BOOL;
+		view->data.boolean = 1;
+	}else if(_obus_matchWord(p, "false")){
+		view->type = OBUS_JSON_BOOL;
+		view->data.boolean = 0;
+	}else if(_obus_matchWord(p, "null")){
+		view->type = OBUS_JSON_NULL;
+	}else if(c == '-' || (c >= '0' && c <= '9')){
+		const char* start = p->cur;
+		while(p->cur < p->end && strchr("+-.eE0123456789", *p->cur)){
+			p->cur++;
+		}
+
+		//The buffer isn't necessarily terminated, so strtod gets a copy
+		char num[64];
+		size_t len = p->cur - start;
+		if(len >= sizeof(num)){
+			return NULL;
+		}
+		memcpy(num, start, len);
+		num[len] = '\0';
+
+		char* numEnd;
+		view->type = OBUS_JSON_NUMBER;
+		view->data.number = strtod(num, &numEnd);
+		if(numEnd != &num[len]){
+			return NULL;
+		}
+		
+		view->str = start;
+		view->len = len;
+	}else{
+		return NULL;
+	}
+
+	return view;
+}
+
+/*
+ * Parses str into a view allocated from the context's arena, without
+ * copying any of str. Returns NULL if str isn't a single JSON value.
+ */
+const obus_JsonView* obus_parseView(obus_ParseCtx* ctx, const char* str, size_t len){
+	_obus_ViewParser p;
+	p.arena = &ctx->arena;
+	p.cur = str;
+	p.end = str + len;
+	p.depth = 0;
+
+	//Messages from obus-cli carry a trailing NUL
+	while(p.end > p.cur && p.end[-1] == '\0'){
+		p.end--;
+	}
+
+	obus_JsonView* view = _obus_parseValue(&p);
+	if(!view){
+		return NULL;
+	}
+
+	_obus_skipSpace(&p);
+	if(p.cur != p.end){
+		return NULL;
+	}
+	
+	return view;
+}
+
+const obus_JsonView* obus_jsonViewGet(const obus_JsonView* obj, const char* key){
+	if(!obj || obj->type != OBUS_JSON_OBJECT){
+		return NULL;
+	}
+
+	size_t keyLen = strlen(key);
+	
+	const obus_JsonView* child;
+	for(child = obj->child; child; child = child->next){
+		if(child->keyLen == keyLen && memcmp(child->key, key, keyLen) == 0){
+			return child;
+		}
+	}
+	return NULL;
+}
+
+unsigned char obus_jsonViewStrEquals(const obus_JsonView* view, const char* str, size_t len){
+	return view && view->type == OBUS_JSON_STRING && view->len == len && memcmp(view->str, str, len) == 0;
+}
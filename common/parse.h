@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUS_PARSE_H_
+#define OBUS_PARSE_H_
+
+#include <json.h>
+#include <stddef.h>
+
+#define OBUS_JSON_NULL 0
+#define OBUS_JSON_BOOL 1
+#define OBUS_JSON_NUMBER 2
+#define OBUS_JSON_STRING 3
+#define OBUS_JSON_ARRAY 4
+#define OBUS_JSON_OBJECT 5
+
+//Deeper documents are rejected by obus_parseView
+#define OBUS_JSON_MAX_DEPTH 64
+
+#define OBUS_ARENA_CHUNK_LEN (16 * 1024)
+
+typedef struct obus_ArenaChunk{
+	struct obus_ArenaChunk* next;
+	size_t len;
+	size_t used;
+} obus_ArenaChunk;
+
+//Bump allocator, everything in it is freed at once by obus_arenaReset
+typedef struct obus_Arena{
+	obus_ArenaChunk* head;
+} obus_Arena;
+
+/*
+ * A borrowed view of one JSON value. Strings, keys and numbers point into
+ * the parsed buffer rather than being copied, so a view is only valid while
+ * that buffer is. String escapes are left undecoded; escaped is set when
+ * str contains any.
+ */
+typedef struct obus_JsonView{
+	unsigned char type;
+	unsigned char escaped;
+	const char* str;
+	size_t len;
+	union{
+		double number;
+		int boolean;
+	} data;
+	const char* key;
+	size_t keyLen;
+	//First element or member
+	struct obus_JsonView* child;
+	struct obus_JsonView* next;
+} obus_JsonView;
+
+/*
+ * Per-thread parsing state: a reusable tokener for json-c trees, and an
+ * arena for views. Get the calling thread's with obus_parseCtxGet.
+ */
+typedef struct obus_ParseCtx{
+	struct json_tokener* tok;
+	obus_Arena arena;
+} obus_ParseCtx;
+
+void* obus_arenaAlloc(obus_Arena* arena, size_t len);
+void obus_arenaReset(obus_Arena* arena);
+
+obus_ParseCtx* obus_parseCtxGet();
+void obus_parseCtxReset(obus_ParseCtx* ctx);
+
+struct json_object* obus_parseTree(obus_ParseCtx* ctx, const char* str, int len);
+const obus_JsonView* obus_parseView(obus_ParseCtx* ctx, const char* str, size_t len);
+
+const obus_JsonView* obus_jsonViewGet(const obus_JsonView* obj, const char* key);
+unsigned char obus_jsonViewStrEquals(const obus_JsonView* view, const char* str, size_t len);
+
+#endif
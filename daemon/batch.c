@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+#include "obus.h"
+#include "stats.h"
+#include "seq.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+/*
+ * A topic's batch only exists while it holds messages, and is queued on
+ * its batcher's due queue when it takes its first one. Every batch waits
+ * as long, so they are due in the order they were queued.
+ *
+ * Batches are keyed by their topic's bytes and length. A batch, its
+ * messages and its topic are a single allocation.
+ */
+typedef struct obusd_Batch{
+	GBytes* key;
+	char* topic;
+	size_t topicLen;
+	zmq_msg_t* msgs;
+	gint64* receivedAt;
+	int count;
+	gint64 firstAt;
+	uint64_t seq;
+	//The batch's link in the batcher's due queue
+	GList* dueLink;
+} obusd_Batch;
+
+static void _obusd_destroy_batch(void* vdBatch){
+	if(!vdBatch){
+		return;
+	}
+
+	obusd_Batch* batch = (obusd_Batch*)vdBatch;
+
+	int i;
+	for(i = 0; i < batch->count; i++){
+		zmq_msg_close(&batch->msgs[i]);
+	}
+
+	g_bytes_unref(batch->key);
+	free(batch);
+}
+
+obusd_Batcher* obusd_batcherNew(int max, gint64 window){
+	obusd_Batcher* batcher = malloc(sizeof(obusd_Batcher));
+	if(!batcher){
+		return NULL;
+	}
+
+	batcher->topics = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, NULL, _obusd_destroy_batch);
+	batcher->due = g_queue_new();
+	batcher->max = max;
+	batcher->window = window;
+
+	return batcher;
+}
+
+void obusd_batcherFree(obusd_Batcher* batcher){
+	if(batcher){
+		g_hash_table_destroy(batcher->topics);
+		g_queue_free(batcher->due);
+		free(batcher);
+	}
+}
+
+//Publishes a batch's messages, after which the batch is forgotten
+static unsigned char _obusd_batchFlush(obusd_Batcher* batcher, obusd_Batch* batch, void* zmq_pub){
+	g_queue_delete_link(batcher->due, batch->dueLink);
+
+	int count = batch->count;
+	batch->count = 0;
+
+	unsigned char r = 0;
+	
+	//Nothing to gain from framing a lone message
+	if(count == 1){
+		size_t bytes = zmq_msg_size(&batch->msgs[0]);
+		
+		r = obusd_publishFrame(&batch->msgs[0], zmq_pub, 1, 1);
+		if(r == 0){
+			r = obusd_publishSeq(zmq_pub, batch->seq, 0, 0);
+		}
+		if(r == 0){
+			obusd_statsOut(batch->topic, batch->topicLen, bytes, g_get_monotonic_time() - batch->receivedAt[0]);
+		}
+	}else{
+		obus_BatchHeader hdr;
+		memcpy(hdr.magic, OBUS_BATCH_MAGIC, sizeof(hdr.magic));
+		hdr.version = OBUS_BATCH_VERSION;
+		memset(hdr.reserved, 0, sizeof(hdr.reserved));
+		hdr.count = htonl(count);
+		hdr.reserved2 = 0;
+		hdr.seq = obus_htonll(batch->seq);
+
+		zmq_msg_t frame;
+		zmq_msg_init_size(&frame, batch->topicLen);
+		memcpy(zmq_msg_data(&frame), batch->topic, batch->topicLen);
+		
+		r = obusd_publishFrame(&frame, zmq_pub, 1, 1);
+		zmq_msg_close(&frame);
+		
+		if(r == 0){
+			zmq_msg_init_size(&frame, sizeof(hdr));
+			memcpy(zmq_msg_data(&frame), &hdr, sizeof(hdr));
+		
+			r = obusd_publishFrame(&frame, zmq_pub, 0, 1);
+			zmq_msg_close(&frame);
+		}
+
+		gint64 now = g_get_monotonic_time();
+
+		int i;
+		for(i = 0; i < count && r == 0; i++){
+			size_t bytes = zmq_msg_size(&batch->msgs[i]);
+			
+			r = obusd_publishFrame(&batch->msgs[i], zmq_pub, 0, i + 1 < count);
+			if(r == 0){
+				obusd_statsOut(batch->topic, batch->topicLen, bytes, now - batch->receivedAt[i]);
+			}
+		}
+	}
+
+	if(r == OBUSD_PUBLISH_DROPPED){
+		obusd_statsDrop(batch->topic, batch->topicLen, count);
+		r = 0;
+	}
+
+	int i;
+	for(i = 0; i < count; i++){
+		zmq_msg_close(&batch->msgs[i]);
+	}
+
+	g_hash_table_remove(batcher->topics, batch->key);
+
+	return r;
+}
+
+//Looks up the batch for req's topic, creating and queueing it if needed
+static obusd_Batch* _obusd_batchFor(obusd_Batcher* batcher, obusd_Request* req, unsigned char create){
+	size_t topicLen = req->topicLen;
+
+	GBytes* key = g_bytes_new_static(req->topic, topicLen);
+	obusd_Batch* batch = g_hash_table_lookup(batcher->topics, key);
+	g_bytes_unref(key);
+	
+	if(batch || !create){
+		return batch;
+	}
+
+	batch = malloc(sizeof(obusd_Batch) + (sizeof(zmq_msg_t) + sizeof(gint64)) * batcher->max + topicLen);
+	if(!batch){
+		return NULL;
+	}
+
+	batch->msgs = (zmq_msg_t*)(batch + 1);
+	batch->receivedAt = (gint64*)(batch->msgs + batcher->max);
+	batch->topic = (char*)(batch->receivedAt + batcher->max);
+	memcpy(batch->topic, req->topic, topicLen);
+	batch->topicLen = topicLen;
+	batch->key = g_bytes_new_static(batch->topic, topicLen);
+	batch->count = 0;
+	batch->firstAt = g_get_monotonic_time();
+	//Messages reach a topic's batch in sequence, so only the first's is kept
+	batch->seq = req->seq;
+
+	g_queue_push_tail(batcher->due, batch);
+	batch->dueLink = g_queue_peek_tail_link(batcher->due);
+
+	g_hash_table_insert(batcher->topics, batch->key, batch);
+
+	return batch;
+}
+
+/*
+ * Queues msg on its topic's batch, taking its content. The batch is
+ * published immediately once it is full.
+ */
+unsigned char obusd_batchAdd(obusd_Batcher* batcher, zmq_msg_t* msg, obusd_Request* req){
+	obusd_Batch* batch = _obusd_batchFor(batcher, req, 1);
+	if(!batch){
+		unsigned char r = obusd_publishFrame(msg, req->zmq_pub, 1, 1);
+		if(r == 0){
+			r = obusd_publishSeq(req->zmq_pub, req->seq, 0, 0);
+		}
+		if(r == OBUSD_PUBLISH_DROPPED){
+			obusd_statsDrop(req->topic, req->topicLen, 1);
+			r = 0;
+		}
+		return r;
+	}
+
+	zmq_msg_init(&batch->msgs[batch->count]);
+	zmq_msg_move(&batch->msgs[batch->count], msg);
+	batch->receivedAt[batch->count] = req->receivedAt;
+	batch->count++;
+
+	if(batch->count >= batcher->max){
+		return _obusd_batchFlush(batcher, batch, req->zmq_pub);
+	}
+
+	return 0;
+}
+
+//Publishes whatever is pending for req's topic, to keep it ordered before req
+unsigned char obusd_batchFlushTopic(obusd_Batcher* batcher, obusd_Request* req){
+	if(g_queue_is_empty(batcher->due)){
+		return 0;
+	}
+	
+	obusd_Batch* batch = _obusd_batchFor(batcher, req, 0);
+	if(batch){
+		return _obusd_batchFlush(batcher, batch, req->zmq_pub);
+	}
+	return 0;
+}
+
+unsigned char obusd_batchFlushDue(obusd_Batcher* batcher, void* zmq_pub){
+	gint64 now = g_get_monotonic_time();
+
+	while(!g_queue_is_empty(batcher->due)){
+		obusd_Batch* batch = g_queue_peek_head(batcher->due);
+		if(now - batch->firstAt < batcher->window){
+			break;
+		}
+		if(_obusd_batchFlush(batcher, batch, zmq_pub) != 0){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//Milliseconds until the next batch is due, or -1 if nothing is pending
+long obusd_batchTimeout(obusd_Batcher* batcher){
+	if(g_queue_is_empty(batcher->due)){
+		return -1;
+	}
+
+	obusd_Batch* batch = g_queue_peek_head(batcher->due);
+	gint64 soonest = batch->firstAt + batcher->window - g_get_monotonic_time();
+
+	if(soonest <= 0){
+		return 0;
+	}
+	
+	//Round up, zmq_poll only has millisecond resolution
+	return (soonest + 999) / 1000;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_BATCH_H_
+#define OBUSD_BATCH_H_
+
+#include "obusd.h"
+
+#include <zmq.h>
+
+#include <glib.h>
+
+/*
+ * Collects single-chunk messages per topic and publishes them together
+ * once batch_max of them are pending, or the oldest has waited
+ * batch_window_us microseconds. Each publishing thread owns one batcher,
+ * as it is tied to that thread's publisher socket.
+ *
+ * A batch's topic frame is the bare topic, which subscriptions to longer
+ * prefixes, like "topic:{\"id\"", don't match, so the caller leaves
+ * such topics' messages out of batches, see obusd_subsMatch.
+ */
+typedef struct obusd_Batcher{
+	GHashTable* topics;
+	//Batches holding messages, oldest first
+	GQueue* due;
+	int max;
+	gint64 window;
+} obusd_Batcher;
+
+obusd_Batcher* obusd_batcherNew(int max, gint64 window);
+void obusd_batcherFree(obusd_Batcher* batcher);
+
+unsigned char obusd_batchAdd(obusd_Batcher* batcher, zmq_msg_t* msg, obusd_Request* req);
+unsigned char obusd_batchFlushTopic(obusd_Batcher* batcher, obusd_Request* req);
+unsigned char obusd_batchFlushDue(obusd_Batcher* batcher, void* zmq_pub);
+long obusd_batchTimeout(obusd_Batcher* batcher);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "compression.h"
+#include "compress.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+
+typedef struct obusd_CompressRule{
+	char* prefix;
+	int codec;
+} obusd_CompressRule;
+
+//Replaced whole when the configuration is reloaded
+static pthread_rwlock_t obusd_compressLock = PTHREAD_RWLOCK_INITIALIZER;
+static obusd_CompressRule* obusd_compressRules = NULL;
+static int obusd_compressRuleCount = 0;
+
+static void _obusd_freeRules(obusd_CompressRule* rules, int count){
+	int i;
+	for(i = 0; i < count; i++){
+		free(rules[i].prefix);
+	}
+	free(rules);
+}
+
+/*
+ * Reads the rules from the a:compress_topics entry ent, or clears them if
+ * ent is NULL. The rules in place are only replaced if all of ent is valid.
+ */
+unsigned char obusd_compressionConfigure(obus_ConfigEntry* ent){
+	if(ent && ent->type != OBUS_CONF_ENT_TYPE_ARRAY){
+		fputs("compress_topics should be an array.\n", stderr);
+		return 1;
+	}
+
+	int len = ent ? ent->data.array.len : 0;
+	int count = 0;
+	
+	obusd_CompressRule* rules = calloc(len > 0 ? len : 1, sizeof(obusd_CompressRule));
+	if(!rules){
+		return 1;
+	}
+
+	int i;
+	for(i = 0; i < len; i++){
+		obus_ConfigEntry* rule = ent->data.array.array[i];
+		if(rule->type != OBUS_CONF_ENT_TYPE_STR || rule->data.str.len == 0){
+			continue;
+		}
+
+		char* prefix = strdup(rule->data.str.str);
+		if(!prefix){
+			_obusd_freeRules(rules, count);
+			return 1;
+		}
+
+		//Defaults to LZ4, which costs producers the least
+		int codec = OBUS_CODEC_LZ4;
+		
+		char* space = strrchr(prefix, ' ');
+		if(space){
+			*space = '\0';
+			codec = obus_codecFromName(space + 1);
+			if(codec < 0){
+				fprintf(stderr, "Unknown codec for compress_topics: %s\n", space + 1);
+				free(prefix);
+				_obusd_freeRules(rules, count);
+				return 1;
+			}
+		}
+
+		if(strlen(prefix) >= OBUSD_MAX_TOPIC_LEN){
+			fprintf(stderr, "Topic too long for compress_topics: %s\n", prefix);
+			free(prefix);
+			_obusd_freeRules(rules, count);
+			return 1;
+		}
+
+		rules[count].prefix = prefix;
+		rules[count].codec = codec;
+		count++;
+	}
+
+	pthread_rwlock_wrlock(&obusd_compressLock);
+	
+	obusd_CompressRule* old = obusd_compressRules;
+	int oldCount = obusd_compressRuleCount;
+	obusd_compressRules = rules;
+	obusd_compressRuleCount = count;
+	
+	pthread_rwlock_unlock(&obusd_compressLock);
+
+	_obusd_freeRules(old, oldCount);
+	return 0;
+}
+
+unsigned char obusd_compressionIsCommand(const char* data, size_t len){
+	size_t prefixLen = strlen(OBUSD_COMPRESS_PREFIX);
+	return len >= prefixLen && memcmp(data, OBUSD_COMPRESS_PREFIX, prefixLen) == 0;
+}
+
+//Answers a "$compress:" command with every rule, reading the rest of the request
+unsigned char obusd_compressionHandle(obusd_Request* req){
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	int more = req->more;
+	while(more){
+		if(zmq_msg_recv(&msg, req->zmq_resp, 0) < 0){
+			zmq_msg_close(&msg);
+			return 1;
+		}
+		more = zmq_msg_more(&msg);
+	}
+	zmq_msg_close(&msg);
+
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+
+	pthread_rwlock_rdlock(&obusd_compressLock);
+
+	int r = zmq_send(req->zmq_resp, OBUSD_COMPRESS_PREFIX, strlen(OBUSD_COMPRESS_PREFIX), obusd_compressRuleCount > 0 ? ZMQ_SNDMORE : 0);
+	
+	int i;
+	for(i = 0; r >= 0 && i < obusd_compressRuleCount; i++){
+		char frame[OBUSD_MAX_TOPIC_LEN + 16];
+		int frameLen = snprintf(frame, sizeof(frame), "%s %s", obusd_compressRules[i].prefix, obus_codecName(obusd_compressRules[i].codec));
+		
+		r = zmq_send(req->zmq_resp, frame, frameLen, i + 1 < obusd_compressRuleCount ? ZMQ_SNDMORE : 0);
+	}
+
+	pthread_rwlock_unlock(&obusd_compressLock);
+
+	if(r < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
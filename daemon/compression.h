@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_COMPRESSION_H_
+#define OBUSD_COMPRESSION_H_
+
+#include "obusd.h"
+#include "conf.h"
+
+#include <stddef.h>
+
+/*
+ * The daemon never compresses or decompresses anything itself. It tells
+ * producers which topics to compress, from a:compress_topics, whose
+ * entries are a topic prefix optionally followed by a codec name:
+ *
+ *   a:compress_topics
+ *   s:logs: zstd
+ *   s:metrics:
+ *
+ * A producer asks with [""]["$compress:"] and gets back
+ * [""]["$compress:"]["<prefix> <codec>"]..., one frame per rule. The
+ * first rule matching a topic applies.
+ */
+#define OBUSD_COMPRESS_PREFIX "$compress:"
+
+unsigned char obusd_compressionConfigure(obus_ConfigEntry* ent);
+unsigned char obusd_compressionIsCommand(const char* data, size_t len);
+unsigned char obusd_compressionHandle(obusd_Request* req);
+
+#endif
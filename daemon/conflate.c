@@ -0,0 +1,572 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "conflate.h"
+#include "obus.h"
+#include "parse.h"
+#include "compress.h"
+#include "stats.h"
+#include "seq.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <arpa/inet.h>
+
+//Longer fields are rejected by obusd_conflateConfigure, as dotted ones are copied on the stack
+#define OBUSD_CONFLATE_MAX_FIELD_LEN 64
+
+typedef struct obusd_ConflateRule{
+	char* prefix;
+	size_t prefixLen;
+	char* field;
+} obusd_ConflateRule;
+
+//Shared by every conflator using them, and freed once the last lets go
+typedef struct obusd_ConflateRules{
+	atomic_int refs;
+	int count;
+	obusd_ConflateRule rules[];
+} obusd_ConflateRules;
+
+typedef struct obusd_Held{
+	zmq_msg_t* frames;
+	int frameCount;
+	size_t bytes;
+	uint64_t seq;
+	int64_t receivedAt;
+	unsigned char enveloped;
+	obus_Envelope envelope;
+	unsigned char forwarded;
+	//The entity's key, or NULL if it couldn't be read
+	char* key;
+	//Owned by the conflator's rules, which outlive the message being received
+	const char* field;
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	size_t topicLen;
+} obusd_Held;
+
+typedef struct obusd_ConflateTopic{
+	//Held messages in the order they are to be published
+	GQueue* held;
+	//Key of each held message, to the link holding it
+	GHashTable* byKey;
+	gint64 firstAt;
+	//The topic's link in the conflator's due queue
+	GList* dueLink;
+	char topic[];
+} obusd_ConflateTopic;
+
+atomic_int obusd_conflateMs = OBUSD_CONFLATE_DEFAULT_MS;
+
+/*
+ * Replaced whole when the configuration is reloaded, which bumps the
+ * generation. Conflators keep a reference to the rules they last saw, and
+ * only take the lock to pick up new ones.
+ */
+static pthread_rwlock_t obusd_conflateRulesLock = PTHREAD_RWLOCK_INITIALIZER;
+static obusd_ConflateRules* obusd_conflateRules = NULL;
+static atomic_uint obusd_conflateRulesGen = 0;
+
+static void _obusd_rulesUnref(obusd_ConflateRules* rules){
+	if(!rules || atomic_fetch_sub(&rules->refs, 1) != 1){
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < rules->count; i++){
+		free(rules->rules[i].prefix);
+	}
+	free(rules);
+}
+
+/*
+ * Reads the rules from the a:conflate_topics entry ent, or clears them if
+ * ent is NULL. The rules in place are only replaced if all of ent is
+ * valid.
+ */
+unsigned char obusd_conflateConfigure(obus_ConfigEntry* ent){
+	if(ent && ent->type != OBUS_CONF_ENT_TYPE_ARRAY){
+		fputs("conflate_topics should be an array.\n", stderr);
+		return 1;
+	}
+
+	int len = ent ? ent->data.array.len : 0;
+	int count = 0;
+	
+	obusd_ConflateRules* rules = calloc(1, sizeof(obusd_ConflateRules) + sizeof(obusd_ConflateRule) * len);
+	if(!rules){
+		return 1;
+	}
+	atomic_init(&rules->refs, 1);
+
+	int i;
+	for(i = 0; i < len; i++){
+		obus_ConfigEntry* rule = ent->data.array.array[i];
+		if(rule->type != OBUS_CONF_ENT_TYPE_STR || rule->data.str.len == 0){
+			continue;
+		}
+
+		//The prefix and field share one allocation, split at the last space
+		char* prefix = strdup(rule->data.str.str);
+		if(!prefix){
+			_obusd_rulesUnref(rules);
+			return 1;
+		}
+
+		char* space = strrchr(prefix, ' ');
+		if(!space || space[1] == '\0' || strlen(space + 1) >= OBUSD_CONFLATE_MAX_FIELD_LEN){
+			fprintf(stderr, "Invalid entry for conflate_topics: %s\n", rule->data.str.str);
+			free(prefix);
+			_obusd_rulesUnref(rules);
+			return 1;
+		}
+		*space = '\0';
+
+		rules->rules[count].prefix = prefix;
+		rules->rules[count].prefixLen = space - prefix;
+		rules->rules[count].field = space + 1;
+		rules->count = ++count;
+	}
+
+	pthread_rwlock_wrlock(&obusd_conflateRulesLock);
+	
+	obusd_ConflateRules* old = obusd_conflateRules;
+	obusd_conflateRules = rules;
+	atomic_fetch_add(&obusd_conflateRulesGen, 1);
+	
+	pthread_rwlock_unlock(&obusd_conflateRulesLock);
+
+	_obusd_rulesUnref(old);
+	return 0;
+}
+
+//The key field of the first of the conflator's rules whose prefix topic starts with, or NULL
+static const char* _obusd_conflateFieldFor(obusd_Conflator* conflator, const char* topic, size_t topicLen){
+	obusd_ConflateRules* rules = conflator->rules;
+	if(!rules){
+		return NULL;
+	}
+
+	int i;
+	for(i = 0; i < rules->count; i++){
+		obusd_ConflateRule* rule = &rules->rules[i];
+		if(rule->prefixLen <= topicLen && memcmp(topic, rule->prefix, rule->prefixLen) == 0){
+			return rule->field;
+		}
+	}
+	return NULL;
+}
+
+static void _obusd_heldFree(obusd_Held* held){
+	if(!held){
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < held->frameCount; i++){
+		zmq_msg_close(&held->frames[i]);
+	}
+	free(held->frames);
+	free(held->key);
+	free(held);
+}
+
+static void _obusd_destroy_topic(void* vdTopic){
+	obusd_ConflateTopic* topic = vdTopic;
+
+	while(!g_queue_is_empty(topic->held)){
+		_obusd_heldFree(g_queue_pop_head(topic->held));
+	}
+	g_queue_free(topic->held);
+	g_hash_table_destroy(topic->byKey);
+	free(topic);
+}
+
+obusd_Conflator* obusd_conflatorNew(){
+	obusd_Conflator* conflator = malloc(sizeof(obusd_Conflator));
+	if(!conflator){
+		return NULL;
+	}
+
+	conflator->topics = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _obusd_destroy_topic);
+	conflator->due = g_queue_new();
+	conflator->current = NULL;
+	conflator->rules = NULL;
+	conflator->rulesGen = 0;
+	conflator->ruled = 0;
+
+	return conflator;
+}
+
+void obusd_conflatorFree(obusd_Conflator* conflator){
+	if(conflator){
+		_obusd_heldFree(conflator->current);
+		g_hash_table_destroy(conflator->topics);
+		g_queue_free(conflator->due);
+		_obusd_rulesUnref(conflator->rules);
+		free(conflator);
+	}
+}
+
+static const obus_JsonView* _obusd_conflateLookup(const obus_JsonView* body, const char* field){
+	const char* dot = strchr(field, '.');
+	if(!dot){
+		return obus_jsonViewGet(body, field);
+	}
+
+	char part[dot - field + 1];
+	memcpy(part, field, dot - field);
+	part[dot - field] = '\0';
+	
+	return _obusd_conflateLookup(obus_jsonViewGet(body, part), dot + 1);
+}
+
+//The entity key of the JSON document in str, as its raw text, or NULL
+char* obusd_conflateKeyOf(const char* str, size_t len, const char* field){
+	obus_ParseCtx* ctx = obus_parseCtxGet();
+	if(!ctx){
+		return NULL;
+	}
+
+	char* key = NULL;
+	
+	const obus_JsonView* value = _obusd_conflateLookup(obus_parseView(ctx, str, len), field);
+	if(value && (value->type == OBUS_JSON_STRING || value->type == OBUS_JSON_NUMBER)){
+		key = g_strndup(value->str, value->len);
+	}
+	
+	obus_parseCtxReset(ctx);
+	return key;
+}
+
+/*
+ * Reads the key of a held message: from the body of a single chunk text
+ * message, or from the payload of an enveloped JSON message.
+ */
+static char* _obusd_heldKey(obusd_Held* held){
+	if(!held->enveloped){
+		if(held->frameCount != 1){
+			return NULL;
+		}
+		
+		const char* data = zmq_msg_data(&held->frames[0]);
+		size_t size = zmq_msg_size(&held->frames[0]);
+		size_t topicLen = obus_topicLength(data, size);
+		
+		return obusd_conflateKeyOf(data + topicLen, size - topicLen, held->field);
+	}
+
+	//The topic frame and the payload, in one chunk
+	if(held->frameCount != 2 || ntohs(held->envelope.contentType) != OBUS_CONTENT_JSON){
+		return NULL;
+	}
+
+	int codec = held->envelope.flags & OBUS_ENVELOPE_CODEC_MASK;
+	if(codec == OBUS_CODEC_NONE){
+		return obusd_conflateKeyOf(zmq_msg_data(&held->frames[1]), zmq_msg_size(&held->frames[1]), held->field);
+	}
+
+	void* body = NULL;
+	size_t bodyLen = 0;
+	if(obus_decompress(codec, zmq_msg_data(&held->frames[1]), zmq_msg_size(&held->frames[1]), OBUS_DEFAULT_MAX_BODY_LEN, &body, &bodyLen) != 0){
+		return NULL;
+	}
+
+	char* key = obusd_conflateKeyOf(body, bodyLen, held->field);
+	free(body);
+	return key;
+}
+
+//Publishes a held message as it would have been, but marked as conflated
+static unsigned char _obusd_heldPublish(obusd_Held* held, void* zmq_pub){
+	int more = held->frameCount > 1;
+	
+	unsigned char r = obusd_publishFrame(&held->frames[0], zmq_pub, 1, 1);
+	if(r == 0 && held->enveloped){
+		obus_Envelope env = held->envelope;
+		env.flags |= OBUS_ENVELOPE_CONFLATED;
+		
+		r = obusd_publishEnvelope(zmq_pub, &env, more);
+	}else if(r == 0){
+		r = obusd_publishSeq(zmq_pub, held->seq, OBUS_SEQ_CONFLATED | (held->forwarded ? OBUS_SEQ_FORWARDED : 0), more);
+	}
+
+	int i;
+	for(i = 1; i < held->frameCount && r == 0; i++){
+		r = obusd_publishFrame(&held->frames[i], zmq_pub, 0, i + 1 < held->frameCount);
+	}
+
+	if(r == 0){
+		obusd_statsOut(held->topic, held->topicLen, held->bytes, g_get_monotonic_time() - held->receivedAt);
+	}else if(r == OBUSD_PUBLISH_DROPPED){
+		obusd_statsDrop(held->topic, held->topicLen, 1);
+		r = 0;
+	}
+	return r;
+}
+
+//Publishes everything held for topic, which is then forgotten
+static unsigned char _obusd_conflateFlush(obusd_Conflator* conflator, obusd_ConflateTopic* topic, void* zmq_pub){
+	g_queue_delete_link(conflator->due, topic->dueLink);
+	g_hash_table_remove_all(topic->byKey);
+
+	unsigned char r = 0;
+	while(!g_queue_is_empty(topic->held)){
+		obusd_Held* held = g_queue_pop_head(topic->held);
+		if(r == 0){
+			r = _obusd_heldPublish(held, zmq_pub);
+		}
+		_obusd_heldFree(held);
+	}
+
+	g_hash_table_remove(conflator->topics, topic->topic);
+	return r;
+}
+
+static unsigned char _obusd_conflateFlushAll(obusd_Conflator* conflator, void* zmq_pub){
+	unsigned char r = 0;
+	while(!g_queue_is_empty(conflator->due)){
+		r |= _obusd_conflateFlush(conflator, g_queue_peek_head(conflator->due), zmq_pub);
+	}
+	return r;
+}
+
+/*
+ * The held messages of the topic name, which is nameLen bytes long and
+ * NUL terminated. Topics only exist while they hold messages, and are
+ * queued to be flushed in the order they were created.
+ */
+static obusd_ConflateTopic* _obusd_conflateTopicFor(obusd_Conflator* conflator, const char* name, size_t nameLen, unsigned char create){
+	obusd_ConflateTopic* topic = g_hash_table_lookup(conflator->topics, name);
+	if(topic || !create){
+		return topic;
+	}
+
+	topic = malloc(sizeof(obusd_ConflateTopic) + nameLen + 1);
+	if(!topic){
+		return NULL;
+	}
+
+	memcpy(topic->topic, name, nameLen + 1);
+	topic->held = g_queue_new();
+	topic->byKey = g_hash_table_new(g_str_hash, g_str_equal);
+	topic->firstAt = g_get_monotonic_time();
+
+	g_queue_push_tail(conflator->due, topic);
+	topic->dueLink = g_queue_peek_tail_link(conflator->due);
+
+	g_hash_table_insert(conflator->topics, topic->topic, topic);
+
+	return topic;
+}
+
+/*
+ * Picks up the rules if a reload replaced them. Messages held under the
+ * old ones are published first, so every held topic has a rule.
+ */
+static unsigned char _obusd_conflateRefresh(obusd_Conflator* conflator, void* zmq_pub){
+	if(atomic_load(&obusd_conflateRulesGen) == conflator->rulesGen){
+		return 0;
+	}
+
+	unsigned char r = _obusd_conflateFlushAll(conflator, zmq_pub);
+	
+	pthread_rwlock_rdlock(&obusd_conflateRulesLock);
+
+	_obusd_rulesUnref(conflator->rules);
+	conflator->rules = obusd_conflateRules;
+	if(conflator->rules){
+		atomic_fetch_add(&conflator->rules->refs, 1);
+	}
+	conflator->rulesGen = atomic_load(&obusd_conflateRulesGen);
+	
+	pthread_rwlock_unlock(&obusd_conflateRulesLock);
+	return r;
+}
+
+/*
+ * Called with the first chunk of every message. Sets req->conflated if
+ * req's topic is conflated, in which case all of its chunks go to
+ * obusd_conflateAdd.
+ */
+unsigned char obusd_conflateStart(obusd_Conflator* conflator, obusd_Request* req){
+	//Left over from a request that failed part way
+	_obusd_heldFree(conflator->current);
+	conflator->current = NULL;
+
+	req->conflated = 0;
+	conflator->ruled = 0;
+
+	if(_obusd_conflateRefresh(conflator, req->zmq_pub) != 0){
+		return 1;
+	}
+	
+	//Truncated topics would replace each other's messages
+	if(req->topicLen >= OBUSD_MAX_TOPIC_LEN){
+		return 0;
+	}
+
+	const char* field = _obusd_conflateFieldFor(conflator, req->topic, req->topicLen);
+	if(!field){
+		return 0;
+	}
+	conflator->ruled = 1;
+
+	obusd_Held* held = calloc(1, sizeof(obusd_Held));
+	if(!held){
+		return 0;
+	}
+
+	held->field = field;
+	memcpy(held->topic, req->topic, req->topicLen);
+	held->topicLen = req->topicLen;
+	held->seq = req->seq;
+	held->receivedAt = req->receivedAt;
+	held->enveloped = req->enveloped;
+	held->envelope = req->envelope;
+	held->forwarded = req->forwarded;
+
+	conflator->current = held;
+	req->conflated = 1;
+	return 0;
+}
+
+/*
+ * Holds a chunk of a conflated message, taking its content. Once the
+ * last one is in, the message replaces any held message of the same
+ * entity, and goes to the back of its topic's queue.
+ */
+unsigned char obusd_conflateAdd(obusd_Conflator* conflator, zmq_msg_t* msg, obusd_Request* req){
+	obusd_Held* held = conflator->current;
+	if(!held){
+		return 0;
+	}
+
+	zmq_msg_t* frames = realloc(held->frames, sizeof(zmq_msg_t) * (held->frameCount + 1));
+	if(!frames){
+		_obusd_heldFree(held);
+		conflator->current = NULL;
+		
+		req->dropped = 1;
+		obusd_statsDrop(req->topic, req->topicLen, 1);
+		return 0;
+	}
+	held->frames = frames;
+	
+	zmq_msg_init(&frames[held->frameCount]);
+	zmq_msg_move(&frames[held->frameCount], msg);
+	held->frameCount++;
+
+	if(req->more){
+		return 0;
+	}
+
+	conflator->current = NULL;
+	held->bytes = req->bytes;
+	held->key = _obusd_heldKey(held);
+
+	obusd_ConflateTopic* topic = _obusd_conflateTopicFor(conflator, held->topic, held->topicLen, 1);
+	if(!topic){
+		unsigned char r = _obusd_heldPublish(held, req->zmq_pub);
+		_obusd_heldFree(held);
+		return r;
+	}
+
+	if(held->key){
+		GList* link = g_hash_table_lookup(topic->byKey, held->key);
+		if(link){
+			g_hash_table_remove(topic->byKey, held->key);
+			_obusd_heldFree(link->data);
+			g_queue_delete_link(topic->held, link);
+			
+			obusd_statsConflate(held->topic, held->topicLen, 1);
+		}
+	}
+
+	g_queue_push_tail(topic->held, held);
+	if(held->key){
+		g_hash_table_insert(topic->byKey, held->key, g_queue_peek_tail_link(topic->held));
+	}
+
+	if(g_queue_get_length(topic->held) >= OBUSD_CONFLATE_MAX_HELD){
+		return _obusd_conflateFlush(conflator, topic, req->zmq_pub);
+	}
+	return 0;
+}
+
+/*
+ * Publishes whatever is held for req's topic, to keep it ordered before
+ * req. Every held topic has a rule, so only messages with one are looked
+ * up, which are those that couldn't be held.
+ */
+unsigned char obusd_conflateFlushTopic(obusd_Conflator* conflator, obusd_Request* req){
+	if(g_queue_is_empty(conflator->due) || !conflator->ruled || req->topicLen >= OBUSD_MAX_TOPIC_LEN){
+		return 0;
+	}
+
+	char name[OBUSD_MAX_TOPIC_LEN];
+	memcpy(name, req->topic, req->topicLen);
+	name[req->topicLen] = '\0';
+
+	obusd_ConflateTopic* topic = _obusd_conflateTopicFor(conflator, name, req->topicLen, 0);
+	if(topic){
+		return _obusd_conflateFlush(conflator, topic, req->zmq_pub);
+	}
+	return 0;
+}
+
+//Topics are due in the order they were queued, as they all wait as long
+unsigned char obusd_conflateFlushDue(obusd_Conflator* conflator, void* zmq_pub){
+	gint64 now = g_get_monotonic_time();
+	gint64 window = (gint64)atomic_load_explicit(&obusd_conflateMs, memory_order_relaxed) * 1000;
+
+	while(!g_queue_is_empty(conflator->due)){
+		obusd_ConflateTopic* topic = g_queue_peek_head(conflator->due);
+		if(now - topic->firstAt < window){
+			break;
+		}
+		if(_obusd_conflateFlush(conflator, topic, zmq_pub) != 0){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//Milliseconds until the next topic is due, or -1 if nothing is held
+long obusd_conflateTimeout(obusd_Conflator* conflator){
+	if(g_queue_is_empty(conflator->due)){
+		return -1;
+	}
+
+	obusd_ConflateTopic* topic = g_queue_peek_head(conflator->due);
+	gint64 soonest = topic->firstAt + (gint64)atomic_load_explicit(&obusd_conflateMs, memory_order_relaxed) * 1000 - g_get_monotonic_time();
+
+	if(soonest <= 0){
+		return 0;
+	}
+	
+	//Round up, zmq_poll only has millisecond resolution
+	return (soonest + 999) / 1000;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_CONFLATE_H_
+#define OBUSD_CONFLATE_H_
+
+#include "obusd.h"
+#include "conf.h"
+
+#include <zmq.h>
+
+#include <glib.h>
+
+/*
+ * Topics listed in a:conflate_topics are held back for i:conflate_ms, and
+ * only the latest message of each entity is published when they are
+ * flushed. Entries are a topic prefix and the JSON field holding the
+ * entity's key, which may be dotted to reach into nested objects:
+ *
+ *   a:conflate_topics
+ *   s:position: id
+ *   s:player: player.id
+ *
+ * The key is read from the body of text messages, and from the payload
+ * of enveloped JSON messages. Messages it can't be read from are held
+ * and published in order too, but never replaced.
+ *
+ * Published messages keep their sequence numbers and are marked with
+ * OBUS_SEQ_CONFLATED, so subscribers know gaps before them are expected.
+ * Each publishing thread owns one conflator, as it is tied to that
+ * thread's publisher socket.
+ */
+#define OBUSD_CONFLATE_DEFAULT_MS 50
+
+//A topic is flushed early once it holds this many entities
+#define OBUSD_CONFLATE_MAX_HELD 4096
+
+typedef struct obusd_Conflator{
+	GHashTable* topics;
+	//Topics holding messages, oldest first
+	GQueue* due;
+	//The message being received
+	struct obusd_Held* current;
+	//The rules last picked up, and the generation they came from, 0 before any were configured
+	struct obusd_ConflateRules* rules;
+	unsigned int rulesGen;
+	//Whether the message being received has a rule
+	unsigned char ruled;
+} obusd_Conflator;
+
+//Set by the main thread, also on a reload
+extern atomic_int obusd_conflateMs;
+
+unsigned char obusd_conflateConfigure(obus_ConfigEntry* ent);
+char* obusd_conflateKeyOf(const char* str, size_t len, const char* field);
+
+obusd_Conflator* obusd_conflatorNew();
+void obusd_conflatorFree(obusd_Conflator* conflator);
+
+unsigned char obusd_conflateStart(obusd_Conflator* conflator, obusd_Request* req);
+unsigned char obusd_conflateAdd(obusd_Conflator* conflator, zmq_msg_t* msg, obusd_Request* req);
+unsigned char obusd_conflateFlushTopic(obusd_Conflator* conflator, obusd_Request* req);
+unsigned char obusd_conflateFlushDue(obusd_Conflator* conflator, void* zmq_pub);
+long obusd_conflateTimeout(obusd_Conflator* conflator);
+
+#endif
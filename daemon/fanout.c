@@ -0,0 +1,830 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fanout.h"
+#include "obus.h"
+#include "obusd.h"
+#include "log.h"
+#include "lvc.h"
+#include "conflate.h"
+#include "compress.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <zmq.h>
+
+typedef struct obusd_FanoutRule{
+	char* prefix;
+	int policy;
+	//The entity key's field, for conflate
+	char* field;
+} obusd_FanoutRule;
+
+//A published message, shared by the queues of every subscriber it is for
+typedef struct obusd_Published{
+	int refs;
+	zmq_msg_t* frames;
+	int frameCount;
+	char key[OBUSD_MAX_TOPIC_LEN];
+	int policy;
+	//What it is conflated on, its topic and maybe its entity, or NULL if it can't be
+	char* conflateKey;
+} obusd_Published;
+
+typedef struct obusd_Prefix{
+	size_t len;
+	char data[];
+} obusd_Prefix;
+
+typedef struct obusd_Subscriber{
+	char identity[256];
+	size_t identityLen;
+	//Identity in hex, for stats and logs
+	char* name;
+	GPtrArray* prefixes;
+	GQueue* queue;
+	//Key of each conflated message queued, to the link holding it
+	GHashTable* byKey;
+	uint64_t sent;
+	uint64_t dropped;
+	uint64_t conflated;
+	unsigned char lagging;
+} obusd_Subscriber;
+
+atomic_int obusd_fanoutQueueLen = 0;
+
+//Replaced whole when the configuration is reloaded
+static pthread_rwlock_t obusd_fanoutRulesLock = PTHREAD_RWLOCK_INITIALIZER;
+static obusd_FanoutRule* obusd_fanoutRules = NULL;
+static int obusd_fanoutRuleCount = 0;
+
+/*
+ * The sockets and subscribers belong to the fanout thread. The lock is
+ * held while it works, and only ever taken by someone else to report on
+ * the subscribers.
+ */
+static pthread_mutex_t obusd_fanoutLock = PTHREAD_MUTEX_INITIALIZER;
+static void* obusd_fanoutSub = NULL;
+static void* obusd_fanoutRouter = NULL;
+static GHashTable* obusd_fanoutSubscribers = NULL;
+//The subscribers with something queued, which are all a retry looks at
+static GHashTable* obusd_fanoutBacklog = NULL;
+static atomic_int obusd_fanoutStarted = 0;
+
+static const char* const obusd_fanoutPolicyNames[] = {"drop-newest", "drop-oldest", "conflate", "disconnect"};
+
+static void _obusd_freeRules(obusd_FanoutRule* rules, int count){
+	int i;
+	for(i = 0; i < count; i++){
+		free(rules[i].prefix);
+		free(rules[i].field);
+	}
+	free(rules);
+}
+
+static int _obusd_policyFromName(const char* name){
+	int p;
+	for(p = 0; p < sizeof(obusd_fanoutPolicyNames) / sizeof(obusd_fanoutPolicyNames[0]); p++){
+		if(strcmp(name, obusd_fanoutPolicyNames[p]) == 0){
+			return p;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Reads the policies from the a:sub_policies entry ent, or clears them if
+ * ent is NULL. The policies in place are only replaced if all of ent is
+ * valid.
+ */
+unsigned char obusd_fanoutConfigure(obus_ConfigEntry* ent){
+	if(ent && ent->type != OBUS_CONF_ENT_TYPE_ARRAY){
+		fputs("sub_policies should be an array.\n", stderr);
+		return 1;
+	}
+
+	int len = ent ? ent->data.array.len : 0;
+	int count = 0;
+	
+	obusd_FanoutRule* rules = calloc(len > 0 ? len : 1, sizeof(obusd_FanoutRule));
+	if(!rules){
+		return 1;
+	}
+
+	int i;
+	for(i = 0; i < len; i++){
+		obus_ConfigEntry* rule = ent->data.array.array[i];
+		if(rule->type != OBUS_CONF_ENT_TYPE_STR || rule->data.str.len == 0){
+			continue;
+		}
+
+		char* prefix = strdup(rule->data.str.str);
+		if(!prefix){
+			_obusd_freeRules(rules, count);
+			return 1;
+		}
+
+		int policy = -1;
+		char* field = NULL;
+		
+		char* space = strrchr(prefix, ' ');
+		if(space){
+			*space = '\0';
+			policy = _obusd_policyFromName(space + 1);
+
+			//conflate may be followed by the entity key's field
+			char* before = policy < 0 ? strrchr(prefix, ' ') : NULL;
+			if(before && _obusd_policyFromName(before + 1) == OBUSD_FANOUT_CONFLATE){
+				*before = '\0';
+				policy = OBUSD_FANOUT_CONFLATE;
+				field = strdup(space + 1);
+				if(!field){
+					free(prefix);
+					_obusd_freeRules(rules, count);
+					return 1;
+				}
+			}
+		}
+		if(policy < 0){
+			fprintf(stderr, "Unknown policy for sub_policies: %s\n", rule->data.str.str);
+			free(prefix);
+			_obusd_freeRules(rules, count);
+			return 1;
+		}
+
+		rules[count].prefix = prefix;
+		rules[count].policy = policy;
+		rules[count].field = field;
+		count++;
+	}
+
+	pthread_rwlock_wrlock(&obusd_fanoutRulesLock);
+	
+	obusd_FanoutRule* old = obusd_fanoutRules;
+	int oldCount = obusd_fanoutRuleCount;
+	obusd_fanoutRules = rules;
+	obusd_fanoutRuleCount = count;
+	
+	pthread_rwlock_unlock(&obusd_fanoutRulesLock);
+
+	_obusd_freeRules(old, oldCount);
+	return 0;
+}
+
+/*
+ * The entity key of a published message: a text message in one chunk
+ * followed by its sequence header, or an enveloped JSON one with its
+ * payload in one chunk. NULL for anything else.
+ */
+static char* _obusd_fanoutEntityKey(obusd_Published* pub, const char* field){
+	if(pub->frameCount == 2 && obus_isSeqHeader(zmq_msg_data(&pub->frames[1]), zmq_msg_size(&pub->frames[1]))){
+		const char* data = zmq_msg_data(&pub->frames[0]);
+		size_t size = zmq_msg_size(&pub->frames[0]);
+		size_t topicLen = obus_topicLength(data, size);
+		
+		return obusd_conflateKeyOf(data + topicLen, size - topicLen, field);
+	}
+
+	if(pub->frameCount != 3 || !obus_isEnvelope(zmq_msg_data(&pub->frames[1]), zmq_msg_size(&pub->frames[1]))){
+		return NULL;
+	}
+
+	obus_Envelope env;
+	memcpy(&env, zmq_msg_data(&pub->frames[1]), sizeof(env));
+	if(ntohs(env.contentType) != OBUS_CONTENT_JSON){
+		return NULL;
+	}
+
+	int codec = env.flags & OBUS_ENVELOPE_CODEC_MASK;
+	if(codec == OBUS_CODEC_NONE){
+		return obusd_conflateKeyOf(zmq_msg_data(&pub->frames[2]), zmq_msg_size(&pub->frames[2]), field);
+	}
+
+	void* body = NULL;
+	size_t bodyLen = 0;
+	if(obus_decompress(codec, zmq_msg_data(&pub->frames[2]), zmq_msg_size(&pub->frames[2]), OBUS_DEFAULT_MAX_BODY_LEN, &body, &bodyLen) != 0){
+		return NULL;
+	}
+
+	char* key = obusd_conflateKeyOf(body, bodyLen, field);
+	free(body);
+	return key;
+}
+
+//Sets pub's policy from the first rule its topic, pub->key, starts with
+static void _obusd_fanoutClassify(obusd_Published* pub, size_t topicLen){
+	pub->policy = OBUSD_FANOUT_DROP_NEWEST;
+	
+	pthread_rwlock_rdlock(&obusd_fanoutRulesLock);
+
+	int i;
+	for(i = 0; i < obusd_fanoutRuleCount; i++){
+		size_t prefixLen = strlen(obusd_fanoutRules[i].prefix);
+		if(prefixLen <= topicLen && memcmp(pub->key, obusd_fanoutRules[i].prefix, prefixLen) == 0){
+			pub->policy = obusd_fanoutRules[i].policy;
+			break;
+		}
+	}
+
+	if(pub->policy == OBUSD_FANOUT_CONFLATE){
+		if(!obusd_fanoutRules[i].field){
+			pub->conflateKey = g_strdup(pub->key);
+		}else{
+			//The topic ends at its first ':', so no two topics and keys make the same string
+			char* entity = _obusd_fanoutEntityKey(pub, obusd_fanoutRules[i].field);
+			if(entity){
+				pub->conflateKey = g_strconcat(pub->key, entity, NULL);
+				g_free(entity);
+			}
+		}
+	}
+	
+	pthread_rwlock_unlock(&obusd_fanoutRulesLock);
+}
+
+static void _obusd_publishedUnref(obusd_Published* pub){
+	if(--pub->refs > 0){
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < pub->frameCount; i++){
+		zmq_msg_close(&pub->frames[i]);
+	}
+	free(pub->frames);
+	g_free(pub->conflateKey);
+	free(pub);
+}
+
+//Takes the queued message at link off sub's queue, without releasing it
+static obusd_Published* _obusd_fanoutUnlink(obusd_Subscriber* sub, GList* link){
+	obusd_Published* pub = link->data;
+	
+	if(pub->conflateKey && g_hash_table_lookup(sub->byKey, pub->conflateKey) == link){
+		g_hash_table_remove(sub->byKey, pub->conflateKey);
+	}
+	g_queue_delete_link(sub->queue, link);
+
+	if(g_queue_is_empty(sub->queue)){
+		g_hash_table_remove(obusd_fanoutBacklog, sub);
+	}
+	return pub;
+}
+
+static void _obusd_subscriberFree(void* vdSub){
+	obusd_Subscriber* sub = vdSub;
+
+	while(!g_queue_is_empty(sub->queue)){
+		_obusd_publishedUnref(_obusd_fanoutUnlink(sub, g_queue_peek_head_link(sub->queue)));
+	}
+	
+	guint i;
+	for(i = 0; i < sub->prefixes->len; i++){
+		obusd_Prefix* prefix = g_ptr_array_index(sub->prefixes, i);
+		zmq_setsockopt(obusd_fanoutSub, ZMQ_UNSUBSCRIBE, prefix->data, prefix->len);
+		free(prefix);
+	}
+	
+	g_ptr_array_free(sub->prefixes, 1);
+	g_queue_free(sub->queue);
+	g_hash_table_destroy(sub->byKey);
+	g_free(sub->name);
+	free(sub);
+}
+
+static obusd_Subscriber* _obusd_subscriberFor(const char* identity, size_t identityLen, unsigned char create){
+	char name[sizeof(((obusd_Subscriber*)0)->identity) * 2 + 1];
+	
+	size_t i;
+	for(i = 0; i < identityLen; i++){
+		snprintf(&name[i * 2], 3, "%02x", (unsigned char)identity[i]);
+	}
+	name[identityLen * 2] = '\0';
+
+	obusd_Subscriber* sub = g_hash_table_lookup(obusd_fanoutSubscribers, name);
+	if(sub || !create){
+		return sub;
+	}
+
+	sub = calloc(1, sizeof(obusd_Subscriber));
+	if(!sub){
+		return NULL;
+	}
+	
+	memcpy(sub->identity, identity, identityLen);
+	sub->identityLen = identityLen;
+	sub->name = g_strdup(name);
+	sub->prefixes = g_ptr_array_new();
+	sub->queue = g_queue_new();
+	sub->byKey = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_insert(obusd_fanoutSubscribers, sub->name, sub);
+	return sub;
+}
+
+static int _obusd_subscriberFindPrefix(obusd_Subscriber* sub, const char* data, size_t len){
+	guint i;
+	for(i = 0; i < sub->prefixes->len; i++){
+		obusd_Prefix* prefix = g_ptr_array_index(sub->prefixes, i);
+		if(prefix->len == len && memcmp(prefix->data, data, len) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static unsigned char _obusd_subscriberMatches(obusd_Subscriber* sub, zmq_msg_t* first){
+	guint i;
+	for(i = 0; i < sub->prefixes->len; i++){
+		obusd_Prefix* prefix = g_ptr_array_index(sub->prefixes, i);
+		if(prefix->len <= zmq_msg_size(first) && memcmp(prefix->data, zmq_msg_data(first), prefix->len) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#define _OBUSD_FANOUT_SENT 0
+#define _OBUSD_FANOUT_FULL 1
+#define _OBUSD_FANOUT_GONE 2
+
+//What _obusd_fanoutServeCached is serving
+typedef struct obusd_FanoutServing{
+	obusd_Subscriber* sub;
+	unsigned char gone;
+} obusd_FanoutServing;
+
+static int _obusd_fanoutSend(obusd_Subscriber* sub, obusd_Published* pub);
+static unsigned char _obusd_fanoutEnqueue(obusd_Subscriber* sub, obusd_Published* pub);
+
+//Sends one cached message to the subscriber being served, as obusd_LvcFn
+static void _obusd_fanoutServeCached(zmq_msg_t* frames, int frameCount, const char* topic, size_t topicLen, void* ud){
+	obusd_FanoutServing* serving = ud;
+	
+	obusd_Published* pub = calloc(1, sizeof(obusd_Published));
+	if(!pub){
+		int i;
+		for(i = 0; i < frameCount; i++){
+			zmq_msg_close(&frames[i]);
+		}
+		free(frames);
+		return;
+	}
+	
+	pub->refs = 1;
+	pub->frames = frames;
+	pub->frameCount = frameCount;
+	if(topicLen >= OBUSD_MAX_TOPIC_LEN){
+		topicLen = OBUSD_MAX_TOPIC_LEN - 1;
+	}
+	memcpy(pub->key, topic, topicLen);
+	pub->key[topicLen] = '\0';
+	_obusd_fanoutClassify(pub, topicLen);
+
+	if(!serving->gone){
+		int r = _OBUSD_FANOUT_FULL;
+		if(g_queue_is_empty(serving->sub->queue)){
+			r = _obusd_fanoutSend(serving->sub, pub);
+		}
+		if(r == _OBUSD_FANOUT_GONE || (r == _OBUSD_FANOUT_FULL && _obusd_fanoutEnqueue(serving->sub, pub) != 0)){
+			serving->gone = 1;
+		}
+	}
+
+	_obusd_publishedUnref(pub);
+}
+
+//Handles one command from a queued subscriber
+static void _obusd_fanoutCommand(){
+	zmq_msg_t frames[3];
+	int frameCount = 0;
+	int more = 1;
+
+	//The identity, the empty delimiter if there is one, then the command
+	while(more){
+		zmq_msg_t* msg = &frames[frameCount < 3 ? frameCount : 2];
+		if(frameCount < 3){
+			zmq_msg_init(msg);
+		}
+		if(zmq_msg_recv(msg, obusd_fanoutRouter, 0) < 0){
+			break;
+		}
+		more = zmq_msg_more(msg);
+		if(frameCount < 3){
+			frameCount++;
+		}
+	}
+
+	zmq_msg_t* cmd = frameCount >= 2 ? &frames[frameCount - 1] : NULL;
+	if(frameCount == 3 && zmq_msg_size(&frames[1]) != 0){
+		cmd = &frames[1];
+	}
+
+	if(cmd){
+		const char* data = zmq_msg_data(cmd);
+		size_t len = zmq_msg_size(cmd);
+		size_t subLen = strlen(OBUSD_FANOUT_SUBSCRIBE_PREFIX);
+		size_t unsubLen = strlen(OBUSD_FANOUT_UNSUBSCRIBE_PREFIX);
+
+		if(len >= subLen && memcmp(data, OBUSD_FANOUT_SUBSCRIBE_PREFIX, subLen) == 0){
+			obusd_Subscriber* sub = _obusd_subscriberFor(zmq_msg_data(&frames[0]), zmq_msg_size(&frames[0]), 1);
+			
+			if(sub && _obusd_subscriberFindPrefix(sub, data + subLen, len - subLen) < 0){
+				obusd_Prefix* prefix = malloc(sizeof(obusd_Prefix) + len - subLen);
+				if(prefix){
+					prefix->len = len - subLen;
+					memcpy(prefix->data, data + subLen, prefix->len);
+					g_ptr_array_add(sub->prefixes, prefix);
+					
+					zmq_setsockopt(obusd_fanoutSub, ZMQ_SUBSCRIBE, prefix->data, prefix->len);
+					obusd_log(OBUSD_LOG_DEBUG, "Queued subscriber %s subscribed to %.*s", sub->name, (int)prefix->len, prefix->data);
+
+					//Only this subscriber is sent the cache, ahead of anything published from now on
+					obusd_FanoutServing serving = {sub, 0};
+					if(obusd_lvcEach(prefix->data, prefix->len, _obusd_fanoutServeCached, &serving) != 0){
+						obusd_log(OBUSD_LOG_WARN, "Out of memory serving the cache to queued subscriber %s", sub->name);
+					}
+					if(serving.gone){
+						g_hash_table_remove(obusd_fanoutSubscribers, sub->name);
+					}
+				}
+			}
+		}else if(len >= unsubLen && memcmp(data, OBUSD_FANOUT_UNSUBSCRIBE_PREFIX, unsubLen) == 0){
+			obusd_Subscriber* sub = _obusd_subscriberFor(zmq_msg_data(&frames[0]), zmq_msg_size(&frames[0]), 0);
+			int i = sub ? _obusd_subscriberFindPrefix(sub, data + unsubLen, len - unsubLen) : -1;
+			
+			if(i >= 0){
+				obusd_Prefix* prefix = g_ptr_array_remove_index(sub->prefixes, i);
+				zmq_setsockopt(obusd_fanoutSub, ZMQ_UNSUBSCRIBE, prefix->data, prefix->len);
+				free(prefix);
+
+				if(sub->prefixes->len == 0){
+					g_hash_table_remove(obusd_fanoutSubscribers, sub->name);
+				}
+			}
+		}
+	}
+
+	int i;
+	for(i = 0; i < frameCount; i++){
+		zmq_msg_close(&frames[i]);
+	}
+}
+
+//Sends pub to sub if its connection can take it right now
+static int _obusd_fanoutSend(obusd_Subscriber* sub, obusd_Published* pub){
+	//With ZMQ_ROUTER_MANDATORY, a full connection is EAGAIN and a closed one EHOSTUNREACH
+	if(zmq_send(obusd_fanoutRouter, sub->identity, sub->identityLen, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0){
+		return errno == EAGAIN ? _OBUSD_FANOUT_FULL : _OBUSD_FANOUT_GONE;
+	}
+
+	//Once the first frame is taken, so are the rest
+	int i;
+	for(i = 0; i < pub->frameCount; i++){
+		zmq_msg_t frame;
+		zmq_msg_init(&frame);
+		zmq_msg_copy(&frame, &pub->frames[i]);
+		
+		int r = zmq_msg_send(&frame, obusd_fanoutRouter, i + 1 < pub->frameCount ? ZMQ_SNDMORE : 0);
+		zmq_msg_close(&frame);
+		if(r < 0){
+			return _OBUSD_FANOUT_GONE;
+		}
+	}
+
+	sub->sent++;
+	return _OBUSD_FANOUT_SENT;
+}
+
+/*
+ * Queues pub for sub, which couldn't take it, applying pub's policy if
+ * the queue is full. Returns 1 if sub is to be disconnected.
+ */
+static unsigned char _obusd_fanoutEnqueue(obusd_Subscriber* sub, obusd_Published* pub){
+	if(pub->conflateKey){
+		GList* link = g_hash_table_lookup(sub->byKey, pub->conflateKey);
+		if(link){
+			//The old message's key goes with it
+			g_hash_table_replace(sub->byKey, pub->conflateKey, link);
+			_obusd_publishedUnref(link->data);
+			link->data = pub;
+			pub->refs++;
+			
+			sub->conflated++;
+			return 0;
+		}
+	}
+
+	if(g_queue_get_length(sub->queue) >= atomic_load_explicit(&obusd_fanoutQueueLen, memory_order_relaxed)){
+		if(!sub->lagging){
+			sub->lagging = 1;
+			obusd_log(OBUSD_LOG_WARN, "Queued subscriber %s is lagging, applying %s", sub->name, obusd_fanoutPolicyNames[pub->policy]);
+		}
+		
+		if(pub->policy == OBUSD_FANOUT_DISCONNECT){
+			obusd_log(OBUSD_LOG_WARN, "Disconnecting queued subscriber %s", sub->name);
+			return 1;
+		}
+
+		//Counted for the subscriber only, the message still went out to the rest
+		sub->dropped++;
+		
+		if(pub->policy == OBUSD_FANOUT_DROP_NEWEST){
+			return 0;
+		}
+		_obusd_publishedUnref(_obusd_fanoutUnlink(sub, g_queue_peek_head_link(sub->queue)));
+	}
+
+	if(g_queue_is_empty(sub->queue)){
+		g_hash_table_add(obusd_fanoutBacklog, sub);
+	}
+	
+	g_queue_push_tail(sub->queue, pub);
+	pub->refs++;
+	
+	if(pub->conflateKey){
+		g_hash_table_insert(sub->byKey, pub->conflateKey, g_queue_peek_tail_link(sub->queue));
+	}
+	return 0;
+}
+
+//Receives one published message and hands it to every subscriber it is for
+static void _obusd_fanoutDispatch(){
+	obusd_Published* pub = calloc(1, sizeof(obusd_Published));
+	if(!pub){
+		return;
+	}
+	pub->refs = 1;
+
+	int more = 1;
+	while(more){
+		zmq_msg_t* frames = realloc(pub->frames, sizeof(zmq_msg_t) * (pub->frameCount + 1));
+		if(!frames){
+			break;
+		}
+		pub->frames = frames;
+		
+		zmq_msg_init(&frames[pub->frameCount]);
+		if(zmq_msg_recv(&frames[pub->frameCount], obusd_fanoutSub, 0) < 0){
+			zmq_msg_close(&frames[pub->frameCount]);
+			break;
+		}
+		more = zmq_msg_more(&frames[pub->frameCount]);
+		pub->frameCount++;
+	}
+
+	//Whatever is left of a message that couldn't be kept
+	if(more || pub->frameCount == 0){
+		zmq_msg_t rest;
+		zmq_msg_init(&rest);
+		while(more && zmq_msg_recv(&rest, obusd_fanoutSub, 0) >= 0){
+			more = zmq_msg_more(&rest);
+		}
+		zmq_msg_close(&rest);
+		
+		_obusd_publishedUnref(pub);
+		return;
+	}
+
+	size_t topicLen = obus_topicLength(zmq_msg_data(&pub->frames[0]), zmq_msg_size(&pub->frames[0]));
+	if(topicLen >= OBUSD_MAX_TOPIC_LEN){
+		topicLen = OBUSD_MAX_TOPIC_LEN - 1;
+	}
+	memcpy(pub->key, zmq_msg_data(&pub->frames[0]), topicLen);
+	pub->key[topicLen] = '\0';
+	_obusd_fanoutClassify(pub, topicLen);
+
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	
+	g_hash_table_iter_init(&iter, obusd_fanoutSubscribers);
+	while(g_hash_table_iter_next(&iter, &key, &value)){
+		obusd_Subscriber* sub = value;
+		if(!_obusd_subscriberMatches(sub, &pub->frames[0])){
+			continue;
+		}
+
+		//Nothing may overtake what is already queued
+		int r = _OBUSD_FANOUT_FULL;
+		if(g_queue_is_empty(sub->queue)){
+			r = _obusd_fanoutSend(sub, pub);
+		}
+		
+		if(r == _OBUSD_FANOUT_GONE || (r == _OBUSD_FANOUT_FULL && _obusd_fanoutEnqueue(sub, pub) != 0)){
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	_obusd_publishedUnref(pub);
+}
+
+/*
+ * Sends what it can of every backlogged subscriber's queue. Returns
+ * whether anything was sent.
+ */
+static unsigned char _obusd_fanoutFlush(){
+	unsigned char progress = 0;
+	
+	//Subscribers leave the backlog as their queues empty
+	GList* backlog = g_hash_table_get_keys(obusd_fanoutBacklog);
+	GList* l;
+	for(l = backlog; l; l = l->next){
+		obusd_Subscriber* sub = l->data;
+		
+		int r = _OBUSD_FANOUT_SENT;
+		while(!g_queue_is_empty(sub->queue)){
+			r = _obusd_fanoutSend(sub, g_queue_peek_head(sub->queue));
+			if(r != _OBUSD_FANOUT_SENT){
+				break;
+			}
+			_obusd_publishedUnref(_obusd_fanoutUnlink(sub, g_queue_peek_head_link(sub->queue)));
+			progress = 1;
+		}
+
+		if(r == _OBUSD_FANOUT_GONE){
+			g_hash_table_remove(obusd_fanoutSubscribers, sub->name);
+		}else if(sub->lagging && g_queue_is_empty(sub->queue)){
+			sub->lagging = 0;
+			obusd_log(OBUSD_LOG_INFO, "Queued subscriber %s caught up", sub->name);
+		}
+	}
+	g_list_free(backlog);
+
+	return progress;
+}
+
+static void* _obusd_fanoutMain(void* ud){
+	zmq_pollitem_t items[2];
+	items[0] = (zmq_pollitem_t){obusd_fanoutSub, 0, ZMQ_POLLIN, 0};
+	items[1] = (zmq_pollitem_t){obusd_fanoutRouter, 0, ZMQ_POLLIN, 0};
+
+	//ZeroMQ can't say which subscriber's connection has room again, so
+	//backlogged ones are retried, less often while none of them has any
+	long retryMs = OBUSD_FANOUT_RETRY_MS;
+
+	while(1){
+		long timeout = g_hash_table_size(obusd_fanoutBacklog) > 0 ? retryMs : -1;
+		
+		int r = zmq_poll(items, 2, timeout);
+		if(r < 0){
+			if(errno == ETERM){
+				break;
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&obusd_fanoutLock);
+
+		if(items[1].revents & ZMQ_POLLIN){
+			_obusd_fanoutCommand();
+		}
+		if(items[0].revents & ZMQ_POLLIN){
+			_obusd_fanoutDispatch();
+		}
+		if(g_hash_table_size(obusd_fanoutBacklog) > 0){
+			if(_obusd_fanoutFlush()){
+				retryMs = OBUSD_FANOUT_RETRY_MS;
+			}else if(r == 0 && retryMs < OBUSD_FANOUT_MAX_RETRY_MS){
+				retryMs *= 2;
+			}
+		}
+		
+		pthread_mutex_unlock(&obusd_fanoutLock);
+	}
+
+	return NULL;
+}
+
+static void _obusd_fanoutCleanup(){
+	if(obusd_fanoutSubscribers){
+		g_hash_table_destroy(obusd_fanoutSubscribers);
+		obusd_fanoutSubscribers = NULL;
+	}
+	if(obusd_fanoutRouter){
+		zmq_close(obusd_fanoutRouter);
+		obusd_fanoutRouter = NULL;
+	}
+	if(obusd_fanoutSub){
+		zmq_close(obusd_fanoutSub);
+		obusd_fanoutSub = NULL;
+	}
+	if(obusd_fanoutBacklog){
+		g_hash_table_destroy(obusd_fanoutBacklog);
+		obusd_fanoutBacklog = NULL;
+	}
+}
+
+/*
+ * Binds the fanout endpoint and starts its thread. The publisher has to
+ * be bound to OBUSD_FANOUT_ENDPOINT already. Only called by the main
+ * thread, which may try again if it fails.
+ */
+unsigned char obusd_fanoutStart(void* zmq_ctx, const char* endpoint){
+	if(atomic_load(&obusd_fanoutStarted)){
+		return 0;
+	}
+	
+	obusd_fanoutSubscribers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _obusd_subscriberFree);
+	obusd_fanoutBacklog = g_hash_table_new(g_direct_hash, g_direct_equal);
+	
+	obusd_fanoutRouter = zmq_socket(zmq_ctx, ZMQ_ROUTER);
+	obusd_fanoutSub = zmq_socket(zmq_ctx, ZMQ_SUB);
+
+	int mandatory = 1;
+	zmq_setsockopt(obusd_fanoutRouter, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+
+	//The queues here do the buffering, so this only has to cover the
+	//fanout thread falling behind for a moment
+	int hwm = OBUSD_FANOUT_SUB_HWM;
+	zmq_setsockopt(obusd_fanoutSub, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+	
+	if(zmq_bind(obusd_fanoutRouter, endpoint) != 0){
+		fprintf(stderr, "Failed to bind %s\n", endpoint);
+		_obusd_fanoutCleanup();
+		return 1;
+	}
+	if(zmq_connect(obusd_fanoutSub, OBUSD_FANOUT_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_FANOUT_ENDPOINT);
+		_obusd_fanoutCleanup();
+		return 1;
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_fanoutMain, NULL) != 0){
+		_obusd_fanoutCleanup();
+		return 1;
+	}
+	pthread_detach(thread);
+
+	atomic_store(&obusd_fanoutStarted, 1);
+	return 0;
+}
+
+unsigned char obusd_fanoutRunning(){
+	return atomic_load(&obusd_fanoutStarted);
+}
+
+//Every queued subscriber, with its queue and what became of its messages
+struct json_object* obusd_fanoutToJSON(){
+	struct json_object* jsubs = json_object_new_array();
+	
+	pthread_mutex_lock(&obusd_fanoutLock);
+
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	
+	g_hash_table_iter_init(&iter, obusd_fanoutSubscribers);
+	while(g_hash_table_iter_next(&iter, &key, &value)){
+		obusd_Subscriber* sub = value;
+		
+		struct json_object* jsub = json_object_new_object();
+		struct json_object* jprefixes = json_object_new_array();
+
+		guint i;
+		for(i = 0; i < sub->prefixes->len; i++){
+			obusd_Prefix* prefix = g_ptr_array_index(sub->prefixes, i);
+			json_object_array_add(jprefixes, json_object_new_string_len(prefix->data, prefix->len));
+		}
+		
+		json_object_object_add(jsub, "id", json_object_new_string(sub->name));
+		json_object_object_add(jsub, "prefixes", jprefixes);
+		json_object_object_add(jsub, "queued", json_object_new_int64(g_queue_get_length(sub->queue)));
+		json_object_object_add(jsub, "sent", json_object_new_int64(sub->sent));
+		json_object_object_add(jsub, "dropped", json_object_new_int64(sub->dropped));
+		json_object_object_add(jsub, "conflated", json_object_new_int64(sub->conflated));
+		json_object_object_add(jsub, "lagging", json_object_new_boolean(sub->lagging));
+
+		json_object_array_add(jsubs, jsub);
+	}
+	
+	pthread_mutex_unlock(&obusd_fanoutLock);
+	return jsubs;
+}
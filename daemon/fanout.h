@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_FANOUT_H_
+#define OBUSD_FANOUT_H_
+
+#include "obusd.h"
+#include "conf.h"
+
+#include <stddef.h>
+
+#include <json.h>
+
+/*
+ * Queued subscribers connect a DEALER to the fanout endpoint, port + 3 or
+ * s:bind_queued, instead of a SUB to the publisher, and send
+ * "subscribe:<prefix>" and "unsubscribe:<prefix>". They get messages
+ * exactly as a SUB would.
+ *
+ * A thread of its own takes everything published and keeps a queue of up
+ * to i:sub_queue_len messages for each queued subscriber that can't keep
+ * up, so a slow one never holds up the publisher or anyone else. What
+ * happens when a queue is full depends on the message's topic, from
+ * a:sub_policies, whose entries are a topic prefix and a policy:
+ *
+ *   a:sub_policies
+ *   s:game: drop-oldest
+ *   s:dashboard: conflate
+ *   s:debug: disconnect
+ *
+ * drop-newest, the default, drops the message that doesn't fit.
+ * drop-oldest drops the longest queued one instead. conflate replaces a
+ * queued message of the same topic, so only the latest of each is sent,
+ * and otherwise drops the oldest. Followed by a JSON field, as in
+ *
+ *   s:position: conflate id
+ *
+ * it replaces the queued message of the same topic and entity instead,
+ * with the key read as for a:conflate_topics; messages it can't be read
+ * from are never replaced. disconnect drops the subscriber, which gets
+ * nothing more until it subscribes again.
+ *
+ * The fanout is started once i:sub_queue_len is set, also by a reload.
+ */
+#define OBUSD_FANOUT_SUBSCRIBE_PREFIX "subscribe:"
+#define OBUSD_FANOUT_UNSUBSCRIBE_PREFIX "unsubscribe:"
+
+//The publisher is also bound here, for the fanout thread to subscribe to
+#define OBUSD_FANOUT_ENDPOINT "inproc://obusd-fanout"
+
+#define OBUSD_FANOUT_DROP_NEWEST 0
+#define OBUSD_FANOUT_DROP_OLDEST 1
+#define OBUSD_FANOUT_CONFLATE 2
+#define OBUSD_FANOUT_DISCONNECT 3
+
+//How often backlogged subscribers are retried, doubled up to the most while none can take anything
+#define OBUSD_FANOUT_RETRY_MS 1
+#define OBUSD_FANOUT_MAX_RETRY_MS 64
+
+//Messages the fanout thread may have waiting for it, past which the publisher drops them for it
+#define OBUSD_FANOUT_SUB_HWM 100000
+
+extern atomic_int obusd_fanoutQueueLen;
+
+unsigned char obusd_fanoutConfigure(obus_ConfigEntry* ent);
+unsigned char obusd_fanoutStart(void* zmq_ctx, const char* endpoint);
+unsigned char obusd_fanoutRunning();
+
+struct json_object* obusd_fanoutToJSON();
+
+#endif
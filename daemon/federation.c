@@ -0,0 +1,527 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "federation.h"
+#include "obus.h"
+#include "compress.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <zmq.h>
+
+uint64_t obusd_originId = 0;
+
+//Owned by the thread reading the publisher's subscriptions, which reports them on it
+static void* obusd_federationNotify = NULL;
+
+//The rest belong to the federation thread
+static void* obusd_federationTap = NULL;
+static void* obusd_federationPeerPub = NULL;
+static void* obusd_federationPeerSub = NULL;
+static void* obusd_federationInject = NULL;
+static void* obusd_federationPull = NULL;
+
+//Subscribers to each prefix on this daemon, which is what is asked of peers
+static GHashTable* obusd_federationWanted = NULL;
+//Subscription messages the tap caused, which aren't anyone's interest
+static GHashTable* obusd_federationEchoes = NULL;
+//Last sequence number forwarded per origin and topic, as obusd_FederationSeen
+static GHashTable* obusd_federationLastSeqs = NULL;
+static gint64 obusd_federationLastSweep = 0;
+//Forwarded messages dropped since the last sweep, as this daemon fell behind
+static unsigned long long obusd_federationInjectDrops = 0;
+
+typedef struct obusd_FederationSeen{
+	uint64_t seq;
+	gint64 seenAt;
+} obusd_FederationSeen;
+
+//Drops the rest of a message, once its first frames are read into msg
+static void _obusd_federationDrain(void* sock, zmq_msg_t* msg, int more){
+	while(more && zmq_msg_recv(msg, sock, 0) >= 0){
+		more = zmq_msg_more(msg);
+	}
+}
+
+//A subscription message as a string, "+prefix" or "-prefix"
+static char* _obusd_federationEchoKey(const char* data, size_t len){
+	return g_strdup_printf("%c%.*s", data[0] == 1 ? '+' : '-', (int)(len - 1), &data[1]);
+}
+
+//Counts one subscription message the tap is about to cause
+static void _obusd_federationExpectEcho(const char* data, size_t len){
+	char* key = _obusd_federationEchoKey(data, len);
+	int count = GPOINTER_TO_INT(g_hash_table_lookup(obusd_federationEchoes, key));
+	g_hash_table_replace(obusd_federationEchoes, key, GINT_TO_POINTER(count + 1));
+}
+
+static unsigned char _obusd_federationIsEcho(const char* data, size_t len){
+	char* key = _obusd_federationEchoKey(data, len);
+
+	int count = GPOINTER_TO_INT(g_hash_table_lookup(obusd_federationEchoes, key));
+	if(count == 0){
+		g_free(key);
+		return 0;
+	}
+	
+	if(count == 1){
+		g_hash_table_remove(obusd_federationEchoes, key);
+		g_free(key);
+	}else{
+		g_hash_table_replace(obusd_federationEchoes, key, GINT_TO_POINTER(count - 1));
+	}
+	return 1;
+}
+
+/*
+ * Keeps the subscriptions at the peers in step with the subscribers
+ * here, subscribing to a prefix when it gets its first and unsubscribing
+ * when it loses its last.
+ */
+static void _obusd_federationOnInterest(){
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+	
+	int r = zmq_msg_recv(&msg, obusd_federationPull, 0);
+	if(r < 1){
+		zmq_msg_close(&msg);
+		return;
+	}
+
+	const char* data = zmq_msg_data(&msg);
+	if((data[0] != 0 && data[0] != 1) || _obusd_federationIsEcho(data, r)){
+		zmq_msg_close(&msg);
+		return;
+	}
+
+	//Content filters are evaluated here, on everything
+	size_t prefixLen = r - 1;
+	if(prefixLen > 0 && data[1] == '?'){
+		prefixLen = 0;
+	}
+	
+	char* prefix = g_strndup(&data[1], prefixLen);
+	int count = GPOINTER_TO_INT(g_hash_table_lookup(obusd_federationWanted, prefix));
+
+	if(data[0] == 1){
+		g_hash_table_replace(obusd_federationWanted, prefix, GINT_TO_POINTER(count + 1));
+	}else if(count > 1){
+		g_hash_table_replace(obusd_federationWanted, prefix, GINT_TO_POINTER(count - 1));
+	}else{
+		g_hash_table_remove(obusd_federationWanted, prefix);
+		g_free(prefix);
+	}
+
+	if((data[0] == 1 && count == 0) || (data[0] == 0 && count == 1)){
+		char sub[prefixLen + 1];
+		sub[0] = data[0];
+		memcpy(&sub[1], &data[1], prefixLen);
+		
+		zmq_send(obusd_federationPeerSub, sub, prefixLen + 1, 0);
+		obusd_log(OBUSD_LOG_DEBUG, "%s %.*s at peers", data[0] == 1 ? "Subscribed to" : "Unsubscribed from", (int)prefixLen, &data[1]);
+	}
+	
+	zmq_msg_close(&msg);
+}
+
+//Subscribes the tap to what the peers subscribed to here, so only that is forwarded
+static void _obusd_federationOnPeerSubscription(){
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+	
+	int r = zmq_msg_recv(&msg, obusd_federationPeerPub, 0);
+	if(r >= 1){
+		const char* data = zmq_msg_data(&msg);
+		if(data[0] == 1 || data[0] == 0){
+			_obusd_federationExpectEcho(data, r);
+			zmq_setsockopt(obusd_federationTap, data[0] == 1 ? ZMQ_SUBSCRIBE : ZMQ_UNSUBSCRIBE, &data[1], r - 1);
+		}
+	}
+	
+	zmq_msg_close(&msg);
+}
+
+/*
+ * Sends a message published here on to the peers subscribed to it, with
+ * an obus_PeerHeader after its first frame. Messages that came from a
+ * peer or from the cache aren't sent, nor are copies routed to content
+ * filters, which the peers route themselves.
+ */
+static void _obusd_federationOnLocal(){
+	zmq_msg_t first;
+	zmq_msg_t msg;
+	zmq_msg_init(&first);
+	zmq_msg_init(&msg);
+
+	int more = 0;
+	if(zmq_msg_recv(&first, obusd_federationTap, 0) < 0){
+		goto done;
+	}
+	more = zmq_msg_more(&first);
+	if(!more || zmq_msg_recv(&msg, obusd_federationTap, 0) < 0){
+		goto done;
+	}
+	more = zmq_msg_more(&msg);
+
+	const void* data = zmq_msg_data(&msg);
+	size_t len = zmq_msg_size(&msg);
+	
+	unsigned char local = zmq_msg_size(&first) == 0 || ((const char*)zmq_msg_data(&first))[0] != '?';
+	if(obus_isSeqHeader(data, len)){
+		local = local && !(((const obus_SeqHeader*)data)->flags & (OBUS_SEQ_CACHED | OBUS_SEQ_FORWARDED));
+	}else if(obus_isEnvelope(data, len)){
+		local = local && !(((const obus_Envelope*)data)->flags & (OBUS_ENVELOPE_CACHED | OBUS_ENVELOPE_FORWARDED));
+	}else{
+		local = local && obus_isBatchHeader(data, len);
+	}
+	if(!local){
+		goto done;
+	}
+
+	obus_PeerHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBUS_PEER_MAGIC, sizeof(hdr.magic));
+	hdr.version = OBUS_PEER_VERSION;
+	hdr.origin = obus_htonll(obusd_originId);
+
+	if(zmq_msg_send(&first, obusd_federationPeerPub, ZMQ_SNDMORE) < 0 ||
+	   zmq_send(obusd_federationPeerPub, &hdr, sizeof(hdr), ZMQ_SNDMORE) < 0){
+		goto done;
+	}
+	
+	while(1){
+		if(zmq_msg_send(&msg, obusd_federationPeerPub, more ? ZMQ_SNDMORE : 0) < 0 || !more){
+			break;
+		}
+		if(zmq_msg_recv(&msg, obusd_federationTap, 0) < 0){
+			more = 0;
+			break;
+		}
+		more = zmq_msg_more(&msg);
+	}
+
+ done:
+	_obusd_federationDrain(obusd_federationTap, &msg, more);
+	zmq_msg_close(&first);
+	zmq_msg_close(&msg);
+}
+
+//Whether the message seq of topic from origin was already forwarded, noting it if not
+static unsigned char _obusd_federationSeen(uint64_t origin, const char* topic, size_t topicLen, uint64_t seq){
+	if(topicLen >= OBUSD_MAX_TOPIC_LEN){
+		topicLen = OBUSD_MAX_TOPIC_LEN - 1;
+	}
+	
+	char* key = g_strdup_printf("%016llx %.*s", (unsigned long long)origin, (int)topicLen, topic);
+	
+	obusd_FederationSeen* last = g_hash_table_lookup(obusd_federationLastSeqs, key);
+	if(last){
+		g_free(key);
+		if(seq <= last->seq){
+			return 1;
+		}
+	}else{
+		last = malloc(sizeof(obusd_FederationSeen));
+		if(!last){
+			g_free(key);
+			return 0;
+		}
+		g_hash_table_insert(obusd_federationLastSeqs, key, last);
+	}
+
+	last->seq = seq;
+	last->seenAt = g_get_monotonic_time();
+	return 0;
+}
+
+static gboolean _obusd_federationIsStale(gpointer key, gpointer value, gpointer ud){
+	return ((obusd_FederationSeen*)value)->seenAt < *(gint64*)ud;
+}
+
+/*
+ * Forgets the origins and topics nothing was forwarded from for a while,
+ * such as those of a peer that restarted with a new ID, and reports the
+ * forwarded messages dropped since the last sweep.
+ */
+static void _obusd_federationSweep(){
+	gint64 now = g_get_monotonic_time();
+	if(now - obusd_federationLastSweep < OBUSD_FEDERATION_SWEEP_MS * 1000){
+		return;
+	}
+	obusd_federationLastSweep = now;
+	
+	gint64 cutoff = now - OBUSD_FEDERATION_SEEN_TTL_MS * (gint64)1000;
+	g_hash_table_foreach_remove(obusd_federationLastSeqs, _obusd_federationIsStale, &cutoff);
+
+	if(obusd_federationInjectDrops > 0){
+		obusd_log(OBUSD_LOG_WARN, "Dropped %llu forwarded message(s), this daemon is falling behind its peers", obusd_federationInjectDrops);
+		obusd_federationInjectDrops = 0;
+	}
+}
+
+/*
+ * Publishes a message from a peer here, as [obus_PeerHeader][env][first]
+ * [rest...], where env is the message's envelope, if it has one. If the
+ * request socket's queue is full the message is dropped, rather than
+ * stalling this thread and letting the tap back up behind it.
+ */
+static void _obusd_federationInjectOne(const obus_PeerHeader* hdr, const obus_Envelope* env, zmq_msg_t* first, zmq_msg_t* rest, int restCount){
+	//Once the first frame is queued, the rest are too
+	if(zmq_send(obusd_federationInject, hdr, sizeof(obus_PeerHeader), ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0){
+		if(errno == EAGAIN){
+			obusd_federationInjectDrops++;
+		}
+		return;
+	}
+	if(env && zmq_send(obusd_federationInject, env, sizeof(obus_Envelope), ZMQ_SNDMORE) < 0){
+		return;
+	}
+
+	int i;
+	for(i = -1; i < restCount; i++){
+		zmq_msg_t frame;
+		zmq_msg_init(&frame);
+		zmq_msg_copy(&frame, i < 0 ? first : &rest[i]);
+		
+		int r = zmq_msg_send(&frame, obusd_federationInject, i + 1 < restCount ? ZMQ_SNDMORE : 0);
+		zmq_msg_close(&frame);
+		if(r < 0){
+			return;
+		}
+	}
+}
+
+/*
+ * Publishes a message forwarded by a peer here, unless it first came
+ * from here or was already forwarded another way. It is sent as a
+ * producer would send it: the seq header is left out, and an envelope
+ * goes ahead of the topic frame.
+ */
+static void _obusd_federationOnPeer(){
+	zmq_msg_t* frames = NULL;
+	int count = 0;
+	int more = 1;
+	int i;
+	
+	while(more){
+		zmq_msg_t* tmp = realloc(frames, sizeof(zmq_msg_t) * (count + 1));
+		if(!tmp){
+			break;
+		}
+		frames = tmp;
+		
+		zmq_msg_init(&frames[count]);
+		if(zmq_msg_recv(&frames[count], obusd_federationPeerSub, 0) < 0){
+			zmq_msg_close(&frames[count]);
+			break;
+		}
+		more = zmq_msg_more(&frames[count]);
+		count++;
+	}
+
+	if(more){
+		zmq_msg_t rest;
+		zmq_msg_init(&rest);
+		_obusd_federationDrain(obusd_federationPeerSub, &rest, more);
+		zmq_msg_close(&rest);
+		goto done;
+	}
+	
+	if(count < 3 || !obus_isPeerHeader(zmq_msg_data(&frames[1]), zmq_msg_size(&frames[1]))){
+		goto done;
+	}
+
+	obus_PeerHeader hdr;
+	memcpy(&hdr, zmq_msg_data(&frames[1]), sizeof(hdr));
+	
+	uint64_t origin = obus_ntohll(hdr.origin);
+	if(origin == obusd_originId){
+		goto done;
+	}
+
+	const char* first = zmq_msg_data(&frames[0]);
+	size_t firstLen = zmq_msg_size(&frames[0]);
+	const void* data = zmq_msg_data(&frames[2]);
+	size_t len = zmq_msg_size(&frames[2]);
+	
+	if(obus_isSeqHeader(data, len)){
+		const obus_SeqHeader* seqHdr = data;
+		if(!_obusd_federationSeen(origin, first, obus_topicLength(first, firstLen), obus_ntohll(seqHdr->seq))){
+			_obusd_federationInjectOne(&hdr, NULL, &frames[0], &frames[3], count - 3);
+		}
+	}else if(obus_isEnvelope(data, len)){
+		obus_Envelope env;
+		memcpy(&env, data, sizeof(env));
+		
+		if(!_obusd_federationSeen(origin, first, firstLen, obus_ntohll(env.seq))){
+			//Whether it was cached or conflated there is no concern of this daemon
+			env.flags &= OBUS_ENVELOPE_CODEC_MASK;
+			_obusd_federationInjectOne(&hdr, &env, &frames[0], &frames[3], count - 3);
+		}
+	}else if(obus_isBatchHeader(data, len)){
+		const obus_BatchHeader* batchHdr = data;
+		uint64_t seq = obus_ntohll(batchHdr->seq);
+		
+		for(i = 3; i < count && i - 3 < ntohl(batchHdr->count); i++){
+			if(!_obusd_federationSeen(origin, first, firstLen, seq + i - 3)){
+				_obusd_federationInjectOne(&hdr, NULL, &frames[i], NULL, 0);
+			}
+		}
+	}
+
+ done:
+	for(i = 0; i < count; i++){
+		zmq_msg_close(&frames[i]);
+	}
+	free(frames);
+}
+
+static void* _obusd_federationMain(void* ud){
+	zmq_pollitem_t items[4];
+	items[0] = (zmq_pollitem_t){obusd_federationPull, 0, ZMQ_POLLIN, 0};
+	items[1] = (zmq_pollitem_t){obusd_federationPeerPub, 0, ZMQ_POLLIN, 0};
+	items[2] = (zmq_pollitem_t){obusd_federationTap, 0, ZMQ_POLLIN, 0};
+	items[3] = (zmq_pollitem_t){obusd_federationPeerSub, 0, ZMQ_POLLIN, 0};
+
+	obusd_federationLastSweep = g_get_monotonic_time();
+
+	while(1){
+		int r = zmq_poll(items, 4, OBUSD_FEDERATION_SWEEP_MS);
+		if(r < 0){
+			if(errno == ETERM){
+				break;
+			}
+			continue;
+		}
+
+		_obusd_federationSweep();
+
+		if(items[0].revents & ZMQ_POLLIN){
+			_obusd_federationOnInterest();
+		}
+		if(items[1].revents & ZMQ_POLLIN){
+			_obusd_federationOnPeerSubscription();
+		}
+		if(items[2].revents & ZMQ_POLLIN){
+			_obusd_federationOnLocal();
+		}
+		if(items[3].revents & ZMQ_POLLIN){
+			_obusd_federationOnPeer();
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Binds the peer endpoint, connects to every endpoint in the a:peers
+ * entry peers and starts the federation thread. The publisher must
+ * already be bound to OBUSD_FEDERATION_TAP_ENDPOINT, and the peers'
+ * request socket to OBUSD_FEDERATION_INJECT_ENDPOINT.
+ */
+unsigned char obusd_federationStart(void* zmq_ctx, const char* endpoint, obus_ConfigEntry* peers){
+	if(peers->type != OBUS_CONF_ENT_TYPE_ARRAY){
+		fputs("peers should be an array.\n", stderr);
+		return 1;
+	}
+	
+	obusd_originId = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+	obusd_federationWanted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	obusd_federationEchoes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	obusd_federationLastSeqs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	
+	obusd_federationTap = zmq_socket(zmq_ctx, ZMQ_SUB);
+	obusd_federationPeerPub = zmq_socket(zmq_ctx, ZMQ_XPUB);
+	obusd_federationPeerSub = zmq_socket(zmq_ctx, ZMQ_XSUB);
+	obusd_federationInject = zmq_socket(zmq_ctx, ZMQ_DEALER);
+	obusd_federationPull = zmq_socket(zmq_ctx, ZMQ_PULL);
+	obusd_federationNotify = zmq_socket(zmq_ctx, ZMQ_PUSH);
+
+	//Nothing may be lost between threads, or the subscriptions get out of
+	//step. The tap is only messages, so it keeps its default limit, like
+	//any other subscriber to the publisher.
+	int hwm = 0;
+	zmq_setsockopt(obusd_federationPull, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+	zmq_setsockopt(obusd_federationNotify, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+	//Forwarded messages queue up to a limit, and are dropped past it
+	int injectHwm = OBUSD_FEDERATION_INJECT_HWM;
+	zmq_setsockopt(obusd_federationInject, ZMQ_SNDHWM, &injectHwm, sizeof(injectHwm));
+	
+	if(zmq_bind(obusd_federationPeerPub, endpoint) != 0){
+		fprintf(stderr, "Failed to bind %s\n", endpoint);
+		return 1;
+	}
+	if(zmq_bind(obusd_federationPull, OBUSD_FEDERATION_INTEREST_ENDPOINT) != 0 ||
+	   zmq_connect(obusd_federationNotify, OBUSD_FEDERATION_INTEREST_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_FEDERATION_INTEREST_ENDPOINT);
+		return 1;
+	}
+	if(zmq_connect(obusd_federationTap, OBUSD_FEDERATION_TAP_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_FEDERATION_TAP_ENDPOINT);
+		return 1;
+	}
+	if(zmq_connect(obusd_federationInject, OBUSD_FEDERATION_INJECT_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_FEDERATION_INJECT_ENDPOINT);
+		return 1;
+	}
+
+	int i;
+	for(i = 0; i < peers->data.array.len; i++){
+		obus_ConfigEntry* peer = peers->data.array.array[i];
+		if(peer->type != OBUS_CONF_ENT_TYPE_STR || peer->data.str.len == 0){
+			continue;
+		}
+		
+		if(zmq_connect(obusd_federationPeerSub, peer->data.str.str) != 0){
+			fprintf(stderr, "Failed to connect to peer %s\n", peer->data.str.str);
+			return 1;
+		}
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_federationMain, NULL) != 0){
+		return 1;
+	}
+	pthread_detach(thread);
+
+	obusd_log(OBUSD_LOG_INFO, "Federating with %i peer(s) as %016llx", peers->data.array.len, (unsigned long long)obusd_originId);
+	return 0;
+}
+
+unsigned char obusd_federationRunning(){
+	return obusd_federationNotify != NULL;
+}
+
+//Passes on a subscription message from the publisher, from the main thread
+void obusd_federationInterest(const char* data, size_t len){
+	if(obusd_federationNotify){
+		zmq_send(obusd_federationNotify, data, len, 0);
+	}
+}
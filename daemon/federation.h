@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_FEDERATION_H_
+#define OBUSD_FEDERATION_H_
+
+#include "obusd.h"
+#include "conf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Federation joins daemons into one bus, such as one per rack. It is on
+ * when a:peers is set, listing the peer endpoints, port + 4 or
+ * s:bind_peer, of the daemons to take messages from:
+ *
+ *   a:peers
+ *   s:tcp://rack2:14456
+ *   s:tcp://rack3:14456
+ *
+ * A daemon subscribes at its peers to exactly the prefixes its own
+ * subscribers want, and its peers subscribe at it the same way, so only
+ * topics someone on the other side listens to cross between them. A
+ * subscription to a content filter asks for everything, as the filter is
+ * evaluated where it was subscribed.
+ *
+ * Forwarded messages are published again like any other, taking the
+ * receiving daemon's sequence numbers, journal and cache, but marked
+ * with OBUS_SEQ_FORWARDED. Only messages first published on a daemon are
+ * sent on to its peers, so every daemon should list every other one it
+ * wants messages from. Each carries its origin's ID, and a daemon drops
+ * its own messages coming back, and copies of a message it already got
+ * another way.
+ */
+
+//The publisher is also bound here, for the federation thread to subscribe to
+#define OBUSD_FEDERATION_TAP_ENDPOINT "inproc://obusd-federation"
+//And a request socket of its own here, for it to publish forwarded
+//messages through. Peer headers are only accepted from this one.
+#define OBUSD_FEDERATION_INJECT_ENDPOINT "inproc://obusd-federation-in"
+//Where the main thread tells it about subscriptions to the publisher
+#define OBUSD_FEDERATION_INTEREST_ENDPOINT "inproc://obusd-federation-interest"
+
+//How long a forwarded copy from another path is still recognised as one
+#define OBUSD_FEDERATION_SEEN_TTL_MS 60000
+//How often the sequence numbers of quiet origins and topics are forgotten
+#define OBUSD_FEDERATION_SWEEP_MS 10000
+//Forwarded messages waiting to be published here, past which they are dropped
+#define OBUSD_FEDERATION_INJECT_HWM 10000
+
+extern uint64_t obusd_originId;
+
+unsigned char obusd_federationStart(void* zmq_ctx, const char* endpoint, obus_ConfigEntry* peers);
+unsigned char obusd_federationRunning();
+void obusd_federationInterest(const char* data, size_t len);
+
+#endif
@@ -0,0 +1,910 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+#include "log.h"
+#include "seq.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+/*
+ * The journal is a directory of numbered segment files, each an
+ * append-only run of records. Routing threads only queue records, along
+ * with a reference to the message's content; a flusher thread writes
+ * everything queued with writev and syncs once per flush interval, so the
+ * cost of fsync is shared by every message in the group.
+ *
+ * Records keep the sequence number the message was published with. Each
+ * segment remembers the first and last sequence of every topic in it, so a replay only maps and scans
+ * segments that can hold what was asked for, and only what has been
+ * synced is ever replayed.
+ *
+ * A sender waiting on an answer is only told its message was published
+ * once the flush holding it has synced: the flusher sends the answers it
+ * was handed to the main thread, which passes them on to the senders.
+ * If the flusher can't write, it stops and wakes the main thread, which
+ * shuts the daemon down rather than acknowledge messages it can't keep.
+ * Replays are answered by a thread of their own, so scanning segments
+ * never holds up the threads routing requests.
+ *
+ * With journal_max_segments set, the flusher deletes the oldest segments
+ * past it once everything queued for them has synced. A topic whose
+ * records were all deleted starts over from 1 after a restart.
+ */
+
+#define _OBUSD_JOURNAL_PAD(len) (((len) + 7) & ~(size_t)7)
+
+typedef struct obusd_SegmentTopic{
+	uint64_t first;
+	uint64_t last;
+} obusd_SegmentTopic;
+
+typedef struct obusd_Segment{
+	int id;
+	char* path;
+	//Bytes queued for this segment, and bytes known to be on disk
+	size_t len;
+	size_t durableLen;
+	//Only touched by the flusher
+	size_t writtenLen;
+	GHashTable* topics;
+} obusd_Segment;
+
+typedef struct _obusd_JournalPending{
+	obusd_JournalRecord hdr;
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	zmq_msg_t msg;
+	obusd_Segment* segment;
+} _obusd_JournalPending;
+
+typedef struct _obusd_JournalAck{
+	zmq_msg_t identity;
+	char text[64];
+} _obusd_JournalAck;
+
+static char* obusd_journalPath = NULL;
+static size_t obusd_journalSegmentMax = 0;
+static int obusd_journalInterval = 0;
+static int obusd_journalMaxSegments = 0;
+
+static pthread_mutex_t obusd_journalLock = PTHREAD_MUTEX_INITIALIZER;
+static GPtrArray* obusd_journalSegments = NULL;
+
+static _obusd_JournalPending* obusd_journalPending = NULL;
+static int obusd_journalPendingLen = 0;
+static int obusd_journalPendingCap = 0;
+
+static _obusd_JournalAck* obusd_journalAcks = NULL;
+static int obusd_journalAcksLen = 0;
+static int obusd_journalAcksCap = 0;
+
+//Only used by the flusher, connected to OBUSD_JOURNAL_ACK_ENDPOINT
+static void* obusd_journalAckSock = NULL;
+
+//Set once by the flusher when it gives up, after the reason is written
+static atomic_int obusd_journalFailed = 0;
+static char obusd_journalFailedReason[256];
+
+unsigned char obusd_journalEnabled(){
+	return obusd_journalPath != NULL;
+}
+
+//Why the journal stopped being written, or NULL if it hasn't
+const char* obusd_journalFailure(){
+	if(!atomic_load(&obusd_journalFailed)){
+		return NULL;
+	}
+	return obusd_journalFailedReason;
+}
+
+static obusd_Segment* _obusd_segmentNew(int id){
+	obusd_Segment* seg = calloc(1, sizeof(obusd_Segment));
+	if(!seg){
+		return NULL;
+	}
+
+	seg->id = id;
+	seg->path = g_strdup_printf("%s/%08d.seg", obusd_journalPath, id);
+	seg->topics = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+
+	return seg;
+}
+
+static void _obusd_segmentIndex(obusd_Segment* seg, const char* topic, uint64_t seq){
+	obusd_SegmentTopic* st = g_hash_table_lookup(seg->topics, topic);
+	if(!st){
+		st = malloc(sizeof(obusd_SegmentTopic));
+		if(!st){
+			return;
+		}
+		st->first = seq;
+		g_hash_table_insert(seg->topics, g_strdup(topic), st);
+	}
+	st->last = seq;
+}
+
+/*
+ * Rebuilds a segment's index from disk, cutting off a record that was
+ * only partly written when the daemon last stopped.
+ */
+static unsigned char _obusd_segmentLoad(obusd_Segment* seg){
+	int fd = open(seg->path, O_RDWR);
+	if(fd < 0){
+		return 1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return 1;
+	}
+
+	size_t size = st.st_size;
+	size_t off = 0;
+
+	if(size > 0){
+		char* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(map == MAP_FAILED){
+			close(fd);
+			return 1;
+		}
+
+		while(off + sizeof(obusd_JournalRecord) <= size){
+			obusd_JournalRecord* rec = (obusd_JournalRecord*)&map[off];
+			size_t recLen = _OBUSD_JOURNAL_PAD(sizeof(obusd_JournalRecord) + rec->topicLen + rec->len);
+			
+			if(rec->magic != OBUSD_JOURNAL_MAGIC || rec->topicLen >= OBUSD_MAX_TOPIC_LEN || off + recLen > size){
+				break;
+			}
+
+			char topic[OBUSD_MAX_TOPIC_LEN];
+			memcpy(topic, &map[off + sizeof(obusd_JournalRecord)], rec->topicLen);
+			topic[rec->topicLen] = '\0';
+
+			_obusd_segmentIndex(seg, topic, rec->seq);
+			obusd_seqSeen(topic, rec->topicLen, rec->seq);
+
+			off += recLen;
+		}
+
+		munmap(map, size);
+	}
+
+	if(off < size){
+		obusd_log(OBUSD_LOG_WARN, "Truncating %s from %zu to %zu bytes", seg->path, size, off);
+		if(ftruncate(fd, off) != 0){
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+
+	seg->len = off;
+	seg->durableLen = off;
+	seg->writtenLen = off;
+
+	return 0;
+}
+
+static int _obusd_segmentCompare(const void* a, const void* b){
+	return (*(const int*)a > *(const int*)b) - (*(const int*)a < *(const int*)b);
+}
+
+static unsigned char _obusd_journalScan(){
+	DIR* dir = opendir(obusd_journalPath);
+	if(!dir){
+		return 1;
+	}
+
+	int* ids = NULL;
+	int idCount = 0;
+
+	struct dirent* ent;
+	while((ent = readdir(dir))){
+		int id;
+		char suffix[8];
+		if(sscanf(ent->d_name, "%d.%4s", &id, suffix) == 2 && strcmp(suffix, "seg") == 0){
+			int* tmpIds = realloc(ids, sizeof(int) * (idCount + 1));
+			if(!tmpIds){
+				free(ids);
+				closedir(dir);
+				return 1;
+			}
+			ids = tmpIds;
+			ids[idCount++] = id;
+		}
+	}
+	closedir(dir);
+
+	qsort(ids, idCount, sizeof(int), _obusd_segmentCompare);
+
+	int i;
+	for(i = 0; i < idCount; i++){
+		obusd_Segment* seg = _obusd_segmentNew(ids[i]);
+		if(!seg || _obusd_segmentLoad(seg) != 0){
+			fprintf(stderr, "Failed to load journal segment %d\n", ids[i]);
+			free(ids);
+			return 1;
+		}
+		g_ptr_array_add(obusd_journalSegments, seg);
+	}
+	free(ids);
+
+	if(obusd_journalSegments->len == 0){
+		obusd_Segment* seg = _obusd_segmentNew(1);
+		if(!seg){
+			return 1;
+		}
+		g_ptr_array_add(obusd_journalSegments, seg);
+	}
+
+	return 0;
+}
+
+//Writes all of iov, picking up after short writes
+static unsigned char _obusd_writevAll(int fd, struct iovec* iov, int count){
+	while(count > 0){
+		ssize_t n = writev(fd, iov, count);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return 1;
+		}
+
+		while(count > 0 && n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0){
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static unsigned char _obusd_journalSync(int fd, obusd_Segment* seg){
+	if(fd < 0){
+		return 0;
+	}
+	
+	if(fdatasync(fd) != 0){
+		return 1;
+	}
+
+	pthread_mutex_lock(&obusd_journalLock);
+	seg->durableLen = seg->writtenLen;
+	pthread_mutex_unlock(&obusd_journalLock);
+	
+	return 0;
+}
+
+static void _obusd_segmentFree(obusd_Segment* seg){
+	g_hash_table_destroy(seg->topics);
+	g_free(seg->path);
+	free(seg);
+}
+
+/*
+ * Deletes the oldest segments past obusd_journalMaxSegments whose records
+ * have all synced. Only the flusher calls this, as it is the only thread
+ * holding on to segments without the lock, through current and fd.
+ */
+static void _obusd_journalTrim(obusd_Segment** current, int* fd){
+	if(obusd_journalMaxSegments <= 0){
+		return;
+	}
+	
+	while(1){
+		obusd_Segment* oldest = NULL;
+		
+		pthread_mutex_lock(&obusd_journalLock);
+		if(obusd_journalSegments->len > (guint)obusd_journalMaxSegments){
+			oldest = g_ptr_array_index(obusd_journalSegments, 0);
+			if(oldest->durableLen < oldest->len){
+				oldest = NULL;
+			}else{
+				g_ptr_array_remove_index(obusd_journalSegments, 0);
+			}
+		}
+		pthread_mutex_unlock(&obusd_journalLock);
+
+		if(!oldest){
+			return;
+		}
+
+		if(oldest == *current){
+			close(*fd);
+			*fd = -1;
+			*current = NULL;
+		}
+
+		if(unlink(oldest->path) != 0 && errno != ENOENT){
+			obusd_log(OBUSD_LOG_WARN, "Failed to delete journal segment %s: %s", oldest->path, strerror(errno));
+		}else{
+			obusd_log(OBUSD_LOG_DEBUG, "Deleted journal segment %s", oldest->path);
+		}
+		_obusd_segmentFree(oldest);
+	}
+}
+
+//Sends the answers held for a flush that synced on to the main thread
+static void _obusd_journalSendAcks(_obusd_JournalAck* acks, int count){
+	int i;
+	for(i = 0; i < count; i++){
+		int r = zmq_msg_send(&acks[i].identity, obusd_journalAckSock, ZMQ_SNDMORE);
+		if(r >= 0){
+			r = zmq_send(obusd_journalAckSock, "", 0, ZMQ_SNDMORE);
+		}
+		if(r >= 0){
+			r = zmq_send(obusd_journalAckSock, acks[i].text, strlen(acks[i].text), 0);
+		}
+		if(r < 0){
+			fputs("Failed to send message.\n", stderr);
+		}
+		zmq_msg_close(&acks[i].identity);
+	}
+}
+
+static void* _obusd_journalMain(void* unused){
+	static const char padding[8] = {0};
+	
+	_obusd_JournalPending* flushing = NULL;
+	int flushingCap = 0;
+	_obusd_JournalAck* acking = NULL;
+	int ackingCap = 0;
+
+	obusd_Segment* seg = NULL;
+	int fd = -1;
+
+	long iovMax = sysconf(_SC_IOV_MAX);
+	if(iovMax < 16 || iovMax > 1024){
+		iovMax = iovMax < 16 ? 16 : 1024;
+	}
+	struct iovec iov[iovMax];
+	
+	while(1){
+		usleep(obusd_journalInterval * 1000);
+
+		//Take everything queued, handing back the array flushed last time
+		pthread_mutex_lock(&obusd_journalLock);
+		_obusd_JournalPending* tmpPending = obusd_journalPending;
+		int count = obusd_journalPendingLen;
+		int tmpCap = obusd_journalPendingCap;
+		
+		obusd_journalPending = flushing;
+		obusd_journalPendingCap = flushingCap;
+		obusd_journalPendingLen = 0;
+		
+		flushing = tmpPending;
+		flushingCap = tmpCap;
+
+		_obusd_JournalAck* tmpAcks = obusd_journalAcks;
+		int ackCount = obusd_journalAcksLen;
+		int tmpAckCap = obusd_journalAcksCap;
+
+		obusd_journalAcks = acking;
+		obusd_journalAcksCap = ackingCap;
+		obusd_journalAcksLen = 0;
+
+		acking = tmpAcks;
+		ackingCap = tmpAckCap;
+		pthread_mutex_unlock(&obusd_journalLock);
+
+		if(count == 0 && ackCount == 0){
+			continue;
+		}
+
+		int iovLen = 0;
+		unsigned char failed = 0;
+		
+		int i;
+		for(i = 0; i < count && !failed; i++){
+			_obusd_JournalPending* p = &flushing[i];
+
+			if(p->segment != seg){
+				if(iovLen > 0){
+					failed = _obusd_writevAll(fd, iov, iovLen);
+					iovLen = 0;
+				}
+				if(!failed){
+					failed = _obusd_journalSync(fd, seg);
+				}
+				if(fd >= 0){
+					close(fd);
+				}
+
+				seg = p->segment;
+				fd = open(seg->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+				if(fd < 0){
+					failed = 1;
+					break;
+				}
+			}
+
+			if(iovLen + 4 > iovMax){
+				failed = _obusd_writevAll(fd, iov, iovLen);
+				iovLen = 0;
+			}
+
+			size_t size = zmq_msg_size(&p->msg);
+			size_t recLen = sizeof(obusd_JournalRecord) + p->hdr.topicLen + size;
+			
+			iov[iovLen++] = (struct iovec){&p->hdr, sizeof(obusd_JournalRecord)};
+			iov[iovLen++] = (struct iovec){p->topic, p->hdr.topicLen};
+			iov[iovLen++] = (struct iovec){zmq_msg_data(&p->msg), size};
+			if(_OBUSD_JOURNAL_PAD(recLen) != recLen){
+				iov[iovLen++] = (struct iovec){(void*)padding, _OBUSD_JOURNAL_PAD(recLen) - recLen};
+			}
+
+			seg->writtenLen += _OBUSD_JOURNAL_PAD(recLen);
+		}
+
+		if(!failed && iovLen > 0){
+			failed = _obusd_writevAll(fd, iov, iovLen);
+		}
+		if(!failed){
+			failed = _obusd_journalSync(fd, seg);
+		}
+
+		if(failed){
+			snprintf(obusd_journalFailedReason, sizeof(obusd_journalFailedReason), "Failed to write journal segment %s: %s", seg ? seg->path : "", strerror(errno));
+			atomic_store(&obusd_journalFailed, 1);
+			obusd_wakeMain();
+
+			if(fd >= 0){
+				close(fd);
+			}
+			return NULL;
+		}
+
+		for(i = 0; i < count; i++){
+			zmq_msg_close(&flushing[i].msg);
+		}
+
+		_obusd_journalSendAcks(acking, ackCount);
+
+		_obusd_journalTrim(&seg, &fd);
+	}
+
+	return NULL;
+}
+
+unsigned char obusd_journalOpen(const char* dir, int segmentMb, int flushMs, int maxSegments){
+	if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+		fprintf(stderr, "Failed to create journal directory %s\n", dir);
+		return 1;
+	}
+
+	obusd_journalPath = strdup(dir);
+	obusd_journalSegmentMax = (size_t)(segmentMb > 0 ? segmentMb : OBUSD_JOURNAL_DEFAULT_SEGMENT_MB) * 1024 * 1024;
+	obusd_journalInterval = flushMs > 0 ? flushMs : OBUSD_JOURNAL_DEFAULT_FLUSH_MS;
+	obusd_journalMaxSegments = maxSegments > 0 ? maxSegments : 0;
+
+	obusd_journalSegments = g_ptr_array_new();
+
+	if(_obusd_journalScan() != 0){
+		fprintf(stderr, "Failed to read journal %s\n", dir);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts the flusher, which sends the answers it holds on a PUSH socket
+ * connected to OBUSD_JOURNAL_ACK_ENDPOINT, where the main thread binds a
+ * PULL socket.
+ */
+unsigned char obusd_journalStart(void* zmq_ctx){
+	obusd_journalAckSock = zmq_socket(zmq_ctx, ZMQ_PUSH);
+	if(!obusd_journalAckSock){
+		return 1;
+	}
+
+	//An answer must never be lost, or its sender would hang
+	int hwm = 0;
+	zmq_setsockopt(obusd_journalAckSock, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+	if(zmq_connect(obusd_journalAckSock, OBUSD_JOURNAL_ACK_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_JOURNAL_ACK_ENDPOINT);
+		return 1;
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_journalMain, NULL) != 0){
+		return 1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * Queues one chunk of req to be journaled under req->seq, keeping a
+ * reference to msg's content rather than a copy. more says whether
+ * another chunk of the message follows.
+ */
+static unsigned char _obusd_journalAppendChunk(zmq_msg_t* msg, obusd_Request* req, int more){
+	//Nothing more will be written
+	if(atomic_load(&obusd_journalFailed)){
+		return 1;
+	}
+	
+	//The record would have the wrong topic, so it couldn't be replayed.
+	//obusd_handleRequest refuses these before they get here.
+	if(req->topicLen >= OBUSD_MAX_TOPIC_LEN){
+		return 1;
+	}
+
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	memcpy(topic, req->topic, req->topicLen);
+	topic[req->topicLen] = '\0';
+
+	size_t size = zmq_msg_size(msg);
+	size_t recLen = _OBUSD_JOURNAL_PAD(sizeof(obusd_JournalRecord) + req->topicLen + size);
+	
+	pthread_mutex_lock(&obusd_journalLock);
+
+	obusd_Segment* seg = g_ptr_array_index(obusd_journalSegments, obusd_journalSegments->len - 1);
+	if(seg->len > 0 && seg->len + recLen > obusd_journalSegmentMax){
+		obusd_Segment* newSeg = _obusd_segmentNew(seg->id + 1);
+		if(!newSeg){
+			pthread_mutex_unlock(&obusd_journalLock);
+			return 1;
+		}
+		g_ptr_array_add(obusd_journalSegments, newSeg);
+		seg = newSeg;
+	}
+
+	if(obusd_journalPendingLen == obusd_journalPendingCap){
+		int newCap = obusd_journalPendingCap > 0 ? obusd_journalPendingCap * 2 : 256;
+		_obusd_JournalPending* tmpPending = realloc(obusd_journalPending, sizeof(_obusd_JournalPending) * newCap);
+		if(!tmpPending){
+			pthread_mutex_unlock(&obusd_journalLock);
+			return 1;
+		}
+		obusd_journalPending = tmpPending;
+		obusd_journalPendingCap = newCap;
+	}
+
+	_obusd_JournalPending* p = &obusd_journalPending[obusd_journalPendingLen++];
+	memset(&p->hdr, 0, sizeof(p->hdr));
+	p->hdr.magic = OBUSD_JOURNAL_MAGIC;
+	p->hdr.len = size;
+	p->hdr.seq = req->seq;
+	p->hdr.time = g_get_real_time();
+	p->hdr.topicLen = req->topicLen;
+	p->hdr.flags = more ? OBUSD_JOURNAL_MORE : 0;
+	memcpy(p->topic, req->topic, req->topicLen);
+	zmq_msg_init(&p->msg);
+	zmq_msg_copy(&p->msg, msg);
+	p->segment = seg;
+
+	seg->len += recLen;
+	_obusd_segmentIndex(seg, topic, req->seq);
+
+	pthread_mutex_unlock(&obusd_journalLock);
+
+	return 0;
+}
+
+unsigned char obusd_journalAppend(zmq_msg_t* msg, obusd_Request* req){
+	//The envelope still follows the topic of a binary message
+	return _obusd_journalAppendChunk(msg, req, req->more || (req->first && req->enveloped));
+}
+
+//Journals req's envelope, which is replayed after its topic as it is published
+unsigned char obusd_journalAppendEnvelope(obusd_Request* req){
+	zmq_msg_t msg;
+	if(zmq_msg_init_size(&msg, sizeof(obus_Envelope)) != 0){
+		return 1;
+	}
+	memcpy(zmq_msg_data(&msg), &req->envelope, sizeof(obus_Envelope));
+
+	unsigned char r = _obusd_journalAppendChunk(&msg, req, req->more);
+	zmq_msg_close(&msg);
+	return r;
+}
+
+/*
+ * Holds the answer ack to req, a message just journaled, until the flush
+ * holding it has synced.
+ */
+unsigned char obusd_journalAck(obusd_Request* req, const char* ack){
+	pthread_mutex_lock(&obusd_journalLock);
+
+	if(obusd_journalAcksLen == obusd_journalAcksCap){
+		int newCap = obusd_journalAcksCap > 0 ? obusd_journalAcksCap * 2 : 64;
+		_obusd_JournalAck* tmpAcks = realloc(obusd_journalAcks, sizeof(_obusd_JournalAck) * newCap);
+		if(!tmpAcks){
+			pthread_mutex_unlock(&obusd_journalLock);
+			return 1;
+		}
+		obusd_journalAcks = tmpAcks;
+		obusd_journalAcksCap = newCap;
+	}
+
+	_obusd_JournalAck* a = &obusd_journalAcks[obusd_journalAcksLen++];
+	zmq_msg_init(&a->identity);
+	zmq_msg_copy(&a->identity, &req->identity);
+	snprintf(a->text, sizeof(a->text), "%s", ack);
+
+	pthread_mutex_unlock(&obusd_journalLock);
+
+	return 0;
+}
+
+typedef struct _obusd_ReplaySegment{
+	char* path;
+	size_t len;
+} _obusd_ReplaySegment;
+
+/*
+ * Calls fn for every synced chunk of topic with a sequence number of at
+ * least since, stopping after limit whole messages. Returns how many
+ * messages were replayed, or -1 on error.
+ */
+int obusd_journalReplay(const char* topic, size_t topicLen, uint64_t since, int limit, obusd_JournalReplayFn fn, void* ud){
+	if(!obusd_journalPath || topicLen >= OBUSD_MAX_TOPIC_LEN){
+		return -1;
+	}
+
+	char key[OBUSD_MAX_TOPIC_LEN];
+	memcpy(key, topic, topicLen);
+	key[topicLen] = '\0';
+
+	//Pick the segments to read while locked, read them after
+	pthread_mutex_lock(&obusd_journalLock);
+	
+	_obusd_ReplaySegment segs[obusd_journalSegments->len];
+	int segCount = 0;
+
+	guint i;
+	for(i = 0; i < obusd_journalSegments->len; i++){
+		obusd_Segment* seg = g_ptr_array_index(obusd_journalSegments, i);
+		obusd_SegmentTopic* st = g_hash_table_lookup(seg->topics, key);
+		
+		if(st && st->last >= since && seg->durableLen > 0){
+			//The flusher may delete the segment once the lock is let go
+			segs[segCount].path = g_strdup(seg->path);
+			segs[segCount].len = seg->durableLen;
+			segCount++;
+		}
+	}
+	
+	pthread_mutex_unlock(&obusd_journalLock);
+
+	int count = 0;
+	unsigned char done = 0;
+	
+	int s;
+	for(s = 0; s < segCount && !done; s++){
+		int fd = open(segs[s].path, O_RDONLY);
+		if(fd < 0){
+			//Deleted since, its messages are gone
+			if(errno == ENOENT){
+				continue;
+			}
+			count = -1;
+			break;
+		}
+
+		char* map = mmap(NULL, segs[s].len, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED){
+			count = -1;
+			break;
+		}
+
+		size_t off = 0;
+		while(off + sizeof(obusd_JournalRecord) <= segs[s].len){
+			obusd_JournalRecord* rec = (obusd_JournalRecord*)&map[off];
+			if(rec->magic != OBUSD_JOURNAL_MAGIC){
+				break;
+			}
+			
+			const char* recTopic = &map[off + sizeof(obusd_JournalRecord)];
+			
+			if(rec->seq >= since && rec->topicLen == topicLen && memcmp(recTopic, topic, topicLen) == 0){
+				if(fn(rec, recTopic + rec->topicLen, ud) != 0){
+					count = -1;
+					done = 1;
+					break;
+				}
+
+				if(!(rec->flags & OBUSD_JOURNAL_MORE)){
+					if(++count >= limit){
+						done = 1;
+						break;
+					}
+				}
+			}
+			
+			off += _OBUSD_JOURNAL_PAD(sizeof(obusd_JournalRecord) + rec->topicLen + rec->len);
+		}
+
+		munmap(map, segs[s].len);
+	}
+
+	for(s = 0; s < segCount; s++){
+		g_free(segs[s].path);
+	}
+
+	return count;
+}
+
+typedef struct _obusd_ReplayState{
+	obusd_Request* req;
+	uint64_t next;
+	unsigned char inMessage;
+} _obusd_ReplayState;
+
+static unsigned char _obusd_replayChunk(const obusd_JournalRecord* rec, const char* data, void* ud){
+	_obusd_ReplayState* state = ud;
+	void* sock = state->req->zmq_resp;
+
+	if(!state->inMessage){
+		if(obusd_replyHead(state->req) != 0){
+			return 1;
+		}
+
+		char head[32];
+		int headLen = snprintf(head, sizeof(head), OBUSD_JOURNAL_REPLAY_PREFIX "%llu", (unsigned long long)rec->seq);
+		if(zmq_send(sock, head, headLen, ZMQ_SNDMORE) < 0){
+			return 1;
+		}
+	}
+
+	int more = rec->flags & OBUSD_JOURNAL_MORE;
+	
+	if(zmq_send(sock, data, rec->len, more ? ZMQ_SNDMORE : 0) < 0){
+		return 1;
+	}
+
+	state->inMessage = more;
+	state->next = rec->seq + 1;
+	
+	return 0;
+}
+
+static unsigned char _obusd_replayReply(obusd_Request* req, const char* reply){
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+	if(zmq_send(req->zmq_resp, reply, strlen(reply), 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Answers "$replay:<topic> <seq> [limit]" with one reply per journaled
+ * message, ["$replay:<seq>"][chunks...], followed by "$replay:end <next>".
+ * A client that got limit messages back asks again from next.
+ */
+unsigned char obusd_journalHandleReplay(obusd_Request* req, const char* cmd, size_t len){
+	size_t prefixLen = strlen(OBUSD_JOURNAL_REPLAY_PREFIX);
+	
+	char args[OBUSD_MAX_TOPIC_LEN + 64];
+	if(len - prefixLen >= sizeof(args)){
+		return _obusd_replayReply(req, OBUSD_JOURNAL_REPLAY_PREFIX "error request too long");
+	}
+	memcpy(args, cmd + prefixLen, len - prefixLen);
+	args[len - prefixLen] = '\0';
+
+	if(!obusd_journalEnabled()){
+		return _obusd_replayReply(req, OBUSD_JOURNAL_REPLAY_PREFIX "error journal disabled");
+	}
+
+	char* sep = strchr(args, ' ');
+	if(!sep || sep == args){
+		return _obusd_replayReply(req, OBUSD_JOURNAL_REPLAY_PREFIX "error bad request");
+	}
+	*sep = '\0';
+
+	char* end;
+	uint64_t since = strtoull(sep + 1, &end, 10);
+	long limit = strtol(end, NULL, 10);
+	if(limit <= 0 || limit > OBUSD_JOURNAL_DEFAULT_REPLAY_LIMIT){
+		limit = OBUSD_JOURNAL_DEFAULT_REPLAY_LIMIT;
+	}
+
+	_obusd_ReplayState state = {req, since, 0};
+	
+	int count = obusd_journalReplay(args, sep - args, since, limit, _obusd_replayChunk, &state);
+	if(count < 0){
+		//A reply may have been cut short, so the client can't be answered
+		if(state.inMessage){
+			fputs("Failed to replay journal.\n", stderr);
+			return 1;
+		}
+		return _obusd_replayReply(req, OBUSD_JOURNAL_REPLAY_PREFIX "error replay failed");
+	}
+
+	char reply[64];
+	snprintf(reply, sizeof(reply), OBUSD_JOURNAL_REPLAY_PREFIX "end %llu", (unsigned long long)state.next);
+	return _obusd_replayReply(req, reply);
+}
+
+unsigned char obusd_journalIsReplay(const char* data, size_t len){
+	size_t prefixLen = strlen(OBUSD_JOURNAL_REPLAY_PREFIX);
+	return len >= prefixLen && memcmp(data, OBUSD_JOURNAL_REPLAY_PREFIX, prefixLen) == 0;
+}
+
+//Answers the replay commands the main thread passes on, as a worker would
+static void* _obusd_journalReplayMain(void* vdSock){
+	void* zmq_req = vdSock;
+	
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	while(1){
+		if(obusd_handleRequest(&msg, zmq_req, NULL, 0) != 0){
+			obusd_log(OBUSD_LOG_ERROR, "Journal replays stopped");
+			break;
+		}
+	}
+
+	zmq_msg_close(&msg);
+	zmq_close(zmq_req);
+	
+	return NULL;
+}
+
+//Starts the replay thread, on a DEALER connected to OBUSD_JOURNAL_REPLAY_ENDPOINT
+unsigned char obusd_journalStartReplayer(void* zmq_ctx){
+	void* zmq_req = zmq_socket(zmq_ctx, ZMQ_DEALER);
+	if(!zmq_req){
+		return 1;
+	}
+
+	if(zmq_connect(zmq_req, OBUSD_JOURNAL_REPLAY_ENDPOINT) != 0){
+		fprintf(stderr, "Failed to connect %s\n", OBUSD_JOURNAL_REPLAY_ENDPOINT);
+		zmq_close(zmq_req);
+		return 1;
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_journalReplayMain, zmq_req) != 0){
+		zmq_close(zmq_req);
+		return 1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
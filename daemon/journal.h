@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_JOURNAL_H_
+#define OBUSD_JOURNAL_H_
+
+#include "obusd.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zmq.h>
+
+#define OBUSD_JOURNAL_MAGIC 0x314a424f
+//Set on every chunk of a chunked message but the last
+#define OBUSD_JOURNAL_MORE 1
+
+#define OBUSD_JOURNAL_DEFAULT_SEGMENT_MB 64
+#define OBUSD_JOURNAL_DEFAULT_FLUSH_MS 10
+//Most messages a single replay request gets back
+#define OBUSD_JOURNAL_DEFAULT_REPLAY_LIMIT 1000
+
+//Requests starting with this are replay commands, not messages to publish
+#define OBUSD_JOURNAL_REPLAY_PREFIX "$replay:"
+
+//The main thread binds a DEALER here and passes replay commands on to it
+#define OBUSD_JOURNAL_REPLAY_ENDPOINT "inproc://obusd-journal-replay"
+//The main thread binds a PULL here and passes the answers of synced messages on
+#define OBUSD_JOURNAL_ACK_ENDPOINT "inproc://obusd-journal-acks"
+
+/*
+ * Each record is this header, the topic, then the chunk's bytes, padded
+ * to a multiple of 8. Records are in host byte order, a journal isn't
+ * meant to move between machines.
+ */
+typedef struct obusd_JournalRecord{
+	uint32_t magic;
+	uint32_t len;
+	uint64_t seq;
+	int64_t time;
+	uint16_t topicLen;
+	uint16_t flags;
+	uint32_t reserved;
+} obusd_JournalRecord;
+
+//Called for every chunk replayed, with OBUSD_JOURNAL_MORE set as journaled
+typedef unsigned char (*obusd_JournalReplayFn)(const obusd_JournalRecord* rec, const char* data, void* ud);
+
+unsigned char obusd_journalOpen(const char* dir, int segmentMb, int flushMs, int maxSegments);
+unsigned char obusd_journalStart(void* zmq_ctx);
+unsigned char obusd_journalEnabled();
+const char* obusd_journalFailure();
+
+unsigned char obusd_journalAppend(zmq_msg_t* msg, obusd_Request* req);
+unsigned char obusd_journalAppendEnvelope(obusd_Request* req);
+unsigned char obusd_journalAck(obusd_Request* req, const char* ack);
+int obusd_journalReplay(const char* topic, size_t topicLen, uint64_t since, int limit, obusd_JournalReplayFn fn, void* ud);
+unsigned char obusd_journalIsReplay(const char* data, size_t len);
+unsigned char obusd_journalHandleReplay(obusd_Request* req, const char* cmd, size_t len);
+unsigned char obusd_journalStartReplayer(void* zmq_ctx);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+/*
+ * Log lines go through a bounded lock-free ring (Vyukov's MPMC queue, used
+ * here with a single consumer). Any thread may log without blocking; a
+ * background thread drains the ring to stdout. When the ring is full, lines
+ * are dropped and counted rather than stalling the caller.
+ *
+ * Once the ring is empty, the background thread flushes what it wrote and
+ * waits on obusd_logWake. It sets obusd_logSleeping first and looks at the
+ * ring again, and a logging thread only takes the lock to wake it when it
+ * sees that set, so logging stays lock-free while lines keep coming.
+ */
+typedef struct obusd_LogEntry{
+	atomic_size_t seq;
+	int level;
+	int len;
+	char text[OBUSD_LOG_LINE_LEN];
+} obusd_LogEntry;
+
+atomic_int obusd_logLevel = OBUSD_LOG_INFO;
+atomic_int obusd_logSample = 1;
+
+static obusd_LogEntry* obusd_logRing = NULL;
+static size_t obusd_logMask = 0;
+static atomic_size_t obusd_logHead;
+static size_t obusd_logTail = 0;
+static atomic_ulong obusd_logDropped;
+
+static pthread_mutex_t obusd_logWakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t obusd_logWake = PTHREAD_COND_INITIALIZER;
+static atomic_int obusd_logSleeping = 0;
+
+static __thread unsigned int obusd_logSampleCount = 0;
+
+static const char* obusd_logLevelNames[] = {"error", "warn", "info", "debug", "trace"};
+
+int obusd_logLevelFromName(const char* name){
+	int i;
+	for(i = 0; i <= OBUSD_LOG_TRACE; i++){
+		if(strcmp(name, obusd_logLevelNames[i]) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+//Accepts either "N" or "1/N", meaning one line in N is kept
+int obusd_logSampleFromString(const char* str){
+	const char* slash = strchr(str, '/');
+	if(slash){
+		if(atoi(str) != 1){
+			return -1;
+		}
+		str = slash + 1;
+	}
+
+	int n = atoi(str);
+	if(n < 1){
+		return -1;
+	}
+	return n;
+}
+
+//Whether the next line to be written is ready
+static unsigned char _obusd_logReady(){
+	obusd_LogEntry* ent = &obusd_logRing[obusd_logTail & obusd_logMask];
+	return atomic_load_explicit(&ent->seq, memory_order_acquire) == obusd_logTail + 1;
+}
+
+static void* _obusd_logMain(void* unused){
+	unsigned long reportedDrops = 0;
+	unsigned char written = 0;
+	
+	while(1){
+		if(!_obusd_logReady()){
+			unsigned long drops = atomic_load_explicit(&obusd_logDropped, memory_order_relaxed);
+			if(drops != reportedDrops){
+				printf("[warn] %lu log lines dropped\n", drops - reportedDrops);
+				reportedDrops = drops;
+				written = 1;
+			}
+
+			if(written){
+				fflush(stdout);
+				written = 0;
+				continue;
+			}
+
+			pthread_mutex_lock(&obusd_logWakeLock);
+			atomic_store(&obusd_logSleeping, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			while(!_obusd_logReady()){
+				pthread_cond_wait(&obusd_logWake, &obusd_logWakeLock);
+			}
+			atomic_store(&obusd_logSleeping, 0);
+			pthread_mutex_unlock(&obusd_logWakeLock);
+			continue;
+		}
+
+		obusd_LogEntry* ent = &obusd_logRing[obusd_logTail & obusd_logMask];
+		printf("[%s] %.*s\n", obusd_logLevelNames[ent->level], ent->len, ent->text);
+		written = 1;
+
+		atomic_store_explicit(&ent->seq, obusd_logTail + obusd_logMask + 1, memory_order_release);
+		obusd_logTail++;
+	}
+
+	return NULL;
+}
+
+//ringSize is rounded up to a power of two
+unsigned char obusd_logStart(int ringSize){
+	size_t size = 1;
+	while(size < ringSize){
+		size <<= 1;
+	}
+
+	obusd_logRing = malloc(sizeof(obusd_LogEntry) * size);
+	if(!obusd_logRing){
+		return 1;
+	}
+	obusd_logMask = size - 1;
+
+	size_t i;
+	for(i = 0; i < size; i++){
+		atomic_init(&obusd_logRing[i].seq, i);
+	}
+	atomic_init(&obusd_logHead, 0);
+	atomic_init(&obusd_logDropped, 0);
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_logMain, NULL) != 0){
+		return 1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+//Per-thread 1-in-obusd_logSample filter for high volume lines
+unsigned char obusd_logSampled(){
+	int sample = atomic_load_explicit(&obusd_logSample, memory_order_relaxed);
+	if(sample <= 1){
+		return 1;
+	}
+	
+	if(++obusd_logSampleCount >= (unsigned int)sample){
+		obusd_logSampleCount = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void obusd_log(int level, const char* fmt, ...){
+	if(!obusd_logEnabled(level)){
+		return;
+	}
+
+	if(!obusd_logRing){
+		va_list args;
+		va_start(args, fmt);
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		fputc('\n', stderr);
+		return;
+	}
+
+	obusd_LogEntry* ent;
+	size_t pos = atomic_load_explicit(&obusd_logHead, memory_order_relaxed);
+	
+	while(1){
+		ent = &obusd_logRing[pos & obusd_logMask];
+		size_t seq = atomic_load_explicit(&ent->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if(diff == 0){
+			if(atomic_compare_exchange_weak_explicit(&obusd_logHead, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}else if(diff < 0){
+			atomic_fetch_add_explicit(&obusd_logDropped, 1, memory_order_relaxed);
+			return;
+		}else{
+			pos = atomic_load_explicit(&obusd_logHead, memory_order_relaxed);
+		}
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(ent->text, sizeof(ent->text), fmt, args);
+	va_end(args);
+
+	if(len < 0){
+		len = 0;
+	}else if(len >= sizeof(ent->text)){
+		len = sizeof(ent->text) - 1;
+	}
+	
+	ent->level = level;
+	ent->len = len;
+
+	atomic_store_explicit(&ent->seq, pos + 1, memory_order_release);
+
+	//Pairs with the fence in _obusd_logMain, so either it sees the line or this sees it sleeping
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&obusd_logSleeping, memory_order_relaxed)){
+		pthread_mutex_lock(&obusd_logWakeLock);
+		pthread_cond_signal(&obusd_logWake);
+		pthread_mutex_unlock(&obusd_logWakeLock);
+	}
+}
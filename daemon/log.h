@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_LOG_H_
+#define OBUSD_LOG_H_
+
+#include <stdatomic.h>
+
+#define OBUSD_LOG_ERROR 0
+#define OBUSD_LOG_WARN 1
+#define OBUSD_LOG_INFO 2
+#define OBUSD_LOG_DEBUG 3
+//Every routed message
+#define OBUSD_LOG_TRACE 4
+
+//Longer lines are truncated
+#define OBUSD_LOG_LINE_LEN 256
+#define OBUSD_LOG_DEFAULT_RING_SIZE 4096
+
+//Set by the main thread, also on a reload, and read by every thread
+extern atomic_int obusd_logLevel;
+extern atomic_int obusd_logSample;
+
+//Cheap enough to guard anything on the hot path
+#define obusd_logEnabled(level) ((level) <= atomic_load_explicit(&obusd_logLevel, memory_order_relaxed))
+
+int obusd_logLevelFromName(const char* name);
+int obusd_logSampleFromString(const char* str);
+
+unsigned char obusd_logStart(int ringSize);
+unsigned char obusd_logSampled();
+void obusd_log(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
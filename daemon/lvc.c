@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "lvc.h"
+#include "obus.h"
+#include "obusd.h"
+#include "seq.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <glib.h>
+
+typedef struct obusd_LvcEntry{
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	size_t topicLen;
+	uint64_t seq;
+	unsigned char enveloped;
+	obus_Envelope envelope;
+	//Copies of the message's chunks, sharing their content with the originals
+	zmq_msg_t** chunks;
+	int chunkCount;
+	size_t bytes;
+	//Its place in obusd_lvcOrder
+	GList* link;
+} obusd_LvcEntry;
+
+//0 while the cache is off. Changed with obusd_lvcLock held
+static atomic_int obusd_lvcMaxTopics = 0;
+static size_t obusd_lvcMaxBytes = 0;
+
+/*
+ * Written by whichever thread published a topic's message last, and read
+ * by the main thread to serve subscribers. obusd_lvcOrder has the most
+ * recently updated topic at its head.
+ */
+static pthread_mutex_t obusd_lvcLock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable* obusd_lvcTopics = NULL;
+static GQueue* obusd_lvcOrder = NULL;
+static size_t obusd_lvcBytes = 0;
+
+//The message this thread is in the middle of, until its last chunk
+static __thread obusd_LvcEntry* obusd_lvcPending = NULL;
+
+static void _obusd_lvcFree(obusd_LvcEntry* entry){
+	if(!entry){
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < entry->chunkCount; i++){
+		zmq_msg_close(entry->chunks[i]);
+		free(entry->chunks[i]);
+	}
+	free(entry->chunks);
+	free(entry);
+}
+
+void obusd_lvcStart(int maxTopics, int maxMb){
+	obusd_lvcTopics = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)_obusd_lvcFree);
+	obusd_lvcOrder = g_queue_new();
+	
+	atomic_store(&obusd_lvcMaxTopics, maxTopics > 0 ? maxTopics : 0);
+	obusd_lvcMaxBytes = (size_t)maxMb * 1024 * 1024;
+}
+
+unsigned char obusd_lvcEnabled(){
+	return atomic_load_explicit(&obusd_lvcMaxTopics, memory_order_relaxed) > 0;
+}
+
+//Called with obusd_lvcLock held
+static void _obusd_lvcRemove(obusd_LvcEntry* entry){
+	obusd_lvcBytes -= entry->bytes;
+	g_queue_delete_link(obusd_lvcOrder, entry->link);
+	g_hash_table_remove(obusd_lvcTopics, entry->topic);
+}
+
+//Called with obusd_lvcLock held
+static void _obusd_lvcEvict(){
+	while(g_queue_get_length(obusd_lvcOrder) > (guint)obusd_lvcMaxTopics || obusd_lvcBytes > obusd_lvcMaxBytes){
+		_obusd_lvcRemove(g_queue_peek_tail(obusd_lvcOrder));
+	}
+}
+
+//Changes the cache's limits, such as on a reload. 0 topics turns it off, emptying it
+void obusd_lvcResize(int maxTopics, int maxMb){
+	pthread_mutex_lock(&obusd_lvcLock);
+	
+	atomic_store(&obusd_lvcMaxTopics, maxTopics > 0 ? maxTopics : 0);
+	obusd_lvcMaxBytes = (size_t)maxMb * 1024 * 1024;
+	_obusd_lvcEvict();
+	
+	pthread_mutex_unlock(&obusd_lvcLock);
+}
+
+static void _obusd_lvcCommit(obusd_LvcEntry* entry){
+	pthread_mutex_lock(&obusd_lvcLock);
+
+	obusd_LvcEntry* old = g_hash_table_lookup(obusd_lvcTopics, entry->topic);
+	if(old){
+		_obusd_lvcRemove(old);
+	}
+
+	g_hash_table_insert(obusd_lvcTopics, entry->topic, entry);
+	g_queue_push_head(obusd_lvcOrder, entry);
+	entry->link = obusd_lvcOrder->head;
+	obusd_lvcBytes += entry->bytes;
+
+	_obusd_lvcEvict();
+	
+	pthread_mutex_unlock(&obusd_lvcLock);
+}
+
+/*
+ * Keeps a copy of one chunk of the message being published, which
+ * replaces its topic's cached message once the last chunk is in. Caching
+ * is best effort, a message that can't be kept is simply not cached.
+ */
+void obusd_lvcAppend(zmq_msg_t* msg, obusd_Request* req){
+	if(!obusd_lvcEnabled()){
+		return;
+	}
+	
+	if(req->first){
+		//Left over from a request that failed part way
+		_obusd_lvcFree(obusd_lvcPending);
+		obusd_lvcPending = NULL;
+
+		//Truncated topics would overwrite each other's messages
+		if(req->topicLen >= OBUSD_MAX_TOPIC_LEN){
+			return;
+		}
+
+		obusd_lvcPending = calloc(1, sizeof(obusd_LvcEntry));
+		if(!obusd_lvcPending){
+			return;
+		}
+		
+		memcpy(obusd_lvcPending->topic, req->topic, req->topicLen);
+		obusd_lvcPending->topicLen = req->topicLen;
+		obusd_lvcPending->seq = req->seq;
+		obusd_lvcPending->enveloped = req->enveloped;
+		obusd_lvcPending->envelope = req->envelope;
+		obusd_lvcPending->bytes = sizeof(obusd_LvcEntry);
+	}
+
+	obusd_LvcEntry* entry = obusd_lvcPending;
+	if(!entry){
+		return;
+	}
+	
+	zmq_msg_t** chunks = realloc(entry->chunks, sizeof(zmq_msg_t*) * (entry->chunkCount + 1));
+	if(chunks){
+		entry->chunks = chunks;
+		chunks[entry->chunkCount] = malloc(sizeof(zmq_msg_t));
+	}
+	
+	//Nor is a message that would push everything else out on its own
+	entry->bytes += zmq_msg_size(msg);
+	if(!chunks || !chunks[entry->chunkCount] || entry->bytes > obusd_lvcMaxBytes){
+		if(chunks){
+			free(chunks[entry->chunkCount]);
+		}
+		_obusd_lvcFree(entry);
+		obusd_lvcPending = NULL;
+		return;
+	}
+
+	zmq_msg_init(chunks[entry->chunkCount]);
+	zmq_msg_copy(chunks[entry->chunkCount], msg);
+	entry->chunkCount++;
+
+	if(!req->more){
+		obusd_lvcPending = NULL;
+		_obusd_lvcCommit(entry);
+	}
+}
+
+static unsigned char _obusd_lvcMatches(obusd_LvcEntry* entry, const char* prefix, size_t prefixLen){
+	zmq_msg_t* first = entry->chunks[0];
+	return zmq_msg_size(first) >= prefixLen && memcmp(zmq_msg_data(first), prefix, prefixLen) == 0;
+}
+
+//A copy of entry, sharing its chunks' content, to use once the lock is released
+static obusd_LvcEntry* _obusd_lvcClone(obusd_LvcEntry* entry){
+	obusd_LvcEntry* clone = malloc(sizeof(obusd_LvcEntry));
+	if(!clone){
+		return NULL;
+	}
+	
+	*clone = *entry;
+	clone->link = NULL;
+	clone->chunkCount = 0;
+	clone->chunks = malloc(sizeof(zmq_msg_t*) * entry->chunkCount);
+	if(!clone->chunks){
+		free(clone);
+		return NULL;
+	}
+
+	int i;
+	for(i = 0; i < entry->chunkCount; i++){
+		clone->chunks[i] = malloc(sizeof(zmq_msg_t));
+		if(!clone->chunks[i]){
+			_obusd_lvcFree(clone);
+			return NULL;
+		}
+		zmq_msg_init(clone->chunks[i]);
+		zmq_msg_copy(clone->chunks[i], entry->chunks[i]);
+		clone->chunkCount++;
+	}
+	return clone;
+}
+
+/*
+ * Copies out the cached messages whose first frame starts with prefix,
+ * oldest first, the order they were published in. The lock is only held
+ * while copying, so nothing is sent with it held. Returns NULL if out of
+ * memory.
+ */
+static GPtrArray* _obusd_lvcCollect(const char* prefix, size_t prefixLen){
+	GPtrArray* entries = g_ptr_array_new_with_free_func((GDestroyNotify)_obusd_lvcFree);
+	
+	pthread_mutex_lock(&obusd_lvcLock);
+
+	GList* link;
+	for(link = obusd_lvcOrder->tail; link; link = link->prev){
+		obusd_LvcEntry* entry = link->data;
+		if(!_obusd_lvcMatches(entry, prefix, prefixLen)){
+			continue;
+		}
+		
+		obusd_LvcEntry* clone = _obusd_lvcClone(entry);
+		if(!clone){
+			pthread_mutex_unlock(&obusd_lvcLock);
+			g_ptr_array_free(entries, 1);
+			return NULL;
+		}
+		g_ptr_array_add(entries, clone);
+	}
+
+	pthread_mutex_unlock(&obusd_lvcLock);
+	return entries;
+}
+
+/*
+ * Calls fn with every cached message prefix matches, oldest first, as it
+ * was first published but marked as cached: [chunk][obus_SeqHeader]
+ * [chunks...], or [topic][obus_Envelope][payload...]. fn takes the frames
+ * over. Returns 1 if out of memory.
+ */
+unsigned char obusd_lvcEach(const char* prefix, size_t prefixLen, obusd_LvcFn fn, void* ud){
+	if(!obusd_lvcEnabled()){
+		return 0;
+	}
+	
+	GPtrArray* entries = _obusd_lvcCollect(prefix, prefixLen);
+	if(!entries){
+		return 1;
+	}
+
+	guint e;
+	for(e = 0; e < entries->len; e++){
+		obusd_LvcEntry* entry = g_ptr_array_index(entries, e);
+		
+		int frameCount = entry->chunkCount + 1;
+		zmq_msg_t* frames = malloc(sizeof(zmq_msg_t) * frameCount);
+		if(!frames){
+			g_ptr_array_free(entries, 1);
+			return 1;
+		}
+
+		zmq_msg_init(&frames[0]);
+		zmq_msg_move(&frames[0], entry->chunks[0]);
+
+		if(entry->enveloped){
+			obus_Envelope env = entry->envelope;
+			env.flags |= OBUS_ENVELOPE_CACHED;
+			
+			zmq_msg_init_size(&frames[1], sizeof(env));
+			memcpy(zmq_msg_data(&frames[1]), &env, sizeof(env));
+		}else{
+			obus_SeqHeader hdr;
+			obusd_seqHeaderInit(&hdr, entry->seq, OBUS_SEQ_CACHED);
+			
+			zmq_msg_init_size(&frames[1], sizeof(hdr));
+			memcpy(zmq_msg_data(&frames[1]), &hdr, sizeof(hdr));
+		}
+
+		int i;
+		for(i = 1; i < entry->chunkCount; i++){
+			zmq_msg_init(&frames[i + 1]);
+			zmq_msg_move(&frames[i + 1], entry->chunks[i]);
+		}
+
+		fn(frames, frameCount, entry->topic, entry->topicLen, ud);
+	}
+
+	g_ptr_array_free(entries, 1);
+	return 0;
+}
+
+unsigned char obusd_lvcIsCommand(const char* data, size_t len){
+	size_t prefixLen = strlen(OBUSD_LVC_SNAPSHOT_PREFIX);
+	return len >= prefixLen && memcmp(data, OBUSD_LVC_SNAPSHOT_PREFIX, prefixLen) == 0;
+}
+
+static unsigned char _obusd_lvcReplyEntry(obusd_Request* req, obusd_LvcEntry* entry){
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+
+	void* sock = req->zmq_resp;
+	
+	char head[32];
+	int headLen = snprintf(head, sizeof(head), OBUSD_LVC_SNAPSHOT_PREFIX "%llu", (unsigned long long)entry->seq);
+	if(zmq_send(sock, head, headLen, ZMQ_SNDMORE) < 0){
+		return 1;
+	}
+
+	//Enveloped messages are journaled as [topic][envelope][payload]..., so replies match replay's
+	int i;
+	for(i = 0; i < entry->chunkCount; i++){
+		int more = i + 1 < entry->chunkCount;
+		
+		zmq_msg_t frame;
+		zmq_msg_init(&frame);
+		zmq_msg_copy(&frame, entry->chunks[i]);
+
+		int r = zmq_msg_send(&frame, sock, more || (i == 0 && entry->enveloped) ? ZMQ_SNDMORE : 0);
+		zmq_msg_close(&frame);
+		if(r < 0){
+			return 1;
+		}
+
+		if(i == 0 && entry->enveloped){
+			if(zmq_send(sock, &entry->envelope, sizeof(obus_Envelope), more ? ZMQ_SNDMORE : 0) < 0){
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static unsigned char _obusd_lvcReply(obusd_Request* req, const char* reply){
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+	if(zmq_send(req->zmq_resp, reply, strlen(reply), 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+//Answers "$snapshot:<prefix>" with the cached messages matching prefix
+unsigned char obusd_lvcHandleSnapshot(obusd_Request* req, const char* cmd, size_t len){
+	if(!obusd_lvcEnabled()){
+		return _obusd_lvcReply(req, OBUSD_LVC_SNAPSHOT_PREFIX "error cache disabled");
+	}
+	
+	size_t prefixLen = strlen(OBUSD_LVC_SNAPSHOT_PREFIX);
+	const char* prefix = cmd + prefixLen;
+	size_t topicLen = len - prefixLen;
+
+	GPtrArray* entries = _obusd_lvcCollect(prefix, topicLen);
+	if(!entries){
+		return _obusd_lvcReply(req, OBUSD_LVC_SNAPSHOT_PREFIX "error out of memory");
+	}
+	
+	unsigned char r = 0;
+	
+	guint i;
+	for(i = 0; i < entries->len && r == 0; i++){
+		r = _obusd_lvcReplyEntry(req, g_ptr_array_index(entries, i));
+	}
+
+	unsigned long count = entries->len;
+	g_ptr_array_free(entries, 1);
+
+	//A reply may have been cut short, so the client can't be answered
+	if(r != 0){
+		fputs("Failed to send snapshot.\n", stderr);
+		return 1;
+	}
+
+	char reply[64];
+	snprintf(reply, sizeof(reply), OBUSD_LVC_SNAPSHOT_PREFIX "end %lu", count);
+	return _obusd_lvcReply(req, reply);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_LVC_H_
+#define OBUSD_LVC_H_
+
+#include "obusd.h"
+
+#include <stddef.h>
+
+#include <zmq.h>
+
+/*
+ * The last-value cache keeps every topic's latest message, so a new
+ * subscriber doesn't have to wait for the next one. It is off unless
+ * i:lvc_max_topics is set, which a reload may change, 0 turning it off.
+ * When it or i:lvc_max_mb is exceeded, the topics updated longest ago are
+ * evicted first.
+ *
+ * The publisher can't address one subscriber, so subscribers to it ask
+ * for a snapshot after subscribing, as obus-cli and libobus do. Queued
+ * subscribers are sent the cached messages through their own queue.
+ */
+#define OBUSD_LVC_DEFAULT_MAX_MB 64
+
+/*
+ * A client asks with "$snapshot:<prefix>" and gets back one reply per
+ * cached message whose first frame starts with prefix,
+ * ["$snapshot:<seq>"][chunks...], followed by "$snapshot:end <count>". The
+ * chunks are as $replay: returns them.
+ */
+#define OBUSD_LVC_SNAPSHOT_PREFIX "$snapshot:"
+
+void obusd_lvcStart(int maxTopics, int maxMb);
+void obusd_lvcResize(int maxTopics, int maxMb);
+unsigned char obusd_lvcEnabled();
+
+//Takes over frames, a cached message as it would be published
+typedef void (*obusd_LvcFn)(zmq_msg_t* frames, int frameCount, const char* topic, size_t topicLen, void* ud);
+
+void obusd_lvcAppend(zmq_msg_t* msg, obusd_Request* req);
+unsigned char obusd_lvcEach(const char* prefix, size_t prefixLen, obusd_LvcFn fn, void* ud);
+
+unsigned char obusd_lvcIsCommand(const char* data, size_t len);
+unsigned char obusd_lvcHandleSnapshot(obusd_Request* req, const char* cmd, size_t len);
+
+#endif
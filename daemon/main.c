@@ -20,14 +20,37 @@
 #include "config.h"
 #include "conf.h"
 #include "obus.h"
+#include "obusd.h"
+#include "batch.h"
+#include "log.h"
+#include "stats.h"
+#include "route.h"
+#include "journal.h"
+#include "seq.h"
+#include "rpc.h"
+#include "compression.h"
+#include "subs.h"
+#include "lvc.h"
+#include "fanout.h"
+#include "conflate.h"
+#include "federation.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include <glib.h>
 
 #include <zmq.h>
 
@@ -35,20 +58,1091 @@ unsigned char obusd_isVerbose = 0;
 char* obusd_confFile = NULL;
 int obusd_port = 14452;
 char* obusd_host = NULL;
+char* obusd_bindRpc = NULL;
+char* obusd_bindPub = NULL;
+char* obusd_bindStats = NULL;
+char* obusd_bindQueued = NULL;
+char* obusd_bindPeer = NULL;
+int obusd_maxMessageLen = OBUS_DEFAULT_MAX_MESSAGE_LEN;
+int obusd_threads = 1;
+int obusd_batchMax = 0;
+int obusd_batchWindow = 1000;
+atomic_int obusd_pubNoDrop = 0;
+//Whether clients may send "$reload:"
+atomic_int obusd_reloadCommand = 0;
+char* obusd_journalDir = NULL;
+int obusd_journalSegmentMb = OBUSD_JOURNAL_DEFAULT_SEGMENT_MB;
+int obusd_journalFlushMs = OBUSD_JOURNAL_DEFAULT_FLUSH_MS;
+int obusd_journalMaxSegments = 0;
+int obusd_lvcMaxTopics = 0;
+int obusd_lvcMaxMb = OBUSD_LVC_DEFAULT_MAX_MB;
+
+//Set by SIGHUP or a "$reload:" command, and acted on by the main thread
+static atomic_int obusd_reloadPending = 0;
+
+//Written to by obusd_wakeMain, and polled by the main thread
+static int obusd_wakePipe[2] = {-1, -1};
+
+//The replay thread's backend, only ever set in the main thread
+static __thread void* obusd_replayBackend = NULL;
+
+__thread obusd_Batcher* obusd_batcher = NULL;
+__thread obusd_Conflator* obusd_conflator = NULL;
+
+//Sets up the per-thread state of a thread that publishes messages
+unsigned char obusd_threadInit(){
+	if(obusd_statsThreadInit() != 0){
+		return 1;
+	}
+	
+	if(obusd_batchMax > 1){
+		obusd_batcher = obusd_batcherNew(obusd_batchMax, obusd_batchWindow);
+		if(!obusd_batcher){
+			return 1;
+		}
+	}
 
-unsigned char obus_processMessage(char* buf, int len, void* zmq_resp, void* zmq_pub){
-	puts(buf);
+	//Always there, conflate_topics may be set by a reload
+	obusd_conflator = obusd_conflatorNew();
+	if(!obusd_conflator){
+		return 1;
+	}
+	return 0;
+}
+
+//Milliseconds the calling thread may block for before it has work to do
+long obusd_threadTimeout(){
+	long timeout = obusd_conflator ? obusd_conflateTimeout(obusd_conflator) : -1;
+	if(obusd_batcher){
+		long batchTimeout = obusd_batchTimeout(obusd_batcher);
+		if(timeout < 0 || (batchTimeout >= 0 && batchTimeout < timeout)){
+			timeout = batchTimeout;
+		}
+	}
+	return timeout;
+}
+
+//Runs the calling thread's time-based work, such as flushing due batches
+unsigned char obusd_threadTick(void* zmq_pub){
+	if(obusd_batcher && obusd_batchFlushDue(obusd_batcher, zmq_pub) != 0){
+		return 1;
+	}
+	if(obusd_conflator){
+		return obusd_conflateFlushDue(obusd_conflator, zmq_pub);
+	}
+	return 0;
+}
 
-	int r = zmq_send(zmq_pub, buf, len, 0);
+/*
+ * Sends one frame of a message to the publisher. The first frame is sent
+ * without blocking: if the publisher can't take it, because i:pub_nodrop
+ * is set and a subscriber's queue is full, OBUSD_PUBLISH_DROPPED is
+ * returned and the caller should drop the whole message.
+ */
+unsigned char obusd_publishFrame(zmq_msg_t* msg, void* zmq_pub, int first, int more){
+	int flags = more ? ZMQ_SNDMORE : 0;
+	if(first){
+		flags |= ZMQ_DONTWAIT;
+	}
+	
+	int r = zmq_msg_send(msg, zmq_pub, flags);
 	if(r < 0){
+		if(first && errno == EAGAIN){
+			return OBUSD_PUBLISH_DROPPED;
+		}
 		fputs("Failed to send message.\n", stderr);
 		return 1;
 	}
+	return 0;
+}
+
+//Sends an enveloped message's envelope, which follows its topic frame
+unsigned char obusd_publishEnvelope(void* zmq_pub, const obus_Envelope* env, int more){
+	zmq_msg_t frame;
+	zmq_msg_init_size(&frame, sizeof(obus_Envelope));
+	memcpy(zmq_msg_data(&frame), env, sizeof(obus_Envelope));
+
+	unsigned char r = obusd_publishFrame(&frame, zmq_pub, 0, more);
+	zmq_msg_close(&frame);
+	
+	return r;
+}
+
+/*
+ * Forwards a received message chunk to the publisher socket without copying
+ * it. On success, ownership of the chunk's content moves to the publisher
+ * and msg is left empty, ready to be received into again. Large messages
+ * arrive as several chunks, so the daemon only ever holds a single chunk
+ * at a time.
+ *
+ * With batching enabled, single-chunk messages are queued on their topic's
+ * batch instead, and chunked messages flush it first to stay in order.
+ * A batch is published under its bare topic, so messages of a topic
+ * someone subscribes to more narrowly than that are sent on their own.
+ * Messages of topics in conflate_topics are held by the thread's
+ * conflator instead, see conflate.h.
+ *
+ * Every message takes its topic's next sequence number, which subscribers
+ * use to notice messages they missed.
+ *
+ * Messages nobody subscribes to are still numbered, journaled and cached,
+ * so they can be replayed or served later, but are otherwise dropped on
+ * the spot.
+ */
+unsigned char obus_processMessage(zmq_msg_t* msg, obusd_Request* req){
+	if(req->first){
+		req->unwatched = !obusd_subsMatch(zmq_msg_data(msg), zmq_msg_size(msg), req->topicLen, obusd_batcher ? &req->narrowed : NULL);
+		
+		if(!req->unwatched && obusd_logEnabled(OBUSD_LOG_TRACE) && obusd_logSampled()){
+			obusd_log(OBUSD_LOG_TRACE, "%.*s", (int)zmq_msg_size(msg), (char*)zmq_msg_data(msg));
+		}
+		
+		req->seq = obusd_seqNext(req->topic, req->topicLen);
+
+		if(req->enveloped){
+			if(req->forwarded){
+				req->envelope.flags |= OBUS_ENVELOPE_FORWARDED;
+			}
+			req->envelope.seq = obus_htonll(req->seq);
+			if(req->envelope.timestamp == 0){
+				req->envelope.timestamp = obus_htonll(g_get_real_time());
+			}
+		}
+	}
+
+	if(obusd_journalEnabled()){
+		if(obusd_journalAppend(msg, req) != 0 ||
+		   (req->first && req->enveloped && obusd_journalAppendEnvelope(req) != 0)){
+			fputs("Failed to journal message.\n", stderr);
+			return 1;
+		}
+	}
+
+	obusd_lvcAppend(msg, req);
+
+	//Content filters match on the JSON of text messages
+	if(req->first && !req->more && !req->enveloped && obusd_routeActive()){
+		if(obusd_routeMessage(msg, req) != 0){
+			return 1;
+		}
+	}
+
+	//Content filters are subscribed to separately, so those are still routed
+	if(req->unwatched){
+		return 0;
+	}
+
+	//Conflated topics are held back, after anything batched before them
+	if(obusd_conflator && req->first){
+		if(obusd_conflateStart(obusd_conflator, req) != 0){
+			return 1;
+		}
+		
+		if(req->conflated && obusd_batcher && obusd_batchFlushTopic(obusd_batcher, req) != 0){
+			return 1;
+		}
+		if(!req->conflated && obusd_conflateFlushTopic(obusd_conflator, req) != 0){
+			return 1;
+		}
+	}
+	if(req->conflated){
+		return obusd_conflateAdd(obusd_conflator, msg, req);
+	}
+
+	//Batches are keyed on the topic, so a truncated one can't be batched
+	if(obusd_batcher && req->first && req->topicLen < OBUSD_MAX_TOPIC_LEN){
+		//Batches have nowhere to mark forwarded messages, and their topic
+		//frame wouldn't match narrower subscriptions
+		if(!req->more && !req->enveloped && !req->forwarded && !req->narrowed){
+			return obusd_batchAdd(obusd_batcher, msg, req);
+		}
+		
+		if(obusd_batchFlushTopic(obusd_batcher, req) != 0){
+			return 1;
+		}
+	}
+
+	if(req->dropped){
+		return 0;
+	}
+
+	//The sequence number, or the envelope holding it, goes out right after the first chunk
+	unsigned char r = obusd_publishFrame(msg, req->zmq_pub, req->first, req->first || req->more);
+	if(r == OBUSD_PUBLISH_DROPPED){
+		req->dropped = 1;
+		obusd_statsDrop(req->topic, req->topicLen, 1);
+		return 0;
+	}else if(r != 0){
+		return 1;
+	}
+
+	if(req->first && req->enveloped){
+		if(obusd_publishEnvelope(req->zmq_pub, &req->envelope, req->more) != 0){
+			return 1;
+		}
+	}else if(req->first){
+		if(obusd_publishSeq(req->zmq_pub, req->seq, req->forwarded ? OBUS_SEQ_FORWARDED : 0, req->more) != 0){
+			return 1;
+		}
+	}
+
+	if(!req->more){
+		obusd_statsOut(req->topic, req->topicLen, req->bytes, g_get_monotonic_time() - req->receivedAt);
+	}
 	
 	return 0;
 }
 
-int main(int argc, char* argv[]){
+/*
+ * Wakes the main thread from its poll to look at what changed, such as
+ * the journal failing. Safe to call from any thread or a signal handler.
+ */
+void obusd_wakeMain(){
+	if(obusd_wakePipe[1] >= 0){
+		char byte = 0;
+		//A full pipe will wake the main thread anyway
+		ssize_t r = write(obusd_wakePipe[1], &byte, 1);
+		(void)r;
+	}
+}
+
+//Whether a request's payload is a command to the daemon, not a message
+static unsigned char obusd_isCommand(const char* data, size_t len){
+	return len > 0 && data[0] == OBUS_COMMAND_MARKER;
+}
+
+//Passes a replay command on to the replay thread, which answers it
+static unsigned char obusd_forwardReplay(zmq_msg_t* msg, obusd_Request* req){
+	zmq_msg_t identity;
+	zmq_msg_init(&identity);
+	zmq_msg_copy(&identity, &req->identity);
+
+	int r = zmq_msg_send(&identity, obusd_replayBackend, ZMQ_SNDMORE);
+	if(r >= 0 && req->delimited){
+		r = zmq_send(obusd_replayBackend, "", 0, ZMQ_SNDMORE);
+	}
+	if(r >= 0){
+		zmq_msg_t cmd;
+		zmq_msg_init(&cmd);
+		zmq_msg_copy(&cmd, msg);
+		
+		r = zmq_msg_send(&cmd, obusd_replayBackend, 0);
+		if(r < 0){
+			zmq_msg_close(&cmd);
+		}
+	}else{
+		zmq_msg_close(&identity);
+	}
+	
+	if(r < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Starts a reply to the sender of req, addressed with its identity and
+ * followed by the empty delimiter if the request had one. The caller
+ * sends the rest of the reply's frames.
+ */
+unsigned char obusd_replyHead(obusd_Request* req){
+	zmq_msg_t identity;
+	zmq_msg_init(&identity);
+	zmq_msg_copy(&identity, &req->identity);
+
+	int r = zmq_msg_send(&identity, req->zmq_resp, ZMQ_SNDMORE);
+	if(r >= 0 && req->delimited){
+		r = zmq_send(req->zmq_resp, "", 0, ZMQ_SNDMORE);
+	}
+	if(r < 0){
+		zmq_msg_close(&identity);
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+//Handles a request whose first chunk, msg, is a command, reading the rest
+static unsigned char obusd_handleCommand(zmq_msg_t* msg, obusd_Request* req){
+	const char* data = zmq_msg_data(msg);
+	size_t len = zmq_msg_size(msg);
+	
+	if(obusd_rpcIsCommand(data, len)){
+		return obusd_rpcHandle(msg, req);
+	}
+	if(obusd_compressionIsCommand(data, len)){
+		return obusd_compressionHandle(req);
+	}
+
+	unsigned char r;
+	if(obusd_lvcIsCommand(data, len)){
+		r = obusd_lvcHandleSnapshot(req, data, len);
+	}else if(len >= strlen(OBUSD_RELOAD_PREFIX) && memcmp(data, OBUSD_RELOAD_PREFIX, strlen(OBUSD_RELOAD_PREFIX)) == 0){
+		//Anyone who can reach the daemon could send it, so it is off unless configured
+		const char* answer = OBUSD_RELOAD_PREFIX "error not allowed";
+		if(atomic_load(&obusd_reloadCommand)){
+			//The main thread does the reloading
+			atomic_store(&obusd_reloadPending, 1);
+			obusd_wakeMain();
+			answer = OBUSD_RELOAD_PREFIX "queued";
+		}
+		
+		r = obusd_replyHead(req);
+		if(r == 0 && zmq_send(req->zmq_resp, answer, strlen(answer), 0) < 0){
+			fputs("Failed to send message.\n", stderr);
+			r = 1;
+		}
+	}else if(obusd_journalIsReplay(data, len)){
+		//The main thread has the replay thread answer it
+		r = obusd_replayBackend ? obusd_forwardReplay(msg, req) : obusd_journalHandleReplay(req, data, len);
+	}else{
+		r = obusd_replyHead(req);
+		if(r == 0 && zmq_send(req->zmq_resp, OBUSD_UNKNOWN_COMMAND, strlen(OBUSD_UNKNOWN_COMMAND), 0) < 0){
+			fputs("Failed to send message.\n", stderr);
+			r = 1;
+		}
+	}
+	if(r != 0){
+		return 1;
+	}
+
+	//Replay, snapshot and reload commands are a single frame, anything more is ignored
+	int more = zmq_msg_more(msg);
+	while(more){
+		if(zmq_msg_recv(msg, req->zmq_resp, 0) < 0){
+			return 1;
+		}
+		more = zmq_msg_more(msg);
+	}
+	return 0;
+}
+
+/*
+ * Tells a sender waiting on an answer, such as a REQ socket, what became
+ * of its message. A journaled message is only answered once the journal
+ * has synced it, so the answer means the message can still be replayed.
+ */
+static unsigned char obusd_ackPublish(obusd_Request* req){
+	char ack[64];
+	snprintf(ack, sizeof(ack), "%s %llu", req->dropped ? "publish:dropped" : "publish:ok", (unsigned long long)req->seq);
+
+	if(req->seq > 0 && !req->forwarded && obusd_journalEnabled()){
+		return obusd_journalAck(req, ack);
+	}
+
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+	if(zmq_send(req->zmq_resp, ack, strlen(ack), 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reads one request from zmq_resp and publishes it on zmq_pub. Frame 0 is
+ * the sender's identity, followed by the empty delimiter REQ sockets add,
+ * then one or more payload chunks. zmq_resp is either the ROUTER itself or
+ * a worker's DEALER, which both see the same frames.
+ *
+ * Senders that used the empty delimiter get exactly one answer back, so
+ * REQ sockets don't hang. A payload starting with OBUS_COMMAND_MARKER,
+ * such as "$replay:" or one of the RPC prefixes in rpc.h, is a command
+ * instead, answered over zmq_resp.
+ *
+ * A payload that starts with an obus_Envelope frame is a binary message:
+ * the envelope is held back, and the topic frame after it is treated as
+ * the message's first chunk.
+ *
+ * A payload that starts with an obus_PeerHeader frame was forwarded by a
+ * peer daemon, and is never a command. Only requests fromPeers, those the
+ * federation thread injected, may carry one; anyone else's is dropped.
+ */
+unsigned char obusd_handleRequest(zmq_msg_t* msg, void* zmq_resp, void* zmq_pub, unsigned char fromPeers){
+	obusd_Request req;
+	req.zmq_resp = zmq_resp;
+	req.zmq_pub = zmq_pub;
+	zmq_msg_init(&req.identity);
+	req.delimited = 0;
+	req.first = 1;
+	req.more = 0;
+	req.dropped = 0;
+	req.topicLen = 0;
+	req.bytes = 0;
+	req.receivedAt = 0;
+	req.seq = 0;
+	req.enveloped = 0;
+	req.unwatched = 0;
+	req.conflated = 0;
+	req.forwarded = 0;
+	
+	int frameIdx = 0;
+	unsigned char ret = 0;
+	unsigned char rejected = 0;
+	unsigned char tooLong = 0;
+	
+	do{
+		int r = zmq_msg_recv(msg, zmq_resp, 0);
+		if(r < 0){
+			if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
+				fputs("Failed to receive message.\n", stderr);
+				ret = 1;
+			}else{
+				if(errno == EFSM){
+					fputs("EFSM\n", stderr);
+				}
+			}
+			break;
+		}
+
+		req.more = zmq_msg_more(msg);
+
+		if(frameIdx == 0){
+			zmq_msg_copy(&req.identity, msg);
+		}else if(frameIdx == 1 && r == 0){
+			req.delimited = 1;
+		}else{
+			if(req.first && !req.enveloped){
+				if(!req.forwarded && obus_isPeerHeader(zmq_msg_data(msg), r)){
+					if(!fromPeers){
+						obusd_log(OBUSD_LOG_DEBUG, "Dropped a peer header from a client");
+						rejected = 1;
+						break;
+					}
+					req.forwarded = 1;
+					frameIdx++;
+					continue;
+				}
+				
+				if(!req.forwarded && obusd_isCommand(zmq_msg_data(msg), r)){
+					ret = obusd_handleCommand(msg, &req);
+					break;
+				}
+
+				//Topics leading with '?' are the copies route.c publishes
+				if(!req.forwarded && r > 0 && ((char*)zmq_msg_data(msg))[0] == '?'){
+					obusd_log(OBUSD_LOG_DEBUG, "Dropped a message with a filter topic from a client");
+					rejected = 1;
+					break;
+				}
+
+				if(obus_isEnvelope(zmq_msg_data(msg), r)){
+					memcpy(&req.envelope, zmq_msg_data(msg), sizeof(obus_Envelope));
+					req.enveloped = 1;
+					frameIdx++;
+					continue;
+				}
+			}
+			
+			if(req.first){
+				req.receivedAt = g_get_monotonic_time();
+				if(req.enveloped){
+					req.topicLen = r;
+				}else{
+					req.topicLen = obus_topicLength(zmq_msg_data(msg), r);
+				}
+				//The journal can't hold a topic this long, so the message couldn't be replayed
+				if(req.topicLen >= OBUSD_MAX_TOPIC_LEN && obusd_journalEnabled()){
+					obusd_log(OBUSD_LOG_DEBUG, "Refused a message with a topic too long to journal");
+					tooLong = 1;
+					break;
+				}
+				if(req.topicLen > OBUSD_MAX_TOPIC_LEN){
+					req.topicLen = OBUSD_MAX_TOPIC_LEN;
+				}
+				memcpy(req.topic, zmq_msg_data(msg), req.topicLen);
+			}
+			req.bytes += r;
+			
+			r = obus_processMessage(msg, &req);
+			if(r != 0){
+				ret = 1;
+				break;
+			}
+			req.first = 0;
+		}
+
+		frameIdx++;
+	}while(req.more);
+
+	if(rejected){
+		if(obusd_drain(msg, zmq_resp, req.more) != 0){
+			ret = 1;
+		}else if(req.delimited){
+			req.dropped = 1;
+			ret = obusd_ackPublish(&req);
+		}
+	}
+
+	if(tooLong){
+		if(obusd_drain(msg, zmq_resp, req.more) != 0){
+			ret = 1;
+		}else if(req.delimited){
+			ret = obusd_replyHead(&req);
+			if(ret == 0 && zmq_send(zmq_resp, OBUSD_TOPIC_TOO_LONG, strlen(OBUSD_TOPIC_TOO_LONG), 0) < 0){
+				fputs("Failed to send message.\n", stderr);
+				ret = 1;
+			}
+		}
+	}
+
+	if(!req.first){
+		obusd_statsIn(req.topic, req.topicLen, req.bytes);
+
+		if(ret == 0 && req.delimited){
+			ret = obusd_ackPublish(&req);
+		}
+	}
+
+	zmq_msg_close(&req.identity);
+	return ret;
+}
+
+//Sends the first frameCount frames of a request on to, then whatever more of it there is
+static unsigned char obusd_sendFrames(zmq_msg_t* frames, int frameCount, int more, void* from, void* to){
+	unsigned char ret = 0;
+	
+	int i;
+	for(i = 0; i < frameCount; i++){
+		if(ret == 0 && zmq_msg_send(&frames[i], to, (i + 1 < frameCount || more) ? ZMQ_SNDMORE : 0) < 0){
+			fputs("Failed to send message.\n", stderr);
+			ret = 1;
+		}
+		zmq_msg_close(&frames[i]);
+	}
+
+	if(ret == 0 && more){
+		zmq_msg_t msg;
+		zmq_msg_init(&msg);
+		ret = obusd_relay(&msg, from, to);
+		zmq_msg_close(&msg);
+	}
+
+	return ret;
+}
+
+/*
+ * Passes one request from the ROUTER on to a worker. Requests are sharded
+ * on their topic, so all of a topic's messages are numbered and published
+ * in order by the same worker. Commands aren't published, so they are
+ * spread on the sender's identity instead, except for replays, which go
+ * to the journal's replay thread.
+ *
+ * Workers trust the peer headers they see, so only requests fromPeers may
+ * carry one. A client's is dropped here, answering it if it waits.
+ */
+static unsigned char obusd_shardRequest(void* zmq_resp, void** zmq_workers, unsigned char fromPeers){
+	//The identity, the empty delimiter if there is one, the peer header if
+	//the message was forwarded, the envelope if there is one, and the
+	//first chunk or topic frame
+	zmq_msg_t frames[5];
+	int frameCount = 0;
+	int more = 1;
+	unsigned char forwarded = 0;
+	unsigned char enveloped = 0;
+	unsigned char delimited = 0;
+	
+	while(more && frameCount < 5){
+		zmq_msg_init(&frames[frameCount]);
+		
+		int r = zmq_msg_recv(&frames[frameCount], zmq_resp, 0);
+		if(r < 0){
+			zmq_msg_close(&frames[frameCount]);
+			more = 0;
+			break;
+		}
+		
+		more = zmq_msg_more(&frames[frameCount]);
+		frameCount++;
+
+		if(frameCount == 1){
+			continue;
+		}
+		if(frameCount == 2 && r == 0){
+			delimited = 1;
+			continue;
+		}
+		
+		const void* data = zmq_msg_data(&frames[frameCount - 1]);
+		if(!forwarded && !enveloped && obus_isPeerHeader(data, r)){
+			forwarded = 1;
+			if(!fromPeers){
+				break;
+			}
+			continue;
+		}
+		if(enveloped || !obus_isEnvelope(data, r)){
+			break;
+		}
+		enveloped = 1;
+	}
+
+	if(frameCount == 0){
+		if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
+			fputs("Failed to receive message.\n", stderr);
+			return 1;
+		}
+		return 0;
+	}
+
+	if(forwarded && !fromPeers){
+		obusd_log(OBUSD_LOG_DEBUG, "Dropped a peer header from a client");
+		
+		unsigned char ret = 0;
+		zmq_msg_t msg;
+		zmq_msg_init(&msg);
+		if(obusd_drain(&msg, zmq_resp, more) != 0){
+			ret = 1;
+		}
+		zmq_msg_close(&msg);
+		
+		if(ret == 0 && delimited){
+			const char* ack = "publish:dropped 0";
+			if(zmq_msg_send(&frames[0], zmq_resp, ZMQ_SNDMORE) < 0 ||
+			   zmq_send(zmq_resp, "", 0, ZMQ_SNDMORE) < 0 ||
+			   zmq_send(zmq_resp, ack, strlen(ack), 0) < 0){
+				fputs("Failed to send message.\n", stderr);
+				ret = 1;
+			}
+		}
+		
+		int i;
+		for(i = 0; i < frameCount; i++){
+			zmq_msg_close(&frames[i]);
+		}
+		return ret;
+	}
+
+	zmq_msg_t* payload = &frames[frameCount - 1];
+	const char* data = zmq_msg_data(payload);
+	size_t len = zmq_msg_size(payload);
+	
+	//Replays are answered by the journal's own thread, rather than hold up a worker
+	if(!fromPeers && !forwarded && !enveloped && obusd_replayBackend && frameCount == 2 + delimited && obusd_journalIsReplay(data, len)){
+		return obusd_sendFrames(frames, frameCount, more, zmq_resp, obusd_replayBackend);
+	}
+	
+	uint32_t hash;
+	if(enveloped && frameCount > 2 + delimited + forwarded){
+		size_t topicLen = len < OBUSD_MAX_TOPIC_LEN ? len : OBUSD_MAX_TOPIC_LEN;
+		hash = obus_hash(data, topicLen);
+	}else if(frameCount > 1 + delimited + forwarded && len > 0 && (forwarded || !obusd_isCommand(data, len))){
+		size_t topicLen = obus_topicLength(data, len);
+		if(topicLen > OBUSD_MAX_TOPIC_LEN){
+			topicLen = OBUSD_MAX_TOPIC_LEN;
+		}
+		hash = obus_hash(data, topicLen);
+	}else{
+		hash = obus_hash(zmq_msg_data(&frames[0]), zmq_msg_size(&frames[0]));
+	}
+	
+	return obusd_sendFrames(frames, frameCount, more, zmq_resp, zmq_workers[hash % obusd_threads]);
+}
+
+/*
+ * Moves one message the workers published from the internal XSUB to the
+ * external XPUB, dropping it if the XPUB can't take it right now. The
+ * worker already counted the message out, so a drop is moved over to the
+ * drops, along with every message a dropped batch carries. Copies for
+ * content filters were never counted, and their drops aren't either.
+ */
+unsigned char obusd_relayPublished(zmq_msg_t* msg, void* from, void* to){
+	int frameIdx = 0;
+	int more = 0;
+	unsigned char dropped = 0;
+	
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	size_t topicLen = 0;
+	size_t firstLen = 0;
+
+	//What the worker counted out: every frame but the headers, and the topic of a batch
+	unsigned long count = 1;
+	size_t bytes = 0;
+	
+	do{
+		int r = zmq_msg_recv(msg, from, 0);
+		if(r < 0){
+			if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
+				fputs("Failed to receive message.\n", stderr);
+				return 1;
+			}
+			break;
+		}
+
+		more = zmq_msg_more(msg);
+
+		if(dropped){
+			if(frameIdx == 1 && obus_isBatchHeader(zmq_msg_data(msg), r)){
+				obus_BatchHeader* hdr = (obus_BatchHeader*)zmq_msg_data(msg);
+				count = ntohl(hdr->count);
+				bytes -= firstLen;
+			}else if(frameIdx != 1 || !(obus_isSeqHeader(zmq_msg_data(msg), r) || obus_isEnvelope(zmq_msg_data(msg), r))){
+				bytes += r;
+			}
+		}else{
+			if(frameIdx == 0){
+				topicLen = obus_topicLength(zmq_msg_data(msg), r);
+				if(topicLen > OBUSD_MAX_TOPIC_LEN){
+					topicLen = OBUSD_MAX_TOPIC_LEN;
+				}
+				memcpy(topic, zmq_msg_data(msg), topicLen);
+				firstLen = r;
+				bytes = r;
+			}
+			
+			r = obusd_publishFrame(msg, to, frameIdx == 0, more);
+			if(r == OBUSD_PUBLISH_DROPPED){
+				dropped = 1;
+			}else if(r != 0){
+				return 1;
+			}
+		}
+		
+		frameIdx++;
+	}while(more);
+
+	if(dropped && !(topicLen > 0 && topic[0] == '?')){
+		obusd_statsLost(topic, topicLen, count, bytes);
+	}
+
+	return 0;
+}
+
+/*
+ * With ZMQ_XPUB_MANUAL a subscription only takes effect once it is set
+ * here, for the subscriber it came from. Copies published for content
+ * filters lead with '?', so a subscription to everything is set as one to
+ * every other first byte, leaving those copies to filter subscribers.
+ */
+static void _obusd_applySubscription(void* zmq_pub, const char* data, int len){
+	int option = data[0] == 1 ? ZMQ_SUBSCRIBE : ZMQ_UNSUBSCRIBE;
+	if(len > 1){
+		zmq_setsockopt(zmq_pub, option, data + 1, len - 1);
+		return;
+	}
+
+	int c;
+	for(c = 0; c < 256; c++){
+		if(c != '?'){
+			char prefix = (char)c;
+			zmq_setsockopt(zmq_pub, option, &prefix, 1);
+		}
+	}
+}
+
+/*
+ * Subscriptions to everything held, and subscriptions to a single first
+ * byte, as subscribers sent them. ZeroMQ may report a catch-all going
+ * away as unsubscribes from the bytes it was set as, one at a time; those
+ * are collected here until all of them are in, and then taken as the one
+ * unsubscribe from "" the index and the peers saw subscribed. Only used
+ * by the thread reading the publisher's subscriptions.
+ */
+static int obusd_catchAlls = 0;
+static unsigned long obusd_byteSubs[256];
+static unsigned char obusd_catchAllGone[256];
+static int obusd_catchAllGoneCount = 0;
+
+/*
+ * Turns a subscription message as ZeroMQ reported it into the one the
+ * subscriber sent, so the index and peers see what was subscribed. Returns
+ * 0 when there is nothing to pass on yet.
+ */
+static unsigned char _obusd_originalSubscription(const char** data, int* len){
+	static const char catchAllUnsub = 0;
+	
+	unsigned char subscribe = (*data)[0] == 1;
+	
+	if(*len == 1){
+		if(subscribe){
+			obusd_catchAlls++;
+		}else if(obusd_catchAlls > 0){
+			obusd_catchAlls--;
+		}
+		return 1;
+	}
+	
+	unsigned char c = (unsigned char)(*data)[1];
+	if(*len != 2 || c == '?'){
+		return 1;
+	}
+
+	if(subscribe){
+		obusd_byteSubs[c]++;
+		return 1;
+	}
+
+	//A byte nobody subscribed to alone, or one while a catch-all's come back, is the catch-all's
+	if(obusd_catchAlls > 0 && !obusd_catchAllGone[c] && (obusd_byteSubs[c] == 0 || obusd_catchAllGoneCount > 0)){
+		obusd_catchAllGone[c] = 1;
+		if(++obusd_catchAllGoneCount < 255){
+			return 0;
+		}
+
+		memset(obusd_catchAllGone, 0, sizeof(obusd_catchAllGone));
+		obusd_catchAllGoneCount = 0;
+		obusd_catchAlls--;
+		
+		*data = &catchAllUnsub;
+		*len = 1;
+		return 1;
+	}
+
+	if(obusd_byteSubs[c] > 0){
+		obusd_byteSubs[c]--;
+	}
+	return 1;
+}
+
+//Records a subscription message waiting on the publisher
+void obusd_handleSubscription(zmq_msg_t* msg, void* zmq_pub){
+	int r = zmq_msg_recv(msg, zmq_pub, 0);
+	if(r > 0){
+		const char* data = zmq_msg_data(msg);
+		if(data[0] != 0 && data[0] != 1){
+			return;
+		}
+		
+		_obusd_applySubscription(zmq_pub, data, r);
+
+		if(!_obusd_originalSubscription(&data, &r)){
+			return;
+		}
+		
+		if(obusd_subsUpdate(data, r)){
+			obusd_routeSubscription(data, r);
+		}
+		obusd_federationInterest(data, r);
+	}
+}
+
+//Reads and throws away the rest of a multipart message, if there is more
+unsigned char obusd_drain(zmq_msg_t* msg, void* from, int more){
+	while(more){
+		if(zmq_msg_recv(msg, from, 0) < 0){
+			fputs("Failed to receive message.\n", stderr);
+			return 1;
+		}
+		more = zmq_msg_more(msg);
+	}
+	return 0;
+}
+
+//Moves every frame of one multipart message from one socket to another
+unsigned char obusd_relay(zmq_msg_t* msg, void* from, void* to){
+	int more = 0;
+	
+	do{
+		int r = zmq_msg_recv(msg, from, 0);
+		if(r < 0){
+			if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
+				fputs("Failed to receive message.\n", stderr);
+				return 1;
+			}
+			break;
+		}
+
+		more = zmq_msg_more(msg);
+
+		r = zmq_msg_send(msg, to, more ? ZMQ_SNDMORE : 0);
+		if(r < 0){
+			fputs("Failed to send message.\n", stderr);
+			return 1;
+		}
+	}while(more);
+
+	return 0;
+}
+
+/*
+ * Reads the settings that can change while the daemon runs, at startup
+ * and again on every reload. Returns 1 if one was invalid.
+ */
+static unsigned char obusd_readTunables(){
+	obus_ConfigEntry* ent = NULL;
+
+	ent = obus_getConfigEntry("log_level");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+			if(ent->data.str.len > 0){
+				int level = obusd_logLevelFromName(ent->data.str.str);
+				if(level >= 0){
+					obusd_logLevel = level;
+				}
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("log_sample");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer > 0){
+				obusd_logSample = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("pub_nodrop");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+		    obusd_pubNoDrop = ent->data.integer;
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("reload_command");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			obusd_reloadCommand = ent->data.integer != 0;
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("rpc_heartbeat_ms");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer > 0){
+				obusd_rpcHeartbeat = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	//Cleared if the entry is gone, but kept if it's invalid
+	ent = obus_getConfigEntry("compress_topics");
+	unsigned char r = obusd_compressionConfigure(ent);
+	obus_releaseConfigEntry(ent);
+	ent = NULL;
+
+	//0 turns the cache off
+	ent = obus_getConfigEntry("lvc_max_topics");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer >= 0){
+				obusd_lvcMaxTopics = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("lvc_max_mb");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer > 0){
+				obusd_lvcMaxMb = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("conflate_ms");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer > 0){
+				obusd_conflateMs = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("conflate_topics");
+	r |= obusd_conflateConfigure(ent);
+	obus_releaseConfigEntry(ent);
+	ent = NULL;
+
+	ent = obus_getConfigEntry("sub_queue_len");
+	if(ent){
+		if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			if(ent->data.integer > 0){
+				obusd_fanoutQueueLen = ent->data.integer;
+			}
+		}
+		obus_releaseConfigEntry(ent);
+		ent = NULL;
+	}
+
+	ent = obus_getConfigEntry("sub_policies");
+	r |= obusd_fanoutConfigure(ent);
+	obus_releaseConfigEntry(ent);
+	ent = NULL;
+
+	return r;
+}
+
+//The wake pipe makes sure a SIGHUP just before the main thread polls isn't missed
+static void obusd_onSighup(int sig){
+	atomic_store(&obusd_reloadPending, 1);
+	obusd_wakeMain();
+}
+
+//Starts the fanout for queued subscribers, if sub_queue_len asks for it and it isn't running yet
+static unsigned char obusd_startFanout(void* zmq_ctx){
+	if(obusd_fanoutQueueLen <= 0 || obusd_fanoutRunning()){
+		return 0;
+	}
+	
+	char* zmq_host_str = obus_endpoint(obusd_bindQueued, obusd_host, obusd_port+3);
+	if(!zmq_host_str){
+		return 1;
+	}
+	
+	unsigned char r = obusd_fanoutStart(zmq_ctx, zmq_host_str);
+	free(zmq_host_str);
+	return r;
+}
+
+/*
+ * Loads the configuration file again and applies the settings read by
+ * obusd_readTunables. The rest, such as endpoints and threads, only take
+ * effect on a restart. A file that can't be loaded changes nothing.
+ * zmq_pub is NULL when the publisher thread owns it, which picks up
+ * pub_nodrop itself.
+ */
+static void obusd_reload(void* zmq_ctx, void* zmq_pub){
+	if(obus_loadConfig(obusd_confFile) != 0){
+		obusd_log(OBUSD_LOG_WARN, "Failed to reload %s, keeping the current configuration", obusd_confFile);
+		return;
+	}
+	
+	if(obusd_readTunables() != 0){
+		obusd_log(OBUSD_LOG_WARN, "Invalid settings in %s were not applied", obusd_confFile);
+	}
+	if(obusd_isVerbose){
+		obusd_logLevel = OBUSD_LOG_TRACE;
+	}
+
+	obusd_lvcResize(obusd_lvcMaxTopics, obusd_lvcMaxMb);
+
+	if(obusd_startFanout(zmq_ctx) != 0){
+		obusd_log(OBUSD_LOG_WARN, "Failed to start the fanout for queued subscribers");
+	}
+
+	if(zmq_pub){
+		int noDrop = obusd_pubNoDrop != 0;
+		zmq_setsockopt(zmq_pub, ZMQ_XPUB_NODROP, &noDrop, sizeof(noDrop));
+	}
+
+	obusd_log(OBUSD_LOG_INFO, "Reloaded %s", obusd_confFile);
+}
+
+/*
+ * Runs the daemon with the given command line until it fails. zmq_ctx is
+ * the ZeroMQ context to use, or NULL for one of its own; sharing one lets
+ * clients in the same process connect over inproc://, as obus-bench does.
+ */
+int obusd_main(int argc, char* argv[], void* zmq_ctx){
 	obusd_confFile = strdup("obusd.conf");
 	obusd_host = strdup("*");
 	
@@ -59,13 +1153,18 @@ int main(int argc, char* argv[]){
 		{"port", required_argument, 0, 'p'},
         {"verbose", no_argument, 0, 'V'},
 		{"config", required_argument, 0, 'c'},
+		{"bind-rpc", required_argument, 0, 'b'},
+		{"bind-pub", required_argument, 0, 'B'},
+		{"threads", required_argument, 0, 'T'},
+		{"log-level", required_argument, 0, 'L'},
+		{"log-sample", required_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
 
     int opt_idx = 0;
 
     while(1){
-        int c = getopt_long(argc, argv, "vhVc:p:H:", long_opts, &opt_idx);
+        int c = getopt_long(argc, argv, "vhVc:p:H:b:B:T:L:S:", long_opts, &opt_idx);
 
         if(c == -1){
             break;
@@ -90,9 +1189,14 @@ int main(int argc, char* argv[]){
                 printf("Usage: %s [options]\n", argv[0]);
 				puts("   -H, --host                  Sets the host/address to bind to");
 				puts("   -p, --port                  Sets the port to bind to");
+				puts("   -b, --bind-rpc              Endpoint for requests, instead of the host and port");
+				puts("   -B, --bind-pub              Endpoint for subscribers, instead of the host and port + 1");
 				puts("   -c, --config                Uses a specified file instead of obusd.conf");
+				puts("   -T, --threads               Number of I/O and publish worker threads");
                 puts("   -v, --version               Prints version information and exits");
 				puts("   -V, --verbose               Print verbose messages throughout operation");
+				puts("   -L, --log-level             One of error, warn, info, debug or trace");
+				puts("   -S, --log-sample            Only log 1/N of the messages traced");
                 puts("   -h, --help                  Prints this help text and exits");
                 puts("");
                 puts("Options are specified by doubled hyphens and their name or by a single");
@@ -113,11 +1217,41 @@ int main(int argc, char* argv[]){
 			case 'p': {
 				obusd_port = atoi(optarg);
                 break;
+            }
+			case 'b': {
+				free(obusd_bindRpc);
+				obusd_bindRpc = strdup(optarg);
+                break;
+            }
+			case 'B': {
+				free(obusd_bindPub);
+				obusd_bindPub = strdup(optarg);
+                break;
             }
 			case 'c': {
                 free(obusd_confFile);
 				obusd_confFile = strdup(optarg);
                 break;
+            }
+			case 'T': {
+				obusd_threads = atoi(optarg);
+                break;
+            }
+			case 'L': {
+				obusd_logLevel = obusd_logLevelFromName(optarg);
+				if(obusd_logLevel < 0){
+					fprintf(stderr, "Unknown log level: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+                break;
+            }
+			case 'S': {
+				obusd_logSample = obusd_logSampleFromString(optarg);
+				if(obusd_logSample < 0){
+					fprintf(stderr, "Invalid log sample rate: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+                break;
             }
             case 'V': {
                 obusd_isVerbose = !obusd_isVerbose;
@@ -158,16 +1292,244 @@ int main(int argc, char* argv[]){
 			obus_releaseConfigEntry(ent);
 			ent = NULL;
 		}
+
+		//Full endpoints, such as ipc:///run/obus/rpc, so that services on
+		//the same machine can skip TCP altogether
+		ent = obus_getConfigEntry("bind_rpc");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+					free(obusd_bindRpc);
+				    obusd_bindRpc = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("bind_pub");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+					free(obusd_bindPub);
+				    obusd_bindPub = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("bind_stats");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+					free(obusd_bindStats);
+				    obusd_bindStats = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("bind_queued");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+					free(obusd_bindQueued);
+				    obusd_bindQueued = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("bind_peer");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+					free(obusd_bindPeer);
+					obusd_bindPeer = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("io_threads");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer > 0){
+					obusd_threads = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("batch_max");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			    obusd_batchMax = ent->data.integer;
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("batch_window_us");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer >= 0){
+					obusd_batchWindow = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("content_routing");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+			    obusd_contentRouting = ent->data.integer;
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("max_message_len");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer > 0){
+					obusd_maxMessageLen = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("journal_dir");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_STR){
+				if(ent->data.str.len > 0){
+				    obusd_journalDir = strdup(ent->data.str.str);
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("journal_segment_mb");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer > 0){
+					obusd_journalSegmentMb = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		ent = obus_getConfigEntry("journal_flush_ms");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer > 0){
+					obusd_journalFlushMs = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		//0 keeps every segment
+		ent = obus_getConfigEntry("journal_max_segments");
+		if(ent){
+			if(ent->type == OBUS_CONF_ENT_TYPE_INT){
+				if(ent->data.integer >= 0){
+					obusd_journalMaxSegments = ent->data.integer;
+				}
+			}
+			obus_releaseConfigEntry(ent);
+			ent = NULL;
+		}
+
+		if(obusd_readTunables() != 0){
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(obusd_threads < 1){
+		obusd_threads = 1;
+	}
+
+	if(obusd_isVerbose){
+		obusd_logLevel = OBUSD_LOG_TRACE;
+	}
+
+	//SIGHUP reloads the configuration. It is blocked in every thread
+	//started from here on, such as logging's, so that it is delivered to
+	//the main thread, whose handler wakes its poll through the wake pipe.
+	sigset_t hupSet;
+	sigemptyset(&hupSet);
+	sigaddset(&hupSet, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hupSet, NULL);
+
+	struct sigaction hupAction;
+	memset(&hupAction, 0, sizeof(hupAction));
+	hupAction.sa_handler = obusd_onSighup;
+	sigemptyset(&hupAction.sa_mask);
+	sigaction(SIGHUP, &hupAction, NULL);
+
+	//Other threads wake the main one through this, see obusd_wakeMain
+	if(pipe(obusd_wakePipe) != 0 ||
+	   fcntl(obusd_wakePipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+	   fcntl(obusd_wakePipe[1], F_SETFL, O_NONBLOCK) != 0){
+		fputs("Failed to create the wake pipe.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if(obusd_logStart(OBUSD_LOG_DEFAULT_RING_SIZE) != 0){
+		fputs("Failed to start logging.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if(obusd_journalDir){
+		if(obusd_journalOpen(obusd_journalDir, obusd_journalSegmentMb, obusd_journalFlushMs, obusd_journalMaxSegments) != 0){
+			return EXIT_FAILURE;
+		}
 	}
 
-	void* zmq_ctx = zmq_ctx_new();
+	//Always started, lvc_max_topics may be set by a reload
+	obusd_lvcStart(obusd_lvcMaxTopics, obusd_lvcMaxMb);
+
+	if(!zmq_ctx){
+		zmq_ctx = zmq_ctx_new();
+		zmq_ctx_set(zmq_ctx, ZMQ_IO_THREADS, obusd_threads);
+	}
+	
 	void* zmq_resp = zmq_socket(zmq_ctx, ZMQ_ROUTER);
-	void* zmq_pub = zmq_socket(zmq_ctx, ZMQ_PUB);
+	void* zmq_pub = zmq_socket(zmq_ctx, ZMQ_XPUB);
+
+	//Peers sending a chunk over the limit are disconnected by ZeroMQ,
+	//rather than having their message silently truncated.
+	int64_t maxMsgSize = obusd_maxMessageLen;
+	zmq_setsockopt(zmq_resp, ZMQ_MAXMSGSIZE, &maxMsgSize, sizeof(maxMsgSize));
 
-	//18 is tcp:// + : + 10 for port (lots of buffer, as max port is 5 digits) + 1 '\0'
-	int zmq_host_str_maxlen = 18 + strlen(obusd_host);
-	char* zmq_host_str = malloc(zmq_host_str_maxlen);
-	snprintf(zmq_host_str, zmq_host_str_maxlen-1, "tcp://%s:%i", obusd_host, obusd_port);
+	//Every subscribe and unsubscribe is reported, not just a topic's first
+	//and last, so subs.c can count subscribers, and is only applied by
+	//obusd_handleSubscription. Without VERBOSER, those of a subscriber that
+	//goes away would still only be reported for the last to hold them.
+	int manual = 1;
+	zmq_setsockopt(zmq_pub, ZMQ_XPUB_MANUAL, &manual, sizeof(manual));
+	int verboser = 1;
+	zmq_setsockopt(zmq_pub, ZMQ_XPUB_VERBOSER, &verboser, sizeof(verboser));
+
+	//By default a subscriber that falls behind silently loses messages.
+	//With pub_nodrop, the daemon sees this and counts the drops instead.
+	if(obusd_pubNoDrop){
+		int noDrop = 1;
+		zmq_setsockopt(zmq_pub, ZMQ_XPUB_NODROP, &noDrop, sizeof(noDrop));
+	}
+
+	char* zmq_host_str = obus_endpoint(obusd_bindRpc, obusd_host, obusd_port);
 		
     r = zmq_bind(zmq_resp, zmq_host_str);
 	if(r != 0){
@@ -176,7 +1538,8 @@ int main(int argc, char* argv[]){
 		return EXIT_FAILURE;
 	}
 
-	snprintf(zmq_host_str, zmq_host_str_maxlen-1, "tcp://%s:%i", obusd_host, obusd_port+1);
+	free(zmq_host_str);
+	zmq_host_str = obus_endpoint(obusd_bindPub, obusd_host, obusd_port+1);
 	
 	r = zmq_bind(zmq_pub, zmq_host_str);
 	if(r != 0){
@@ -186,46 +1549,271 @@ int main(int argc, char* argv[]){
 	}
 
 	free(zmq_host_str);
+	zmq_host_str = obus_endpoint(obusd_bindStats, obusd_host, obusd_port+2);
+	
+	r = obusd_statsStart(zmq_ctx, zmq_host_str);
+	if(r != 0){
+		free(zmq_host_str);
+		return EXIT_FAILURE;
+	}
+
+	free(zmq_host_str);
+
+	//Replays scan the journal on a thread of their own, so they don't hold
+	//up requests, and their answers are passed back like the workers'
+	void* zmq_replay = NULL;
+	
+	if(obusd_journalEnabled()){
+		zmq_replay = zmq_socket(zmq_ctx, ZMQ_DEALER);
+		
+		if(zmq_bind(zmq_replay, OBUSD_JOURNAL_REPLAY_ENDPOINT) != 0){
+			fprintf(stderr, "Failed to bind %s\n", OBUSD_JOURNAL_REPLAY_ENDPOINT);
+			return EXIT_FAILURE;
+		}
+		if(obusd_journalStartReplayer(zmq_ctx) != 0){
+			fputs("Failed to start the replay thread.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		
+		obusd_replayBackend = zmq_replay;
+	}
+
+	//Answers to journaled messages come back from the journal once synced
+	void* zmq_acks = NULL;
+
+	if(obusd_journalEnabled()){
+		zmq_acks = zmq_socket(zmq_ctx, ZMQ_PULL);
+
+		int hwm = 0;
+		zmq_setsockopt(zmq_acks, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+
+		if(zmq_bind(zmq_acks, OBUSD_JOURNAL_ACK_ENDPOINT) != 0){
+			fprintf(stderr, "Failed to bind %s\n", OBUSD_JOURNAL_ACK_ENDPOINT);
+			return EXIT_FAILURE;
+		}
+		if(obusd_journalStart(zmq_ctx) != 0){
+			fputs("Failed to start the journal.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	//Queued subscribers get their own queue, so one that falls behind only
+	//loses its own messages, as its topics' sub_policies say. The endpoint
+	//is always bound, as sub_queue_len may be set by a reload, and costs
+	//nothing until the fanout subscribes to it.
+	r = zmq_bind(zmq_pub, OBUSD_FANOUT_ENDPOINT);
+	if(r != 0){
+		fprintf(stderr, "Failed to bind %s\n", OBUSD_FANOUT_ENDPOINT);
+		return EXIT_FAILURE;
+	}
+	if(obusd_startFanout(zmq_ctx) != 0){
+		return EXIT_FAILURE;
+	}
+
+	//Peers take what is published here through a tap on the publisher, and
+	//what they forward comes in on a request socket of its own, the only
+	//one peer headers are accepted from
+	void* zmq_inject = NULL;
+	
+	obus_ConfigEntry* peers = obus_getConfigEntry("peers");
+	if(peers){
+		zmq_inject = zmq_socket(zmq_ctx, ZMQ_ROUTER);
+		
+		if(zmq_bind(zmq_pub, OBUSD_FEDERATION_TAP_ENDPOINT) != 0 || zmq_bind(zmq_inject, OBUSD_FEDERATION_INJECT_ENDPOINT) != 0){
+			fputs("Failed to bind the federation endpoints.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		
+		zmq_host_str = obus_endpoint(obusd_bindPeer, obusd_host, obusd_port+4);
+		
+		r = obusd_federationStart(zmq_ctx, zmq_host_str, peers);
+		free(zmq_host_str);
+		obus_releaseConfigEntry(peers);
+		if(r != 0){
+			return EXIT_FAILURE;
+		}
+	}
 
-	char buffer[OBUS_MAX_MESSAGE_LEN];
+	//With more than one thread, this loop only shards requests to the
+	//workers and passes back their replies. What they publish comes back
+	//through zmq_pubIn to the publisher thread, which owns the XPUB.
+	void** zmq_workers = NULL;
+	void* zmq_pubIn = NULL;
+
+	if(obusd_threads > 1){
+		//Drops are only counted at the external XPUB, so the internal hop
+		//must not lose anything
+		int hwm = 0;
+		zmq_pubIn = zmq_socket(zmq_ctx, ZMQ_XSUB);
+		zmq_setsockopt(zmq_pubIn, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+		
+		r = zmq_bind(zmq_pubIn, OBUSD_PUB_ENDPOINT);
+		if(r != 0){
+			fprintf(stderr, "Failed to bind %s\n", OBUSD_PUB_ENDPOINT);
+			return EXIT_FAILURE;
+		}
+
+		//Subscribe to everything, the external XPUB does the filtering
+		zmq_send(zmq_pubIn, "\1", 1, 0);
+
+		zmq_workers = obusd_startWorkers(zmq_ctx, obusd_threads);
+		if(!zmq_workers){
+			return EXIT_FAILURE;
+		}
+
+		if(obusd_startPublisher(zmq_pub, zmq_pubIn) != 0){
+			return EXIT_FAILURE;
+		}
+	}else{
+		if(obusd_threadInit() != 0){
+			return EXIT_FAILURE;
+		}
+	}
+
+	//The request socket and the wake pipe, then the publisher unless the
+	//publisher thread has it, then the peers' requests, then the replay
+	//thread's, the journal's answers and the workers' sockets
+	int itemCount = 2;
+	int pubItem = -1;
+	int injectItem = -1;
+	int replayItem = -1;
+	int acksItem = -1;
+	int workersItem = -1;
+	
+	if(!zmq_workers){
+		pubItem = itemCount++;
+	}
+	if(zmq_inject){
+		injectItem = itemCount++;
+	}
+	if(zmq_replay){
+		replayItem = itemCount++;
+	}
+	if(zmq_acks){
+		acksItem = itemCount++;
+	}
+	if(zmq_workers){
+		workersItem = itemCount;
+		itemCount += obusd_threads;
+	}
+	
+	zmq_pollitem_t* items = malloc(sizeof(zmq_pollitem_t) * itemCount);
+	if(!items){
+		return EXIT_FAILURE;
+	}
+
+	items[0] = (zmq_pollitem_t){zmq_resp, 0, ZMQ_POLLIN, 0};
+	items[1] = (zmq_pollitem_t){NULL, obusd_wakePipe[0], ZMQ_POLLIN, 0};
+	if(!zmq_workers){
+		items[pubItem] = (zmq_pollitem_t){zmq_pub, 0, ZMQ_POLLIN, 0};
+	}
+	if(zmq_inject){
+		items[injectItem] = (zmq_pollitem_t){zmq_inject, 0, ZMQ_POLLIN, 0};
+	}
+	if(zmq_replay){
+		items[replayItem] = (zmq_pollitem_t){zmq_replay, 0, ZMQ_POLLIN, 0};
+	}
+	if(zmq_acks){
+		items[acksItem] = (zmq_pollitem_t){zmq_acks, 0, ZMQ_POLLIN, 0};
+	}
+	if(zmq_workers){
+		int i;
+		for(i = 0; i < obusd_threads; i++){
+			items[workersItem + i] = (zmq_pollitem_t){zmq_workers[i], 0, ZMQ_POLLIN, 0};
+		}
+	}
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	pthread_sigmask(SIG_UNBLOCK, &hupSet, NULL);
 
 	while(1){
-		zmq_pollitem_t items[] = {
-            {zmq_resp, 0, ZMQ_POLLIN, 0},
-            {zmq_pub, 0, ZMQ_POLLIN, 0}
-        };
+		if(atomic_exchange(&obusd_reloadPending, 0)){
+			obusd_reload(zmq_ctx, zmq_workers ? NULL : zmq_pub);
+		}
+		
+		r = zmq_poll(items, itemCount, zmq_workers ? -1 : obusd_threadTimeout());
+		if(r < 0){
+			if(errno == ETERM){
+				break;
+			}
+			continue;
+		}
+
+		if(items[1].revents & ZMQ_POLLIN){
+			char wakes[64];
+			while(read(obusd_wakePipe[0], wakes, sizeof(wakes)) > 0){
+			}
+		}
 
-		zmq_poll(items, 2, -1);
+		//Messages would be acknowledged that the journal can't keep
+		const char* journalFailure = obusd_journalFailure();
+		if(journalFailure){
+			fprintf(stderr, "%s\n", journalFailure);
+			return EXIT_FAILURE;
+		}
 
 		if(items[0].revents & ZMQ_POLLIN){
-			r = zmq_recv(zmq_resp, buffer, OBUS_MAX_MESSAGE_LEN, 0);
-			if(r < 0){
-				if(errno == ENOTSUP || errno == ETERM || errno == ENOTSOCK){
-					fputs("Failed to receive message.\n", stderr);
+			if(zmq_workers){
+				if(obusd_shardRequest(zmq_resp, zmq_workers, 0) != 0){
+					return EXIT_FAILURE;
+				}
+			}else{
+				if(obusd_handleRequest(&msg, zmq_resp, zmq_pub, 0) != 0){
 					return EXIT_FAILURE;
-				}else{
-					if(errno == EFSM){
-						fputs("EFSM\n", stderr);
-					}
 				}
 			}
+		}
 
-			if(r > 0){
-				if(buffer[0] != '\0'){
-					buffer[r] = '\0';
-					r = obus_processMessage(buffer, r, zmq_resp, zmq_pub);
-					if(r != 0){
-						return EXIT_FAILURE;
-					}
-					memset(buffer, '\0', OBUS_MAX_MESSAGE_LEN);
+		if(zmq_inject && (items[injectItem].revents & ZMQ_POLLIN)){
+			if(zmq_workers){
+				if(obusd_shardRequest(zmq_inject, zmq_workers, 1) != 0){
+					return EXIT_FAILURE;
+				}
+			}else{
+				if(obusd_handleRequest(&msg, zmq_inject, zmq_pub, 1) != 0){
+					return EXIT_FAILURE;
 				}
 			}
 		}
 
-		if(items[1].revents & ZMQ_POLLIN){
-		    
+		if(zmq_replay && (items[replayItem].revents & ZMQ_POLLIN)){
+			if(obusd_relay(&msg, zmq_replay, zmq_resp) != 0){
+				return EXIT_FAILURE;
+			}
+		}
+
+		if(zmq_acks && (items[acksItem].revents & ZMQ_POLLIN)){
+			if(obusd_relay(&msg, zmq_acks, zmq_resp) != 0){
+				return EXIT_FAILURE;
+			}
+		}
+
+		if(!zmq_workers){
+			if(items[pubItem].revents & ZMQ_POLLIN){
+				obusd_handleSubscription(&msg, zmq_pub);
+			}
+			
+			if(obusd_threadTick(zmq_pub) != 0){
+				return EXIT_FAILURE;
+			}
+		}
+
+		if(zmq_workers){
+			int i;
+			for(i = 0; i < obusd_threads; i++){
+				if(items[workersItem + i].revents & ZMQ_POLLIN){
+					if(obusd_relay(&msg, zmq_workers[i], zmq_resp) != 0){
+						return EXIT_FAILURE;
+					}
+				}
+			}
 		}
 	}
+
+	zmq_msg_close(&msg);
+	free(items);
 	
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_H_
+#define OBUSD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <zmq.h>
+
+#include "obus.h"
+
+//Each worker N connects a DEALER to OBUSD_WORKER_ENDPOINT with N filled in
+#define OBUSD_WORKER_ENDPOINT "inproc://obusd-worker-%i"
+//Workers publish to an XSUB bound here, which feeds the external XPUB
+#define OBUSD_PUB_ENDPOINT "inproc://obusd-pub"
+
+//Asks the daemon to reload its configuration file, as SIGHUP does. Refused
+//with "$reload:error not allowed" unless i:reload_command is 1
+#define OBUSD_RELOAD_PREFIX "$reload:"
+//The answer to a request starting with OBUS_COMMAND_MARKER that isn't a command
+#define OBUSD_UNKNOWN_COMMAND "$error unknown command"
+
+//Longer topics are truncated when used as a key, such as for stats
+#define OBUSD_MAX_TOPIC_LEN 128
+//The answer to a message whose topic is too long to journal, when journaling
+#define OBUSD_TOPIC_TOO_LONG "publish:error topic too long"
+
+//The request being handled, across all of the chunks it arrives in
+typedef struct obusd_Request{
+	void* zmq_resp;
+	void* zmq_pub;
+	//Frame 0, and whether the sender put an empty delimiter after it
+	zmq_msg_t identity;
+	unsigned char delimited;
+	int first;
+	int more;
+	unsigned char dropped;
+	char topic[OBUSD_MAX_TOPIC_LEN];
+	size_t topicLen;
+	size_t bytes;
+	int64_t receivedAt;
+	//The topic's sequence number, when journaling
+	uint64_t seq;
+	//Set when nobody subscribes to the message, so it isn't published
+	unsigned char unwatched;
+	//Set when someone subscribes to a longer prefix than the topic
+	unsigned char narrowed;
+	//Set when the message is held back to be conflated
+	unsigned char conflated;
+	//Set when a peer daemon forwarded the message, see federation.h
+	unsigned char forwarded;
+	//Binary messages arrive with an envelope ahead of the topic frame
+	unsigned char enveloped;
+	obus_Envelope envelope;
+} obusd_Request;
+
+//Returned by obusd_publishFrame when a full queue made it drop the message
+#define OBUSD_PUBLISH_DROPPED 2
+
+extern unsigned char obusd_isVerbose;
+extern int obusd_maxMessageLen;
+extern int obusd_threads;
+//Set by the main thread, also on a reload
+extern atomic_int obusd_pubNoDrop;
+
+int obusd_main(int argc, char* argv[], void* zmq_ctx);
+void obusd_wakeMain();
+
+unsigned char obusd_threadInit();
+long obusd_threadTimeout();
+unsigned char obusd_threadTick(void* zmq_pub);
+
+unsigned char obusd_publishFrame(zmq_msg_t* msg, void* zmq_pub, int first, int more);
+unsigned char obusd_publishEnvelope(void* zmq_pub, const obus_Envelope* env, int more);
+unsigned char obusd_replyHead(obusd_Request* req);
+unsigned char obusd_handleRequest(zmq_msg_t* msg, void* zmq_resp, void* zmq_pub, unsigned char fromPeers);
+unsigned char obusd_drain(zmq_msg_t* msg, void* from, int more);
+unsigned char obusd_relay(zmq_msg_t* msg, void* from, void* to);
+unsigned char obusd_relayPublished(zmq_msg_t* msg, void* from, void* to);
+void obusd_handleSubscription(zmq_msg_t* msg, void* zmq_pub);
+
+void** obusd_startWorkers(void* zmq_ctx, int count);
+unsigned char obusd_startPublisher(void* zmq_pub, void* zmq_pubIn);
+
+#endif
@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "route.h"
+#include "obus.h"
+#include "parse.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <glib.h>
+
+/*
+ * Content-based routing. A subscriber subscribes to a filter topic, "?"
+ * followed by an expression such as
+ *
+ *     type == "player" && region == 3
+ *
+ * and a NUL. Every message whose JSON body satisfies the expression is
+ * published again with that exact filter as its topic, so ZeroMQ delivers
+ * it to everyone with the same filter. Identifiers name top-level members
+ * of the body (or nested ones, as a.b); type falls back to the message's
+ * type prefix when the body has no such member.
+ *
+ * Filters are a conjunction of comparisons. Identical comparisons are
+ * shared between filters and evaluated at most once per message, and each
+ * filter with an equality comparison is indexed on it, so a message only
+ * looks at the filters whose indexed value it actually has.
+ *
+ * Only messages sent in a single chunk are routed; the body of a chunked
+ * message isn't in one place to parse, and an enveloped one isn't JSON.
+ * Those are published as usual but never match a filter.
+ *
+ * Copies lead with '?', which no type does, and main.c applies a
+ * subscription to everything as one to every other first byte, so only
+ * those subscribing to a filter are sent them.
+ */
+
+#define _OBUSD_OP_EQ 0
+#define _OBUSD_OP_NE 1
+#define _OBUSD_OP_LT 2
+#define _OBUSD_OP_LE 3
+#define _OBUSD_OP_GT 4
+#define _OBUSD_OP_GE 5
+
+typedef struct obusd_RouteTerm{
+	int id;
+	int refs;
+	char* text;
+	char* field;
+	int op;
+	unsigned char litType;
+	char* str;
+	size_t len;
+	double num;
+} obusd_RouteTerm;
+
+typedef struct obusd_RouteFilter{
+	char* topic;
+	size_t topicLen;
+	int termCount;
+	obusd_RouteTerm** terms;
+	//Index key of the first equality term, if any
+	obusd_RouteTerm* indexedOn;
+	char* indexKey;
+} obusd_RouteFilter;
+
+int obusd_contentRouting = 0;
+
+static pthread_rwlock_t obusd_routeLock = PTHREAD_RWLOCK_INITIALIZER;
+static GHashTable* obusd_routeTerms = NULL;
+static GHashTable* obusd_routeFilters = NULL;
+//field -> (index key -> GPtrArray of filters)
+static GHashTable* obusd_routeIndex = NULL;
+static GPtrArray* obusd_routeScan = NULL;
+static int obusd_routeNextTermId = 0;
+//Ids of released terms, reused so the memo below stays as long as the
+//most terms there have been at once
+static int* obusd_routeFreeIds = NULL;
+static int obusd_routeFreeIdCount = 0;
+static int obusd_routeFreeIdCap = 0;
+//Only written under the write lock, read without it by every routing thread
+static atomic_int obusd_routeFilterCount = 0;
+
+//Per-thread memo of term results, valid when the generation matches
+static __thread unsigned int* obusd_routeMemoGen = NULL;
+static __thread unsigned char* obusd_routeMemo = NULL;
+static __thread int obusd_routeMemoLen = 0;
+static __thread unsigned int obusd_routeGen = 0;
+
+unsigned char obusd_routeActive(){
+	return obusd_contentRouting && atomic_load_explicit(&obusd_routeFilterCount, memory_order_relaxed) > 0;
+}
+
+static void _obusd_skipSpace(const char** cur, const char* end){
+	while(*cur < end && isspace((unsigned char)**cur)){
+		(*cur)++;
+	}
+}
+
+static void _obusd_destroy_term(obusd_RouteTerm* term){
+	free(term->text);
+	free(term->field);
+	free(term->str);
+	free(term);
+}
+
+//Index key of a literal or value: a type letter, then its text
+static char* _obusd_literalKey(unsigned char type, const char* str, size_t len, double num){
+	if(type == OBUS_JSON_STRING){
+		char* key = malloc(len + 2);
+		if(key){
+			key[0] = 's';
+			memcpy(&key[1], str, len);
+			key[len + 1] = '\0';
+		}
+		return key;
+	}else if(type == OBUS_JSON_NUMBER){
+		char buf[40];
+		snprintf(buf, sizeof(buf), "n%.17g", num);
+		return strdup(buf);
+	}else if(type == OBUS_JSON_BOOL){
+		return strdup(num ? "b1" : "b0");
+	}
+	return strdup("z");
+}
+
+/*
+ * Parses one comparison, advancing cur past it. Terms are deduplicated on
+ * their canonical text, so the same comparison in two filters is one term.
+ */
+static obusd_RouteTerm* _obusd_parseTerm(const char** cur, const char* end){
+	_obusd_skipSpace(cur, end);
+
+	const char* fieldStart = *cur;
+	while(*cur < end && (isalnum((unsigned char)**cur) || **cur == '_' || **cur == '.')){
+		(*cur)++;
+	}
+	size_t fieldLen = *cur - fieldStart;
+	if(fieldLen == 0){
+		return NULL;
+	}
+
+	_obusd_skipSpace(cur, end);
+	if(end - *cur < 1){
+		return NULL;
+	}
+
+	int op;
+	const char* p = *cur;
+	if(end - p >= 2 && p[0] == '=' && p[1] == '='){
+		op = _OBUSD_OP_EQ;
+		*cur += 2;
+	}else if(end - p >= 2 && p[0] == '!' && p[1] == '='){
+		op = _OBUSD_OP_NE;
+		*cur += 2;
+	}else if(end - p >= 2 && p[0] == '<' && p[1] == '='){
+		op = _OBUSD_OP_LE;
+		*cur += 2;
+	}else if(end - p >= 2 && p[0] == '>' && p[1] == '='){
+		op = _OBUSD_OP_GE;
+		*cur += 2;
+	}else if(p[0] == '<'){
+		op = _OBUSD_OP_LT;
+		*cur += 1;
+	}else if(p[0] == '>'){
+		op = _OBUSD_OP_GT;
+		*cur += 1;
+	}else{
+		return NULL;
+	}
+
+	_obusd_skipSpace(cur, end);
+
+	unsigned char litType;
+	const char* litStart;
+	size_t litLen;
+	double num = 0;
+
+	if(*cur < end && **cur == '"'){
+		(*cur)++;
+		litStart = *cur;
+		while(*cur < end && **cur != '"'){
+			if(**cur == '\\'){
+				(*cur)++;
+			}
+			(*cur)++;
+		}
+		if(*cur >= end){
+			return NULL;
+		}
+		litLen = *cur - litStart;
+		(*cur)++;
+		litType = OBUS_JSON_STRING;
+	}else{
+		litStart = *cur;
+		while(*cur < end && (isalnum((unsigned char)**cur) || strchr("+-.", **cur))){
+			(*cur)++;
+		}
+		litLen = *cur - litStart;
+
+		if(litLen == 4 && memcmp(litStart, "true", 4) == 0){
+			litType = OBUS_JSON_BOOL;
+			num = 1;
+		}else if(litLen == 5 && memcmp(litStart, "false", 5) == 0){
+			litType = OBUS_JSON_BOOL;
+		}else if(litLen == 4 && memcmp(litStart, "null", 4) == 0){
+			litType = OBUS_JSON_NULL;
+		}else{
+			char buf[64];
+			if(litLen == 0 || litLen >= sizeof(buf)){
+				return NULL;
+			}
+			memcpy(buf, litStart, litLen);
+			buf[litLen] = '\0';
+			
+			char* numEnd;
+			num = strtod(buf, &numEnd);
+			if(*numEnd != '\0'){
+				return NULL;
+			}
+			litType = OBUS_JSON_NUMBER;
+		}
+	}
+
+	static const char* opNames[] = {"==", "!=", "<", "<=", ">", ">="};
+	char* litKey = _obusd_literalKey(litType, litStart, litLen, num);
+	if(!litKey){
+		return NULL;
+	}
+	char* text = g_strdup_printf("%.*s%s%s", (int)fieldLen, fieldStart, opNames[op], litKey);
+	free(litKey);
+
+	obusd_RouteTerm* term = g_hash_table_lookup(obusd_routeTerms, text);
+	if(term){
+		g_free(text);
+		term->refs++;
+		return term;
+	}
+
+	term = calloc(1, sizeof(obusd_RouteTerm));
+	if(!term){
+		g_free(text);
+		return NULL;
+	}
+
+	if(obusd_routeFreeIdCount > 0){
+		term->id = obusd_routeFreeIds[--obusd_routeFreeIdCount];
+	}else{
+		term->id = obusd_routeNextTermId++;
+	}
+	term->refs = 1;
+	term->text = strdup(text);
+	g_free(text);
+	term->field = strndup(fieldStart, fieldLen);
+	term->op = op;
+	term->litType = litType;
+	term->str = strndup(litStart, litLen);
+	term->len = litLen;
+	term->num = num;
+
+	g_hash_table_insert(obusd_routeTerms, term->text, term);
+	
+	return term;
+}
+
+static void _obusd_releaseTerm(obusd_RouteTerm* term){
+	if(--term->refs < 1){
+		if(obusd_routeFreeIdCount == obusd_routeFreeIdCap){
+			int newCap = obusd_routeFreeIdCap > 0 ? obusd_routeFreeIdCap * 2 : 16;
+			int* tmp = realloc(obusd_routeFreeIds, sizeof(int) * newCap);
+			if(tmp){
+				obusd_routeFreeIds = tmp;
+				obusd_routeFreeIdCap = newCap;
+			}
+		}
+		//Otherwise the id is just never reused
+		if(obusd_routeFreeIdCount < obusd_routeFreeIdCap){
+			obusd_routeFreeIds[obusd_routeFreeIdCount++] = term->id;
+		}
+		
+		g_hash_table_remove(obusd_routeTerms, term->text);
+		_obusd_destroy_term(term);
+	}
+}
+
+static void _obusd_destroy_filter(obusd_RouteFilter* filter){
+	int i;
+	for(i = 0; i < filter->termCount; i++){
+		_obusd_releaseTerm(filter->terms[i]);
+	}
+	free(filter->terms);
+	free(filter->indexKey);
+	free(filter->topic);
+	free(filter);
+}
+
+//Compiles a filter topic, "?" expression NUL, with the route lock held
+static obusd_RouteFilter* _obusd_compileFilter(const char* topic, size_t topicLen){
+	obusd_RouteFilter* filter = calloc(1, sizeof(obusd_RouteFilter));
+	if(!filter){
+		return NULL;
+	}
+
+	filter->topic = malloc(topicLen);
+	if(!filter->topic){
+		free(filter);
+		return NULL;
+	}
+	memcpy(filter->topic, topic, topicLen);
+	filter->topicLen = topicLen;
+
+	const char* cur = topic + 1;
+	const char* end = topic + topicLen - 1;
+
+	while(1){
+		obusd_RouteTerm* term = _obusd_parseTerm(&cur, end);
+		if(!term){
+			_obusd_destroy_filter(filter);
+			return NULL;
+		}
+
+		obusd_RouteTerm** tmpTerms = realloc(filter->terms, sizeof(obusd_RouteTerm*) * (filter->termCount + 1));
+		if(!tmpTerms){
+			_obusd_releaseTerm(term);
+			_obusd_destroy_filter(filter);
+			return NULL;
+		}
+		filter->terms = tmpTerms;
+		filter->terms[filter->termCount++] = term;
+
+		if(!filter->indexedOn && term->op == _OBUSD_OP_EQ){
+			filter->indexedOn = term;
+		}
+
+		_obusd_skipSpace(&cur, end);
+		if(cur >= end){
+			break;
+		}
+		
+		if(end - cur < 2 || cur[0] != '&' || cur[1] != '&'){
+			_obusd_destroy_filter(filter);
+			return NULL;
+		}
+		cur += 2;
+	}
+
+	return filter;
+}
+
+static void _obusd_addFilter(obusd_RouteFilter* filter){
+	g_hash_table_insert(obusd_routeFilters, g_strndup(filter->topic, filter->topicLen), filter);
+
+	if(!filter->indexedOn){
+		g_ptr_array_add(obusd_routeScan, filter);
+		return;
+	}
+
+	obusd_RouteTerm* term = filter->indexedOn;
+	filter->indexKey = _obusd_literalKey(term->litType, term->str, term->len, term->num);
+
+	GHashTable* values = g_hash_table_lookup(obusd_routeIndex, term->field);
+	if(!values){
+		values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+		g_hash_table_insert(obusd_routeIndex, g_strdup(term->field), values);
+	}
+
+	GPtrArray* filters = g_hash_table_lookup(values, filter->indexKey);
+	if(!filters){
+		filters = g_ptr_array_new();
+		g_hash_table_insert(values, g_strdup(filter->indexKey), filters);
+	}
+	g_ptr_array_add(filters, filter);
+}
+
+static void _obusd_removeFilter(obusd_RouteFilter* filter){
+	if(!filter->indexedOn){
+		g_ptr_array_remove(obusd_routeScan, filter);
+	}else{
+		GHashTable* values = g_hash_table_lookup(obusd_routeIndex, filter->indexedOn->field);
+		GPtrArray* filters = values ? g_hash_table_lookup(values, filter->indexKey) : NULL;
+		if(filters){
+			g_ptr_array_remove(filters, filter);
+			if(filters->len == 0){
+				g_hash_table_remove(values, filter->indexKey);
+				if(g_hash_table_size(values) == 0){
+					g_hash_table_remove(obusd_routeIndex, filter->indexedOn->field);
+				}
+			}
+		}
+	}
+
+	char* key = g_strndup(filter->topic, filter->topicLen);
+	g_hash_table_remove(obusd_routeFilters, key);
+	g_free(key);
+	
+	_obusd_destroy_filter(filter);
+}
+
+/*
+ * Handles a subscription message from the XPUB: a byte that is 1 to
+ * subscribe or 0 to unsubscribe, then the topic. It is only passed on for
+ * the first subscriber to a topic and the last to leave it (see subs.c),
+ * so each filter is compiled once however many subscribers share it.
+ */
+void obusd_routeSubscription(const char* data, size_t len){
+	if(!obusd_contentRouting || len < 3 || data[1] != '?' || data[len - 1] != '\0'){
+		return;
+	}
+
+	const char* topic = data + 1;
+	size_t topicLen = len - 1;
+
+	pthread_rwlock_wrlock(&obusd_routeLock);
+
+	if(!obusd_routeFilters){
+		obusd_routeTerms = g_hash_table_new(g_str_hash, g_str_equal);
+		obusd_routeFilters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		obusd_routeIndex = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+		obusd_routeScan = g_ptr_array_new();
+	}
+
+	char* key = g_strndup(topic, topicLen);
+	obusd_RouteFilter* filter = g_hash_table_lookup(obusd_routeFilters, key);
+	g_free(key);
+
+	if(data[0] == 1){
+		if(!filter){
+			filter = _obusd_compileFilter(topic, topicLen);
+			if(filter){
+				_obusd_addFilter(filter);
+				atomic_store_explicit(&obusd_routeFilterCount, atomic_load_explicit(&obusd_routeFilterCount, memory_order_relaxed) + 1, memory_order_relaxed);
+				obusd_log(OBUSD_LOG_DEBUG, "Added filter %.*s", (int)(topicLen - 2), topic + 1);
+			}else{
+				obusd_log(OBUSD_LOG_WARN, "Invalid filter %.*s", (int)(topicLen - 2), topic + 1);
+			}
+		}
+	}else if(filter){
+		_obusd_removeFilter(filter);
+		atomic_store_explicit(&obusd_routeFilterCount, atomic_load_explicit(&obusd_routeFilterCount, memory_order_relaxed) - 1, memory_order_relaxed);
+		obusd_log(OBUSD_LOG_DEBUG, "Removed filter %.*s", (int)(topicLen - 2), topic + 1);
+	}
+
+	pthread_rwlock_unlock(&obusd_routeLock);
+}
+
+//Finds a member of the body by a dotted path
+static const obus_JsonView* _obusd_lookupField(const obus_JsonView* body, const char* field){
+	const char* dot = strchr(field, '.');
+	if(!dot){
+		return obus_jsonViewGet(body, field);
+	}
+
+	char part[dot - field + 1];
+	memcpy(part, field, dot - field);
+	part[dot - field] = '\0';
+	
+	return _obusd_lookupField(obus_jsonViewGet(body, part), dot + 1);
+}
+
+static unsigned char _obusd_evalTerm(obusd_RouteTerm* term, const obus_JsonView* body, obus_JsonView* typeView){
+	if(obusd_routeMemoGen[term->id] == obusd_routeGen){
+		return obusd_routeMemo[term->id];
+	}
+	
+	const obus_JsonView* value = _obusd_lookupField(body, term->field);
+	if(!value && strcmp(term->field, "type") == 0){
+		value = typeView;
+	}
+
+	unsigned char result = 0;
+
+	if(value && value->type == term->litType){
+		int cmp = 0;
+		if(term->litType == OBUS_JSON_STRING){
+			size_t n = value->len < term->len ? value->len : term->len;
+			cmp = memcmp(value->str, term->str, n);
+			if(cmp == 0){
+				cmp = (value->len > term->len) - (value->len < term->len);
+			}
+		}else if(term->litType == OBUS_JSON_NUMBER){
+			cmp = (value->data.number > term->num) - (value->data.number < term->num);
+		}else if(term->litType == OBUS_JSON_BOOL){
+			cmp = value->data.boolean != (int)term->num;
+		}
+
+		switch(term->op){
+			case _OBUSD_OP_EQ: result = cmp == 0; break;
+			case _OBUSD_OP_NE: result = cmp != 0; break;
+			case _OBUSD_OP_LT: result = cmp < 0; break;
+			case _OBUSD_OP_LE: result = cmp <= 0; break;
+			case _OBUSD_OP_GT: result = cmp > 0; break;
+			case _OBUSD_OP_GE: result = cmp >= 0; break;
+		}
+	}else if(term->op == _OBUSD_OP_NE){
+		//Missing or differently typed values are never equal
+		result = 1;
+	}
+
+	obusd_routeMemoGen[term->id] = obusd_routeGen;
+	obusd_routeMemo[term->id] = result;
+	
+	return result;
+}
+
+static unsigned char _obusd_publishMatch(obusd_RouteFilter* filter, const obus_JsonView* body, obus_JsonView* typeView, zmq_msg_t* msg, obusd_Request* req){
+	int i;
+	for(i = 0; i < filter->termCount; i++){
+		if(!_obusd_evalTerm(filter->terms[i], body, typeView)){
+			return 0;
+		}
+	}
+
+	zmq_msg_t topic;
+	zmq_msg_init_size(&topic, filter->topicLen);
+	memcpy(zmq_msg_data(&topic), filter->topic, filter->topicLen);
+
+	unsigned char r = obusd_publishFrame(&topic, req->zmq_pub, 1, 1);
+	zmq_msg_close(&topic);
+	
+	if(r == 0){
+		//Shares msg's content rather than copying it
+		zmq_msg_t copy;
+		zmq_msg_init(&copy);
+		zmq_msg_copy(&copy, msg);
+		
+		r = obusd_publishFrame(&copy, req->zmq_pub, 0, 0);
+		zmq_msg_close(&copy);
+	}
+
+	if(r == OBUSD_PUBLISH_DROPPED){
+		r = 0;
+	}
+	return r;
+}
+
+/*
+ * Publishes a copy of msg under every filter topic its body matches. msg
+ * itself is left untouched, to be published as usual.
+ */
+unsigned char obusd_routeMessage(zmq_msg_t* msg, obusd_Request* req){
+	obus_ParseCtx* ctx = obus_parseCtxGet();
+	if(!ctx){
+		return 0;
+	}
+
+	const char* data = zmq_msg_data(msg);
+	size_t size = zmq_msg_size(msg);
+	size_t topicLen = obus_topicLength(data, size);
+	
+	const obus_JsonView* body = obus_parseView(ctx, data + topicLen, size - topicLen);
+	if(!body || body->type != OBUS_JSON_OBJECT){
+		obus_parseCtxReset(ctx);
+		return 0;
+	}
+
+	obus_JsonView typeView;
+	memset(&typeView, 0, sizeof(typeView));
+	typeView.type = OBUS_JSON_STRING;
+	typeView.str = data;
+	typeView.len = topicLen > 0 ? topicLen - 1 : 0;
+
+	unsigned char r = 0;
+
+	pthread_rwlock_rdlock(&obusd_routeLock);
+
+	if(obusd_routeMemoLen < obusd_routeNextTermId){
+		int newLen = obusd_routeNextTermId * 2;
+		unsigned int* tmpGen = realloc(obusd_routeMemoGen, sizeof(unsigned int) * newLen);
+		if(tmpGen){
+			obusd_routeMemoGen = tmpGen;
+			unsigned char* tmpMemo = realloc(obusd_routeMemo, newLen);
+			if(tmpMemo){
+				obusd_routeMemo = tmpMemo;
+				memset(&obusd_routeMemoGen[obusd_routeMemoLen], 0, sizeof(unsigned int) * (newLen - obusd_routeMemoLen));
+				obusd_routeMemoLen = newLen;
+			}
+		}
+		
+		if(obusd_routeMemoLen < obusd_routeNextTermId){
+			pthread_rwlock_unlock(&obusd_routeLock);
+			obus_parseCtxReset(ctx);
+			return 1;
+		}
+	}
+
+	if(++obusd_routeGen == 0){
+		memset(obusd_routeMemoGen, 0, sizeof(unsigned int) * obusd_routeMemoLen);
+		obusd_routeGen = 1;
+	}
+
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, obusd_routeIndex);
+	while(r == 0 && g_hash_table_iter_next(&iter, &key, &value)){
+		const obus_JsonView* field = _obusd_lookupField(body, key);
+		if(!field && strcmp(key, "type") == 0){
+			field = &typeView;
+		}
+		if(!field){
+			continue;
+		}
+
+		char* valueKey = _obusd_literalKey(field->type, field->str, field->len, field->type == OBUS_JSON_BOOL ? field->data.boolean : field->data.number);
+		GPtrArray* filters = valueKey ? g_hash_table_lookup(value, valueKey) : NULL;
+		free(valueKey);
+
+		guint i;
+		for(i = 0; filters && i < filters->len && r == 0; i++){
+			r = _obusd_publishMatch(g_ptr_array_index(filters, i), body, &typeView, msg, req);
+		}
+	}
+
+	guint i;
+	for(i = 0; i < obusd_routeScan->len && r == 0; i++){
+		r = _obusd_publishMatch(g_ptr_array_index(obusd_routeScan, i), body, &typeView, msg, req);
+	}
+
+	pthread_rwlock_unlock(&obusd_routeLock);
+
+	obus_parseCtxReset(ctx);
+	
+	return r;
+}
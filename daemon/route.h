@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_ROUTE_H_
+#define OBUSD_ROUTE_H_
+
+#include "obusd.h"
+
+#include <stddef.h>
+
+#include <zmq.h>
+
+extern int obusd_contentRouting;
+
+unsigned char obusd_routeActive();
+void obusd_routeSubscription(const char* data, size_t len);
+unsigned char obusd_routeMessage(zmq_msg_t* msg, obusd_Request* req);
+
+#endif
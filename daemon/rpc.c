@@ -0,0 +1,767 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rpc.h"
+#include "obus.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <glib.h>
+
+/*
+ * Services are load balanced in the style of ZeroMQ's Majordomo pattern:
+ * each call goes to the least loaded worker with a credit to spare, and
+ * when none has one, it waits on the service's queue for the next reply
+ * to free one up. Workers that stop sending heartbeats are dropped the
+ * next time their service is looked at, and the calls they had in flight
+ * are failed back to their callers.
+ *
+ * Only a registered worker may reply, and only to a call it was sent, so
+ * no one else can answer someone's call.
+ */
+
+typedef struct obusd_Service obusd_Service;
+
+//The caller and tag of a call sent to a worker, until it replies
+typedef struct obusd_RpcPending{
+	zmq_msg_t caller;
+	zmq_msg_t tag;
+} obusd_RpcPending;
+
+typedef struct obusd_ServiceWorker{
+	size_t idLen;
+	unsigned char id[OBUSD_RPC_MAX_IDENTITY_LEN];
+	obusd_Service* service;
+	int credits;
+	//Calls in flight, as obusd_RpcPending
+	GQueue* inFlight;
+	gint64 lastSeen;
+} obusd_ServiceWorker;
+
+struct obusd_Service{
+	char* name;
+	GPtrArray* workers;
+	guint next;
+	GQueue* queued;
+};
+
+//A call's frames, [call][caller][tag][body]..., held until it is sent
+typedef struct obusd_RpcCall{
+	zmq_msg_t* frames;
+	int count;
+} obusd_RpcCall;
+
+atomic_int obusd_rpcHeartbeat = OBUSD_RPC_DEFAULT_HEARTBEAT_MS;
+
+//Shared by every thread, as a call can land on a different one than its service
+static pthread_mutex_t obusd_rpcLock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable* obusd_rpcServices = NULL;
+static GHashTable* obusd_rpcWorkers = NULL;
+
+static unsigned char _obusd_rpcHasPrefix(const char* data, size_t len, const char* prefix){
+	size_t prefixLen = strlen(prefix);
+	return len >= prefixLen && memcmp(data, prefix, prefixLen) == 0;
+}
+
+unsigned char obusd_rpcIsCommand(const char* data, size_t len){
+	return _obusd_rpcHasPrefix(data, len, OBUSD_RPC_REGISTER_PREFIX) ||
+		_obusd_rpcHasPrefix(data, len, OBUSD_RPC_UNREGISTER_PREFIX) ||
+		_obusd_rpcHasPrefix(data, len, OBUSD_RPC_HEARTBEAT_PREFIX) ||
+		_obusd_rpcHasPrefix(data, len, OBUSD_RPC_CALL_PREFIX) ||
+		_obusd_rpcHasPrefix(data, len, OBUSD_RPC_REPLY_PREFIX);
+}
+
+static guint _obusd_workerHash(gconstpointer key){
+	const obusd_ServiceWorker* worker = key;
+	return obus_hash(worker->id, worker->idLen);
+}
+
+static gboolean _obusd_workerEqual(gconstpointer a, gconstpointer b){
+	const obusd_ServiceWorker* workerA = a;
+	const obusd_ServiceWorker* workerB = b;
+	return workerA->idLen == workerB->idLen && memcmp(workerA->id, workerB->id, workerA->idLen) == 0;
+}
+
+static void _obusd_rpcCallFree(obusd_RpcCall* call){
+	int i;
+	for(i = 0; i < call->count; i++){
+		zmq_msg_close(&call->frames[i]);
+	}
+	free(call->frames);
+	free(call);
+}
+
+//Must be called with obusd_rpcLock held
+static void _obusd_rpcInit(){
+	if(!obusd_rpcServices){
+		obusd_rpcServices = g_hash_table_new(g_str_hash, g_str_equal);
+		obusd_rpcWorkers = g_hash_table_new(_obusd_workerHash, _obusd_workerEqual);
+	}
+}
+
+//Must be called with obusd_rpcLock held
+static obusd_ServiceWorker* _obusd_rpcFindWorker(zmq_msg_t* identity){
+	obusd_ServiceWorker key;
+	key.idLen = zmq_msg_size(identity);
+	memcpy(key.id, zmq_msg_data(identity), key.idLen);
+	
+	return g_hash_table_lookup(obusd_rpcWorkers, &key);
+}
+
+static void _obusd_rpcPendingFree(obusd_RpcPending* pending){
+	zmq_msg_close(&pending->caller);
+	zmq_msg_close(&pending->tag);
+	free(pending);
+}
+
+static unsigned char _obusd_rpcFrameEquals(zmq_msg_t* a, zmq_msg_t* b){
+	return zmq_msg_size(a) == zmq_msg_size(b) && memcmp(zmq_msg_data(a), zmq_msg_data(b), zmq_msg_size(a)) == 0;
+}
+
+/*
+ * Notes that call, [call][caller][tag][body]..., is about to be sent to
+ * worker. Must be called with obusd_rpcLock held.
+ */
+static unsigned char _obusd_rpcAddInFlight(obusd_ServiceWorker* worker, obusd_RpcCall* call){
+	obusd_RpcPending* pending = malloc(sizeof(obusd_RpcPending));
+	if(!pending){
+		return 1;
+	}
+	
+	zmq_msg_init(&pending->caller);
+	zmq_msg_copy(&pending->caller, &call->frames[1]);
+	zmq_msg_init(&pending->tag);
+	zmq_msg_copy(&pending->tag, &call->frames[2]);
+	
+	g_queue_push_tail(worker->inFlight, pending);
+	return 0;
+}
+
+/*
+ * Takes the call to caller with tag off worker's calls in flight, if it
+ * has one. Must be called with obusd_rpcLock held.
+ */
+static unsigned char _obusd_rpcTakeInFlight(obusd_ServiceWorker* worker, zmq_msg_t* caller, zmq_msg_t* tag){
+	GList* link;
+	for(link = g_queue_peek_head_link(worker->inFlight); link; link = link->next){
+		obusd_RpcPending* pending = link->data;
+		if(_obusd_rpcFrameEquals(&pending->caller, caller) && _obusd_rpcFrameEquals(&pending->tag, tag)){
+			g_queue_delete_link(worker->inFlight, link);
+			_obusd_rpcPendingFree(pending);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Removes worker, moving the calls it had in flight onto lost for the
+ * caller to fail once unlocked. Must be called with obusd_rpcLock held.
+ */
+static void _obusd_rpcRemoveWorker(obusd_ServiceWorker* worker, GQueue* lost){
+	g_hash_table_remove(obusd_rpcWorkers, worker);
+	g_ptr_array_remove(worker->service->workers, worker);
+
+	obusd_RpcPending* pending;
+	while((pending = g_queue_pop_head(worker->inFlight))){
+		g_queue_push_tail(lost, pending);
+	}
+	g_queue_free(worker->inFlight);
+	free(worker);
+}
+
+/*
+ * Drops the service's workers that stopped sending heartbeats, moving
+ * their calls in flight onto lost. Returns the calls left stranded when
+ * that leaves it with no workers at all, for the caller to fail once
+ * unlocked. Must be called with obusd_rpcLock held.
+ */
+static GQueue* _obusd_rpcExpire(obusd_Service* service, GQueue* lost){
+	gint64 deadline = g_get_monotonic_time() - (gint64)atomic_load_explicit(&obusd_rpcHeartbeat, memory_order_relaxed) * OBUSD_RPC_LIVENESS * 1000;
+	
+	guint i = 0;
+	while(i < service->workers->len){
+		obusd_ServiceWorker* worker = g_ptr_array_index(service->workers, i);
+		if(worker->lastSeen < deadline){
+			obusd_log(OBUSD_LOG_INFO, "Worker of service %s expired", service->name);
+			_obusd_rpcRemoveWorker(worker, lost);
+		}else{
+			i++;
+		}
+	}
+
+	if(service->workers->len == 0 && !g_queue_is_empty(service->queued)){
+		GQueue* stranded = service->queued;
+		service->queued = g_queue_new();
+		return stranded;
+	}
+	return NULL;
+}
+
+/*
+ * Picks the least loaded of the service's workers that has a credit to
+ * spare, starting from a different one each time to spread out ties.
+ * Must be called with obusd_rpcLock held.
+ */
+static obusd_ServiceWorker* _obusd_rpcPick(obusd_Service* service){
+	obusd_ServiceWorker* best = NULL;
+	guint count = service->workers->len;
+
+	guint i;
+	for(i = 0; i < count; i++){
+		obusd_ServiceWorker* worker = g_ptr_array_index(service->workers, (service->next + i) % count);
+		int inFlight = g_queue_get_length(worker->inFlight);
+		if(inFlight >= worker->credits){
+			continue;
+		}
+		
+		//Compare in flight / credits without dividing
+		if(!best || (int64_t)inFlight * best->credits < (int64_t)g_queue_get_length(best->inFlight) * worker->credits){
+			best = worker;
+		}
+	}
+
+	service->next++;
+	return best;
+}
+
+//Copies the service name following prefix into name, up to a space or NUL
+static unsigned char _obusd_rpcName(zmq_msg_t* msg, const char* prefix, char* name, const char** rest){
+	const char* data = zmq_msg_data(msg);
+	size_t len = zmq_msg_size(msg);
+	size_t prefixLen = strlen(prefix);
+
+	size_t nameLen = 0;
+	while(prefixLen + nameLen < len && data[prefixLen + nameLen] != ' ' && data[prefixLen + nameLen] != '\0'){
+		nameLen++;
+	}
+	
+	if(nameLen == 0 || nameLen >= OBUSD_RPC_MAX_SERVICE_LEN){
+		return 1;
+	}
+
+	memcpy(name, &data[prefixLen], nameLen);
+	name[nameLen] = '\0';
+
+	if(rest){
+		*rest = &data[prefixLen + nameLen];
+	}
+	return 0;
+}
+
+static unsigned char _obusd_rpcSend(zmq_msg_t* msg, void* sock, int more){
+	if(zmq_msg_send(msg, sock, more ? ZMQ_SNDMORE : 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+//Reads and throws away what is left of a request
+static unsigned char _obusd_rpcDrain(zmq_msg_t* msg, void* sock, int more){
+	while(more){
+		if(zmq_msg_recv(msg, sock, 0) < 0){
+			fputs("Failed to receive message.\n", stderr);
+			return 1;
+		}
+		more = zmq_msg_more(msg);
+	}
+	return 0;
+}
+
+//Answers req's sender with head, then tag if there is one
+static unsigned char _obusd_rpcAnswer(obusd_Request* req, const char* head, zmq_msg_t* tag){
+	if(obusd_replyHead(req) != 0){
+		return 1;
+	}
+	
+	if(zmq_send(req->zmq_resp, head, strlen(head), tag ? ZMQ_SNDMORE : 0) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+
+	if(tag){
+		return _obusd_rpcSend(tag, req->zmq_resp, 0);
+	}
+	return 0;
+}
+
+//Sends [worker][""][call][caller][tag][body]..., emptying the call's frames
+static unsigned char _obusd_rpcSendCall(void* sock, const unsigned char* id, size_t idLen, obusd_RpcCall* call){
+	if(zmq_send(sock, id, idLen, ZMQ_SNDMORE) < 0 || zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+
+	int i;
+	for(i = 0; i < call->count; i++){
+		if(_obusd_rpcSend(&call->frames[i], sock, i + 1 < call->count) != 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Fails a call that couldn't be sent, answering its caller directly
+static unsigned char _obusd_rpcFailCall(void* sock, obusd_RpcCall* call, const char* reason){
+	//[caller][""][reason][tag]
+	if(_obusd_rpcSend(&call->frames[1], sock, 1) != 0 || zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0){
+		return 1;
+	}
+	if(zmq_send(sock, reason, strlen(reason), ZMQ_SNDMORE) < 0){
+		fputs("Failed to send message.\n", stderr);
+		return 1;
+	}
+	return _obusd_rpcSend(&call->frames[2], sock, 0);
+}
+
+//Fails the calls lost with their workers, [caller][""][reason][tag]
+static unsigned char _obusd_rpcFailLost(void* sock, GQueue* lost){
+	unsigned char ret = 0;
+	const char* reason = OBUSD_RPC_REPLY_PREFIX "error worker lost";
+	
+	obusd_RpcPending* pending;
+	while((pending = g_queue_pop_head(lost))){
+		if(ret == 0){
+			if(zmq_msg_send(&pending->caller, sock, ZMQ_SNDMORE) < 0 ||
+			   zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0 ||
+			   zmq_send(sock, reason, strlen(reason), ZMQ_SNDMORE) < 0 ||
+			   zmq_msg_send(&pending->tag, sock, 0) < 0){
+				fputs("Failed to send message.\n", stderr);
+				ret = 1;
+			}
+		}
+		_obusd_rpcPendingFree(pending);
+	}
+	
+	return ret;
+}
+
+static unsigned char _obusd_rpcFailStranded(void* sock, GQueue* stranded){
+	unsigned char ret = 0;
+	
+	obusd_RpcCall* call;
+	while((call = g_queue_pop_head(stranded))){
+		if(ret == 0){
+			ret = _obusd_rpcFailCall(sock, call, OBUSD_RPC_REPLY_PREFIX "error no such service");
+		}
+		_obusd_rpcCallFree(call);
+	}
+	g_queue_free(stranded);
+	
+	return ret;
+}
+
+//Sends a service's queued calls to whichever of its workers have credits
+static unsigned char _obusd_rpcDispatchQueued(void* sock, obusd_Service* service){
+	while(1){
+		pthread_mutex_lock(&obusd_rpcLock);
+		
+		obusd_RpcCall* call = NULL;
+		obusd_ServiceWorker* worker = NULL;
+		
+		if(!g_queue_is_empty(service->queued)){
+			worker = _obusd_rpcPick(service);
+			if(worker){
+				call = g_queue_pop_head(service->queued);
+				if(_obusd_rpcAddInFlight(worker, call) != 0){
+					g_queue_push_head(service->queued, call);
+					call = NULL;
+					worker = NULL;
+				}
+			}
+		}
+
+		unsigned char id[OBUSD_RPC_MAX_IDENTITY_LEN];
+		size_t idLen = 0;
+		if(worker){
+			idLen = worker->idLen;
+			memcpy(id, worker->id, idLen);
+		}
+		
+		pthread_mutex_unlock(&obusd_rpcLock);
+
+		if(!call){
+			return 0;
+		}
+
+		unsigned char r = _obusd_rpcSendCall(sock, id, idLen, call);
+		_obusd_rpcCallFree(call);
+		if(r != 0){
+			return 1;
+		}
+	}
+}
+
+static unsigned char _obusd_rpcRegister(zmq_msg_t* msg, obusd_Request* req){
+	char name[OBUSD_RPC_MAX_SERVICE_LEN];
+	const char* rest = NULL;
+	
+	if(_obusd_rpcName(msg, OBUSD_RPC_REGISTER_PREFIX, name, &rest) != 0 || zmq_msg_more(msg)){
+		if(_obusd_rpcDrain(msg, req->zmq_resp, zmq_msg_more(msg)) != 0){
+			return 1;
+		}
+		return _obusd_rpcAnswer(req, OBUSD_RPC_REGISTER_PREFIX "error bad request", NULL);
+	}
+
+	//The message isn't NUL terminated, so the credits are copied out first
+	char creditStr[16] = {0};
+	size_t restLen = zmq_msg_size(msg) - (rest - (const char*)zmq_msg_data(msg));
+	memcpy(creditStr, rest, restLen < sizeof(creditStr) - 1 ? restLen : sizeof(creditStr) - 1);
+	
+	int credits = atoi(creditStr);
+	if(credits < 1){
+		credits = 1;
+	}else if(credits > OBUSD_RPC_MAX_CREDITS){
+		credits = OBUSD_RPC_MAX_CREDITS;
+	}
+
+	pthread_mutex_lock(&obusd_rpcLock);
+	_obusd_rpcInit();
+	
+	obusd_Service* service = g_hash_table_lookup(obusd_rpcServices, name);
+	if(!service){
+		service = malloc(sizeof(obusd_Service));
+		if(!service){
+			pthread_mutex_unlock(&obusd_rpcLock);
+			return 1;
+		}
+		service->name = strdup(name);
+		service->workers = g_ptr_array_new();
+		service->next = 0;
+		service->queued = g_queue_new();
+		g_hash_table_insert(obusd_rpcServices, service->name, service);
+	}
+
+	GQueue lost = G_QUEUE_INIT;
+	
+	//A worker serves one service, registering again can move it or change its credits
+	obusd_ServiceWorker* worker = _obusd_rpcFindWorker(&req->identity);
+	if(worker && worker->service != service){
+		_obusd_rpcRemoveWorker(worker, &lost);
+		worker = NULL;
+	}
+	
+	if(!worker){
+		worker = calloc(1, sizeof(obusd_ServiceWorker));
+		if(!worker){
+			pthread_mutex_unlock(&obusd_rpcLock);
+			_obusd_rpcFailLost(req->zmq_resp, &lost);
+			return 1;
+		}
+		worker->inFlight = g_queue_new();
+		worker->idLen = zmq_msg_size(&req->identity);
+		memcpy(worker->id, zmq_msg_data(&req->identity), worker->idLen);
+		worker->service = service;
+		
+		g_ptr_array_add(service->workers, worker);
+		g_hash_table_insert(obusd_rpcWorkers, worker, worker);
+		
+		obusd_log(OBUSD_LOG_INFO, "Registered a worker for service %s with %i credits", name, credits);
+	}
+	worker->credits = credits;
+	worker->lastSeen = g_get_monotonic_time();
+
+	pthread_mutex_unlock(&obusd_rpcLock);
+
+	if(_obusd_rpcFailLost(req->zmq_resp, &lost) != 0 || _obusd_rpcAnswer(req, OBUSD_RPC_REGISTER_PREFIX "ok", NULL) != 0){
+		return 1;
+	}
+	return _obusd_rpcDispatchQueued(req->zmq_resp, service);
+}
+
+static unsigned char _obusd_rpcUnregister(zmq_msg_t* msg, obusd_Request* req){
+	if(_obusd_rpcDrain(msg, req->zmq_resp, zmq_msg_more(msg)) != 0){
+		return 1;
+	}
+	
+	pthread_mutex_lock(&obusd_rpcLock);
+	_obusd_rpcInit();
+
+	GQueue* stranded = NULL;
+	GQueue lost = G_QUEUE_INIT;
+	
+	obusd_ServiceWorker* worker = _obusd_rpcFindWorker(&req->identity);
+	if(worker){
+		obusd_Service* service = worker->service;
+		_obusd_rpcRemoveWorker(worker, &lost);
+		stranded = _obusd_rpcExpire(service, &lost);
+	}
+	
+	pthread_mutex_unlock(&obusd_rpcLock);
+
+	unsigned char ret = _obusd_rpcFailLost(req->zmq_resp, &lost);
+	if(stranded && _obusd_rpcFailStranded(req->zmq_resp, stranded) != 0){
+		ret = 1;
+	}
+	return ret;
+}
+
+static unsigned char _obusd_rpcHeartbeat(zmq_msg_t* msg, obusd_Request* req){
+	if(_obusd_rpcDrain(msg, req->zmq_resp, zmq_msg_more(msg)) != 0){
+		return 1;
+	}
+	
+	pthread_mutex_lock(&obusd_rpcLock);
+	_obusd_rpcInit();
+	
+	GQueue* stranded = NULL;
+	GQueue lost = G_QUEUE_INIT;
+	
+	//Heartbeats come often, so they are when a service's dead workers are noticed
+	obusd_ServiceWorker* worker = _obusd_rpcFindWorker(&req->identity);
+	if(worker){
+		worker->lastSeen = g_get_monotonic_time();
+		stranded = _obusd_rpcExpire(worker->service, &lost);
+	}
+	
+	pthread_mutex_unlock(&obusd_rpcLock);
+
+	unsigned char ret = _obusd_rpcFailLost(req->zmq_resp, &lost);
+	if(stranded && _obusd_rpcFailStranded(req->zmq_resp, stranded) != 0){
+		ret = 1;
+	}
+	if(ret != 0){
+		return 1;
+	}
+	return _obusd_rpcAnswer(req, worker ? OBUSD_RPC_HEARTBEAT_PREFIX : OBUSD_RPC_HEARTBEAT_PREFIX "unknown", NULL);
+}
+
+static unsigned char _obusd_rpcCall(zmq_msg_t* msg, obusd_Request* req){
+	void* sock = req->zmq_resp;
+	char name[OBUSD_RPC_MAX_SERVICE_LEN];
+
+	if(_obusd_rpcName(msg, OBUSD_RPC_CALL_PREFIX, name, NULL) != 0 || !zmq_msg_more(msg)){
+		if(_obusd_rpcDrain(msg, sock, zmq_msg_more(msg)) != 0){
+			return 1;
+		}
+		return _obusd_rpcAnswer(req, OBUSD_RPC_REPLY_PREFIX "error bad request", NULL);
+	}
+
+	//Read the whole call, [call][caller][tag][body]..., without copying it
+	obusd_RpcCall* call = malloc(sizeof(obusd_RpcCall));
+	int cap = 4;
+	if(!call || !(call->frames = malloc(sizeof(zmq_msg_t) * cap))){
+		free(call);
+		return 1;
+	}
+	
+	zmq_msg_init(&call->frames[0]);
+	zmq_msg_move(&call->frames[0], msg);
+	zmq_msg_init(&call->frames[1]);
+	zmq_msg_copy(&call->frames[1], &req->identity);
+	call->count = 2;
+
+	int more = 1;
+	while(more){
+		if(call->count == cap){
+			cap *= 2;
+			zmq_msg_t* tmpFrames = realloc(call->frames, sizeof(zmq_msg_t) * cap);
+			if(!tmpFrames){
+				_obusd_rpcCallFree(call);
+				return 1;
+			}
+			call->frames = tmpFrames;
+		}
+		
+		zmq_msg_init(&call->frames[call->count]);
+		if(zmq_msg_recv(&call->frames[call->count], sock, 0) < 0){
+			fputs("Failed to receive message.\n", stderr);
+			zmq_msg_close(&call->frames[call->count]);
+			_obusd_rpcCallFree(call);
+			return 1;
+		}
+		more = zmq_msg_more(&call->frames[call->count]);
+		call->count++;
+	}
+
+	pthread_mutex_lock(&obusd_rpcLock);
+	_obusd_rpcInit();
+
+	const char* failure = NULL;
+	GQueue* stranded = NULL;
+	GQueue lost = G_QUEUE_INIT;
+	obusd_ServiceWorker* worker = NULL;
+	
+	unsigned char id[OBUSD_RPC_MAX_IDENTITY_LEN];
+	size_t idLen = 0;
+	
+	obusd_Service* service = g_hash_table_lookup(obusd_rpcServices, name);
+	if(service){
+		stranded = _obusd_rpcExpire(service, &lost);
+	}
+	
+	if(!service || service->workers->len == 0){
+		failure = OBUSD_RPC_REPLY_PREFIX "error no such service";
+	}else if((worker = _obusd_rpcPick(service))){
+		if(_obusd_rpcAddInFlight(worker, call) != 0){
+			failure = OBUSD_RPC_REPLY_PREFIX "error busy";
+		}
+		idLen = worker->idLen;
+		memcpy(id, worker->id, idLen);
+	}else if(g_queue_get_length(service->queued) < OBUSD_RPC_MAX_QUEUED){
+		g_queue_push_tail(service->queued, call);
+		call = NULL;
+	}else{
+		failure = OBUSD_RPC_REPLY_PREFIX "error busy";
+	}
+	
+	pthread_mutex_unlock(&obusd_rpcLock);
+
+	unsigned char ret = _obusd_rpcFailLost(sock, &lost);
+	
+	if(stranded && _obusd_rpcFailStranded(sock, stranded) != 0){
+		ret = 1;
+	}
+	
+	if(call){
+		if(ret == 0){
+			if(failure){
+				obusd_log(OBUSD_LOG_DEBUG, "Call to service %s failed: %s", name, failure);
+				ret = _obusd_rpcFailCall(sock, call, failure);
+			}else{
+				ret = _obusd_rpcSendCall(sock, id, idLen, call);
+			}
+		}
+		_obusd_rpcCallFree(call);
+	}
+
+	return ret;
+}
+
+/*
+ * Passes a worker's [$reply:][caller][tag][body]... back to the caller,
+ * provided the sender is a registered worker answering a call it was sent.
+ */
+static unsigned char _obusd_rpcReply(zmq_msg_t* msg, obusd_Request* req){
+	void* sock = req->zmq_resp;
+	
+	if(!zmq_msg_more(msg)){
+		return 0;
+	}
+
+	zmq_msg_t head;
+	zmq_msg_t caller;
+	zmq_msg_t tag;
+	zmq_msg_init(&head);
+	zmq_msg_move(&head, msg);
+	zmq_msg_init(&caller);
+	zmq_msg_init(&tag);
+	
+	unsigned char ret = 0;
+	int more = 0;
+	
+	if(zmq_msg_recv(&caller, sock, 0) < 0){
+		fputs("Failed to receive message.\n", stderr);
+		ret = 1;
+	}else if(zmq_msg_more(&caller)){
+		if(zmq_msg_recv(&tag, sock, 0) < 0){
+			fputs("Failed to receive message.\n", stderr);
+			ret = 1;
+		}else{
+			more = zmq_msg_more(&tag);
+		}
+	}
+	
+	//The reply frees up one of the worker's credits
+	obusd_Service* service = NULL;
+	GQueue* stranded = NULL;
+	GQueue lost = G_QUEUE_INIT;
+	unsigned char accepted = 0;
+	
+	if(ret == 0){
+		pthread_mutex_lock(&obusd_rpcLock);
+		_obusd_rpcInit();
+		
+		obusd_ServiceWorker* worker = _obusd_rpcFindWorker(&req->identity);
+		if(worker && _obusd_rpcTakeInFlight(worker, &caller, &tag)){
+			accepted = 1;
+			worker->lastSeen = g_get_monotonic_time();
+			service = worker->service;
+			stranded = _obusd_rpcExpire(service, &lost);
+		}
+		
+		pthread_mutex_unlock(&obusd_rpcLock);
+	}
+
+	if(ret == 0 && !accepted){
+		obusd_log(OBUSD_LOG_DEBUG, "Dropped a reply from a peer that does not owe it");
+		ret = _obusd_rpcDrain(msg, sock, more);
+	}else if(ret == 0){
+		ret = _obusd_rpcSend(&caller, sock, 1);
+		if(ret == 0 && zmq_send(sock, "", 0, ZMQ_SNDMORE) < 0){
+			fputs("Failed to send message.\n", stderr);
+			ret = 1;
+		}
+		if(ret == 0){
+			ret = _obusd_rpcSend(&head, sock, 1);
+		}
+		if(ret == 0){
+			ret = _obusd_rpcSend(&tag, sock, more);
+		}
+		if(ret == 0 && more){
+			ret = obusd_relay(msg, sock, sock);
+		}
+	}
+
+	zmq_msg_close(&head);
+	zmq_msg_close(&caller);
+	zmq_msg_close(&tag);
+
+	if(_obusd_rpcFailLost(sock, &lost) != 0){
+		ret = 1;
+	}
+	if(stranded && _obusd_rpcFailStranded(sock, stranded) != 0){
+		ret = 1;
+	}
+	if(ret == 0 && service){
+		ret = _obusd_rpcDispatchQueued(sock, service);
+	}
+	return ret;
+}
+
+/*
+ * Handles a request whose first chunk, msg, is an RPC command, reading the
+ * rest of its frames. Everything goes out on req->zmq_resp: answers to the
+ * sender echo its delimiter, calls and replies passed on to another peer
+ * always have one.
+ */
+unsigned char obusd_rpcHandle(zmq_msg_t* msg, obusd_Request* req){
+	const char* data = zmq_msg_data(msg);
+	size_t len = zmq_msg_size(msg);
+	
+	if(_obusd_rpcHasPrefix(data, len, OBUSD_RPC_REGISTER_PREFIX)){
+		return _obusd_rpcRegister(msg, req);
+	}else if(_obusd_rpcHasPrefix(data, len, OBUSD_RPC_UNREGISTER_PREFIX)){
+		return _obusd_rpcUnregister(msg, req);
+	}else if(_obusd_rpcHasPrefix(data, len, OBUSD_RPC_HEARTBEAT_PREFIX)){
+		return _obusd_rpcHeartbeat(msg, req);
+	}else if(_obusd_rpcHasPrefix(data, len, OBUSD_RPC_CALL_PREFIX)){
+		return _obusd_rpcCall(msg, req);
+	}else if(_obusd_rpcHasPrefix(data, len, OBUSD_RPC_REPLY_PREFIX)){
+		return _obusd_rpcReply(msg, req);
+	}
+	return _obusd_rpcDrain(msg, req->zmq_resp, zmq_msg_more(msg));
+}
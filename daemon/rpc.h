@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_RPC_H_
+#define OBUSD_RPC_H_
+
+#include "obusd.h"
+
+#include <stddef.h>
+
+#include <zmq.h>
+
+/*
+ * A service worker registers with [""]["$register:<name> [credits]"],
+ * offering to take up to credits calls at once, then gets calls as
+ * [""]["$call:<name>"][caller][tag][body]... and answers them with
+ * [""]["$reply:"][caller][tag][body]... Each reply gives a credit back.
+ * Workers send [""]["$heartbeat:"] at least every rpc_heartbeat_ms and are
+ * dropped after missing OBUSD_RPC_LIVENESS of them; the daemon answers
+ * with "$heartbeat:", or "$heartbeat:unknown" when the worker has to
+ * register again. [""]["$unregister:"] leaves.
+ *
+ * A caller sends [""]["$call:<name>"][tag][body]... and gets back
+ * [""]["$reply:"][tag][body]..., or [""]["$reply:error <reason>"][tag].
+ * The tag is the caller's own, so it can have many calls in flight.
+ *
+ * Like every command these lead with OBUS_COMMAND_MARKER, so they take no
+ * topic away from publishers: a message of topic "call:" is published.
+ */
+#define OBUSD_RPC_REGISTER_PREFIX "$register:"
+#define OBUSD_RPC_UNREGISTER_PREFIX "$unregister:"
+#define OBUSD_RPC_HEARTBEAT_PREFIX "$heartbeat:"
+#define OBUSD_RPC_CALL_PREFIX "$call:"
+#define OBUSD_RPC_REPLY_PREFIX "$reply:"
+
+#define OBUSD_RPC_MAX_SERVICE_LEN 128
+//ZeroMQ identities are at most 255 bytes
+#define OBUSD_RPC_MAX_IDENTITY_LEN 255
+
+#define OBUSD_RPC_DEFAULT_HEARTBEAT_MS 2500
+#define OBUSD_RPC_LIVENESS 3
+#define OBUSD_RPC_MAX_CREDITS 1024
+//Calls held per service while all of its workers are busy
+#define OBUSD_RPC_MAX_QUEUED 1024
+
+//Set by the main thread, also on a reload
+extern atomic_int obusd_rpcHeartbeat;
+
+unsigned char obusd_rpcIsCommand(const char* data, size_t len);
+unsigned char obusd_rpcHandle(zmq_msg_t* msg, obusd_Request* req);
+
+#endif
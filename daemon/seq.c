@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "seq.h"
+#include "obus.h"
+#include "obusd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+/*
+ * Per-topic sequence numbers. Requests are sharded on their topic, so a
+ * topic is only ever numbered by one worker, which keeps its own table
+ * and needs no lock. The last sequence the journal holds for each topic
+ * is read at startup, before any worker runs, and a worker starts a topic
+ * from there the first time it sees it.
+ *
+ * Topics are keyed by their bytes and length, as an enveloped message's
+ * topic frame may hold anything, NULs included.
+ */
+static GHashTable* obusd_seqJournaled = NULL;
+static __thread GHashTable* obusd_seqTopics = NULL;
+
+//The last topic numbered by this thread, as runs of one topic are common
+static __thread const char* obusd_seqLastTopic = NULL;
+static __thread size_t obusd_seqLastLen = 0;
+static __thread uint64_t* obusd_seqLast = NULL;
+
+static GHashTable* _obusd_seqTable(void){
+	return g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, free);
+}
+
+//Looks up a topic's entry in table, adding one of 0 if create is set
+static uint64_t* _obusd_seqFor(GHashTable* table, const char* topic, size_t topicLen, unsigned char create, GBytes** stored){
+	GBytes* key = g_bytes_new_static(topic, topicLen);
+	
+	uint64_t* last = NULL;
+	if(!g_hash_table_lookup_extended(table, key, (gpointer*)stored, (gpointer*)&last) && create){
+		last = calloc(1, sizeof(uint64_t));
+		if(last){
+			*stored = g_bytes_new(topic, topicLen);
+			g_hash_table_insert(table, *stored, last);
+		}
+	}
+	
+	g_bytes_unref(key);
+	return last;
+}
+
+//Takes the next sequence number of a topic, the first being 1
+uint64_t obusd_seqNext(const char* topic, size_t topicLen){
+	if(obusd_seqLast && obusd_seqLastLen == topicLen && memcmp(obusd_seqLastTopic, topic, topicLen) == 0){
+		return ++*obusd_seqLast;
+	}
+	
+	if(!obusd_seqTopics){
+		obusd_seqTopics = _obusd_seqTable();
+	}
+
+	GBytes* stored = NULL;
+	uint64_t* last = _obusd_seqFor(obusd_seqTopics, topic, topicLen, 0, &stored);
+	if(!last){
+		last = _obusd_seqFor(obusd_seqTopics, topic, topicLen, 1, &stored);
+		if(!last){
+			return 0;
+		}
+		
+		GBytes* unused;
+		uint64_t* journaled = obusd_seqJournaled ? _obusd_seqFor(obusd_seqJournaled, topic, topicLen, 0, &unused) : NULL;
+		*last = journaled ? *journaled : 0;
+	}
+
+	obusd_seqLastTopic = g_bytes_get_data(stored, NULL);
+	obusd_seqLastLen = topicLen;
+	obusd_seqLast = last;
+	
+	return ++*last;
+}
+
+//Moves a topic's sequence past seq, for messages already journaled. Only called before the workers start.
+void obusd_seqSeen(const char* topic, size_t topicLen, uint64_t seq){
+	if(!obusd_seqJournaled){
+		obusd_seqJournaled = _obusd_seqTable();
+	}
+
+	GBytes* stored;
+	uint64_t* last = _obusd_seqFor(obusd_seqJournaled, topic, topicLen, 1, &stored);
+	if(last && seq > *last){
+		*last = seq;
+	}
+}
+
+void obusd_seqHeaderInit(obus_SeqHeader* hdr, uint64_t seq, uint8_t flags){
+	memcpy(hdr->magic, OBUS_SEQ_MAGIC, sizeof(hdr->magic));
+	hdr->version = OBUS_SEQ_VERSION;
+	hdr->flags = flags;
+	memset(hdr->reserved, 0, sizeof(hdr->reserved));
+	hdr->seq = obus_htonll(seq);
+}
+
+//Sends the obus_SeqHeader frame that follows a message's first chunk
+unsigned char obusd_publishSeq(void* zmq_pub, uint64_t seq, uint8_t flags, int more){
+	obus_SeqHeader hdr;
+	obusd_seqHeaderInit(&hdr, seq, flags);
+
+	zmq_msg_t frame;
+	zmq_msg_init_size(&frame, sizeof(hdr));
+	memcpy(zmq_msg_data(&frame), &hdr, sizeof(hdr));
+
+	unsigned char r = obusd_publishFrame(&frame, zmq_pub, 0, more);
+	zmq_msg_close(&frame);
+	
+	return r;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_SEQ_H_
+#define OBUSD_SEQ_H_
+
+#include "obus.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zmq.h>
+
+uint64_t obusd_seqNext(const char* topic, size_t topicLen);
+void obusd_seqSeen(const char* topic, size_t topicLen, uint64_t seq);
+
+void obusd_seqHeaderInit(obus_SeqHeader* hdr, uint64_t seq, uint8_t flags);
+unsigned char obusd_publishSeq(void* zmq_pub, uint64_t seq, uint8_t flags, int more);
+
+#endif
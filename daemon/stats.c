@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include "subs.h"
+#include "fanout.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <glib.h>
+#include <json.h>
+#include <zmq.h>
+
+/*
+ * Every thread that routes messages keeps its own table of counters, and
+ * is the only one to write them, so counting takes neither a lock nor an
+ * atomic read-modify-write. The table's lock is only taken to add a topic
+ * to it, and by the stats endpoint while it merges the tables.
+ *
+ * Topics are keyed by their bytes and length, as an enveloped message's
+ * topic frame may hold NULs. A table holds at most OBUSD_STATS_MAX_TOPICS
+ * of them, so that a stream of one-off topics cannot grow it without
+ * bound, and counts those past it together in its other counters.
+ */
+typedef struct _obusd_TopicCounters{
+	atomic_uint_fast64_t msgsIn;
+	atomic_uint_fast64_t msgsOut;
+	atomic_uint_fast64_t bytesIn;
+	atomic_uint_fast64_t bytesOut;
+	atomic_uint_fast64_t drops;
+	atomic_uint_fast64_t conflated;
+	atomic_uint_fast64_t latency[OBUSD_STATS_LATENCY_BUCKETS];
+} _obusd_TopicCounters;
+
+typedef struct obusd_StatsTable{
+	pthread_mutex_t lock;
+	GHashTable* topics;
+	_obusd_TopicCounters other;
+	unsigned char hasOther;
+} obusd_StatsTable;
+
+static pthread_mutex_t obusd_statsTablesLock = PTHREAD_MUTEX_INITIALIZER;
+static GPtrArray* obusd_statsTables = NULL;
+
+static __thread obusd_StatsTable* obusd_statsLocal = NULL;
+
+//The topic last counted by this thread, as runs of one topic are common
+static __thread const char* obusd_statsLastTopic = NULL;
+static __thread size_t obusd_statsLastLen = 0;
+static __thread _obusd_TopicCounters* obusd_statsLast = NULL;
+
+static gint64 obusd_statsStartedAt = 0;
+
+unsigned char obusd_statsThreadInit(){
+	if(obusd_statsLocal){
+		return 0;
+	}
+	
+	obusd_StatsTable* table = calloc(1, sizeof(obusd_StatsTable));
+	if(!table){
+		return 1;
+	}
+
+	pthread_mutex_init(&table->lock, NULL);
+	table->topics = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, free);
+
+	pthread_mutex_lock(&obusd_statsTablesLock);
+	if(!obusd_statsTables){
+		obusd_statsTables = g_ptr_array_new();
+	}
+	g_ptr_array_add(obusd_statsTables, table);
+	pthread_mutex_unlock(&obusd_statsTablesLock);
+
+	obusd_statsLocal = table;
+	
+	return 0;
+}
+
+//Only ever called by the thread owning the table
+static _obusd_TopicCounters* _obusd_statsFor(obusd_StatsTable* table, const char* topic, size_t topicLen){
+	if(obusd_statsLast && obusd_statsLastLen == topicLen && memcmp(obusd_statsLastTopic, topic, topicLen) == 0){
+		return obusd_statsLast;
+	}
+	
+	GBytes* key = g_bytes_new_static(topic, topicLen);
+
+	GBytes* stored = NULL;
+	_obusd_TopicCounters* counters = NULL;
+	unsigned char found = g_hash_table_lookup_extended(table->topics, key, (gpointer*)&stored, (gpointer*)&counters);
+	g_bytes_unref(key);
+	
+	if(!found){
+		if(g_hash_table_size(table->topics) >= OBUSD_STATS_MAX_TOPICS){
+			if(!table->hasOther){
+				pthread_mutex_lock(&table->lock);
+				table->hasOther = 1;
+				pthread_mutex_unlock(&table->lock);
+			}
+			//Not remembered, as the next message may well be of another one-off topic
+			return &table->other;
+		}
+		
+		counters = calloc(1, sizeof(_obusd_TopicCounters));
+		if(!counters){
+			return NULL;
+		}
+		stored = g_bytes_new(topic, topicLen);
+		
+		pthread_mutex_lock(&table->lock);
+		g_hash_table_insert(table->topics, stored, counters);
+		pthread_mutex_unlock(&table->lock);
+	}
+
+	obusd_statsLastTopic = g_bytes_get_data(stored, NULL);
+	obusd_statsLastLen = topicLen;
+	obusd_statsLast = counters;
+	
+	return counters;
+}
+
+static inline void _obusd_statsAdd(atomic_uint_fast64_t* counter, uint64_t n){
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void obusd_statsIn(const char* topic, size_t topicLen, size_t bytes){
+	obusd_StatsTable* table = obusd_statsLocal;
+	if(!table){
+		return;
+	}
+
+	_obusd_TopicCounters* counters = _obusd_statsFor(table, topic, topicLen);
+	if(counters){
+		_obusd_statsAdd(&counters->msgsIn, 1);
+		_obusd_statsAdd(&counters->bytesIn, bytes);
+	}
+}
+
+void obusd_statsOut(const char* topic, size_t topicLen, size_t bytes, int64_t latency){
+	obusd_StatsTable* table = obusd_statsLocal;
+	if(!table){
+		return;
+	}
+
+	int bucket = 0;
+	while(bucket < OBUSD_STATS_LATENCY_BUCKETS - 1 && latency >= ((int64_t)1 << bucket)){
+		bucket++;
+	}
+
+	_obusd_TopicCounters* counters = _obusd_statsFor(table, topic, topicLen);
+	if(counters){
+		_obusd_statsAdd(&counters->msgsOut, 1);
+		_obusd_statsAdd(&counters->bytesOut, bytes);
+		_obusd_statsAdd(&counters->latency[bucket], 1);
+	}
+}
+
+void obusd_statsDrop(const char* topic, size_t topicLen, unsigned long count){
+	obusd_StatsTable* table = obusd_statsLocal;
+	if(!table){
+		return;
+	}
+
+	_obusd_TopicCounters* counters = _obusd_statsFor(table, topic, topicLen);
+	if(counters){
+		_obusd_statsAdd(&counters->drops, count);
+	}
+}
+
+/*
+ * Moves count messages of bytes, already counted out by the worker that
+ * sent them on, to the drops. The worker's table still holds them as out,
+ * so this table holds the difference, and merging the two comes out
+ * right. Their latencies stay counted.
+ */
+void obusd_statsLost(const char* topic, size_t topicLen, unsigned long count, size_t bytes){
+	obusd_StatsTable* table = obusd_statsLocal;
+	if(!table){
+		return;
+	}
+
+	_obusd_TopicCounters* counters = _obusd_statsFor(table, topic, topicLen);
+	if(counters){
+		_obusd_statsAdd(&counters->msgsOut, -(uint64_t)count);
+		_obusd_statsAdd(&counters->bytesOut, -(uint64_t)bytes);
+		_obusd_statsAdd(&counters->drops, count);
+	}
+}
+
+void obusd_statsConflate(const char* topic, size_t topicLen, unsigned long count){
+	obusd_StatsTable* table = obusd_statsLocal;
+	if(!table){
+		return;
+	}
+
+	_obusd_TopicCounters* counters = _obusd_statsFor(table, topic, topicLen);
+	if(counters){
+		_obusd_statsAdd(&counters->conflated, count);
+	}
+}
+
+static void _obusd_statsMerge(obusd_TopicStats* dst, _obusd_TopicCounters* src){
+	dst->msgsIn += atomic_load_explicit(&src->msgsIn, memory_order_relaxed);
+	dst->msgsOut += atomic_load_explicit(&src->msgsOut, memory_order_relaxed);
+	dst->bytesIn += atomic_load_explicit(&src->bytesIn, memory_order_relaxed);
+	dst->bytesOut += atomic_load_explicit(&src->bytesOut, memory_order_relaxed);
+	dst->drops += atomic_load_explicit(&src->drops, memory_order_relaxed);
+	dst->conflated += atomic_load_explicit(&src->conflated, memory_order_relaxed);
+
+	int b;
+	for(b = 0; b < OBUSD_STATS_LATENCY_BUCKETS; b++){
+		dst->latency[b] += atomic_load_explicit(&src->latency[b], memory_order_relaxed);
+	}
+}
+
+/*
+ * Merges every thread's counters for topics starting with prefix, keyed
+ * by the topic up to any NUL, as that is all a JSON name can hold. The
+ * topics past each thread's limit are merged into other, which is left
+ * NULL if there are none.
+ */
+static GHashTable* _obusd_statsCollect(const char* prefix, size_t prefixLen, obusd_TopicStats** other){
+	GHashTable* merged = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	*other = NULL;
+
+	pthread_mutex_lock(&obusd_statsTablesLock);
+	
+	guint i;
+	for(i = 0; obusd_statsTables && i < obusd_statsTables->len; i++){
+		obusd_StatsTable* table = g_ptr_array_index(obusd_statsTables, i);
+
+		pthread_mutex_lock(&table->lock);
+
+		GHashTableIter iter;
+		gpointer key, value;
+		
+		g_hash_table_iter_init(&iter, table->topics);
+		while(g_hash_table_iter_next(&iter, &key, &value)){
+			gsize topicLen;
+			const char* topic = g_bytes_get_data(key, &topicLen);
+			if(topicLen < prefixLen || memcmp(topic, prefix, prefixLen) != 0){
+				continue;
+			}
+			
+			char* name = g_strndup(topic, topicLen);
+			obusd_TopicStats* dst = g_hash_table_lookup(merged, name);
+			if(!dst){
+				dst = calloc(1, sizeof(obusd_TopicStats));
+				if(!dst){
+					g_free(name);
+					continue;
+				}
+				g_hash_table_insert(merged, name, dst);
+			}else{
+				g_free(name);
+			}
+
+			_obusd_statsMerge(dst, value);
+		}
+
+		if(table->hasOther){
+			if(!*other){
+				*other = calloc(1, sizeof(obusd_TopicStats));
+			}
+			if(*other){
+				_obusd_statsMerge(*other, &table->other);
+			}
+		}
+		
+		pthread_mutex_unlock(&table->lock);
+	}
+	
+	pthread_mutex_unlock(&obusd_statsTablesLock);
+
+	return merged;
+}
+
+static struct json_object* _obusd_statsTopicToJSON(obusd_TopicStats* stats){
+	struct json_object* jtopic = json_object_new_object();
+	json_object_object_add(jtopic, "msgs_in", json_object_new_int64(stats->msgsIn));
+	json_object_object_add(jtopic, "msgs_out", json_object_new_int64(stats->msgsOut));
+	json_object_object_add(jtopic, "bytes_in", json_object_new_int64(stats->bytesIn));
+	json_object_object_add(jtopic, "bytes_out", json_object_new_int64(stats->bytesOut));
+	json_object_object_add(jtopic, "drops", json_object_new_int64(stats->drops));
+	json_object_object_add(jtopic, "conflated", json_object_new_int64(stats->conflated));
+
+	//Only non-empty buckets, as [upper bound in us, count] pairs.
+	//The last bucket has no upper bound and uses -1.
+	struct json_object* jlatency = json_object_new_array();
+		
+	int b;
+	for(b = 0; b < OBUSD_STATS_LATENCY_BUCKETS; b++){
+		if(stats->latency[b] == 0){
+			continue;
+		}
+			
+		struct json_object* jbucket = json_object_new_array();
+		json_object_array_add(jbucket, json_object_new_int64(b < OBUSD_STATS_LATENCY_BUCKETS - 1 ? ((int64_t)1 << b) : -1));
+		json_object_array_add(jbucket, json_object_new_int64(stats->latency[b]));
+		json_object_array_add(jlatency, jbucket);
+	}
+	json_object_object_add(jtopic, "latency_us", jlatency);
+
+	return jtopic;
+}
+
+static struct json_object* _obusd_statsToJSON(GHashTable* merged, obusd_TopicStats* other, const char* prefix, size_t prefixLen){
+	struct json_object* jtopics = json_object_new_object();
+
+	GHashTableIter iter;
+	gpointer key, value;
+		
+	g_hash_table_iter_init(&iter, merged);
+	while(g_hash_table_iter_next(&iter, &key, &value)){
+		struct json_object* jtopic = _obusd_statsTopicToJSON(value);
+		json_object_object_add(jtopic, "subscribers", json_object_new_int64(obusd_subsCovering(key, strlen(key))));
+		json_object_object_add(jtopics, key, jtopic);
+	}
+
+	struct json_object* jobj = json_object_new_object();
+	json_object_object_add(jobj, "uptime_s", json_object_new_int64((g_get_monotonic_time() - obusd_statsStartedAt) / G_USEC_PER_SEC));
+	json_object_object_add(jobj, "topics", jtopics);
+	//Topics past OBUSD_STATS_MAX_TOPICS, whatever the prefix asked for
+	if(other){
+		json_object_object_add(jobj, "other_topics", _obusd_statsTopicToJSON(other));
+	}
+	json_object_object_add(jobj, "subscriptions", obusd_subsToJSON(prefix, prefixLen));
+	if(obusd_fanoutRunning()){
+		json_object_object_add(jobj, "queued_subscribers", obusd_fanoutToJSON());
+	}
+
+	return jobj;
+}
+
+/*
+ * Answers each request on the stats endpoint with the counters of every
+ * topic starting with the request's payload, so an empty request gets all
+ * of them, along with the prefixes subscribed to.
+ */
+static void* _obusd_statsMain(void* vdSock){
+	void* zmq_rep = vdSock;
+
+	zmq_msg_t req;
+	zmq_msg_init(&req);
+
+	while(1){
+		int r = zmq_msg_recv(&req, zmq_rep, 0);
+		if(r < 0){
+			if(errno == ETERM){
+				break;
+			}
+			continue;
+		}
+
+		//Only the first frame is used as the prefix
+		int more = zmq_msg_more(&req);
+		if(more){
+			zmq_msg_t extra;
+			zmq_msg_init(&extra);
+			while(more && zmq_msg_recv(&extra, zmq_rep, 0) >= 0){
+				more = zmq_msg_more(&extra);
+			}
+			zmq_msg_close(&extra);
+		}
+
+		size_t prefixLen = strnlen(zmq_msg_data(&req), zmq_msg_size(&req));
+		
+		obusd_TopicStats* other;
+		GHashTable* merged = _obusd_statsCollect(zmq_msg_data(&req), prefixLen, &other);
+		struct json_object* jobj = _obusd_statsToJSON(merged, other, zmq_msg_data(&req), prefixLen);
+		g_hash_table_destroy(merged);
+		free(other);
+
+		const char* str = json_object_to_json_string(jobj);
+		zmq_send(zmq_rep, str, strlen(str), 0);
+
+		json_object_put(jobj);
+	}
+
+	zmq_msg_close(&req);
+	zmq_close(zmq_rep);
+	
+	return NULL;
+}
+
+unsigned char obusd_statsStart(void* zmq_ctx, const char* endpoint){
+	obusd_statsStartedAt = g_get_monotonic_time();
+	
+	void* zmq_rep = zmq_socket(zmq_ctx, ZMQ_REP);
+	if(zmq_bind(zmq_rep, endpoint) != 0){
+		fprintf(stderr, "Failed to bind %s\n", endpoint);
+		zmq_close(zmq_rep);
+		return 1;
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _obusd_statsMain, zmq_rep) != 0){
+		zmq_close(zmq_rep);
+		return 1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
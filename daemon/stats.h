@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBUSD_STATS_H_
+#define OBUSD_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Bucket i counts latencies under 2^i microseconds, the last one the rest
+#define OBUSD_STATS_LATENCY_BUCKETS 24
+
+//Topics a thread counts on their own, any more being counted together as "other"
+#define OBUSD_STATS_MAX_TOPICS 10000
+
+//A topic's counters, merged from every thread's
+typedef struct obusd_TopicStats{
+	uint64_t msgsIn;
+	uint64_t msgsOut;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t drops;
+	//Held back and replaced by a newer message of the same entity
+	uint64_t conflated;
+	uint64_t latency[OBUSD_STATS_LATENCY_BUCKETS];
+} obusd_TopicStats;
+
+unsigned char obusd_statsThreadInit();
+
+void obusd_statsIn(const char* topic, size_t topicLen, size_t bytes);
+void obusd_statsOut(const char* topic, size_t topicLen, size_t bytes, int64_t latency);
+void obusd_statsDrop(const char* topic, size_t topicLen, unsigned long count);
+void obusd_statsLost(const char* topic, size_t topicLen, unsigned long count, size_t bytes);
+void obusd_statsConflate(const char* topic, size_t topicLen, unsigned long count);
+
+unsigned char obusd_statsStart(void* zmq_ctx, const char* endpoint);
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "subs.h"
+#include "obusd.h"
+#include "obus.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+/*
+ * Every prefix subscribed to on the XPUB, in a trie with one level per
+ * byte. Each node counts the subscriptions to exactly the prefix that
+ * leads to it; with ZMQ_XPUB_MANUAL, ZeroMQ reports every subscribe and
+ * unsubscribe, including those of subscribers that went away, which main.c
+ * passes on as the subscriber sent them.
+ *
+ * A message has a subscriber if a node with subscriptions lies on the
+ * path its first frame takes through the trie, which is how ZeroMQ
+ * matches them too. The walk stops where the trie does, so it costs at
+ * most the length of the longest subscription.
+ *
+ * A SUB socket subscribing to one prefix more than once sends every
+ * subscribe but only one unsubscribe, and nothing says which subscriber a
+ * message came from, so such a prefix stays counted. libobus subscribes
+ * to each prefix once, however many callbacks share it.
+ */
+typedef struct obusd_SubNode{
+	unsigned long count;
+	int childCount;
+	unsigned char* keys;
+	struct obusd_SubNode** children;
+} obusd_SubNode;
+
+static pthread_rwlock_t obusd_subsLock = PTHREAD_RWLOCK_INITIALIZER;
+static obusd_SubNode obusd_subsRoot;
+//Bumped, with the lock held, by every change to the trie
+static atomic_uint obusd_subsGen = 1;
+
+/*
+ * Per-thread cache of whether a topic has subscribers, valid while the
+ * generation matches. Only topics nobody subscribes to more narrowly are
+ * cached, as the rest of their message doesn't change the answer, so most
+ * messages are matched without taking the lock.
+ */
+#define _OBUSD_SUBS_CACHE_SIZE 256
+
+typedef struct obusd_SubsCached{
+	unsigned int gen;
+	unsigned char matched;
+	size_t topicLen;
+	char topic[OBUSD_MAX_TOPIC_LEN];
+} obusd_SubsCached;
+
+static __thread obusd_SubsCached* obusd_subsCache = NULL;
+
+static obusd_SubNode* _obusd_subChild(obusd_SubNode* node, unsigned char key){
+	int i;
+	for(i = 0; i < node->childCount; i++){
+		if(node->keys[i] == key){
+			return node->children[i];
+		}
+	}
+	return NULL;
+}
+
+static obusd_SubNode* _obusd_subAddChild(obusd_SubNode* node, unsigned char key){
+	obusd_SubNode* child = calloc(1, sizeof(obusd_SubNode));
+	if(!child){
+		return NULL;
+	}
+
+	unsigned char* tmpKeys = realloc(node->keys, node->childCount + 1);
+	if(!tmpKeys){
+		free(child);
+		return NULL;
+	}
+	node->keys = tmpKeys;
+
+	obusd_SubNode** tmpChildren = realloc(node->children, sizeof(obusd_SubNode*) * (node->childCount + 1));
+	if(!tmpChildren){
+		free(child);
+		return NULL;
+	}
+	node->children = tmpChildren;
+
+	node->keys[node->childCount] = key;
+	node->children[node->childCount] = child;
+	node->childCount++;
+	
+	return child;
+}
+
+//Frees the nodes below node that no longer lead to any subscription
+static void _obusd_subPrune(obusd_SubNode* node, const unsigned char* prefix, size_t len){
+	if(len == 0){
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < node->childCount; i++){
+		if(node->keys[i] != prefix[0]){
+			continue;
+		}
+
+		obusd_SubNode* child = node->children[i];
+		_obusd_subPrune(child, prefix + 1, len - 1);
+
+		if(child->count == 0 && child->childCount == 0){
+			free(child->keys);
+			free(child->children);
+			free(child);
+			
+			node->childCount--;
+			node->keys[i] = node->keys[node->childCount];
+			node->children[i] = node->children[node->childCount];
+		}
+		return;
+	}
+}
+
+/*
+ * Records a subscription message from the XPUB: a byte that is 1 to
+ * subscribe or 0 to unsubscribe, then the prefix. Returns 1 when it was
+ * the prefix's first subscriber or the last to leave it, which is what
+ * ZeroMQ alone would have reported.
+ */
+unsigned char obusd_subsUpdate(const char* data, size_t len){
+	if(len < 1 || (data[0] != 0 && data[0] != 1)){
+		return 0;
+	}
+
+	const unsigned char* prefix = (const unsigned char*)data + 1;
+	size_t prefixLen = len - 1;
+	unsigned char changed = 0;
+	
+	pthread_rwlock_wrlock(&obusd_subsLock);
+
+	obusd_SubNode* node = &obusd_subsRoot;
+	
+	size_t i;
+	for(i = 0; node && i < prefixLen; i++){
+		obusd_SubNode* child = _obusd_subChild(node, prefix[i]);
+		if(!child && data[0] == 1){
+			child = _obusd_subAddChild(node, prefix[i]);
+		}
+		node = child;
+	}
+
+	atomic_fetch_add_explicit(&obusd_subsGen, 1, memory_order_relaxed);
+
+	if(data[0] == 1){
+		if(node){
+			changed = node->count++ == 0;
+		}else{
+			obusd_log(OBUSD_LOG_ERROR, "Out of memory indexing a subscription");
+		}
+	}else if(node && node->count > 0){
+		changed = --node->count == 0;
+		if(changed){
+			_obusd_subPrune(&obusd_subsRoot, prefix, prefixLen);
+		}
+	}
+
+	pthread_rwlock_unlock(&obusd_subsLock);
+
+	if(changed && obusd_logEnabled(OBUSD_LOG_DEBUG)){
+		obusd_log(OBUSD_LOG_DEBUG, "%s %.*s", data[0] == 1 ? "Subscribed to" : "Unsubscribed from", (int)prefixLen, (const char*)prefix);
+	}
+	
+	return changed;
+}
+
+/*
+ * Whether anyone subscribes to a message whose first frame is data. If
+ * narrower isn't NULL, it is set when someone subscribes to a prefix
+ * longer than the first topicLen bytes, the message's topic, which a
+ * frame holding only the topic wouldn't match.
+ */
+unsigned char obusd_subsMatch(const char* data, size_t len, size_t topicLen, unsigned char* narrower){
+	const unsigned char* bytes = (const unsigned char*)data;
+	unsigned char matched = 0;
+	unsigned char deeper = 0;
+
+	if(narrower){
+		*narrower = 0;
+	}
+	if(topicLen > len){
+		topicLen = len;
+	}
+
+	obusd_SubsCached* cached = NULL;
+	if(topicLen <= OBUSD_MAX_TOPIC_LEN){
+		if(!obusd_subsCache){
+			obusd_subsCache = calloc(_OBUSD_SUBS_CACHE_SIZE, sizeof(obusd_SubsCached));
+		}
+		if(obusd_subsCache){
+			cached = &obusd_subsCache[obus_hash(data, topicLen) % _OBUSD_SUBS_CACHE_SIZE];
+			if(cached->gen == atomic_load_explicit(&obusd_subsGen, memory_order_relaxed) && cached->topicLen == topicLen && memcmp(cached->topic, data, topicLen) == 0){
+				return cached->matched;
+			}
+		}
+	}
+	
+	pthread_rwlock_rdlock(&obusd_subsLock);
+
+	unsigned int gen = atomic_load_explicit(&obusd_subsGen, memory_order_relaxed);
+	obusd_SubNode* node = &obusd_subsRoot;
+	
+	size_t i = 0;
+	while(node){
+		matched = matched || node->count > 0;
+		if(i == topicLen){
+			deeper = node->childCount > 0;
+		}
+		if(matched && i >= topicLen){
+			break;
+		}
+		node = i < len ? _obusd_subChild(node, bytes[i]) : NULL;
+		i++;
+	}
+
+	pthread_rwlock_unlock(&obusd_subsLock);
+
+	if(deeper){
+		if(narrower){
+			*narrower = 1;
+		}
+	}else if(cached){
+		cached->gen = gen;
+		cached->matched = matched;
+		cached->topicLen = topicLen;
+		memcpy(cached->topic, data, topicLen);
+	}
+	
+	return matched;
+}
+
+//How many subscriptions cover all of topic, those to it and to any shorter prefix
+unsigned long obusd_subsCovering(const char* topic, size_t topicLen){
+	const unsigned char* bytes = (const unsigned char*)topic;
+	unsigned long count = 0;
+	
+	pthread_rwlock_rdlock(&obusd_subsLock);
+
+	obusd_SubNode* node = &obusd_subsRoot;
+	
+	size_t i = 0;
+	while(node){
+		count += node->count;
+		node = i < topicLen ? _obusd_subChild(node, bytes[i++]) : NULL;
+	}
+
+	pthread_rwlock_unlock(&obusd_subsLock);
+	
+	return count;
+}
+
+//Called with the lock held. path holds the len bytes leading to node
+static void _obusd_subsCollect(obusd_SubNode* node, char** path, size_t* pathCap, size_t len, const char* prefix, size_t prefixLen, struct json_object* jsubs){
+	if(node->count > 0 && len >= prefixLen){
+		char key[len + 1];
+		memcpy(key, *path, len);
+		key[len] = '\0';
+		json_object_object_add(jsubs, key, json_object_new_int64(node->count));
+	}
+
+	if(len + 1 > *pathCap){
+		size_t newCap = *pathCap * 2;
+		char* tmpPath = realloc(*path, newCap);
+		if(!tmpPath){
+			return;
+		}
+		*path = tmpPath;
+		*pathCap = newCap;
+	}
+	
+	int i;
+	for(i = 0; i < node->childCount; i++){
+		//Only branches that can still lead to the prefix, or are past it
+		if(len < prefixLen && node->keys[i] != (unsigned char)prefix[len]){
+			continue;
+		}
+		
+		(*path)[len] = node->keys[i];
+		_obusd_subsCollect(node->children[i], path, pathCap, len + 1, prefix, prefixLen, jsubs);
+	}
+}
+
+/*
+ * Every subscribed prefix starting with prefix, as an object of prefix to
+ * subscription count. Content filters are included as the "?expr" topics
+ * they subscribe to, with the NUL left off.
+ */
+struct json_object* obusd_subsToJSON(const char* prefix, size_t prefixLen){
+	struct json_object* jsubs = json_object_new_object();
+
+	size_t pathCap = 64;
+	char* path = malloc(pathCap);
+	if(!path){
+		return jsubs;
+	}
+	
+	pthread_rwlock_rdlock(&obusd_subsLock);
+	_obusd_subsCollect(&obusd_subsRoot, &path, &pathCap, 0, prefix, prefixLen, jsubs);
+	pthread_rwlock_unlock(&obusd_subsLock);
+
+	free(path);
+	return jsubs;
+}
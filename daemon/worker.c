@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "obusd.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+/*
+ * Workers report on their backend whether they started, as a single
+ * byte, then wait to be told to go ahead or to stop, so none of them
+ * handles requests unless all of them can.
+ */
+#define _OBUSD_WORKER_OK 0
+#define _OBUSD_WORKER_FAILED 1
+#define _OBUSD_WORKER_STOP 1
+
+typedef struct obusd_Worker{
+	pthread_t thread;
+	void* zmq_ctx;
+	int id;
+} obusd_Worker;
+
+typedef struct obusd_Publisher{
+	pthread_t thread;
+	void* zmq_pub;
+	void* zmq_pubIn;
+} obusd_Publisher;
+
+//Reports how the worker's start went, and returns what it was told to do
+static unsigned char _obusd_workerReady(void* zmq_req, unsigned char status){
+	if(zmq_send(zmq_req, &status, 1, 0) != 1){
+		return _OBUSD_WORKER_STOP;
+	}
+
+	unsigned char command = _OBUSD_WORKER_STOP;
+	if(zmq_recv(zmq_req, &command, 1, 0) != 1){
+		return _OBUSD_WORKER_STOP;
+	}
+	return command;
+}
+
+static void* _obusd_workerMain(void* vdWorker){
+	obusd_Worker* worker = (obusd_Worker*)vdWorker;
+
+	void* zmq_req = zmq_socket(worker->zmq_ctx, ZMQ_DEALER);
+	//An XPUB rather than a PUB, to see the relay's subscription arrive
+	void* zmq_pub = zmq_socket(worker->zmq_ctx, ZMQ_XPUB);
+
+	int hwm = 0;
+	zmq_setsockopt(zmq_pub, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+	char endpoint[64];
+	snprintf(endpoint, sizeof(endpoint), OBUSD_WORKER_ENDPOINT, worker->id);
+
+	if(zmq_connect(zmq_req, endpoint) != 0 || zmq_connect(zmq_pub, OBUSD_PUB_ENDPOINT) != 0){
+		fprintf(stderr, "Worker %i failed to connect.\n", worker->id);
+		exit(EXIT_FAILURE);
+	}
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	//Until the relay subscribes, anything published would be lost
+	unsigned char status = _OBUSD_WORKER_OK;
+	if(zmq_msg_recv(&msg, zmq_pub, 0) < 0){
+		fprintf(stderr, "Worker %i never heard from the relay.\n", worker->id);
+		status = _OBUSD_WORKER_FAILED;
+	}
+
+	if(status == _OBUSD_WORKER_OK && obusd_threadInit() != 0){
+		fprintf(stderr, "Worker %i failed to start.\n", worker->id);
+		status = _OBUSD_WORKER_FAILED;
+	}
+
+	if(_obusd_workerReady(zmq_req, status) == _OBUSD_WORKER_STOP){
+		zmq_msg_close(&msg);
+		zmq_close(zmq_pub);
+		zmq_close(zmq_req);
+		return NULL;
+	}
+
+	while(1){
+		zmq_pollitem_t items[] = {
+			{zmq_req, 0, ZMQ_POLLIN, 0}
+		};
+
+		zmq_poll(items, 1, obusd_threadTimeout());
+
+		//Peer headers from clients were already dropped by obusd_shardRequest
+		if(items[0].revents & ZMQ_POLLIN){
+			if(obusd_handleRequest(&msg, zmq_req, zmq_pub, 1) != 0){
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if(obusd_threadTick(zmq_pub) != 0){
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	zmq_msg_close(&msg);
+	zmq_close(zmq_pub);
+	zmq_close(zmq_req);
+	
+	return NULL;
+}
+
+//Closes the first count backends and frees them
+static void _obusd_closeBackends(void** backends, int count){
+	int i;
+	for(i = 0; i < count; i++){
+		zmq_close(backends[i]);
+	}
+	free(backends);
+}
+
+/*
+ * Binds one DEALER backend per worker and starts the worker threads.
+ * Messages are sharded onto a backend by an FNV-1a hash of their topic,
+ * so each topic is numbered and published in order by a single worker.
+ * Only commands, which aren't published, go by the sender's identity.
+ * Only returns once every worker is ready to publish, so nothing sent to
+ * them is lost. Returns the array of backends, or NULL on failure, in which
+ * case any workers that did start have been stopped.
+ */
+void** obusd_startWorkers(void* zmq_ctx, int count){
+	void** backends = malloc(sizeof(void*) * count);
+	obusd_Worker* workers = malloc(sizeof(obusd_Worker) * count);
+	if(!backends || !workers){
+		free(backends);
+		free(workers);
+		return NULL;
+	}
+
+	char endpoint[64];
+	
+	int i;
+	for(i = 0; i < count; i++){
+		backends[i] = zmq_socket(zmq_ctx, ZMQ_DEALER);
+		
+		snprintf(endpoint, sizeof(endpoint), OBUSD_WORKER_ENDPOINT, i);
+		if(!backends[i] || zmq_bind(backends[i], endpoint) != 0){
+			fprintf(stderr, "Failed to bind %s\n", endpoint);
+			if(backends[i]){
+				zmq_close(backends[i]);
+			}
+			_obusd_closeBackends(backends, i);
+			free(workers);
+			return NULL;
+		}
+	}
+
+	unsigned char failed = 0;
+	int started;
+	
+	for(started = 0; started < count; started++){
+		workers[started].zmq_ctx = zmq_ctx;
+		workers[started].id = started;
+		
+		if(pthread_create(&workers[started].thread, NULL, _obusd_workerMain, &workers[started]) != 0){
+			fprintf(stderr, "Failed to start worker %i\n", started);
+			failed = 1;
+			break;
+		}
+	}
+
+	for(i = 0; i < started; i++){
+		unsigned char status = _OBUSD_WORKER_FAILED;
+		if(zmq_recv(backends[i], &status, 1, 0) != 1 || status != _OBUSD_WORKER_OK){
+			failed = 1;
+		}
+	}
+
+	unsigned char command = failed ? _OBUSD_WORKER_STOP : _OBUSD_WORKER_OK;
+	for(i = 0; i < started; i++){
+		zmq_send(backends[i], &command, 1, 0);
+	}
+
+	if(failed){
+		for(i = 0; i < started; i++){
+			pthread_join(workers[i].thread, NULL);
+		}
+		_obusd_closeBackends(backends, count);
+		free(workers);
+		return NULL;
+	}
+
+	return backends;
+}
+
+/*
+ * Reads the subscriptions sent to the publisher, and passes on what the
+ * workers publish. Owns both sockets once started, so the main thread
+ * only has requests to shard.
+ */
+static void* _obusd_publisherMain(void* vdPublisher){
+	obusd_Publisher* publisher = (obusd_Publisher*)vdPublisher;
+
+	//For the drops counted in obusd_relayPublished
+	if(obusd_statsThreadInit() != 0){
+		fputs("Publisher failed to start.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	int noDrop = atomic_load(&obusd_pubNoDrop) != 0;
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	while(1){
+		zmq_pollitem_t items[] = {
+			{publisher->zmq_pub, 0, ZMQ_POLLIN, 0},
+			{publisher->zmq_pubIn, 0, ZMQ_POLLIN, 0}
+		};
+
+		if(zmq_poll(items, 2, -1) < 0){
+			if(errno == ETERM){
+				break;
+			}
+			continue;
+		}
+
+		if(items[0].revents & ZMQ_POLLIN){
+			obusd_handleSubscription(&msg, publisher->zmq_pub);
+		}
+
+		//Picks up pub_nodrop after a reload
+		if((atomic_load(&obusd_pubNoDrop) != 0) != noDrop){
+			noDrop = !noDrop;
+			zmq_setsockopt(publisher->zmq_pub, ZMQ_XPUB_NODROP, &noDrop, sizeof(noDrop));
+		}
+
+		if(items[1].revents & ZMQ_POLLIN){
+			if(obusd_relayPublished(&msg, publisher->zmq_pubIn, publisher->zmq_pub) != 0){
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	zmq_msg_close(&msg);
+	return NULL;
+}
+
+//Hands zmq_pub and zmq_pubIn over to a thread of their own
+unsigned char obusd_startPublisher(void* zmq_pub, void* zmq_pubIn){
+	obusd_Publisher* publisher = malloc(sizeof(obusd_Publisher));
+	if(!publisher){
+		return 1;
+	}
+
+	publisher->zmq_pub = zmq_pub;
+	publisher->zmq_pubIn = zmq_pubIn;
+
+	if(pthread_create(&publisher->thread, NULL, _obusd_publisherMain, publisher) != 0){
+		fputs("Failed to start the publisher thread.\n", stderr);
+		free(publisher);
+		return 1;
+	}
+	return 0;
+}
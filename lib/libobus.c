@@ -0,0 +1,1020 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "libobus.h"
+#include "obus.h"
+#include "compress.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include <zmq.h>
+
+typedef struct obus_PoolConn{
+	void* sock;
+	pthread_mutex_t lock;
+} obus_PoolConn;
+
+typedef struct obus_Subscription{
+	char* prefix;
+	size_t prefixLen;
+	obus_MessageFn fn;
+	void* ud;
+} obus_Subscription;
+
+//The daemon's answer on which topics to compress, see obus_publishEnvelope
+typedef struct obus_CodecRule{
+	char* prefix;
+	int codec;
+} obus_CodecRule;
+
+//Milliseconds to wait on the daemon for its compression rules before asking again
+#define OBUS_CLIENT_NEGOTIATE_TIMEOUT 1000
+//Milliseconds between asking for the rules, to pick up a reload of the daemon
+#define OBUS_CLIENT_CODECS_REFRESH 30000
+
+//A subscription change waiting for the receiving thread to make it
+typedef struct obus_SubChange{
+	char* prefix;
+	unsigned char subscribe;
+	//Cleared when the SUB socket already has the prefix
+	unsigned char apply;
+} obus_SubChange;
+
+struct obus_Client{
+	void* zmq_ctx;
+	//Unset when the caller owns zmq_ctx, see obus_clientNewShared
+	unsigned char ownsCtx;
+	char* reqEndpoint;
+
+	//Fetched from the daemon by obus_publishEnvelope, in the background
+	pthread_mutex_t codecLock;
+	void* zmq_codecs;
+	//When the rules were last asked for, and whether the answer is still due
+	long long codecsAskedAt;
+	unsigned char codecsPending;
+	obus_CodecRule* codecRules;
+	int codecRuleCount;
+
+	obus_PoolConn* pool;
+	int poolSize;
+	atomic_uint nextConn;
+
+	//Only used by the thread in obus_poll
+	void* zmq_sub;
+	//Asks for the daemon's cached messages for each new subscription
+	void* zmq_snapshot;
+	//The message being delivered, and its body once decompressed
+	int contentType;
+	int codec;
+	unsigned char cached;
+	const char* payload;
+	size_t payloadLen;
+	void* body;
+	size_t bodyLen;
+	void* zmq_wakeRx;
+	char* buf;
+	size_t bufCap;
+
+	//Guards everything below
+	pthread_mutex_t subLock;
+	void* zmq_wakeTx;
+	obus_Subscription* subs;
+	int subCount;
+	obus_SubChange* changes;
+	int changeCount;
+	unsigned char stopped;
+};
+
+//"type" becomes the "type:" prefix messages of that type start with
+static char* _obus_prefix(const char* type){
+	size_t typeLen = strlen(type);
+	char* prefix = malloc(typeLen + 2);
+	if(!prefix){
+		return NULL;
+	}
+	
+	memcpy(prefix, type, typeLen);
+	if(typeLen > 0){
+		prefix[typeLen++] = ':';
+	}
+	prefix[typeLen] = '\0';
+	return prefix;
+}
+
+static void _obus_clearCodecs(obus_Client* client){
+	int i;
+	for(i = 0; i < client->codecRuleCount; i++){
+		free(client->codecRules[i].prefix);
+	}
+	free(client->codecRules);
+	client->codecRules = NULL;
+	client->codecRuleCount = 0;
+}
+
+/*
+ * Connects to the daemon at host, with requests going to port and
+ * subscriptions to port + 1, as with obus-cli. poolSize publishing
+ * connections are kept, or OBUS_CLIENT_DEFAULT_POOL if it is 0.
+ */
+obus_Client* obus_clientNew(const char* host, int port, int poolSize){
+	char* reqEndpoint = obus_endpoint(NULL, host, port);
+	char* subEndpoint = obus_endpoint(NULL, host, port + 1);
+
+	obus_Client* client = NULL;
+	if(reqEndpoint && subEndpoint){
+		client = obus_clientNewEndpoints(reqEndpoint, subEndpoint, poolSize);
+	}
+	
+	free(reqEndpoint);
+	free(subEndpoint);
+	return client;
+}
+
+/*
+ * Connects to the daemon's bind_rpc and bind_pub endpoints, such as
+ * ipc:///run/obus/rpc for a daemon on the same machine.
+ */
+obus_Client* obus_clientNewEndpoints(const char* reqEndpoint, const char* subEndpoint, int poolSize){
+	return obus_clientNewShared(NULL, reqEndpoint, subEndpoint, poolSize);
+}
+
+/*
+ * As obus_clientNewEndpoints, but on a ZeroMQ context the caller owns and
+ * keeps until the client is freed, so the endpoints may be inproc:// ones
+ * of a daemon running in the same process. A NULL zmq_ctx gives the
+ * client a context of its own.
+ */
+obus_Client* obus_clientNewShared(void* zmq_ctx, const char* reqEndpoint, const char* subEndpoint, int poolSize){
+	obus_Client* client = calloc(1, sizeof(obus_Client));
+	if(!client){
+		return NULL;
+	}
+
+	client->poolSize = poolSize > 0 ? poolSize : OBUS_CLIENT_DEFAULT_POOL;
+	client->pool = calloc(client->poolSize, sizeof(obus_PoolConn));
+	client->ownsCtx = zmq_ctx == NULL;
+	client->zmq_ctx = zmq_ctx ? zmq_ctx : zmq_ctx_new();
+	client->reqEndpoint = strdup(reqEndpoint);
+	pthread_mutex_init(&client->subLock, NULL);
+	pthread_mutex_init(&client->codecLock, NULL);
+	atomic_init(&client->nextConn, 0);
+	
+	if(!client->pool || !client->zmq_ctx || !client->reqEndpoint){
+		obus_clientFree(client);
+		return NULL;
+	}
+
+	unsigned char failed = 0;
+
+	//Give queued messages a moment to go out when the client is freed
+	int linger = 1000;
+	
+	int i;
+	for(i = 0; i < client->poolSize; i++){
+		client->pool[i].sock = zmq_socket(client->zmq_ctx, ZMQ_DEALER);
+		pthread_mutex_init(&client->pool[i].lock, NULL);
+		
+		zmq_setsockopt(client->pool[i].sock, ZMQ_LINGER, &linger, sizeof(linger));
+		if(zmq_connect(client->pool[i].sock, reqEndpoint) != 0){
+			failed = 1;
+		}
+	}
+
+	client->zmq_sub = zmq_socket(client->zmq_ctx, ZMQ_SUB);
+	if(zmq_connect(client->zmq_sub, subEndpoint) != 0){
+		failed = 1;
+	}
+
+	//Nothing is left to wait on when the client is freed
+	int snapshotLinger = 0;
+	client->zmq_snapshot = zmq_socket(client->zmq_ctx, ZMQ_DEALER);
+	zmq_setsockopt(client->zmq_snapshot, ZMQ_LINGER, &snapshotLinger, sizeof(snapshotLinger));
+	if(zmq_connect(client->zmq_snapshot, reqEndpoint) != 0){
+		failed = 1;
+	}
+
+	//Wakes obus_poll when subscriptions change or obus_stop is called
+	char wakeEndpoint[64];
+	snprintf(wakeEndpoint, sizeof(wakeEndpoint), "inproc://obus-wake-%p", (void*)client);
+	
+	client->zmq_wakeRx = zmq_socket(client->zmq_ctx, ZMQ_PAIR);
+	client->zmq_wakeTx = zmq_socket(client->zmq_ctx, ZMQ_PAIR);
+	if(zmq_bind(client->zmq_wakeRx, wakeEndpoint) != 0 || zmq_connect(client->zmq_wakeTx, wakeEndpoint) != 0){
+		failed = 1;
+	}
+
+	if(failed){
+		obus_clientFree(client);
+		return NULL;
+	}
+	
+	return client;
+}
+
+void obus_clientFree(obus_Client* client){
+	if(!client){
+		return;
+	}
+
+	int i;
+	if(client->pool){
+		for(i = 0; i < client->poolSize; i++){
+			if(client->pool[i].sock){
+				zmq_close(client->pool[i].sock);
+				pthread_mutex_destroy(&client->pool[i].lock);
+			}
+		}
+		free(client->pool);
+	}
+
+	if(client->zmq_sub){
+		zmq_close(client->zmq_sub);
+	}
+	if(client->zmq_codecs){
+		zmq_close(client->zmq_codecs);
+	}
+	if(client->zmq_snapshot){
+		zmq_close(client->zmq_snapshot);
+	}
+	if(client->zmq_wakeRx){
+		zmq_close(client->zmq_wakeRx);
+	}
+	if(client->zmq_wakeTx){
+		zmq_close(client->zmq_wakeTx);
+	}
+	if(client->zmq_ctx && client->ownsCtx){
+		zmq_ctx_destroy(client->zmq_ctx);
+	}
+
+	for(i = 0; i < client->subCount; i++){
+		free(client->subs[i].prefix);
+	}
+	free(client->subs);
+	
+	for(i = 0; i < client->changeCount; i++){
+		free(client->changes[i].prefix);
+	}
+	free(client->changes);
+
+	_obus_clearCodecs(client);
+
+	pthread_mutex_destroy(&client->subLock);
+	pthread_mutex_destroy(&client->codecLock);
+	free(client->reqEndpoint);
+	free(client->buf);
+	free(client);
+}
+
+//Takes a free publishing connection, or waits on one if all are in use
+static obus_PoolConn* _obus_poolTake(obus_Client* client){
+	unsigned int start = atomic_fetch_add(&client->nextConn, 1);
+
+	int i;
+	for(i = 0; i < client->poolSize; i++){
+		obus_PoolConn* conn = &client->pool[(start + i) % client->poolSize];
+		if(pthread_mutex_trylock(&conn->lock) == 0){
+			return conn;
+		}
+	}
+
+	obus_PoolConn* conn = &client->pool[start % client->poolSize];
+	pthread_mutex_lock(&conn->lock);
+	return conn;
+}
+
+/*
+ * Publishes a message of the given type without blocking, in chunks of at
+ * most OBUS_DEFAULT_CHUNK_LEN bytes. Returns OBUS_PUBLISH_AGAIN if the
+ * connection's queue is full, in which case nothing was sent.
+ */
+unsigned char obus_publish(obus_Client* client, const char* type, const void* data, size_t len){
+	size_t typeLen = strlen(type);
+	const char* bytes = data;
+
+	size_t firstLen = len < OBUS_DEFAULT_CHUNK_LEN ? len : OBUS_DEFAULT_CHUNK_LEN;
+
+	zmq_msg_t first;
+	if(zmq_msg_init_size(&first, typeLen + 1 + firstLen) != 0){
+		return 1;
+	}
+	memcpy(zmq_msg_data(&first), type, typeLen);
+	((char*)zmq_msg_data(&first))[typeLen] = ':';
+	memcpy((char*)zmq_msg_data(&first) + typeLen + 1, bytes, firstLen);
+
+	obus_PoolConn* conn = _obus_poolTake(client);
+
+	unsigned char ret = 0;
+	
+	//Once the first frame is taken, the rest of the message is too
+	if(zmq_msg_send(&first, conn->sock, ZMQ_DONTWAIT | (firstLen < len ? ZMQ_SNDMORE : 0)) < 0){
+		zmq_msg_close(&first);
+		ret = errno == EAGAIN ? OBUS_PUBLISH_AGAIN : 1;
+	}else if(firstLen < len){
+		ret = obus_sendChunks(conn->sock, bytes + firstLen, len - firstLen, OBUS_DEFAULT_CHUNK_LEN);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+	return ret;
+}
+
+//Milliseconds on a monotonic clock
+static long long _obus_nowMs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Asks the daemon for its a:compress_topics rules, with a connection of
+ * its own so replies can't mix with anything else. Nothing waits on the
+ * answer, which _obus_readCodecs picks up. Must be called with codecLock
+ * held.
+ */
+static void _obus_askCodecs(obus_Client* client, long long now){
+	client->codecsAskedAt = now;
+	
+	if(!client->zmq_codecs){
+		int linger = 0;
+		
+		client->zmq_codecs = zmq_socket(client->zmq_ctx, ZMQ_DEALER);
+		if(!client->zmq_codecs){
+			return;
+		}
+		zmq_setsockopt(client->zmq_codecs, ZMQ_LINGER, &linger, sizeof(linger));
+		
+		if(zmq_connect(client->zmq_codecs, client->reqEndpoint) != 0){
+			zmq_close(client->zmq_codecs);
+			client->zmq_codecs = NULL;
+			return;
+		}
+	}
+
+	if(zmq_send(client->zmq_codecs, "", 0, ZMQ_SNDMORE | ZMQ_DONTWAIT) >= 0){
+		client->codecsPending = zmq_send(client->zmq_codecs, OBUS_COMPRESS_COMMAND, strlen(OBUS_COMPRESS_COMMAND), 0) >= 0;
+	}
+}
+
+/*
+ * Takes the daemon's answer to _obus_askCodecs if it has come, replacing
+ * the rules. Must be called with codecLock held.
+ */
+static void _obus_readCodecs(obus_Client* client){
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	//The empty delimiter, then "$compress:" and a frame for each rule
+	int r = zmq_msg_recv(&msg, client->zmq_codecs, ZMQ_DONTWAIT);
+	if(r < 0){
+		zmq_msg_close(&msg);
+		return;
+	}
+
+	client->codecsPending = 0;
+	_obus_clearCodecs(client);
+
+	int frameIdx = 0;
+	
+	while(r >= 0 && zmq_msg_more(&msg)){
+		r = zmq_msg_recv(&msg, client->zmq_codecs, 0);
+		frameIdx++;
+		if(r < 0 || frameIdx < 2){
+			continue;
+		}
+
+		size_t prefixLen;
+		int codec;
+		if(obus_codecRuleParse(zmq_msg_data(&msg), r, &prefixLen, &codec) != 0){
+			continue;
+		}
+
+		obus_CodecRule* tmpRules = realloc(client->codecRules, sizeof(obus_CodecRule) * (client->codecRuleCount + 1));
+		if(!tmpRules){
+			break;
+		}
+		client->codecRules = tmpRules;
+		
+		char* prefix = strndup(zmq_msg_data(&msg), prefixLen);
+		if(!prefix){
+			break;
+		}
+		client->codecRules[client->codecRuleCount].prefix = prefix;
+		client->codecRules[client->codecRuleCount].codec = codec;
+		client->codecRuleCount++;
+	}
+
+	//Whatever is left of a reply cut short
+	while(r >= 0 && zmq_msg_more(&msg)){
+		r = zmq_msg_recv(&msg, client->zmq_codecs, 0);
+	}
+
+	zmq_msg_close(&msg);
+}
+
+/*
+ * Codec messages of topic are to be compressed with. The rules are asked
+ * for again every OBUS_CLIENT_CODECS_REFRESH, or OBUS_CLIENT_NEGOTIATE_TIMEOUT
+ * after asking went unanswered, with the last ones used in the meantime.
+ */
+static int _obus_topicCodec(obus_Client* client, const char* topic){
+	pthread_mutex_lock(&client->codecLock);
+
+	if(client->codecsPending){
+		_obus_readCodecs(client);
+	}
+
+	long long now = _obus_nowMs();
+	if(client->codecsAskedAt == 0 ||
+	   now - client->codecsAskedAt >= (client->codecsPending ? OBUS_CLIENT_NEGOTIATE_TIMEOUT : OBUS_CLIENT_CODECS_REFRESH)){
+		//A reply this late may never come, and would answer the wrong request
+		if(client->codecsPending){
+			zmq_close(client->zmq_codecs);
+			client->zmq_codecs = NULL;
+			client->codecsPending = 0;
+		}
+		_obus_askCodecs(client, now);
+	}
+
+	int codec = OBUS_CODEC_NONE;
+	
+	int i;
+	for(i = 0; i < client->codecRuleCount; i++){
+		if(strncmp(topic, client->codecRules[i].prefix, strlen(client->codecRules[i].prefix)) == 0){
+			codec = client->codecRules[i].codec;
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&client->codecLock);
+	return codec;
+}
+
+/*
+ * Like obus_publish, but sends data in a binary envelope tagged with
+ * contentType, one of OBUS_CONTENT_*. The payload reaches subscribers
+ * byte for byte, so it may hold NULs.
+ *
+ * Topics the daemon lists in a:compress_topics are compressed here, once,
+ * when that makes them smaller. That list is asked for in the background,
+ * so nothing is compressed until the daemon has answered, and asked for
+ * again now and then to follow the daemon's reloads.
+ */
+unsigned char obus_publishEnvelope(obus_Client* client, const char* type, uint16_t contentType, const void* data, size_t len){
+	char* topic = _obus_prefix(type);
+	if(!topic){
+		return 1;
+	}
+	
+	obus_Envelope env;
+	obus_envelopeInit(&env, contentType);
+
+	void* compressed = NULL;
+	size_t compressedLen = 0;
+	
+	int codec = _obus_topicCodec(client, topic);
+	if(codec != OBUS_CODEC_NONE && len >= OBUS_COMPRESS_MIN_LEN && obus_compress(codec, data, len, &compressed, &compressedLen) == 0){
+		env.flags |= codec;
+		data = compressed;
+		len = compressedLen;
+	}
+
+	obus_PoolConn* conn = _obus_poolTake(client);
+
+	unsigned char ret = 0;
+
+	//Once the envelope is taken, the rest of the message is too
+	if(zmq_send(conn->sock, &env, sizeof(env), ZMQ_DONTWAIT | ZMQ_SNDMORE) < 0){
+		ret = errno == EAGAIN ? OBUS_PUBLISH_AGAIN : 1;
+	}else if(zmq_send(conn->sock, topic, strlen(topic), len > 0 ? ZMQ_SNDMORE : 0) < 0){
+		ret = 1;
+	}else if(len > 0){
+		ret = obus_sendChunks(conn->sock, data, len, OBUS_DEFAULT_CHUNK_LEN);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+	free(compressed);
+	free(topic);
+	return ret;
+}
+
+static void _obus_wake(obus_Client* client){
+	zmq_send(client->zmq_wakeTx, "", 0, ZMQ_DONTWAIT);
+}
+
+//Must be called with subLock held
+static unsigned char _obus_queueChange(obus_Client* client, const char* prefix, unsigned char subscribe, unsigned char apply){
+	obus_SubChange* tmpChanges = realloc(client->changes, sizeof(obus_SubChange) * (client->changeCount + 1));
+	if(!tmpChanges){
+		return 1;
+	}
+	client->changes = tmpChanges;
+
+	char* prefixCopy = strdup(prefix);
+	if(!prefixCopy){
+		return 1;
+	}
+	
+	client->changes[client->changeCount].prefix = prefixCopy;
+	client->changes[client->changeCount].subscribe = subscribe;
+	client->changes[client->changeCount].apply = apply;
+	client->changeCount++;
+
+	_obus_wake(client);
+	return 0;
+}
+
+/*
+ * Calls fn for every message of the given type received from now on, or
+ * every message at all if type is empty.
+ */
+unsigned char obus_subscribe(obus_Client* client, const char* type, obus_MessageFn fn, void* ud){
+	char* prefix = _obus_prefix(type);
+	if(!prefix){
+		return 1;
+	}
+
+	pthread_mutex_lock(&client->subLock);
+
+	//A SUB socket only unsubscribes once, so each prefix is subscribed once
+	unsigned char apply = 1;
+	int i;
+	for(i = 0; i < client->subCount && apply; i++){
+		apply = strcmp(client->subs[i].prefix, prefix) != 0;
+	}
+
+	obus_Subscription* tmpSubs = realloc(client->subs, sizeof(obus_Subscription) * (client->subCount + 1));
+	if(!tmpSubs){
+		pthread_mutex_unlock(&client->subLock);
+		free(prefix);
+		return 1;
+	}
+	client->subs = tmpSubs;
+
+	obus_Subscription* sub = &client->subs[client->subCount++];
+	sub->prefix = prefix;
+	sub->prefixLen = strlen(prefix);
+	sub->fn = fn;
+	sub->ud = ud;
+
+	//Queued either way, for the cached messages of the new callback
+	unsigned char ret = _obus_queueChange(client, prefix, 1, apply);
+	
+	pthread_mutex_unlock(&client->subLock);
+	return ret;
+}
+
+//Removes every subscription to the given type
+unsigned char obus_unsubscribe(obus_Client* client, const char* type){
+	char* prefix = _obus_prefix(type);
+	if(!prefix){
+		return 1;
+	}
+
+	pthread_mutex_lock(&client->subLock);
+
+	unsigned char ret = 0;
+	unsigned char removed = 0;
+	
+	int i = 0;
+	while(i < client->subCount){
+		if(strcmp(client->subs[i].prefix, prefix) == 0){
+			free(client->subs[i].prefix);
+			client->subs[i] = client->subs[--client->subCount];
+			removed = 1;
+		}else{
+			i++;
+		}
+	}
+
+	//The prefix was only subscribed to once, see obus_subscribe
+	if(removed){
+		ret = _obus_queueChange(client, prefix, 0, 1);
+	}
+	
+	pthread_mutex_unlock(&client->subLock);
+	free(prefix);
+	
+	return ret;
+}
+
+/*
+ * Makes queued subscription changes on the SUB socket, from the polling
+ * thread. Once subscribed, the daemon is asked for the messages it has
+ * cached for the new subscription, so nothing published in between is
+ * missed.
+ */
+static void _obus_applyChanges(obus_Client* client){
+	pthread_mutex_lock(&client->subLock);
+	
+	int i;
+	for(i = 0; i < client->changeCount; i++){
+		obus_SubChange* change = &client->changes[i];
+		size_t prefixLen = strlen(change->prefix);
+		if(change->apply){
+			zmq_setsockopt(client->zmq_sub, change->subscribe ? ZMQ_SUBSCRIBE : ZMQ_UNSUBSCRIBE, change->prefix, prefixLen);
+		}
+
+		if(change->subscribe){
+			size_t cmdLen = strlen(OBUS_SNAPSHOT_COMMAND);
+			char cmd[cmdLen + prefixLen];
+			memcpy(cmd, OBUS_SNAPSHOT_COMMAND, cmdLen);
+			memcpy(&cmd[cmdLen], change->prefix, prefixLen);
+			
+			if(zmq_send(client->zmq_snapshot, "", 0, ZMQ_SNDMORE | ZMQ_DONTWAIT) >= 0){
+				zmq_send(client->zmq_snapshot, cmd, cmdLen + prefixLen, 0);
+			}
+		}
+		free(change->prefix);
+	}
+	client->changeCount = 0;
+	
+	pthread_mutex_unlock(&client->subLock);
+}
+
+//Hands one message, its topicLen bytes of topic followed by the payload, to every subscription it matches
+static void _obus_deliver(obus_Client* client, const char* data, size_t len, size_t topicLen, uint64_t seq, int contentType, int codec){
+	client->contentType = contentType;
+	client->codec = codec;
+	client->payload = data + topicLen;
+	client->payloadLen = len - topicLen;
+
+	//Copied out, so callbacks may subscribe and unsubscribe
+	pthread_mutex_lock(&client->subLock);
+	
+	int count = 0;
+	obus_Subscription matched[client->subCount > 0 ? client->subCount : 1];
+	
+	int i;
+	for(i = 0; i < client->subCount; i++){
+		obus_Subscription* sub = &client->subs[i];
+		if(sub->prefixLen <= len && memcmp(data, sub->prefix, sub->prefixLen) == 0){
+			matched[count++] = *sub;
+		}
+	}
+	
+	pthread_mutex_unlock(&client->subLock);
+
+	for(i = 0; i < count; i++){
+		matched[i].fn(client, data, topicLen, seq, data + topicLen, len - topicLen, matched[i].ud);
+	}
+
+	free(client->body);
+	client->body = NULL;
+}
+
+static void _obus_deliverText(obus_Client* client, const char* data, size_t len, uint64_t seq){
+	//obus-cli ends messages with a NUL
+	if(len > 0 && data[len - 1] == '\0'){
+		len--;
+	}
+
+	_obus_deliver(client, data, len, obus_topicLength(data, len), seq, OBUS_CONTENT_TEXT, OBUS_CODEC_NONE);
+}
+
+//Appends one chunk to the reassembly buffer
+static unsigned char _obus_bufAppend(obus_Client* client, size_t* used, zmq_msg_t* msg){
+	size_t size = zmq_msg_size(msg);
+	
+	if(*used + size > client->bufCap){
+		size_t newCap = client->bufCap > 0 ? client->bufCap : 1024;
+		while(newCap < *used + size){
+			newCap *= 2;
+		}
+		
+		char* tmpBuf = realloc(client->buf, newCap);
+		if(!tmpBuf){
+			return 1;
+		}
+		client->buf = tmpBuf;
+		client->bufCap = newCap;
+	}
+
+	memcpy(&client->buf[*used], zmq_msg_data(msg), size);
+	*used += size;
+	return 0;
+}
+
+/*
+ * Delivers the message whose first frame, of r bytes, was received into
+ * msg: [chunk][obus_SeqHeader or obus_BatchHeader][chunks...], [topic]
+ * [obus_Envelope][payload...], or for a cached text message, its chunks.
+ * seq is the message's sequence number if none of its frames has it.
+ * Returns how many messages were delivered, or -1 on error.
+ */
+static int _obus_receiveRest(obus_Client* client, void* sock, zmq_msg_t* first, int r, uint64_t seq){
+	zmq_msg_t msg;
+	zmq_msg_t next;
+	zmq_msg_init(&msg);
+	zmq_msg_init(&next);
+	zmq_msg_move(&msg, first);
+
+	int delivered = 0;
+	int more = zmq_msg_more(&msg);
+
+	if(!more){
+		_obus_deliverText(client, zmq_msg_data(&msg), r, seq);
+		delivered = 1;
+		goto done;
+	}
+
+	r = zmq_msg_recv(&next, sock, 0);
+	if(r < 0){
+		delivered = -1;
+		goto done;
+	}
+	more = zmq_msg_more(&next);
+
+	if(obus_isBatchHeader(zmq_msg_data(&next), r)){
+		obus_BatchHeader* hdr = (obus_BatchHeader*)zmq_msg_data(&next);
+		uint64_t seq = obus_ntohll(hdr->seq);
+		
+		while(more){
+			if(zmq_msg_recv(&msg, sock, 0) < 0){
+				delivered = -1;
+				break;
+			}
+			more = zmq_msg_more(&msg);
+			
+			_obus_deliverText(client, zmq_msg_data(&msg), zmq_msg_size(&msg), seq++);
+			delivered++;
+		}
+		goto done;
+	}
+
+	//Reassemble chunked messages, skipping over the sequence header or envelope
+	size_t used = 0;
+	size_t topicLen = 0;
+	int contentType = -1;
+	int codec = OBUS_CODEC_NONE;
+	
+	unsigned char failed = _obus_bufAppend(client, &used, &msg);
+	if(obus_isSeqHeader(zmq_msg_data(&next), r)){
+		obus_SeqHeader* hdr = (obus_SeqHeader*)zmq_msg_data(&next);
+		seq = obus_ntohll(hdr->seq);
+		client->cached |= (hdr->flags & OBUS_SEQ_CACHED) != 0;
+	}else if(obus_isEnvelope(zmq_msg_data(&next), r)){
+		obus_Envelope* env = (obus_Envelope*)zmq_msg_data(&next);
+		seq = obus_ntohll(env->seq);
+		client->cached |= (env->flags & OBUS_ENVELOPE_CACHED) != 0;
+		contentType = ntohs(env->contentType);
+		codec = env->flags & OBUS_ENVELOPE_CODEC_MASK;
+		topicLen = used;
+	}else if(!failed){
+		failed = _obus_bufAppend(client, &used, &next);
+	}
+
+	while(more){
+		if(zmq_msg_recv(&msg, sock, 0) < 0){
+			failed = 1;
+			break;
+		}
+		more = zmq_msg_more(&msg);
+		
+		if(!failed){
+			failed = _obus_bufAppend(client, &used, &msg);
+		}
+	}
+
+	if(failed){
+		delivered = -1;
+	}else if(contentType >= 0){
+		_obus_deliver(client, client->buf, used, topicLen, seq, contentType, codec);
+		delivered = 1;
+	}else{
+		_obus_deliverText(client, client->buf, used, seq);
+		delivered = 1;
+	}
+
+  done:
+	zmq_msg_close(&next);
+	zmq_msg_close(&msg);
+	return delivered;
+}
+
+/*
+ * Receives one published message, which may be a batch, and delivers it.
+ * Returns how many messages were delivered, or -1 on error.
+ */
+static int _obus_receive(obus_Client* client){
+	void* sock = client->zmq_sub;
+	
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	client->cached = 0;
+	
+	int r = zmq_msg_recv(&msg, sock, ZMQ_DONTWAIT);
+	if(r < 0){
+		zmq_msg_close(&msg);
+		return errno == EAGAIN ? 0 : -1;
+	}
+
+	//Copies published for content filters aren't subscribed to by type
+	if(r > 0 && ((char*)zmq_msg_data(&msg))[0] == '?'){
+		int more = zmq_msg_more(&msg);
+		while(more && zmq_msg_recv(&msg, sock, 0) >= 0){
+			more = zmq_msg_more(&msg);
+		}
+		zmq_msg_close(&msg);
+		return 0;
+	}
+
+	int delivered = _obus_receiveRest(client, sock, &msg, r, 0);
+	zmq_msg_close(&msg);
+	return delivered;
+}
+
+/*
+ * Receives one reply to a snapshot request, [""]["$snapshot:<seq>"] and
+ * the cached message, and delivers the message. The reply ending each
+ * snapshot, and errors such as the cache being off, deliver nothing.
+ * received is cleared when there was no reply to receive. Returns how
+ * many messages were delivered, or -1 on error.
+ */
+static int _obus_receiveSnapshot(obus_Client* client, unsigned char* received){
+	void* sock = client->zmq_snapshot;
+	
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	int delivered = 0;
+	
+	//The empty delimiter, then the reply's header
+	int r = zmq_msg_recv(&msg, sock, ZMQ_DONTWAIT);
+	if(r < 0){
+		*received = 0;
+		zmq_msg_close(&msg);
+		return errno == EAGAIN ? 0 : -1;
+	}
+	if(!zmq_msg_more(&msg) || zmq_msg_recv(&msg, sock, 0) < 0){
+		zmq_msg_close(&msg);
+		return -1;
+	}
+
+	size_t prefixLen = strlen(OBUS_SNAPSHOT_COMMAND);
+	const char* head = zmq_msg_data(&msg);
+	size_t headLen = zmq_msg_size(&msg);
+	int more = zmq_msg_more(&msg);
+
+	if(more && headLen > prefixLen && headLen < 32 && memcmp(head, OBUS_SNAPSHOT_COMMAND, prefixLen) == 0){
+		char seqStr[32];
+		memcpy(seqStr, head + prefixLen, headLen - prefixLen);
+		seqStr[headLen - prefixLen] = '\0';
+		uint64_t seq = strtoull(seqStr, NULL, 10);
+
+		r = zmq_msg_recv(&msg, sock, 0);
+		if(r < 0){
+			delivered = -1;
+		}else{
+			client->cached = 1;
+			delivered = _obus_receiveRest(client, sock, &msg, r, seq);
+			more = 0;
+		}
+	}
+
+	while(more && zmq_msg_recv(&msg, sock, 0) >= 0){
+		more = zmq_msg_more(&msg);
+	}
+	
+	zmq_msg_close(&msg);
+	return delivered;
+}
+
+//The OBUS_CONTENT_* type of the message being delivered, for use in an obus_MessageFn
+int obus_messageContentType(obus_Client* client){
+	return client->contentType;
+}
+
+/*
+ * Whether the message being delivered is a topic's last message, served
+ * by the daemon's cache when someone subscribed, for use in an
+ * obus_MessageFn. It may be one this client has already had.
+ */
+unsigned char obus_messageIsCached(obus_Client* client){
+	return client->cached;
+}
+
+/*
+ * The body of the message being delivered, for use in an obus_MessageFn.
+ * A compressed body is decompressed on the first call, and only then, so
+ * callbacks that don't read it don't pay for it. Returns NULL if it can't
+ * be decompressed.
+ */
+const void* obus_messageBody(obus_Client* client, size_t* len){
+	if(client->codec == OBUS_CODEC_NONE){
+		*len = client->payloadLen;
+		return client->payload;
+	}
+
+	if(!client->body){
+		if(!obus_codecAvailable(client->codec)){
+			return NULL;
+		}
+		if(obus_decompress(client->codec, client->payload, client->payloadLen, OBUS_DEFAULT_MAX_BODY_LEN, &client->body, &client->bodyLen) != 0){
+			client->body = NULL;
+			return NULL;
+		}
+	}
+	
+	*len = client->bodyLen;
+	return client->body;
+}
+
+/*
+ * Waits up to timeout milliseconds (-1 for no limit) for messages, then
+ * delivers all that have arrived. Returns how many were delivered, or -1
+ * on error.
+ */
+int obus_poll(obus_Client* client, long timeout){
+	_obus_applyChanges(client);
+
+	zmq_pollitem_t items[3];
+	items[0] = (zmq_pollitem_t){client->zmq_sub, 0, ZMQ_POLLIN, 0};
+	items[1] = (zmq_pollitem_t){client->zmq_wakeRx, 0, ZMQ_POLLIN, 0};
+	items[2] = (zmq_pollitem_t){client->zmq_snapshot, 0, ZMQ_POLLIN, 0};
+
+	int r = zmq_poll(items, 3, timeout);
+	if(r < 0){
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if(items[1].revents & ZMQ_POLLIN){
+		while(zmq_recv(client->zmq_wakeRx, NULL, 0, ZMQ_DONTWAIT) >= 0);
+		_obus_applyChanges(client);
+	}
+
+	int delivered = 0;
+
+	//Cached messages first, as they are older than what was published since
+	if(items[2].revents & ZMQ_POLLIN){
+		unsigned char received = 1;
+		while(received){
+			r = _obus_receiveSnapshot(client, &received);
+			if(r < 0){
+				return -1;
+			}
+			delivered += r;
+		}
+	}
+	
+	if(items[0].revents & ZMQ_POLLIN){
+		while((r = _obus_receive(client)) > 0){
+			delivered += r;
+		}
+		if(r < 0){
+			return -1;
+		}
+	}
+
+	return delivered;
+}
+
+//Delivers messages until obus_stop is called
+unsigned char obus_run(obus_Client* client){
+	while(1){
+		pthread_mutex_lock(&client->subLock);
+		unsigned char stopped = client->stopped;
+		client->stopped = 0;
+		pthread_mutex_unlock(&client->subLock);
+
+		if(stopped){
+			return 0;
+		}
+		
+		if(obus_poll(client, -1) < 0){
+			return 1;
+		}
+	}
+}
+
+//Makes obus_run return, from a callback or any other thread
+void obus_stop(obus_Client* client){
+	pthread_mutex_lock(&client->subLock);
+	client->stopped = 1;
+	_obus_wake(client);
+	pthread_mutex_unlock(&client->subLock);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 John M. Harris, Jr. <johnmh@openblox.org>
+ *
+ * This file is part of OBus.
+ *
+ * OBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OBus.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBOBUS_H_
+#define LIBOBUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Client library for the message bus. An obus_Client keeps its context
+ * and connections open for its whole life, so publishing costs a send
+ * rather than a connect. Every function may be called from any thread,
+ * except that only one thread at a time may be in obus_poll or obus_run.
+ */
+
+//Default number of publishing connections, so threads rarely wait on each other
+#define OBUS_CLIENT_DEFAULT_POOL 4
+
+//Returned by obus_publish when the message can't be queued without blocking
+#define OBUS_PUBLISH_AGAIN 2
+
+//Content types of enveloped messages, as in obus.h. Text messages are OBUS_CONTENT_TEXT
+#define OBUS_CONTENT_TEXT 0
+#define OBUS_CONTENT_JSON 1
+#define OBUS_CONTENT_BINARY 2
+#define OBUS_CONTENT_MSGPACK 3
+#define OBUS_CONTENT_PROTOBUF 4
+
+typedef struct obus_Client obus_Client;
+
+/*
+ * Called from obus_poll or obus_run for every message of a subscribed
+ * type. topic is the "type:" prefix, data the rest of the message. seq is
+ * the message's sequence number in its topic, or 0 if it has none.
+ *
+ * data is the payload as it was sent, which for topics the daemon has
+ * producers compress is compressed. obus_messageBody always gives the
+ * original.
+ *
+ * A new subscription is first sent the last message of each topic it
+ * matches, from the daemon's cache, which obus_messageIsCached tells
+ * apart. This client's other subscriptions matching them get them too,
+ * and one published while subscribing may come both cached and live.
+ */
+typedef void (*obus_MessageFn)(obus_Client* client, const char* topic, size_t topicLen, uint64_t seq, const char* data, size_t len, void* ud);
+
+obus_Client* obus_clientNew(const char* host, int port, int poolSize);
+obus_Client* obus_clientNewEndpoints(const char* reqEndpoint, const char* subEndpoint, int poolSize);
+obus_Client* obus_clientNewShared(void* zmq_ctx, const char* reqEndpoint, const char* subEndpoint, int poolSize);
+void obus_clientFree(obus_Client* client);
+
+unsigned char obus_publish(obus_Client* client, const char* type, const void* data, size_t len);
+unsigned char obus_publishEnvelope(obus_Client* client, const char* type, uint16_t contentType, const void* data, size_t len);
+
+unsigned char obus_subscribe(obus_Client* client, const char* type, obus_MessageFn fn, void* ud);
+unsigned char obus_unsubscribe(obus_Client* client, const char* type);
+
+int obus_poll(obus_Client* client, long timeout);
+unsigned char obus_run(obus_Client* client);
+void obus_stop(obus_Client* client);
+
+int obus_messageContentType(obus_Client* client);
+unsigned char obus_messageIsCached(obus_Client* client);
+const void* obus_messageBody(obus_Client* client, size_t* len);
+
+#endif